@@ -0,0 +1,424 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "zns_device.h"
+#include "../common/utils.h"
+
+/*
+ * Write benchmark for the FTL: how much CPU is spent per MB written, what the
+ * write latency looks like, and how much CPU the FTL burns while idle. Run it
+ * against two builds of the library to compare them.
+ */
+
+struct bench_thread {
+    struct user_zns_device *dev;
+    uint64_t start_lba;
+    uint64_t num_lbas;
+    uint32_t write_size;
+    uint32_t num_writes;
+    bool random;
+    bool skewed;
+    bool verify;
+    unsigned seed;
+    std::vector<bool> written; // with verify, the LBAs written so far
+    std::vector<uint64_t> latencies; // microseconds
+    int ret;
+};
+
+static uint64_t cpu_microseconds(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000UL +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+extern "C" {
+
+static void *bench_writer(void *arg){
+    struct bench_thread *t = (struct bench_thread *) arg;
+    const uint32_t lbas_per_write = t->write_size / t->dev->lba_size_bytes;
+    char *buf = (char*) calloc(1, t->write_size);
+    assert(buf != nullptr);
+    if(t->verify){
+        // every LBA gets the same pattern, stamped with its own address
+        for(uint32_t k = 0; k < lbas_per_write; k++){
+            write_pattern(buf + k * t->dev->lba_size_bytes, t->dev->lba_size_bytes);
+        }
+        t->written.assign(t->num_lbas, false);
+    } else {
+        write_pattern(buf, t->write_size);
+    }
+    uint64_t next = 0;
+    t->latencies.reserve(t->num_writes);
+    for(uint32_t i = 0; i < t->num_writes; i++){
+        uint64_t lba;
+        if(t->random){
+            uint64_t slots = t->num_lbas / lbas_per_write;
+            // 80% of the writes go to the first 20% of the range
+            if(t->skewed && slots >= 5 && rand_r(&t->seed) % 10 < 8){
+                slots /= 5;
+            }
+            lba = (rand_r(&t->seed) % slots) * lbas_per_write;
+        } else {
+            lba = next;
+            next = (next + lbas_per_write) % (t->num_lbas - lbas_per_write + 1);
+        }
+        if(t->verify){
+            for(uint32_t k = 0; k < lbas_per_write; k++){
+                *(uint64_t *) (buf + k * t->dev->lba_size_bytes) = t->start_lba + lba + k;
+            }
+        }
+        uint64_t s = microseconds_since_epoch();
+        t->ret = zns_udevice_write(t->dev, (t->start_lba + lba) * t->dev->lba_size_bytes, buf, t->write_size);
+        t->latencies.push_back(microseconds_since_epoch() - s);
+        if(t->ret != 0){
+            printf("Error: writing the device failed at lba 0x%lx \n", t->start_lba + lba);
+            break;
+        }
+        for(uint32_t k = 0; t->verify && k < lbas_per_write; k++){
+            t->written[lba + k] = true;
+        }
+    }
+    free(buf);
+    return nullptr;
+}
+
+// Reads back what a writer wrote, returns the number of LBAs that do not match
+// or -1 if a read fails.
+static int64_t bench_verify(struct bench_thread *t){
+    const uint32_t lba_size = t->dev->lba_size_bytes;
+    const uint32_t max_lbas = t->write_size / lba_size;
+    char *buf = (char*) calloc(1, t->write_size);
+    char *expected = (char*) calloc(1, lba_size);
+    assert(buf != nullptr && expected != nullptr);
+    write_pattern(expected, lba_size);
+    int64_t mismatches = 0;
+    for(uint64_t lba = 0; lba < t->num_lbas;){
+        if(!t->written[lba]){
+            lba++;
+            continue;
+        }
+        uint32_t n = 1;
+        while(n < max_lbas && lba + n < t->num_lbas && t->written[lba + n]){
+            n++;
+        }
+        if(zns_udevice_read(t->dev, (t->start_lba + lba) * lba_size, buf, n * lba_size) != 0){
+            printf("Error: reading back the device failed at lba 0x%lx \n", t->start_lba + lba);
+            mismatches = -1;
+            break;
+        }
+        for(uint32_t k = 0; k < n; k++){
+            *(uint64_t *) expected = t->start_lba + lba + k;
+            if(memcmp(buf + k * lba_size, expected, lba_size) != 0){
+                if(mismatches == 0){
+                    printf("Error: lba 0x%lx does not hold what was written \n", t->start_lba + lba + k);
+                }
+                mismatches++;
+            }
+        }
+        lba += n;
+    }
+    free(expected);
+    free(buf);
+    return mismatches;
+}
+
+static int show_help(){
+    printf("Usage: ftl_bench -d device_name -h \n");
+    printf("-d : /dev/nvmeXpY - in this format with the full path, a comma separated list stripes them into one device \n");
+    printf("-u : KB per namespace before the stripe moves on to the next (default, 0 = library default). \n");
+    printf("-l : the number of zones to use for log/metadata (default, minimum = 3). \n");
+    printf("-w : watermark threshold, the number of free zones when to trigger the gc (default, minimum = 1). \n");
+    printf("-t : number of writer threads (default, 1). \n");
+    printf("-s : bytes per write, a multiple of the LBA size (default, one LBA). \n");
+    printf("-n : writes per thread (default, 10,000). \n");
+    printf("-r : random instead of sequential writes. \n");
+    printf("-k : with -r, send 80%% of the writes to 20%% of the range. \n");
+    printf("-g : gc policy, 1 greedy, 2 cost benefit, 3 oldest log zone (default, 0 = oldest log zone). \n");
+    printf("-c : number of gc workers (default, 0 = library default). \n");
+    printf("-m : number of open log zones, split by write temperature (default, 0 = library default). \n");
+    printf("-p : page mapped FTL instead of the hybrid log/data zone FTL. \n");
+    printf("-b : KB of write-back buffer for small writes, flushed before the clock stops (default, 0 = off). \n");
+    printf("-a : KB of read cache (default, 0 = off). \n");
+    printf("-o : KB per logical block, dividing the zone size, packed into shared data zones (default, 0 = one zone). \n");
+    printf("-W : scheduler weights of user read, user write, gc read, gc write, comma separated (default, library default). \n");
+    printf("-q : commands in flight per thread, the scheduler budget is this many MDTS (default, 0 = library default). \n");
+    printf("-e : remount the FTL state of the last run instead of resetting the device. \n");
+    printf("-v : read back every written LBA after the idle time and match it, a mismatch fails the run. \n");
+    printf("-i : seconds to stay idle after the writes to measure background CPU (default, 1). \n");
+    printf("-h : shows help, and exits with success. No argument needed\n");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int ret, c;
+    char *zns_device_name = (char*) "nvme0n1", *str1 = nullptr, *str2 = nullptr;
+    std::vector<char *> zns_device_names;
+    struct user_zns_device *my_dev = nullptr;
+    uint32_t num_threads = 1, write_size = 0, num_writes = 10000, idle_seconds = 1;
+    bool random = false, skewed = false, verify = false;
+
+    struct zdev_init_params params = {};
+    params.force_reset = true;
+    params.log_zones = 3;
+    params.gc_wmark = 1;
+
+    while ((c = getopt(argc, argv, "d:l:w:t:s:n:i:g:c:m:b:a:o:u:W:q:rkevph")) != -1) {
+        switch (c) {
+            case 'h':
+                show_help();
+                exit(0);
+            case 'd':
+                str2 = strdupa(optarg);
+                zns_device_names.clear();
+                for (;;) {
+                    str1 = strsep(&str2, ","); // one name per namespace
+                    if (str1 == nullptr) {
+                        break;
+                    }
+                    for (;;) {
+                        char *token = strsep(&str1, "/"); // delimited is "/"
+                        if (token == nullptr) {
+                            break;
+                        }
+                        zns_device_name = token;
+                    }
+                    zns_device_names.push_back(strdup(zns_device_name));
+                }
+                break;
+            case 'l':
+                params.log_zones = atoi(optarg);
+                break;
+            case 'w':
+                params.gc_wmark = atoi(optarg);
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 's':
+                write_size = atoi(optarg);
+                break;
+            case 'n':
+                num_writes = atoi(optarg);
+                break;
+            case 'r':
+                random = true;
+                break;
+            case 'k':
+                skewed = true;
+                break;
+            case 'e':
+                params.force_reset = false;
+                break;
+            case 'v':
+                verify = true;
+                break;
+            case 'p':
+                params.ftl_mode = ZNS_FTL_PAGE;
+                break;
+            case 'i':
+                idle_seconds = atoi(optarg);
+                break;
+            case 'g':
+                params.gc_policy = atoi(optarg);
+                break;
+            case 'c':
+                params.gc_workers = atoi(optarg);
+                break;
+            case 'm':
+                params.log_streams = atoi(optarg);
+                break;
+            case 'b':
+                params.wbuf_bytes = atoi(optarg) * 1024U;
+                break;
+            case 'a':
+                params.rcache_bytes = atoi(optarg) * 1024ULL;
+                break;
+            case 'o':
+                params.block_bytes = atoi(optarg) * 1024U;
+                break;
+            case 'u':
+                params.stripe_bytes = atoi(optarg) * 1024U;
+                break;
+            case 'W':
+                str2 = strdupa(optarg);
+                for (uint32_t i = 0; i < ZNS_NUM_CLASSES; i++) {
+                    str1 = strsep(&str2, ",");
+                    params.class_weights[i] = str1 != nullptr ? atoi(str1) : 0;
+                }
+                break;
+            case 'q':
+                params.io_depth = atoi(optarg);
+                break;
+            default:
+                show_help();
+                exit(-1);
+        }
+    }
+    params.name = strdup(zns_device_name);
+    params.names = zns_device_names.data();
+    params.num_names = zns_device_names.size();
+    ret = init_ss_zns_device(&params, &my_dev);
+    assert (ret == 0);
+    if(write_size == 0){
+        write_size = my_dev->lba_size_bytes;
+    }
+    assert(write_size % my_dev->lba_size_bytes == 0);
+    const uint64_t lbas_per_thread = (my_dev->capacity_bytes / my_dev->lba_size_bytes) / num_threads;
+    assert(lbas_per_thread >= write_size / my_dev->lba_size_bytes);
+    printf("parameter settings are: device-name %s namespaces %zu log_zones %d gc-watermark %d threads %u write-size %u writes %u pattern %s \n",
+           params.name, zns_device_names.size() ? zns_device_names.size() : 1, params.log_zones, params.gc_wmark, num_threads, write_size, num_writes, random ? "random" : "sequential");
+
+    std::vector<struct bench_thread> threads(num_threads);
+    std::vector<pthread_t> tids(num_threads);
+    uint64_t cpu_start = cpu_microseconds();
+    uint64_t start = microseconds_since_epoch();
+    for(uint32_t i = 0; i < num_threads; i++){
+        threads[i].dev = my_dev;
+        threads[i].start_lba = i * lbas_per_thread;
+        threads[i].num_lbas = lbas_per_thread;
+        threads[i].write_size = write_size;
+        threads[i].num_writes = num_writes;
+        threads[i].random = random;
+        threads[i].skewed = skewed;
+        threads[i].verify = verify;
+        threads[i].seed = (unsigned) (i + 1) * getpid();
+        threads[i].ret = 0;
+        pthread_create(&tids[i], nullptr, &bench_writer, &threads[i]);
+    }
+    std::vector<uint64_t> latencies;
+    for(uint32_t i = 0; i < num_threads; i++){
+        pthread_join(tids[i], nullptr);
+        latencies.insert(latencies.end(), threads[i].latencies.begin(), threads[i].latencies.end());
+        if(threads[i].ret != 0){
+            ret = threads[i].ret;
+        }
+    }
+    // buffered writes count once they are on the device
+    if(zns_udevice_flush(my_dev) != 0){
+        ret = -1;
+    }
+    uint64_t end = microseconds_since_epoch();
+    uint64_t cpu_end = cpu_microseconds();
+    // with nothing to do, the FTL should not use any CPU
+    sleep(idle_seconds);
+    uint64_t cpu_idle = cpu_microseconds() - cpu_end;
+    int64_t mismatches = 0;
+    uint64_t lbas_verified = 0;
+    for(uint32_t i = 0; verify && i < num_threads && mismatches >= 0; i++){
+        int64_t m = bench_verify(&threads[i]);
+        mismatches = m < 0 ? m : mismatches + m;
+        lbas_verified += std::count(threads[i].written.begin(), threads[i].written.end(), true);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    const double mb_written = (double) write_size * latencies.size() / (1024.0 * 1024.0);
+    const double elapsed_s = (end - start) / 1000000.0;
+    printf("====================================================================\n");
+    printf("[stosys-stats] written                 : %.2f MB in %.3f s (%.2f MB/s) \n", mb_written, elapsed_s, mb_written / elapsed_s);
+    printf("[stosys-stats] CPU per MB written      : %.3f ms \n", (cpu_end - cpu_start) / 1000.0 / mb_written);
+    if(!latencies.empty()){
+        uint64_t sum = 0;
+        for(uint64_t l : latencies){
+            sum += l;
+        }
+        printf("[stosys-stats] write latency (us)      : avg %.1f p50 %lu p99 %lu max %lu \n",
+               (double) sum / latencies.size(), latencies[latencies.size() / 2],
+               latencies[(latencies.size() * 99) / 100], latencies.back());
+    }
+    if(idle_seconds > 0){
+        printf("[stosys-stats] idle CPU                : %.1f%% of one core over %u s \n", cpu_idle / (idle_seconds * 10000.0), idle_seconds);
+    }
+    struct zns_udevice_stats stats;
+    zns_udevice_get_stats(my_dev, &stats);
+    const char *class_names[ZNS_NUM_CLASSES] = {"user read", "user write", "gc read", "gc write"};
+    for(uint32_t i = 0; i < ZNS_NUM_CLASSES; i++){
+        printf("[stosys-stats] %-10s bandwidth     : %.2f MB/s (%.2f MB, %lu waits, %.2f MB borrowed) \n", class_names[i],
+               stats.class_mbps[i], stats.class_bytes[i] / (1024.0 * 1024.0), stats.class_waits[i],
+               stats.class_borrowed[i] / (1024.0 * 1024.0));
+    }
+    const double user_mb = stats.class_bytes[ZNS_CLASS_USER_WRITE] / (1024.0 * 1024.0);
+    if(user_mb > 0){
+        printf("[stosys-stats] gc merges               : %lu (%lu log pages, write amplification %.2f) \n",
+               stats.gc_merges, stats.gc_log_pages_merged,
+               (user_mb + stats.class_bytes[ZNS_CLASS_GC_WRITE] / (1024.0 * 1024.0)) / user_mb);
+    }
+    for(uint32_t i = 0; i < stats.log_streams; i++){
+        const double stream_mb = stats.log_stream_bytes[i] / (1024.0 * 1024.0);
+        printf("[stosys-stats] log stream %u            : %.2f MB, %.2f MB merged (write amplification %.2f) \n", i,
+               stream_mb, stats.log_stream_gc_bytes[i] / (1024.0 * 1024.0),
+               stream_mb > 0 ? (stream_mb + stats.log_stream_gc_bytes[i] / (1024.0 * 1024.0)) / stream_mb : 0.0);
+    }
+    printf("[stosys-stats] gc switch merges        : %lu (%lu partial) \n",
+           stats.gc_switch_merges + stats.gc_partial_merges, stats.gc_partial_merges);
+    printf("[stosys-stats] gc compactions          : %lu (%lu pages moved) \n",
+           stats.gc_compactions, stats.gc_compacted_pages);
+    printf("[stosys-stats] data zone cleanings     : %lu (%lu blocks relocated) \n",
+           stats.gc_data_cleanings, stats.gc_relocations);
+    printf("[stosys-stats] data zone holes         : %lu pages write zeroed, %lu pages of zeros appended \n",
+           stats.hole_pages_zeroed, stats.hole_pages_written);
+    printf("[stosys-stats] gc host path            : %.2f MB, %lu us CPU \n",
+           stats.gc_host_bytes / (1024.0 * 1024.0), stats.gc_host_cpu_us);
+    printf("[stosys-stats] gc simple copy          : %.2f MB, %lu us CPU, %.2f MB PCIe saved, ~%lu us CPU saved \n",
+           stats.gc_copy_bytes / (1024.0 * 1024.0), stats.gc_copy_cpu_us,
+           stats.gc_pcie_bytes_saved / (1024.0 * 1024.0), stats.gc_cpu_saved_us);
+    printf("[stosys-stats] metadata                : remount %lu us (%lu records replayed), %lu checkpoints (%.2f MB), %.2f MB journal \n",
+           stats.meta_remount_us, stats.meta_replayed_records, stats.meta_checkpoints,
+           stats.meta_checkpoint_bytes / (1024.0 * 1024.0), stats.meta_journal_bytes / (1024.0 * 1024.0));
+    printf("[stosys-stats] node allocator          : %lu cache hits, %lu misses, %.2f MB slabs \n",
+           stats.alloc_cache_hits, stats.alloc_cache_misses, stats.alloc_slab_bytes / (1024.0 * 1024.0));
+    printf("[stosys-stats] FTL memory              : %.1f KB (map %.1f KB, bitmaps %.1f KB, zones %.1f KB) \n",
+           (stats.mem_map_bytes + stats.mem_bitmap_bytes + stats.mem_zone_bytes) / 1024.0,
+           stats.mem_map_bytes / 1024.0, stats.mem_bitmap_bytes / 1024.0, stats.mem_zone_bytes / 1024.0);
+    printf("[stosys-stats] optimistic read retries : %lu \n", stats.read_retries);
+    printf("[stosys-stats] write-back buffer       : %lu pages (%lu overwritten), %lu read hits, %lu flushes of %lu pages \n",
+           stats.wbuf_pages, stats.wbuf_overwrites, stats.wbuf_read_hits, stats.wbuf_flushes, stats.wbuf_flushed_pages);
+    const uint64_t rcache_lookups = stats.rcache_hits + stats.rcache_misses;
+    printf("[stosys-stats] read cache              : %lu hits, %lu misses (hit ratio %.2f), %lu evicted, %lu invalidated \n",
+           stats.rcache_hits, stats.rcache_misses, rcache_lookups ? (double) stats.rcache_hits / rcache_lookups : 0.0,
+           stats.rcache_evictions, stats.rcache_invalidations);
+    if(verify){
+        printf("[stosys-stats] read back               : %lu LBAs, %s \n", lbas_verified,
+               mismatches == 0 ? "all match" : (mismatches < 0 ? "read failed" : "MISMATCH"));
+    }
+    printf("====================================================================\n");
+    if(deinit_ss_zns_device(my_dev) != 0 || mismatches != 0){
+        ret = -1;
+    }
+    free(params.name);
+    for (char *name : zns_device_names) {
+        free(name);
+    }
+    return ret;
+}
+}
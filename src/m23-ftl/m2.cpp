@@ -97,6 +97,8 @@ static int show_help(){
     printf("-d : /dev/nvmeXpY - in this format with the full path \n");
     printf("-r : resume if the FTL can. \n");
     printf("-l : the number of zones to use for log/metadata (default, minimum = 3). \n");
+    printf("-b : KB of write-back buffer for small writes (default, 0 = off). \n");
+    printf("-a : KB of read cache (default, 0 = off). \n");
     printf("-h : shows help, and exits with success. No argument needed\n");
     return 0;
 }
@@ -108,7 +110,7 @@ int main(int argc, char **argv) {
     int ret, c;
     char *zns_device_name = (char*) "nvme0n1", *test_buf = nullptr, *str1 = nullptr;
     struct user_zns_device *my_dev = nullptr;
-    struct zdev_init_params params;
+    struct zdev_init_params params = {};
     params.force_reset = true;
     params.log_zones = 3;
     params.gc_wmark = 1;
@@ -117,7 +119,7 @@ int main(int argc, char **argv) {
     printf("===================================================================================== \n");
     printf("This is M2. The goal of this milestone is to implement a hybrid log-structure ZTL (Zone Translation Layer) on top of the ZNS (no GC) \n");
     printf("===================================================================================== \n");
-    while ((c = getopt(argc, argv, "l:d:hr")) != -1) {
+    while ((c = getopt(argc, argv, "l:d:b:a:hr")) != -1) {
         switch (c) {
             case 'h':
                 show_help();
@@ -148,6 +150,12 @@ int main(int argc, char **argv) {
                     exit(-1);
                 }
                 break;
+            case 'b':
+                params.wbuf_bytes = atoi(optarg) * 1024U;
+                break;
+            case 'a':
+                params.rcache_bytes = atoi(optarg) * 1024ULL;
+                break;
             default:
                 show_help();
                 exit(-1);
@@ -21,6 +21,7 @@ SOFTWARE.
  */
 
 #include <unistd.h>
+#include <pthread.h>
 
 #include <cstdio>
 #include <cassert>
@@ -195,28 +196,455 @@ static int wr_full_device_verify(struct user_zns_device *dev,
     return ret;
 }
 
+/*
+ * Pages written by the tests below carry a stamp in every 8 bytes: the LBA in the upper half and a version in the lower
+ * half. A torn page, a page of another LBA or an old version then shows up on any read.
+ */
+static void stamp_pages(char *buf, uint64_t lba, uint32_t num_lbas, uint32_t version, uint32_t lba_size){
+    uint64_t *words = (uint64_t *) buf;
+    for(uint32_t i = 0; i < num_lbas; i++){
+        for(uint32_t j = 0; j < lba_size / sizeof(uint64_t); j++){
+            words[i * (lba_size / sizeof(uint64_t)) + j] = ((lba + i) << 32) | version;
+        }
+    }
+}
+
+// returns the version of the page, or -1 if the page is torn or belongs to another LBA
+static int64_t page_version(const char *page, uint64_t lba, uint32_t lba_size){
+    const uint64_t *words = (const uint64_t *) page;
+    if((words[0] >> 32) != lba){
+        return -1;
+    }
+    for(uint32_t j = 1; j < lba_size / sizeof(uint64_t); j++){
+        if(words[j] != words[0]){
+            return -1;
+        }
+    }
+    return (int64_t) (words[0] & 0xffffffffUL);
+}
+
+struct race_thread {
+    struct user_zns_device *dev;
+    uint64_t start_lba;
+    uint32_t num_lbas;
+    uint32_t num_writes;
+    uint32_t *versions; // per LBA of the range, the last version whose write returned
+    volatile bool *stop;
+    unsigned seed;
+    uint64_t reads;
+    int ret;
+};
+
+// one writer per range, so the versions of an LBA only go up
+static void *race_writer(void *arg){
+    struct race_thread *t = (struct race_thread *) arg;
+    const uint32_t lba_size = t->dev->lba_size_bytes;
+    char *buf = (char *) calloc(8, lba_size);
+    assert(buf != nullptr);
+    for(uint32_t v = 1; v <= t->num_writes && t->ret == 0; v++){
+        uint32_t n = 1 + rand_r(&t->seed) % 8;
+        uint64_t off = rand_r(&t->seed) % (t->num_lbas - n + 1);
+        stamp_pages(buf, t->start_lba + off, n, v, lba_size);
+        t->ret = zns_udevice_write(t->dev, (t->start_lba + off) * lba_size, buf, n * lba_size);
+        if(t->ret != 0){
+            printf("Error: racing write failed at lba 0x%lx \n", t->start_lba + off);
+            break;
+        }
+        for(uint32_t i = 0; i < n; i++){
+            __atomic_store_n(&t->versions[off + i], v, __ATOMIC_RELEASE);
+        }
+    }
+    free(buf);
+    return nullptr;
+}
+
+// a read must see at least the version whose write returned before the read started
+static void *race_reader(void *arg){
+    struct race_thread *t = (struct race_thread *) arg;
+    const uint32_t lba_size = t->dev->lba_size_bytes;
+    char *buf = (char *) calloc(8, lba_size);
+    uint32_t expected[8];
+    assert(buf != nullptr);
+    while(!*t->stop && t->ret == 0){
+        uint32_t n = 1 + rand_r(&t->seed) % 8;
+        uint64_t off = rand_r(&t->seed) % (t->num_lbas - n + 1);
+        for(uint32_t i = 0; i < n; i++){
+            expected[i] = __atomic_load_n(&t->versions[off + i], __ATOMIC_ACQUIRE);
+        }
+        t->ret = zns_udevice_read(t->dev, (t->start_lba + off) * lba_size, buf, n * lba_size);
+        if(t->ret != 0){
+            printf("Error: racing read failed at lba 0x%lx \n", t->start_lba + off);
+            break;
+        }
+        for(uint32_t i = 0; i < n; i++){
+            int64_t version = page_version(buf + (uint64_t) i * lba_size, t->start_lba + off + i, lba_size);
+            if(version < expected[i]){
+                printf("ERROR: lba 0x%lx read version %ld, expected at least %u \n",
+                       t->start_lba + off + i, version, expected[i]);
+                t->ret = -EINVAL;
+                break;
+            }
+        }
+        t->reads++;
+    }
+    free(buf);
+    return nullptr;
+}
+
+/*
+ * Writers overwrite random runs of a small range each, while readers read runs of the same ranges. Every read has to
+ * return whole pages no older than the writes that finished before it started, whatever the FTL serves them from.
+ */
+static int racing_reads_verify(struct user_zns_device *dev, uint32_t num_writes){
+    const uint32_t num_writers = 2, num_readers = 4, lbas_per_range = 64;
+    const uint32_t lba_size = dev->lba_size_bytes;
+    const uint64_t max_lba_entries = dev->capacity_bytes / lba_size;
+    uint32_t *versions = (uint32_t *) calloc(num_writers * lbas_per_range, sizeof(uint32_t));
+    char *buf = (char *) calloc(lbas_per_range, lba_size);
+    struct race_thread threads[num_writers + num_readers];
+    pthread_t tids[num_writers + num_readers];
+    volatile bool stop = false;
+    uint64_t reads = 0;
+    int ret = 0;
+    assert(versions != nullptr && buf != nullptr);
+    assert(max_lba_entries >= num_writers * lbas_per_range);
+    const uint64_t start_lba = rand() % (max_lba_entries - num_writers * lbas_per_range + 1);
+    // version 0 everywhere first
+    for(uint32_t i = 0; i < num_writers && ret == 0; i++){
+        uint64_t lba = start_lba + i * lbas_per_range;
+        stamp_pages(buf, lba, lbas_per_range, 0, lba_size);
+        ret = zns_udevice_write(dev, lba * lba_size, buf, lbas_per_range * lba_size);
+    }
+    free(buf);
+    if(ret != 0){
+        printf("Error: writing the racing ranges failed \n");
+        free(versions);
+        return ret;
+    }
+    for(uint32_t i = 0; i < num_writers + num_readers; i++){
+        struct race_thread *t = &threads[i];
+        uint32_t range = i % num_writers;
+        t->dev = dev;
+        t->start_lba = start_lba + range * lbas_per_range;
+        t->num_lbas = lbas_per_range;
+        t->num_writes = num_writes;
+        t->versions = versions + range * lbas_per_range;
+        t->stop = &stop;
+        t->seed = (unsigned) (i + 1) * getpid();
+        t->reads = 0;
+        t->ret = 0;
+        pthread_create(&tids[i], nullptr, i < num_writers ? &race_writer : &race_reader, t);
+    }
+    for(uint32_t i = 0; i < num_writers + num_readers; i++){
+        pthread_join(tids[i], nullptr);
+        if(i == num_writers - 1){
+            stop = true;
+        }
+        if(threads[i].ret != 0){
+            ret = threads[i].ret;
+        }
+        reads += threads[i].reads;
+    }
+    if(ret == 0){
+        printf("Racing %u writes per range against %lu reads OK \n", num_writes, reads);
+    }
+    free(versions);
+    return ret;
+}
+
+// every LBA of the range has to read back with its version
+static int verify_versions(struct user_zns_device *dev, uint64_t start_lba, uint32_t num_lbas, const uint32_t *versions){
+    const uint32_t lba_size = dev->lba_size_bytes;
+    char *buf = (char *) calloc(8, lba_size);
+    int ret = 0;
+    assert(buf != nullptr);
+    for(uint32_t off = 0; off < num_lbas && ret == 0; off += 8){
+        uint32_t n = num_lbas - off < 8 ? num_lbas - off : 8;
+        ret = zns_udevice_read(dev, (start_lba + off) * lba_size, buf, n * lba_size);
+        if(ret != 0){
+            printf("Error: reading the device failed at lba 0x%lx \n", start_lba + off);
+            break;
+        }
+        for(uint32_t i = 0; i < n; i++){
+            int64_t version = page_version(buf + (uint64_t) i * lba_size, start_lba + off + i, lba_size);
+            if(version != versions[off + i]){
+                printf("ERROR: lba 0x%lx read version %ld, expected %u \n", start_lba + off + i, version, versions[off + i]);
+                ret = -EINVAL;
+                break;
+            }
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+/*
+ * Small overwrites of a range sit in the write-back buffer until they are flushed. After zns_udevice_flush the FTL is
+ * shut down and mounted again without a reset, every LBA has to come back with the version it was last written with.
+ * Skipped if the FTL does not persist its state on this device.
+ */
+static int flush_remount_verify(struct user_zns_device **dev, struct zdev_init_params *params, uint32_t num_writes,
+                                bool *skipped){
+    const uint32_t lba_size = (*dev)->lba_size_bytes;
+    const uint64_t max_lba_entries = (*dev)->capacity_bytes / lba_size;
+    const uint32_t num_lbas = max_lba_entries < 1024 ? max_lba_entries : 1024;
+    const uint64_t start_lba = rand() % (max_lba_entries - num_lbas + 1);
+    uint32_t *versions = (uint32_t *) calloc(num_lbas, sizeof(uint32_t));
+    char *buf = (char *) calloc(8, lba_size);
+    struct zns_udevice_stats stats;
+    int ret = 0;
+    assert(versions != nullptr && buf != nullptr);
+    *skipped = false;
+    for(uint32_t off = 0; off < num_lbas && ret == 0; off += 8){
+        uint32_t n = num_lbas - off < 8 ? num_lbas - off : 8;
+        stamp_pages(buf, start_lba + off, n, 1, lba_size);
+        ret = zns_udevice_write(*dev, (start_lba + off) * lba_size, buf, n * lba_size);
+        for(uint32_t i = 0; i < n; i++){
+            versions[off + i] = 1;
+        }
+    }
+    for(uint32_t v = 2; v < num_writes + 2 && ret == 0; v++){
+        uint32_t n = 1 + rand() % 8;
+        uint64_t off = rand() % (num_lbas - n + 1);
+        stamp_pages(buf, start_lba + off, n, v, lba_size);
+        ret = zns_udevice_write(*dev, (start_lba + off) * lba_size, buf, n * lba_size);
+        for(uint32_t i = 0; i < n; i++){
+            versions[off + i] = v;
+        }
+    }
+    free(buf);
+    if(ret != 0){
+        printf("Error: writing the device failed \n");
+        goto done;
+    }
+    ret = zns_udevice_flush(*dev);
+    if(ret != 0){
+        printf("Error: flushing the device failed %d \n", ret);
+        goto done;
+    }
+    ret = verify_versions(*dev, start_lba, num_lbas, versions);
+    if(ret != 0){
+        goto done;
+    }
+    // without a checkpoint the FTL refuses to start without force_reset
+    zns_udevice_get_stats(*dev, &stats);
+    if(stats.meta_checkpoints == 0){
+        printf("The FTL state is not persisted on this device, skipping the remount \n");
+        *skipped = true;
+        goto done;
+    }
+    printf("Overwriting and flushing %u LBAs OK, remounting \n", num_lbas);
+    ret = deinit_ss_zns_device(*dev);
+    *dev = nullptr;
+    if(ret != 0){
+        printf("Error: deinit of the device failed %d \n", ret);
+        goto done;
+    }
+    params->force_reset = false;
+    ret = init_ss_zns_device(params, dev);
+    if(ret != 0){
+        printf("Error: remounting the device failed %d \n", ret);
+        *dev = nullptr;
+        goto done;
+    }
+    zns_udevice_get_stats(*dev, &stats);
+    if(stats.meta_remount_us == 0){
+        printf("ERROR: the device was formatted instead of remounted \n");
+        ret = -EINVAL;
+        goto done;
+    }
+    ret = verify_versions(*dev, start_lba, num_lbas, versions);
+    if(ret == 0){
+        printf("Reading %u LBAs after the remount OK \n", num_lbas);
+    }
+    done:
+    free(versions);
+    return ret;
+}
+
+/*
+ * A read right after an overwrite must not be served the old data, from the read cache or anywhere else. Each round
+ * reads a run, which may cache it, overwrites a part of it, and reads the run twice.
+ */
+static int overwrite_read_verify(struct user_zns_device *dev, uint32_t rounds){
+    const uint32_t lba_size = dev->lba_size_bytes;
+    const uint64_t max_lba_entries = dev->capacity_bytes / lba_size;
+    const uint32_t num_lbas = max_lba_entries < 256 ? max_lba_entries : 256;
+    const uint64_t start_lba = rand() % (max_lba_entries - num_lbas + 1);
+    uint32_t *versions = (uint32_t *) calloc(num_lbas, sizeof(uint32_t));
+    char *buf = (char *) calloc(8, lba_size);
+    int ret = 0;
+    assert(versions != nullptr && buf != nullptr);
+    for(uint32_t off = 0; off < num_lbas && ret == 0; off += 8){
+        uint32_t n = num_lbas - off < 8 ? num_lbas - off : 8;
+        stamp_pages(buf, start_lba + off, n, 1, lba_size);
+        ret = zns_udevice_write(dev, (start_lba + off) * lba_size, buf, n * lba_size);
+        for(uint32_t i = 0; i < n; i++){
+            versions[off + i] = 1;
+        }
+    }
+    for(uint32_t r = 0; r < rounds && ret == 0; r++){
+        uint32_t n = 1 + rand() % 8;
+        uint64_t off = rand() % (num_lbas - n + 1);
+        ret = verify_versions(dev, start_lba + off, n, versions + off);
+        if(ret != 0){
+            break;
+        }
+        uint32_t m = 1 + rand() % n;
+        uint64_t woff = off + rand() % (n - m + 1);
+        stamp_pages(buf, start_lba + woff, m, r + 2, lba_size);
+        ret = zns_udevice_write(dev, (start_lba + woff) * lba_size, buf, m * lba_size);
+        if(ret != 0){
+            printf("Error: writing the device failed at lba 0x%lx \n", start_lba + woff);
+            break;
+        }
+        for(uint32_t i = 0; i < m; i++){
+            versions[woff + i] = r + 2;
+        }
+        ret = verify_versions(dev, start_lba + off, n, versions + off);
+        if(ret == 0){
+            ret = verify_versions(dev, start_lba + off, n, versions + off);
+        }
+    }
+    if(ret == 0){
+        ret = verify_versions(dev, start_lba, num_lbas, versions);
+    }
+    if(ret == 0){
+        printf("Reading back %u overwrites right away OK \n", rounds);
+    }
+    free(buf);
+    free(versions);
+    return ret;
+}
+
 static int show_help(){
     printf("Usage: m2 -d device_name -h -r \n");
-    printf("-d : /dev/nvmeXpY - in this format with the full path \n");
+    printf("-d : /dev/nvmeXpY - in this format with the full path, a comma separated list stripes them into one device \n");
+    printf("-u : KB per namespace before the stripe moves on to the next (default, 0 = library default). \n");
     printf("-r : resume if the FTL can. \n");
     printf("-l : the number of zones to use for log/metadata (default, minimum = 3). \n");
     printf("-w : watermark threshold, the number of free zones when to trigger the gc (default, minimum = 1). \n");
     printf("-o : overwrite so [int] times  (default, 10,000). \n");
+    printf("-b : KB of write-back buffer for small writes (default, 0 = off). \n");
+    printf("-a : KB of read cache (default, 0 = off). \n");
+    printf("-k : KB per logical block, dividing the zone size, packed into shared data zones (default, 0 = one zone). \n");
+    printf("-p : page mapped FTL instead of the hybrid one, needs a reset (no -r). \n");
+    printf("-c : gc copies through the host, never with NVMe Simple Copy. \n");
     printf("-h : shows help, and exits with success. No argument needed\n");
     return 0;
 }
 
+static void count_callback(struct user_zns_device *dev, uint64_t tag, int status, void *cb_arg){
+    (void) dev;
+    (void) tag;
+    if(status == 0){
+        (*(uint32_t *) cb_arg)++;
+    }
+}
+
+// submits reqs, keeping the ring full, and polls until all of them completed with their own tag exactly once
+static int submit_poll_all(struct user_zns_device *dev, struct zns_udevice_request *reqs, uint32_t num_reqs){
+    struct zns_udevice_completion cqes[16];
+    std::vector<bool> seen(num_reqs, false);
+    uint32_t submitted = 0, completed = 0;
+    int ret = 0;
+    while(completed < num_reqs){
+        if(submitted < num_reqs){
+            submitted += zns_udevice_submit(dev, reqs + submitted, num_reqs - submitted);
+        }
+        int n = zns_udevice_poll(dev, cqes, 16, 1);
+        for(int i = 0; i < n; i++){
+            uint64_t tag = cqes[i].tag;
+            if(tag >= num_reqs || reqs[tag].tag != tag || seen[tag]){
+                printf("ERROR: completion with unknown or repeated tag 0x%lx \n", tag);
+                ret = -EINVAL;
+                continue;
+            }
+            seen[tag] = true;
+            if(cqes[i].status != 0 && ret == 0){
+                printf("Error: request %lu failed %d \n", tag, cqes[i].status);
+                ret = cqes[i].status;
+            }
+        }
+        completed += n;
+    }
+    return ret;
+}
+
+/*
+ * The same overwrites as above, but through zns_udevice_submit/poll: each round writes every 8 LBA slot of a range
+ * with a new version at once, and reads all of them back at once. Tags have to come back once each, half of the
+ * requests carry a callback that is counted.
+ */
+static int submit_poll_verify(struct user_zns_device *dev, uint32_t rounds){
+    const uint32_t lba_size = dev->lba_size_bytes;
+    const uint64_t max_lba_entries = dev->capacity_bytes / lba_size;
+    const uint32_t num_slots = max_lba_entries / 8 < 32 ? max_lba_entries / 8 : 32;
+    const uint64_t start_lba = rand() % (max_lba_entries - num_slots * 8 + 1);
+    char *wbuf = (char *) calloc(num_slots * 8, lba_size);
+    char *rbuf = (char *) calloc(num_slots * 8, lba_size);
+    struct zns_udevice_request *reqs = (struct zns_udevice_request *) calloc(num_slots, sizeof(*reqs));
+    uint32_t callbacks = 0, expected_callbacks = 0;
+    int ret = 0;
+    assert(wbuf != nullptr && rbuf != nullptr && reqs != nullptr);
+    rounds = rounds < 64 ? rounds : 64;
+    for(uint32_t r = 1; r <= rounds && ret == 0; r++){
+        for(uint32_t i = 0; i < num_slots; i++){
+            uint32_t n = 1 + rand() % 8;
+            stamp_pages(wbuf + (uint64_t) i * 8 * lba_size, start_lba + i * 8, n, r, lba_size);
+            reqs[i].opcode = ZNS_UDEVICE_WRITE;
+            reqs[i].address = (start_lba + i * 8) * lba_size;
+            reqs[i].buffer = wbuf + (uint64_t) i * 8 * lba_size;
+            reqs[i].size = n * lba_size;
+            reqs[i].tag = i;
+            reqs[i].cb = (i & 1) ? count_callback : nullptr;
+            reqs[i].cb_arg = &callbacks;
+            expected_callbacks += i & 1;
+        }
+        ret = submit_poll_all(dev, reqs, num_slots);
+        if(ret != 0){
+            break;
+        }
+        memset(rbuf, 0, (uint64_t) num_slots * 8 * lba_size);
+        for(uint32_t i = 0; i < num_slots; i++){
+            reqs[i].opcode = ZNS_UDEVICE_READ;
+            reqs[i].buffer = rbuf + (uint64_t) i * 8 * lba_size;
+            expected_callbacks += i & 1;
+        }
+        ret = submit_poll_all(dev, reqs, num_slots);
+        for(uint32_t i = 0; i < num_slots && ret == 0; i++){
+            // the slot reads the last written version up to its size
+            if(memcmp(rbuf + (uint64_t) i * 8 * lba_size, wbuf + (uint64_t) i * 8 * lba_size, reqs[i].size) != 0){
+                printf("ERROR: submitted read of lba 0x%lx does not match round %u \n", start_lba + i * 8, r);
+                ret = -EINVAL;
+            }
+        }
+    }
+    if(ret == 0 && callbacks != expected_callbacks){
+        printf("ERROR: %u callbacks ran, expected %u \n", callbacks, expected_callbacks);
+        ret = -EINVAL;
+    }
+    if(ret == 0){
+        printf("Submitting and polling %u rounds of %u requests OK \n", rounds, num_slots);
+    }
+    free(reqs);
+    free(rbuf);
+    free(wbuf);
+    return ret;
+}
+
 int main(int argc, char **argv) {
     uint64_t start, end;
     start = microseconds_since_epoch();
     srand( (unsigned) time(NULL) * getpid());
     int ret, c;
-    char *zns_device_name = (char*) "nvme0n1", *str1 = nullptr;
+    char *zns_device_name = (char*) "nvme0n1", *str1 = nullptr, *str2 = nullptr;
+    std::vector<char *> zns_device_names;
     struct user_zns_device *my_dev = nullptr;
     uint64_t *seq_addresses = nullptr, *random_addresses = nullptr;
     uint32_t to_hammer_lba = 10000;
 
-    struct zdev_init_params params;
+    struct zdev_init_params params = {};
     params.force_reset = true;
     params.log_zones = 3;
     params.gc_wmark = 1;
@@ -225,7 +653,7 @@ int main(int argc, char **argv) {
     printf("This is M3. The goal of this milestone is to implement a hybrid log-structure ZTL (Zone Translation Layer) on top of the ZNS WITH a GC \n");
     printf("                                                                                                                             ^^^^^^^^^ \n");
     printf("===================================================================================== \n");
-    while ((c = getopt(argc, argv, "o:m:l:d:w:hr")) != -1) {
+    while ((c = getopt(argc, argv, "o:m:l:d:w:b:a:k:u:pchr")) != -1) {
         switch (c) {
             case 'h':
                 show_help();
@@ -237,20 +665,27 @@ int main(int argc, char **argv) {
                 to_hammer_lba = atoi(optarg);
                 break;
             case 'd':
-                str1 = strdupa(optarg);
-                if (!str1) {
+                str2 = strdupa(optarg);
+                if (!str2) {
                     printf("Could not parse the arguments for the device %s '\n", optarg);
                     exit(EXIT_FAILURE);
                 }
-                for (int j = 1; ; j++) {
-                    char *token = strsep(&str1, "/"); // delimited is "/"
-                    if (token == nullptr) {
+                zns_device_names.clear();
+                for (;;) {
+                    str1 = strsep(&str2, ","); // one name per namespace
+                    if (str1 == nullptr) {
                         break;
                     }
-                    // if there was a valid parse, just save it
-                    zns_device_name = token;
+                    for (;;) {
+                        char *token = strsep(&str1, "/"); // delimited is "/"
+                        if (token == nullptr) {
+                            break;
+                        }
+                        // if there was a valid parse, just save it
+                        zns_device_name = token;
+                    }
+                    zns_device_names.push_back(strdup(zns_device_name));
                 }
-                free(str1);
                 break;
             case 'l':
                 params.log_zones = atoi(optarg);
@@ -266,14 +701,34 @@ int main(int argc, char **argv) {
                     exit(-1);
                 }
                 break;
+            case 'b':
+                params.wbuf_bytes = atoi(optarg) * 1024U;
+                break;
+            case 'a':
+                params.rcache_bytes = atoi(optarg) * 1024ULL;
+                break;
+            case 'k':
+                params.block_bytes = atoi(optarg) * 1024U;
+                break;
+            case 'u':
+                params.stripe_bytes = atoi(optarg) * 1024U;
+                break;
+            case 'p':
+                params.ftl_mode = ZNS_FTL_PAGE;
+                break;
+            case 'c':
+                params.gc_host_copy = true;
+                break;
             default:
                 show_help();
                 exit(-1);
         }
     }
     params.name = strdup(zns_device_name);
-    printf("parameter settings are: device-name %s log_zones %d gc-watermark %d force-reset %s hammer-time %d \n",
-           params.name,params.log_zones,params.gc_wmark,params.force_reset==1?"yes":"no", to_hammer_lba);
+    params.names = zns_device_names.data();
+    params.num_names = zns_device_names.size();
+    printf("parameter settings are: device-name %s namespaces %u log_zones %d gc-watermark %d force-reset %s hammer-time %d \n",
+           params.name, params.num_names ? params.num_names : 1, params.log_zones,params.gc_wmark,params.force_reset==1?"yes":"no", to_hammer_lba);
 
     ret = init_ss_zns_device(&params, &my_dev);
     assert (ret == 0);
@@ -290,17 +745,29 @@ int main(int argc, char **argv) {
     int t1 = wr_full_device_verify(my_dev, seq_addresses, max_lba_entries, 0);
     int t2 = wr_full_device_verify(my_dev, random_addresses, max_lba_entries, 0);
     int t3 = wr_full_device_verify(my_dev, random_addresses, max_lba_entries, to_hammer_lba);
+    int t4 = racing_reads_verify(my_dev, to_hammer_lba);
+    bool t5_skipped;
+    int t5 = flush_remount_verify(&my_dev, &params, to_hammer_lba, &t5_skipped);
+    int t6 = my_dev != nullptr ? overwrite_read_verify(my_dev, to_hammer_lba) : -1;
+    int t7 = my_dev != nullptr ? submit_poll_verify(my_dev, to_hammer_lba) : -1;
     // clean up
-    ret = deinit_ss_zns_device(my_dev);
+    ret = my_dev != nullptr ? deinit_ss_zns_device(my_dev) : -1;
     // free all
     delete[] seq_addresses;
     delete[] random_addresses;
+    for (char *name : zns_device_names) {
+        free(name);
+    }
     end = microseconds_since_epoch();
     printf("====================================================================\n");
     printf("Milestone 3 results \n");
     printf("[stosys-result] Test 1 sequential write, read, and match (full device)                : %s \n", (t1 == 0 ? " Passed" : " Failed"));
     printf("[stosys-result] Test 2 randomized write, read, and match (full device)                : %s \n", (t2 == 0 ? " Passed" : " Failed"));
     printf("[stosys-result] Test 3 randomized write, read, and match (full device, hammer %-6u)   : %s \n", to_hammer_lba, (t3 == 0 ? " Passed" : " Failed"));
+    printf("[stosys-result] Test 4 reads racing overwrites of the same LBAs (%-6u writes)        : %s \n", to_hammer_lba, (t4 == 0 ? " Passed" : " Failed"));
+    printf("[stosys-result] Test 5 overwrite, flush, remount, and match (%-6u writes)            : %s \n", to_hammer_lba, (t5_skipped ? " Skipped" : (t5 == 0 ? " Passed" : " Failed")));
+    printf("[stosys-result] Test 6 overwrite and read back right away (%-6u overwrites)         : %s \n", to_hammer_lba, (t6 == 0 ? " Passed" : " Failed"));
+    printf("[stosys-result] Test 7 submit and poll overwrites and reads, match data and tags       : %s \n", (t7 == 0 ? " Passed" : " Failed"));
     printf("====================================================================\n");
     printf("[stosys-stats] The elapsed time is %lu milliseconds \n", ((end -  start)/1000));
     printf("====================================================================\n");
@@ -0,0 +1,98 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include "zns_bitmap.h"
+
+extern "C" {
+
+static inline uint64_t word_mask(uint32_t start, uint32_t end);
+
+uint64_t *zns_bitmap_alloc(uint64_t num_bits)
+{
+    uint64_t num_words = ZNS_BITMAP_WORDS(num_bits);
+    return (uint64_t *)calloc(num_words ? num_words : 1ULL, sizeof(uint64_t));
+}
+
+bool zns_bitmap_set_range(uint64_t *bitmap, uint64_t start,
+                          uint64_t num_bits)
+{
+    uint64_t end = start + num_bits;
+    bool changed = false;
+    while (start < end) {
+        uint64_t word = start >> 6U;
+        uint32_t bits = end - (word << 6U) < 64ULL ? end - (word << 6U) : 64U;
+        uint64_t mask = word_mask(start & 63U, bits);
+        // Rewrites find their bits set, a load keeps the line shared
+        if ((__atomic_load_n(&bitmap[word], __ATOMIC_RELAXED) & mask) != mask) {
+            uint64_t old = __atomic_fetch_or(&bitmap[word], mask,
+                                             __ATOMIC_RELAXED);
+            if ((old & mask) != mask)
+                changed = true;
+        }
+        start = (word << 6U) + bits;
+    }
+    return changed;
+}
+
+bool zns_bitmap_test_range(const uint64_t *bitmap, uint64_t start,
+                           uint64_t num_bits)
+{
+    uint64_t end = start + num_bits;
+    while (start < end) {
+        uint64_t word = start >> 6U;
+        uint32_t bits = end - (word << 6U) < 64ULL ? end - (word << 6U) : 64U;
+        uint64_t mask = word_mask(start & 63U, bits);
+        if ((__atomic_load_n(&bitmap[word], __ATOMIC_RELAXED) & mask) != mask)
+            return false;
+        start = (word << 6U) + bits;
+    }
+    return true;
+}
+
+uint64_t zns_bitmap_find(const uint64_t *bitmap, uint64_t start,
+                         uint64_t end, bool set)
+{
+    while (start < end) {
+        uint64_t word = start >> 6U;
+        uint64_t bits = __atomic_load_n(&bitmap[word], __ATOMIC_RELAXED);
+        if (!set)
+            bits = ~bits;
+        bits &= word_mask(start & 63U, 64U);
+        if (bits) {
+            uint64_t found = (word << 6U) + __builtin_ctzll(bits);
+            return found < end ? found : end;
+        }
+        start = (word + 1ULL) << 6U;
+    }
+    return end;
+}
+
+// Bits [start, end) of a word, start < end <= 64
+static inline uint64_t word_mask(uint32_t start, uint32_t end)
+{
+    uint64_t mask = end == 64U ? ~0ULL : (1ULL << end) - 1ULL;
+    return mask & ~((1ULL << start) - 1ULL);
+}
+
+}
@@ -0,0 +1,51 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_BITMAP_H
+#define STOSYS_PROJECT_ZNS_BITMAP_H
+
+#include <cstdint>
+
+extern "C" {
+
+// Bitmaps of 64 bit words, bit i is bit i % 64 of word i / 64. On little
+// endian hosts that is also the layout of a byte bitmap, which is how
+// checkpoints store them. Ranges are set and tested a word at a time, and
+// setting is atomic per word, so concurrent writers never lose bits.
+
+#define ZNS_BITMAP_WORDS(num_bits) (((uint64_t)(num_bits) + 63ULL) >> 6U)
+
+// Zeroed, free() it
+uint64_t *zns_bitmap_alloc(uint64_t num_bits);
+// Sets [start, start + num_bits), returns true if any of them was clear
+bool zns_bitmap_set_range(uint64_t *bitmap, uint64_t start,
+                          uint64_t num_bits);
+// True if all of [start, start + num_bits) are set
+bool zns_bitmap_test_range(const uint64_t *bitmap, uint64_t start,
+                           uint64_t num_bits);
+// First bit in [start, end) that is set if set, else clear, end if none
+uint64_t zns_bitmap_find(const uint64_t *bitmap, uint64_t start,
+                         uint64_t end, bool set);
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_BITMAP_H
@@ -21,88 +21,382 @@ SOFTWARE.
  */
 
 #include <cerrno>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <libnvme.h>
 #include <pthread.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include "zns_bitmap.h"
 #include "zns_device.h"
+#include "zns_extent_map.h"
+#include "zns_gc_index.h"
+#include "zns_io_engine.h"
+#include "zns_meta.h"
+#include "zns_page_ftl.h"
+#include "zns_rcache.h"
+#include "zns_ring.h"
+#include "zns_sched.h"
+#include "zns_slab.h"
+#include "zns_stripe.h"
+#include "zns_wbuf.h"
 
 extern "C" {
 
-enum {
-    user_read = 0x1,
-    gc_read = 0x2,
-    sb_read = user_read | gc_read,
-    user_write = 0x10,
-    gc_write = 0x20,
-    sb_write = user_write | gc_write
+// ONCS bit for the Copy command, not in the libnvme enum
+#define ZNS_ONCS_COPY (1U << 8)
+
+// Write Zeroes takes a 16 bit block count
+#define ZNS_WRITE_ZEROES_MAX_PAGES 0x10000U
+
+// One more zone than the data and log zones need lets a merge write the new
+// data zone before it resets the old one. The metadata zones before
+// first_zone come on top, see zns_meta.h.
+#define ZNS_SPARE_ZONES 1U
+
+// Blocks smaller than a zone keep one more zone back, only cleaning takes
+// it to relocate blocks out of a data zone
+#define ZNS_CLEAN_ZONES 1U
+
+// Optimistic tries of a read before it holds block->lock across its I/O
+#define ZNS_READ_RETRIES 4U
+
+// Reads of up to this many pages track buffered pages on the stack
+#define ZNS_READ_STACK_PAGES 4096U
+
+// Tries of a zone reset before the zone is taken offline
+#define ZNS_RESET_TRIES 3U
+
+// How long compaction waits for the lock of a log stream
+#define ZNS_COMPACT_LOCK_NS 1000000L
+
+// In zone_info::appends, the last page of the open zone is reserved
+#define ZNS_ZONE_FULL (1U << 31)
+
+// Journal records. Offsets are within the logical block, zones are indexes.
+enum meta_record_type {
+    META_MAP = 1, // arg0 pages << 32 | offset, arg1 physical address
+    META_BITMAP, // arg0 offset, arg1 pages written
+    META_MERGE_BEGIN, // the log pages became old_page_maps
+    // arg0 new data zone, arg1 start << 32 | pages of the image in it,
+    // old_page_maps are gone
+    META_MERGE_END,
+    META_SEQ // arg0 seq zone
+};
+
+#define META_CKPT_MAGIC 0x3354435aU // "ZCT3"
+#define META_NO_ZONE 0xffffffffU
+
+// Checkpoint layout: the header, then for each logical block a
+// meta_ckpt_block, its log extents, its old log extents and its bitmap
+struct meta_ckpt_header {
+    uint32_t magic;
+    uint32_t num_zones;
+    uint32_t zone_num_pages;
+    uint32_t page_size;
+    int32_t num_log_zones;
+    uint32_t num_data_zones;
+    uint32_t block_num_pages;
 };
 
-// zone in zns
-struct zone_info {
+struct meta_ckpt_block {
+    uint64_t lsn;
+    uint32_t data_zone;
+    uint32_t seq_zone;
+    uint32_t num_maps;
+    uint32_t num_old_maps;
+    uint32_t data_start;
+    uint32_t data_pages;
+};
+
+struct meta_ckpt_map {
+    uint64_t physical_addr;
+    uint32_t offset;
+    uint32_t num_pages;
+};
+
+// What a zone is used for. Remount works it out from the mappings.
+enum zone_state {
+    ZONE_FREE = 0, // reset and in free_zones
+    ZONE_META, // journal and checkpoints
+    ZONE_OPEN, // a log stream appends to it
+    ZONE_LOG, // full log zone, reclaimed once it has no valid pages
+    ZONE_EMPTY, // log zone claimed by gc to be reset
+    ZONE_COMPACT, // log zone gc moves the valid pages out of
+    ZONE_SEQ, // seq zone of a block
+    ZONE_PACK, // data zone merges append block images to
+    ZONE_DATA, // data zone of block images, reset once none is left
+    ZONE_OFFLINE // failed to reset, never used again
+};
+
+struct logical_block;
+
+// zone in zns, one cache line each in the zone table. The counters and the
+// state are only changed with atomics.
+struct alignas(ZNS_SLAB_CACHE_LINE) zone_info {
     unsigned long long saddr;
-    uint32_t num_valid_pages;
+    uint32_t num_valid_pages; // of data zones, the pages of their images
     uint32_t write_ptr;
-    pthread_mutex_t num_valid_pages_lock;
-    pthread_mutex_t write_ptr_lock;
-    zone_info *next; // linked in free_zones and used_log_zones
+    uint8_t state; // zone_state
+    uint32_t generation; // bumped before every reset, reads check it
+    zone_info *next; // links the zones a gc worker resets, or pack_zones
+    // Open zones: appends reserved and not yet mapped, plus ZNS_ZONE_FULL
+    // once the zone is reserved up to its end
+    uint32_t appends;
+    uint32_t log_slot; // full log zones: index in log_zones
+    // Open and log zones: the logical page written at each page, so gc can
+    // find the valid pages of a zone. A seq zone kept in the log gets one
+    // when it turns into a log zone.
+    unsigned long long *rmap;
+    // Data zones: the blocks with an image in it, under data_blocks_lock
+    logical_block *data_blocks;
+    // Packed data zones: in clean_index while some images in it are dead
+    gc_candidate clean_candidate;
 };
 
-// page map for log zones
-struct page_map {
-    unsigned long long page_addr;
-    unsigned long long physical_addr;
-    zone_info *zone;
-    page_map *next; // page map for each logical block
+// Device reads of one request, gathered so they can be in flight together
+struct read_runs {
+    zns_io_req *reqs;
+    uint32_t *generations; // of the zone of each run when it was planned
+    uint32_t *offsets; // page of each run in the planned range
+    uint32_t num_reqs;
+    uint32_t max_reqs;
+};
+
+// How far the runs went out, they are sent grant by grant
+struct read_cursor {
+    uint32_t run;
+    uint32_t done; // pages of the run sent
 };
 
 // Contains data in log zone (page map) and data in data zone (block map)
 struct logical_block {
     unsigned long long s_page_addr;
-    page_map *page_maps; // page mapping for this logical block (log zone)
-    page_map *old_page_maps;
-    page_map *page_maps_tail;
+    zns_extent_map page_maps; // page mapping for this logical block (log zone)
+    zns_extent_map old_page_maps; // not empty while the block is merged
+    gc_candidate candidate; // in gc_index while page_maps is not empty
     zone_info *data_zone; // block mapping for this logical block (data zone)
-    uint8_t *bitmap;
-    //TODO: LOCK the access
+    uint32_t data_start; // first page of its image in data_zone
+    uint32_t data_pages; // pages of the image, written or holes
+    // The other blocks with an image in data_zone
+    logical_block *data_next;
+    logical_block *data_prev;
+    zone_info *seq_zone; // log zone written in order from offset 0
+    uint32_t heat; // log pages written, halved every heat epoch
+    uint32_t heat_epoch;
+    uint32_t log_stream; // of the last log write
+    uint64_t *bitmap; // pages written, one block worth of bits
+    uint64_t lsn; // of the last journal record, replay skips older ones
+    // Mapping and zone pointers, never held across I/O by reads
+    pthread_mutex_t lock;
+    // Keeps writes to the data or seq zone in order across their I/O, and
+    // merges from starting under them. Taken before lock.
+    pthread_mutex_t write_lock;
+};
+
+// Completion of a zns_udevice_submit request, waiting to be polled
+struct async_completion {
+    uint64_t tag;
+    int status;
+    zns_udevice_cb cb;
+    void *cb_arg;
+};
+
+// Per-device submission and completion rings of the non-blocking interface.
+// Heads and tails are free running, the slot is the counter modulo depth.
+struct async_rings {
+    user_zns_device *dev;
+    uint32_t depth;
+    zns_udevice_request *sq;
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    async_completion *cq;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t outstanding; // submitted and not yet reaped, at most depth
+    bool stop;
     pthread_mutex_t lock;
+    pthread_cond_t sq_cond;
+    pthread_cond_t cq_cond;
+    uint32_t num_workers;
+    pthread_t *workers;
+};
+
+// Logical pages of a log append, in the order of its data
+struct log_seg {
+    unsigned long long page_addr;
+    uint32_t num_pages;
+    void *buffer; // the data, only in a log_batch
+    // Compaction: the log page the data comes from, the pages are only
+    // mapped if they are still there. 0 for writes.
+    unsigned long long from;
+};
+
+// Log writes of a write-back flush, gathered per stream so they go out in
+// appends of up to the zone append size limit
+struct log_batch {
+    log_seg *segs[ZNS_MAX_LOG_STREAMS];
+    uint32_t num_segs[ZNS_MAX_LOG_STREAMS];
+    uint32_t max_segs[ZNS_MAX_LOG_STREAMS];
+};
+
+// A write of one block to its seq or data zone, in chunks in order
+struct zone_write {
+    logical_block *block; // write_lock held until the write is done
+    zone_info *zone;
+    void *buffer;
+    uint32_t offset; // in the block
+    uint32_t num_pages;
+    uint32_t done; // pages landed
+    uint32_t data_pages; // of the image before, data zone writes
+    bool seq;
+    bool full; // the seq zone holds the whole block, merge it
+    int ret;
+};
+
+// An open log zone. Stream 0 takes the coldest writes.
+struct log_stream {
+    zone_info *zone;
+    pthread_mutex_t lock; // Serializes reservations in zone, not appends
+    bool counted; // the next zone was counted as used when the last filled
+    uint64_t bytes;
+    uint64_t gc_bytes; // merges of blocks last written to this stream
+};
+
+struct zns_info;
+
+// Worker i joins in i log zones below the watermark, so extra mergers only
+// run when one falls behind
+struct gc_worker {
+    zns_info *info;
+    int level;
+    pthread_t thread;
 };
 
 struct zns_info {
     // Values from init parameters
     int num_log_zones;
     int gc_wmark;
-    pthread_t gc_thread;
+    uint32_t num_gc_workers;
+    gc_worker *gc_workers;
     bool run_gc;
+    pthread_cond_t gc_cond; // gc waits here until the watermark is crossed
+    gc_index gc_index; // merge candidates
+    uint64_t gc_merges;
+    uint64_t gc_log_pages_merged;
+    // Simple Copy limits, copy_max_ranges is 0 if merges go through the host
+    uint32_t copy_max_ranges;
+    uint32_t copy_max_range_pages;
+    uint32_t copy_max_pages;
+    uint64_t gc_host_bytes;
+    uint64_t gc_host_cpu_ns;
+    uint64_t gc_copy_bytes;
+    uint64_t gc_copy_cpu_ns;
+    uint64_t gc_switch_merges;
+    uint64_t gc_partial_merges;
+    uint64_t gc_compactions;
+    uint64_t gc_compacted_pages;
+    uint64_t gc_data_cleanings;
+    uint64_t gc_relocations;
+    // Host merges stream through pairs of chunk buffers of mdts bytes,
+    // merge_chunks holds the indexes of the free pairs
+    char *merge_buffers;
+    zns_ring merge_chunks;
+    pthread_cond_t merge_chunk_cond;
+    // Holes of data zones. With Write Zeroes they cost no transfer, else
+    // zeros are appended from zeros.
+    bool write_zeroes;
+    char *zeros;
+    uint32_t zeros_pages;
+    uint64_t hole_pages_zeroed;
+    uint64_t hole_pages_written;
     // Query the nsid for following info
     int fd;
     unsigned nsid;
+    zns_io_engine *engine;
     uint32_t page_size;
     uint32_t num_zones;
     uint32_t num_data_zones;
     uint32_t zone_num_pages;
+    // Logical blocks, several per data zone if packed
+    uint32_t num_blocks;
+    uint32_t block_num_pages;
+    bool packed;
     uint32_t mdts; // max data transfer size (read + append limit)
     uint32_t zasl; // zone append size limit (append limit)
-    uint8_t used_status;
-    uint32_t free_transfer_size;
-    uint32_t free_append_size;
-    pthread_mutex_t size_limit_lock;
+    zns_sched sched; // shares mdts between user and gc traffic
     // Log zones
-    zone_info *curr_log_zone;
+    uint32_t num_log_streams;
+    log_stream log_streams[ZNS_MAX_LOG_STREAMS];
+    uint64_t log_pages; // heat epoch is log_pages / zone_num_pages
+    // open log zones past the first count as used, atomic
     int num_used_log_zones;
-    zone_info *used_log_zones;
-    zone_info *used_log_zones_tail;
-    // Free zones
-    uint32_t num_free_zones;
-    zone_info *free_zones;
-    zone_info *free_zones_tail;
-    pthread_mutex_t zones_lock; // Lock for changing used_log_zone and free_zone
-    // logical block corresponding to each data zone
+    // Indexes of the full log zones, unordered, so gc looks at them
+    // without going over the zone table. Under log_zones_lock.
+    uint32_t *log_zones;
+    uint32_t num_full_log_zones;
+    pthread_mutex_t log_zones_lock;
+    // All zones by index, metadata zones included
+    zone_info *zones;
+    zns_ring free_zones; // indexes of the free zones
+    // Only for sleeping on the conditions, zones are taken and counted
+    // without it
+    pthread_mutex_t zones_lock;
+    pthread_cond_t log_zone_cond; // a log zone was reclaimed or a zone freed
+    // Packed blocks: zones with room for another image, linked by next,
+    // and the data and pack zones in use. Merges take a zone out of the
+    // list while they write to it. One cleaning at a time.
+    zone_info *pack_zones;
+    pthread_mutex_t pack_lock;
+    int num_used_data_zones;
+    pthread_mutex_t clean_lock;
+    // Data zones by valid pages, greedy picks the cleaning's victim. Zones
+    // that left ZONE_DATA since are dropped when picked.
+    struct gc_index clean_index;
+    pthread_mutex_t data_blocks_lock; // taken after block->lock
     logical_block *logical_blocks;
+    uint64_t *bitmaps; // of all logical blocks, bitmap_words each
+    uint32_t bitmap_words;
+    zns_slab extent_slab; // log extents of all logical blocks
+    // zns_udevice_submit/poll
+    async_rings *async;
+    // Metadata zones, only written if persist. Zones before first_zone
+    // are the metadata zones then, else there are none.
+    bool persist;
+    uint32_t first_zone;
+    zns_meta meta;
+    pthread_t checkpointer;
+    uint64_t remount_us;
+    uint64_t replayed_records;
+    uint64_t read_retries;
+    // Write-back buffer of small writes, NULL if off. Flushes take
+    // flush_lock for writing, writes around the buffer for reading.
+    zns_wbuf *wbuf;
+    uint32_t wbuf_max_write; // smaller writes are buffered
+    uint32_t wbuf_flush_pages; // the flusher starts at this many
+    uint64_t wbuf_flush_ns; // or once the oldest write is this old
+    zns_wbuf_page *wbuf_pages; // of the flush in progress
+    char *wbuf_flush_buffer;
+    char *wbuf_gather; // one append of a log_batch
+    uint32_t wbuf_gather_pages;
+    pthread_rwlock_t flush_lock;
+    bool run_flusher;
+    pthread_t flusher;
+    pthread_mutex_t flusher_lock;
+    pthread_cond_t flusher_cond;
+    uint64_t wbuf_flushes;
+    uint64_t wbuf_flushed_pages;
+    // Read cache of logical pages, NULL if off. Below the write-back
+    // buffer, writes invalidate it once they are done.
+    zns_rcache *rcache;
+    // ZNS_FTL_PAGE only, the hybrid state above is then left unused
+    zns_page_ftl *page_ftl;
+    // Striped namespaces, everything but the async rings is in the members
+    zns_stripe *stripe;
 };
 
 static inline void increase_num_valid_page(zone_info *zone, uint32_t num_pages);
@@ -110,29 +404,154 @@ static inline void decrease_num_valid_page(zone_info *zone, uint32_t num_pages);
 static inline void increase_write_ptr(zone_info *zone, uint32_t num_pages);
 static inline void decrease_write_ptr(zone_info *zone, uint32_t num_pages);
 static inline uint32_t get_block_index(unsigned long long page_addr,
-                                       uint32_t zone_num_pages);
+                                       uint32_t block_num_pages);
 static inline uint32_t get_data_offset(unsigned long long page_addr,
-                                       uint32_t zone_num_pages);
-static bool read_bitmap(logical_block *block,
-                        uint32_t offset, uint32_t num_pages);
-static void write_bitmap(logical_block *block,
+                                       uint32_t block_num_pages);
+static void write_bitmap(zns_info *info, logical_block *block,
                          uint32_t offset, uint32_t num_pages);
-static void change_log_zone(zns_info *info);
-static void update_page_map(zns_info *info, unsigned long long page_addr,
+static void get_memory(zns_info *info, zns_udevice_stats *stats);
+static inline uint32_t get_zone_index(zns_info *info, zone_info *zone);
+static inline void set_zone_state(zone_info *zone, uint8_t state);
+static zone_info *take_free_zone(zns_info *info, uint8_t state);
+static inline void log_block(zns_info *info, logical_block *block,
+                             uint32_t type, uint64_t arg0, uint64_t arg1);
+static inline void sync_meta(zns_info *info);
+static inline bool gc_needed(zns_info *info, int level);
+static uint32_t classify_write(zns_info *info, logical_block *block,
+                               uint32_t num_pages);
+static void open_log_zone(zns_info *info, log_stream *stream);
+static void change_log_zone(zns_info *info, log_stream *stream);
+static void alloc_rmap(zns_info *info, zone_info *zone);
+static void update_page_map(zns_info *info, zone_info *zone,
+                            unsigned long long page_addr,
+                            unsigned long long physical_addr,
+                            uint32_t num_pages, unsigned long long from);
+static void insert_page_map(zns_info *info, logical_block *block,
+                            zone_info *zone, unsigned long long page_addr,
                             unsigned long long physical_addr,
                             uint32_t num_pages);
-static unsigned request_transfer_size(zns_info *info, uint8_t type);
-static void free_transfer_size(zns_info *info, uint8_t type, unsigned size);
-static int read_from_zns(zns_info *info, unsigned long long physical_addr,
-                         void *buffer, uint32_t size, uint8_t type);
+static void move_page_map(zns_info *info, logical_block *block,
+                          zone_info *zone, unsigned long long page_addr,
+                          unsigned long long physical_addr,
+                          uint32_t num_pages, unsigned long long from);
+static void release_log_pages(void *zone, uint32_t num_pages, void *);
+static inline uint32_t get_log_end(logical_block *block);
+static inline uint32_t get_merge_cost(logical_block *block);
+static void update_gc_candidate(zns_info *info, logical_block *block);
+static zone_info *get_seq_zone(zns_info *info);
+static int write_zones(zns_info *info, zone_write *writes,
+                       uint32_t num_writes);
+static void add_read_run(zns_info *info, read_runs *runs,
+                         unsigned long long physical_addr, uint32_t num_pages,
+                         uint32_t offset, void *buffer);
+static void get_read_runs(zns_info *info, logical_block *block,
+                          zns_extent_map *old_maps, zns_extent_map *maps,
+                          uint32_t offset, uint32_t num_pages, void *buffer,
+                          read_runs *runs);
+static uint64_t runs_left(const read_runs *runs, const read_cursor *cursor);
+static int submit_runs(zns_info *info, read_runs *runs, read_cursor *cursor,
+                       const zns_sched_grant *grant, zns_io_req *extra,
+                       uint64_t *num_pages);
+static bool read_runs_valid(zns_info *info, const read_runs *runs);
+static int submit_reads(zns_info *info, read_runs *runs, read_cursor *cursor,
+                        uint8_t cls);
+static int reset_zone(zns_info *info, zone_info *zone);
+static void offline_zone(zns_info *info, zone_info *zone);
 static int append_to_data_zone(zns_info *info, zone_info *zone,
-                               void *buffer, uint32_t size, uint8_t type);
-static int append_to_log_zone(zns_info *info, unsigned long long page_addr,
-                              void *buffer, uint32_t size);
-static int read_logical_block(zns_info *info, logical_block *block,
-                              void *buffer);
-static void merge(zns_info *info, logical_block *block);
-static void *garbage_collection(void *info_ptr);
+                               void *buffer, uint32_t size, uint8_t cls);
+static int append_zeros(zns_info *info, zone_info *zone, uint32_t num_pages,
+                        uint8_t cls);
+static void map_log_segs(zns_info *info, zone_info *zone,
+                         const log_seg *segs, uint64_t first,
+                         unsigned long long physical_addr,
+                         uint32_t num_pages);
+static int append_to_log_zone(zns_info *info, log_stream *stream,
+                              const log_seg *segs, void *buffer,
+                              uint32_t size);
+static uint32_t reserve_log_pages(zns_info *info, log_stream *stream,
+                                  uint32_t num_pages, zone_info **zone);
+static zone_info *try_reserve_log_pages(zns_info *info, uint32_t num_pages,
+                                        log_stream **stream);
+static void put_log_reservation(zns_info *info, zone_info *zone);
+static void add_log_zone(zns_info *info, zone_info *zone);
+static void remove_log_zone(zns_info *info, zone_info *zone);
+static int append_log_pages(zns_info *info, zone_info *zone,
+                            const log_seg *segs, uint64_t first, void *buffer,
+                            uint32_t num_pages, uint8_t cls);
+static void add_log_batch(log_batch *batch, uint32_t stream,
+                          unsigned long long page_addr, uint32_t num_pages,
+                          void *buffer);
+static int append_log_batch(zns_info *info, log_batch *batch);
+static int init_merge_chunks(zns_info *info);
+static void deinit_merge_chunks(zns_info *info);
+static char *take_merge_chunks(zns_info *info);
+static void put_merge_chunks(zns_info *info, char *chunks);
+static int append_with_reads(zns_info *info, zone_info *zone, void *buffer,
+                             uint32_t size, read_runs *reads);
+static int stream_pages(zns_info *info, read_runs *runs, uint32_t num_pages,
+                        zone_info *zone);
+static int copy_logical_block(zns_info *info, logical_block *block,
+                              uint32_t num_pages, zone_info *zone);
+static int copy_pages(zns_info *info, nvme_copy_range *ranges, uint32_t nr,
+                      uint32_t num_pages, unsigned long long sdlba,
+                      zns_sched_grant *grant);
+static uint64_t thread_cpu_ns();
+static int move_pages(zns_info *info, zone_info *from, zone_info *to,
+                      uint32_t offset, uint32_t num_pages);
+static bool switch_merge(zns_info *info, logical_block *block,
+                         zone_info *seq);
+static bool merge(zns_info *info, logical_block *block, zone_info *dest);
+static zone_info *take_pack_zone(zns_info *info, uint32_t num_pages,
+                                 bool clean);
+static zone_info *try_take_pack_zone(zns_info *info, uint32_t num_pages,
+                                     int max_used);
+static void put_pack_zone(zns_info *info, zone_info *zone);
+static void release_data_pages(zns_info *info, zone_info *zone,
+                               uint32_t num_pages);
+static void set_data_zone(zns_info *info, logical_block *block,
+                          zone_info *zone);
+static void link_data_block(logical_block *block);
+static void free_data_zone(zns_info *info, zone_info *zone);
+static void update_clean_candidate(zns_info *info, zone_info *zone);
+static bool clean_data_zone(zns_info *info);
+static bool compact_log_zone(zns_info *info, logical_block *block);
+static void put_free_zone(zns_info *info, zone_info *zone);
+static int read_blocks(zns_info *info, uint64_t address, void *buffer,
+                       uint32_t size);
+static int read_block(zns_info *info, logical_block *block, uint32_t offset,
+                      uint32_t num_pages, void *buffer);
+static int write_blocks(zns_info *info, uint64_t address, void *buffer,
+                        uint32_t size, log_batch *batch);
+static int read_direct(zns_info *info, uint64_t address, void *buffer,
+                       uint32_t size);
+static int write_direct(zns_info *info, uint64_t address, void *buffer,
+                        uint32_t size);
+static int write_wbuf(zns_info *info, uint64_t address, void *buffer,
+                      uint32_t size);
+static int init_rcache(zns_info *info, const zdev_init_params *params);
+static void deinit_rcache(zns_info *info);
+static int init_wbuf(zns_info *info, const zdev_init_params *params);
+static void deinit_wbuf(zns_info *info);
+static int flush_wbuf(zns_info *info);
+static void *wbuf_flusher(void *info_ptr);
+static bool reclaim_log_zones(zns_info *info);
+static void *garbage_collection(void *worker_ptr);
+static void init_async_rings(user_zns_device *my_dev, uint32_t depth,
+                             uint32_t num_workers);
+static void deinit_async_rings(zns_info *info);
+static void *async_worker(void *rings_ptr);
+static bool checkpoint_fits(zns_info *info);
+static void write_checkpoint(zns_info *info);
+static void *checkpointer(void *info_ptr);
+static int report_write_ptrs(zns_info *info, uint32_t *write_ptrs);
+static zone_info *remount_zone(zns_info *info, uint64_t index);
+static int load_checkpoint(zns_info *info, const char *ckpt,
+                           uint64_t ckpt_len);
+static void replay_record(zns_info *info, const zns_meta_record *record);
+static void fold_old_page_maps(logical_block *block);
+static void finish_remount(zns_info *info, const uint32_t *write_ptrs);
+static void clear_logical_blocks(zns_info *info);
+static int remount(zns_info *info);
 
 int init_ss_zns_device(struct zdev_init_params *params,
                        struct user_zns_device **my_dev)
@@ -140,10 +559,31 @@ int init_ss_zns_device(struct zdev_init_params *params,
     *my_dev = (user_zns_device *)calloc(1UL, sizeof(user_zns_device));
     (*my_dev)->_private = calloc(1UL, sizeof(zns_info));
     zns_info *info = (zns_info *)(*my_dev)->_private;
+    // Striped namespaces, each member inits like a device of its own
+    if (params->num_names > 1U) {
+        info->stripe = (zns_stripe *)calloc(1UL, sizeof(zns_stripe));
+        int ret = zns_stripe_init(info->stripe, params);
+        if (ret)
+            return ret;
+        info->page_size = info->stripe->page_size;
+        (*my_dev)->lba_size_bytes = info->page_size;
+        (*my_dev)->capacity_bytes = info->stripe->capacity;
+        (*my_dev)->tparams = info->stripe->members[0]->tparams;
+        for (uint32_t i = 1U; i < info->stripe->num_members; ++i)
+            (*my_dev)->tparams.zns_num_zones +=
+                info->stripe->members[i]->tparams.zns_num_zones;
+        init_async_rings(*my_dev, params->async_depth, params->async_workers);
+        return 0;
+    }
     // set num_log_zones
     info->num_log_zones = params->log_zones;
     // set gc_wmark
     info->gc_wmark = params->gc_wmark;
+    // The page mapped FTL keeps no state across runs, it only starts empty
+    if (params->ftl_mode == ZNS_FTL_PAGE && !params->force_reset) {
+        printf("The page mapped FTL needs force_reset\n");
+        return EINVAL;
+    }
     // set fd
     info->fd = nvme_open(params->name);
     if (info->fd < 0) {
@@ -175,6 +615,10 @@ int init_ss_zns_device(struct zdev_init_params *params,
     info->page_size = 1U << ns.lbaf[ns.flbas & 0xF].ds;
     (*my_dev)->tparams.zns_lba_size = info->page_size;
     (*my_dev)->lba_size_bytes = info->page_size;
+    // set io engine
+    info->engine = zns_io_engine_create(params->name, info->fd, info->nsid,
+                                        info->page_size, params->io_engine,
+                                        params->io_depth);
     // set num_zones
     nvme_zone_report zns_report;
     ret = nvme_zns_mgmt_recv(info->fd, info->nsid, 0ULL,
@@ -187,12 +631,40 @@ int init_ss_zns_device(struct zdev_init_params *params,
     }
     info->num_zones = le64_to_cpu(zns_report.nr_zones);
     (*my_dev)->tparams.zns_num_zones = info->num_zones;
-    // set num_data_zones = num_zones - num_log_zones
-    info->num_data_zones = info->num_zones - info->num_log_zones;
     // set zone_num_pages
     nvme_zns_id_ns data;
     nvme_zns_identify_ns(info->fd, info->nsid, &data);
     info->zone_num_pages = data.lbafe[ns.flbas & 0xF].zsze;
+    // set block_num_pages, a zone unless a smaller size divides it
+    info->block_num_pages = params->block_bytes / info->page_size;
+    if (params->ftl_mode == ZNS_FTL_PAGE || !info->block_num_pages ||
+        info->block_num_pages >= info->zone_num_pages ||
+        info->zone_num_pages % info->block_num_pages) {
+        if (params->ftl_mode != ZNS_FTL_PAGE && info->block_num_pages &&
+            info->block_num_pages != info->zone_num_pages)
+            printf("Block size %u does not divide the zone size, using "
+                   "whole zones\n", params->block_bytes);
+        info->block_num_pages = info->zone_num_pages;
+    }
+    info->packed = info->block_num_pages < info->zone_num_pages;
+    // set num_data_zones = num_zones - num_log_zones - spare zones
+    info->num_data_zones = info->num_zones - info->num_log_zones -
+                           ZNS_META_ZONES - ZNS_SPARE_ZONES -
+                           (info->packed ? ZNS_CLEAN_ZONES : 0U);
+    info->num_blocks = info->num_data_zones *
+                       (info->zone_num_pages / info->block_num_pages);
+    // set persist, the page mapped FTL never persists. Without it the
+    // metadata zones hold data too.
+    info->persist = params->ftl_mode != ZNS_FTL_PAGE && checkpoint_fits(info);
+    if (!info->persist && !params->force_reset) {
+        printf("The FTL state of %s is not persisted, it can only start "
+               "with force_reset\n", params->name);
+        return EINVAL;
+    }
+    info->first_zone = info->persist ? ZNS_META_ZONES : 0U;
+    info->num_data_zones += ZNS_META_ZONES - info->first_zone;
+    info->num_blocks = info->num_data_zones *
+                       (info->zone_num_pages / info->block_num_pages);
     // set zns_zone_capacity = #page_per_zone * zone_size
     (*my_dev)->tparams.zns_zone_capacity = info->zone_num_pages *
                                            info->page_size;
@@ -203,7 +675,7 @@ int init_ss_zns_device(struct zdev_init_params *params,
     nvme_id_ctrl id0;
     nvme_identify_ctrl(info->fd, &id0);
     void *regs = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, info->fd, 0L);
-    if (errno) {
+    if (regs == MAP_FAILED) {
         printf("Failed to mmap\n");
         return errno;
     }
@@ -214,52 +686,170 @@ int init_ss_zns_device(struct zdev_init_params *params,
     nvme_zns_identify_ctrl(info->fd, &id1);
     info->zasl = ((1U << (NVME_CAP_MPSMIN(nvme_mmio_read64(regs)) + id1.zasl)) -
                   2U) * info->page_size;
-    munmap(regs, getpagesize());
-    if (errno) {
+    if (munmap(regs, getpagesize())) {
         printf("Failed to munmap\n");
         return errno;
     }
-    info->free_transfer_size = info->mdts;
-    info->free_append_size = info->zasl;
-    pthread_mutex_init(&info->size_limit_lock, NULL);
+    // set simple copy limits, merges copy on the device if supported
+    if (!params->gc_host_copy && (le16_to_cpu(id0.oncs) & ZNS_ONCS_COPY) &&
+        le16_to_cpu(ns.mssrl) && le32_to_cpu(ns.mcl)) {
+        info->copy_max_ranges = ns.msrc + 1U;
+        info->copy_max_range_pages = le16_to_cpu(ns.mssrl);
+        info->copy_max_pages = le32_to_cpu(ns.mcl);
+    }
+    // set write zeroes, holes in data zones then skip the transfer
+    info->write_zeroes = le16_to_cpu(id0.oncs) & NVME_CTRL_ONCS_WRITE_ZEROES;
+    zns_sched_init(&info->sched, info->page_size, info->mdts, info->zasl,
+                   info->engine->depth, params->class_weights);
+    if (params->ftl_mode == ZNS_FTL_PAGE) {
+        info->page_ftl = (zns_page_ftl *)calloc(1UL, sizeof(zns_page_ftl));
+        ret = zns_page_ftl_init(info->page_ftl, info->engine, &info->sched,
+                                info->page_size, info->zone_num_pages,
+                                info->first_zone, info->num_zones,
+                                (*my_dev)->capacity_bytes / info->page_size,
+                                info->mdts, info->gc_wmark);
+        if (ret)
+            return ret;
+        ret = init_wbuf(info, params);
+        if (ret)
+            return ret;
+        ret = init_rcache(info, params);
+        if (ret)
+            return ret;
+        init_async_rings(*my_dev, params->async_depth, params->async_workers);
+        return 0;
+    }
+    zns_slab_init(&info->extent_slab, sizeof(zns_extent));
+    info->zeros_pages = info->mdts / info->page_size;
+    info->zeros = (char *)calloc(info->zeros_pages, info->page_size);
     // init zones_lock
     pthread_mutex_init(&info->zones_lock, NULL);
-    // set all zone index to free_zones
-    info->free_zones = (zone_info *)calloc(1UL, sizeof(zone_info));
-    info->free_zones_tail = info->free_zones;
-    pthread_mutex_init(&info->free_zones->num_valid_pages_lock, NULL);
-    pthread_mutex_init(&info->free_zones->write_ptr_lock, NULL);
-    for (uint32_t i = 1U; i < info->num_zones; ++i) {
-        info->free_zones_tail->next = (zone_info *)calloc(1UL,
-                                                          sizeof(zone_info));
-        info->free_zones_tail = info->free_zones_tail->next;
-        info->free_zones_tail->saddr = i * info->zone_num_pages;
-        pthread_mutex_init(&info->free_zones_tail->num_valid_pages_lock, NULL);
-        pthread_mutex_init(&info->free_zones_tail->write_ptr_lock, NULL);
-    }
-    // set num_free_zones
-    info->num_free_zones = info->num_zones;
-    //Set current log zone to 0th zone
-    info->curr_log_zone = info->free_zones;
-    info->free_zones = info->free_zones->next;
-    if (!info->free_zones)
-        info->free_zones_tail = NULL;
-    info->curr_log_zone->next = NULL;
-    --info->num_free_zones;
-    // set log zone page mapped hashmap size to num_data_zones
-    info->logical_blocks = (logical_block *)calloc(info->num_data_zones,
+    pthread_cond_init(&info->log_zone_cond, NULL);
+    pthread_cond_init(&info->gc_cond, NULL);
+    pthread_mutex_init(&info->pack_lock, NULL);
+    pthread_mutex_init(&info->clean_lock, NULL);
+    pthread_mutex_init(&info->data_blocks_lock, NULL);
+    // Zone table, free zones go to the ring once their state is known
+    ret = posix_memalign((void **)&info->zones, alignof(zone_info),
+                         (size_t)info->num_zones * sizeof(zone_info));
+    if (ret) {
+        printf("Failed to allocate the zone table %d\n", ret);
+        return ret;
+    }
+    memset(info->zones, 0, (size_t)info->num_zones * sizeof(zone_info));
+    info->log_zones = (uint32_t *)calloc(info->num_zones, sizeof(uint32_t));
+    pthread_mutex_init(&info->log_zones_lock, NULL);
+    for (uint32_t i = 0U; i < info->num_zones; ++i) {
+        info->zones[i].saddr = (unsigned long long)i * info->zone_num_pages;
+        if (i < info->first_zone)
+            info->zones[i].state = ZONE_META;
+    }
+    ret = zns_ring_init(&info->free_zones, info->num_zones);
+    if (ret)
+        return ret;
+    // One log stream per temperature, as many as the watermark leaves room
+    // for. Only the coldest stream has a zone from the start.
+    // By default only with the log zones to spare, a hot zone costs one
+    info->num_log_streams = params->log_streams ? params->log_streams :
+                            (info->num_log_zones - info->gc_wmark) / 3;
+    if (!params->log_streams &&
+        info->num_log_streams > ZNS_LOG_DEFAULT_STREAMS)
+        info->num_log_streams = ZNS_LOG_DEFAULT_STREAMS;
+    if (info->num_log_streams > ZNS_MAX_LOG_STREAMS)
+        info->num_log_streams = ZNS_MAX_LOG_STREAMS;
+    if ((int)info->num_log_streams > info->num_log_zones - info->gc_wmark)
+        info->num_log_streams = info->num_log_zones - info->gc_wmark;
+    if (!info->num_log_streams)
+        info->num_log_streams = 1U;
+    for (uint32_t i = 0U; i < info->num_log_streams; ++i)
+        pthread_mutex_init(&info->log_streams[i].lock, NULL);
+    // one logical block per block_num_pages of the capacity
+    info->logical_blocks = (logical_block *)calloc(info->num_blocks,
                                                    sizeof(logical_block));
-    for (uint32_t i = 0U; i < info->num_data_zones; ++i) {
-        info->logical_blocks[i].s_page_addr = i * info->zone_num_pages;
-        info->logical_blocks[i].bitmap = (uint8_t *)
-                                         calloc(info->num_data_zones *
-                                                info->zone_num_pages >> 3UL,
-                                                sizeof(uint8_t));
+    info->bitmap_words = ZNS_BITMAP_WORDS(info->block_num_pages);
+    info->bitmaps = zns_bitmap_alloc((uint64_t)info->num_blocks *
+                                     info->bitmap_words * 64ULL);
+    for (uint32_t i = 0U; i < info->num_blocks; ++i) {
+        info->logical_blocks[i].s_page_addr = (unsigned long long)i *
+                                              info->block_num_pages;
+        info->logical_blocks[i].bitmap = info->bitmaps +
+                                         (uint64_t)i * info->bitmap_words;
+        zns_extent_map_init(&info->logical_blocks[i].page_maps,
+                            &info->extent_slab);
+        zns_extent_map_init(&info->logical_blocks[i].old_page_maps,
+                            &info->extent_slab);
         pthread_mutex_init(&info->logical_blocks[i].lock, NULL);
+        pthread_mutex_init(&info->logical_blocks[i].write_lock, NULL);
+    }
+    gc_index_init(&info->gc_index, params->gc_policy);
+    gc_index_init(&info->clean_index, ZNS_GC_GREEDY);
+    // Remount from the metadata zones, else start empty
+    unsigned long long meta_saddr[ZNS_META_ZONES];
+    for (uint32_t i = 0U; i < ZNS_META_ZONES; ++i)
+        meta_saddr[i] = (unsigned long long)i * info->zone_num_pages;
+    zns_meta_init(&info->meta, info->engine, info->page_size,
+                  info->zone_num_pages, info->mdts / info->page_size,
+                  meta_saddr);
+    bool format = params->force_reset;
+    if (!format) {
+        // Only metadata zones without a checkpoint are formatted, any other
+        // failure leaves the device as it is
+        ret = remount(info);
+        if (ret == ENOENT) {
+            printf("No FTL state on %s, formatting it\n", params->name);
+            format = true;
+        } else if (ret) {
+            printf("Remounting %s failed %d\n", params->name, ret);
+            return ret;
+        }
+    }
+    if (format && !params->force_reset) {
+        ret = nvme_zns_mgmt_send(info->fd, info->nsid, 0ULL, true,
+                                 NVME_ZNS_ZSA_RESET, 0U, NULL);
+        if (ret) {
+            printf("Zone reset failed %d\n", ret);
+            return ret;
+        }
+    }
+    if (format) {
+        // The first zone is the open log zone, the rest is free
+        zone_info *first = &info->zones[info->first_zone];
+        info->log_streams[0].zone = first;
+        first->state = ZONE_OPEN;
+        alloc_rmap(info, first);
+        for (uint32_t i = info->first_zone + 1U; i < info->num_zones; ++i)
+            zns_ring_push(&info->free_zones, i);
+        if (info->persist)
+            zns_meta_format(&info->meta);
+    }
+    if (info->persist) {
+        // Loading always starts from a checkpoint
+        write_checkpoint(info);
+        pthread_create(&info->checkpointer, NULL, &checkpointer, info);
     }
     //Start GC
     info->run_gc = true;
-    pthread_create(&info->gc_thread, NULL, &garbage_collection, info);
+    info->num_gc_workers = params->gc_workers ? params->gc_workers :
+                           ZNS_GC_DEFAULT_WORKERS;
+    info->gc_workers = (gc_worker *)calloc(info->num_gc_workers,
+                                           sizeof(gc_worker));
+    ret = init_merge_chunks(info);
+    if (ret)
+        return ret;
+    for (uint32_t i = 0U; i < info->num_gc_workers; ++i) {
+        gc_worker *worker = &info->gc_workers[i];
+        worker->info = info;
+        // Past the watermark writers stall, everyone is needed there
+        worker->level = (int)i < info->gc_wmark ? (int)i : info->gc_wmark;
+        pthread_create(&worker->thread, NULL, &garbage_collection, worker);
+    }
+    ret = init_wbuf(info, params);
+    if (ret)
+        return ret;
+    ret = init_rcache(info, params);
+    if (ret)
+        return ret;
+    init_async_rings(*my_dev, params->async_depth, params->async_workers);
     return 0;
 }
 
@@ -267,629 +857,3168 @@ int zns_udevice_read(struct user_zns_device *my_dev, uint64_t address,
                      void *buffer, uint32_t size)
 {
     zns_info *info = (zns_info *)my_dev->_private;
+    if (info->stripe)
+        return zns_stripe_read(info->stripe, address, buffer, size);
+    if (!info->wbuf && !info->rcache)
+        return read_direct(info, address, buffer, size);
+    // Taken before anything is looked up, so a write of the range from
+    // here on keeps what is read below out of the cache
+    uint64_t seqs[ZNS_RCACHE_MAX_SHARDS];
+    if (info->rcache)
+        zns_rcache_snapshot(info->rcache, seqs);
+    unsigned long long page_addr = address / info->page_size;
+    uint32_t num_pages = size / info->page_size;
+    uint64_t stack_present[ZNS_BITMAP_WORDS(ZNS_READ_STACK_PAGES)];
+    uint64_t *present = stack_present;
+    if (num_pages > ZNS_READ_STACK_PAGES) {
+        present = (uint64_t *)calloc(ZNS_BITMAP_WORDS(num_pages),
+                                     sizeof(uint64_t));
+        if (!present)
+            return ENOMEM;
+    } else {
+        memset(present, 0, ZNS_BITMAP_WORDS(num_pages) * sizeof(uint64_t));
+    }
+    uint32_t found = 0U;
+    // Buffered pages are copied first. A page that is not buffered by then
+    // was written out before, so the device has it when the rest is read.
+    if (info->wbuf)
+        found = zns_wbuf_get(info->wbuf, page_addr, num_pages, buffer,
+                             present);
+    if (info->rcache && found < num_pages)
+        found += zns_rcache_get(info->rcache, page_addr, num_pages, buffer,
+                                present);
+    int ret = 0;
+    for (uint32_t i = 0U; i < num_pages && found < num_pages && !ret;) {
+        if (present[i >> 6U] >> (i & 63U) & 1ULL) {
+            ++i;
+            continue;
+        }
+        uint32_t j = i + 1U;
+        while (j < num_pages && !(present[j >> 6U] >> (j & 63U) & 1ULL))
+            ++j;
+        ret = read_direct(info, address + (uint64_t)i * info->page_size,
+                          (char *)buffer + (size_t)i * info->page_size,
+                          (j - i) * info->page_size);
+        if (!ret && info->rcache)
+            zns_rcache_fill(info->rcache, page_addr + i, j - i,
+                            (char *)buffer + (size_t)i * info->page_size,
+                            seqs);
+        i = j;
+    }
+    if (present != stack_present)
+        free(present);
+    return ret;
+}
+
+int zns_udevice_write(struct user_zns_device *my_dev, uint64_t address,
+                      void *buffer, uint32_t size)
+{
+    zns_info *info = (zns_info *)my_dev->_private;
+    if (info->stripe)
+        return zns_stripe_write(info->stripe, address, buffer, size);
+    int ret = info->wbuf ? write_wbuf(info, address, buffer, size) :
+                           write_direct(info, address, buffer, size);
+    // Done or failed half way, cached copies of the range are stale
+    if (info->rcache)
+        zns_rcache_invalidate(info->rcache, address / info->page_size,
+                              size / info->page_size);
+    return ret;
+}
+
+int zns_udevice_flush(struct user_zns_device *my_dev)
+{
+    zns_info *info = (zns_info *)my_dev->_private;
+    if (info->stripe)
+        return zns_stripe_flush(info->stripe);
+    return info->wbuf ? flush_wbuf(info) : 0;
+}
+
+static int read_direct(zns_info *info, uint64_t address, void *buffer,
+                       uint32_t size)
+{
+    if (info->page_ftl)
+        return zns_page_ftl_read(info->page_ftl, address, buffer, size);
+    return read_blocks(info, address, buffer, size);
+}
+
+static int write_direct(zns_info *info, uint64_t address, void *buffer,
+                        uint32_t size)
+{
+    if (info->page_ftl)
+        return zns_page_ftl_write(info->page_ftl, address, buffer, size);
+    return write_blocks(info, address, buffer, size, NULL);
+}
+
+static int write_wbuf(zns_info *info, uint64_t address, void *buffer,
+                      uint32_t size)
+{
+    unsigned long long page_addr = address / info->page_size;
+    uint32_t num_pages = size / info->page_size;
+    if (size < info->wbuf_max_write) {
+        while (!zns_wbuf_put(info->wbuf, page_addr, num_pages, buffer)) {
+            // Full, make room in place of the flusher
+            int ret = flush_wbuf(info);
+            if (ret)
+                return ret;
+        }
+        if (zns_wbuf_used(info->wbuf) >= info->wbuf_flush_pages) {
+            pthread_mutex_lock(&info->flusher_lock);
+            pthread_cond_signal(&info->flusher_cond);
+            pthread_mutex_unlock(&info->flusher_lock);
+        }
+        return 0;
+    }
+    // Older buffered pages of the range must not be flushed over it
+    pthread_rwlock_rdlock(&info->flush_lock);
+    zns_wbuf_drop(info->wbuf, page_addr, num_pages);
+    int ret = write_direct(info, address, buffer, size);
+    pthread_rwlock_unlock(&info->flush_lock);
+    return ret;
+}
+
+// The runs of all blocks of a read are planned first and go out together,
+// so pages in different zones are read in parallel. If a zone they hit was
+// reset meanwhile, each block is read again on its own.
+static int read_blocks(zns_info *info, uint64_t address, void *buffer,
+                       uint32_t size)
+{
     unsigned long long page_addr = address / info->page_size;
+    uint32_t num_pages = size / info->page_size;
+    if (num_pages && get_block_index(page_addr, info->block_num_pages) !=
+        get_block_index(page_addr + num_pages - 1U, info->block_num_pages)) {
+        read_runs runs = {NULL, NULL, NULL, 0U, 0U};
+        for (uint32_t done = 0U; done < num_pages;) {
+            uint32_t offset = get_data_offset(page_addr + done,
+                                              info->block_num_pages);
+            logical_block *block = &info->logical_blocks[
+                get_block_index(page_addr + done, info->block_num_pages)];
+            uint32_t n = info->block_num_pages - offset;
+            if (n > num_pages - done)
+                n = num_pages - done;
+            pthread_mutex_lock(&block->lock);
+            get_read_runs(info, block, &block->old_page_maps,
+                          &block->page_maps, offset, n,
+                          (char *)buffer + (uint64_t)done * info->page_size,
+                          &runs);
+            pthread_mutex_unlock(&block->lock);
+            done += n;
+        }
+        int ret = submit_reads(info, &runs, NULL, ZNS_CLASS_USER_READ);
+        bool valid = read_runs_valid(info, &runs);
+        free(runs.reqs);
+        free(runs.generations);
+        free(runs.offsets);
+        if (valid)
+            return ret;
+        __atomic_add_fetch(&info->read_retries, 1ULL, __ATOMIC_RELAXED);
+    }
     while (size) {
-        uint32_t index = get_block_index(page_addr, info->zone_num_pages);
-        uint32_t offset = get_data_offset(page_addr, info->zone_num_pages);
-        logical_block *block = &info->logical_blocks[index];
-        uint32_t curr_block_read_size = (info->zone_num_pages - offset) *
+        uint32_t index = get_block_index(page_addr, info->block_num_pages);
+        uint32_t offset = get_data_offset(page_addr, info->block_num_pages);
+        uint32_t curr_block_read_size = (info->block_num_pages - offset) *
                                         info->page_size;
         if (curr_block_read_size > size)
             curr_block_read_size = size;
-        if (!read_bitmap(block, offset, curr_block_read_size / info->page_size))
-            return -1;
-        pthread_mutex_lock(&block->lock);
-        if (block->data_zone) {
-            uint32_t curr_read_size = block->data_zone->write_ptr *
-                                      info->page_size;
-            if (curr_read_size > curr_block_read_size)
-                curr_read_size = curr_block_read_size;
-            read_from_zns(info, block->data_zone->saddr + offset,
-                          buffer, curr_read_size, user_read);
-        }
-        page_map *curr = block->page_maps ? block->page_maps :
-                                            block->old_page_maps;
-        while (curr && curr->page_addr < page_addr)
-            curr = curr->next;
-        unsigned long long max_page_addr = page_addr + curr_block_read_size /
-                                                       info->page_size - 1ULL;
-        if (curr && curr->page_addr <= max_page_addr) {
-            page_map *prev = curr;
-            page_map *start = curr;
-            curr = curr->next;
-            while (curr) {
-                if (curr->page_addr > max_page_addr)
-                    break;
-                if (curr->page_addr - prev->page_addr != 1ULL ||
-                    curr->physical_addr - prev->physical_addr != 1ULL) {
-                    unsigned long long buff_offset = (start->page_addr -
-                                                      page_addr) *
-                                                     info->page_size;
-                    uint32_t curr_read_size = (prev->page_addr -
-                                               start->page_addr + 1ULL) *
-                                              info->page_size;
-                    read_from_zns(info, start->physical_addr,
-                                  (char *)buffer + buff_offset, curr_read_size,
-                                  user_read);
-                    start = curr;
-                }
-                prev = curr;
-                curr = curr->next;
-            }
-            unsigned long long buff_offset = (start->page_addr - page_addr) *
-                                             info->page_size;
-            uint32_t curr_read_size = (prev->page_addr - start->page_addr +
-                                       1ULL) * info->page_size;
-            read_from_zns(info, start->physical_addr,
-                          (char *)buffer + buff_offset, curr_read_size,
-                          user_read);
-        }
-        pthread_mutex_unlock(&block->lock);
+        int ret = read_block(info, &info->logical_blocks[index], offset,
+                             curr_block_read_size / info->page_size, buffer);
+        if (ret)
+            return ret;
         page_addr += curr_block_read_size / info->page_size;
         buffer = (char *)buffer + curr_block_read_size;
         size -= curr_block_read_size;
     }
-    pthread_mutex_lock(&info->size_limit_lock);
-    info->used_status &= ~user_read;
-    pthread_mutex_unlock(&info->size_limit_lock);
-    return errno;
+    return 0;
 }
 
-int zns_udevice_write(struct user_zns_device *my_dev, uint64_t address,
-                      void *buffer, uint32_t size)
+// The mapping is only held to plan the reads. If a zone they hit was reset
+// meanwhile, a merge or reclaim moved the pages, plan again. The last try
+// holds the lock throughout.
+static int read_block(zns_info *info, logical_block *block, uint32_t offset,
+                      uint32_t num_pages, void *buffer)
 {
-    zns_info *info = (zns_info *)my_dev->_private;
-    while (size) {
+    read_runs runs = {NULL, NULL, NULL, 0U, 0U};
+    int ret;
+    for (uint32_t attempt = 0U;; ++attempt) {
+        bool locked = attempt == ZNS_READ_RETRIES;
+        runs.num_reqs = 0U;
+        pthread_mutex_lock(&block->lock);
+        get_read_runs(info, block, &block->old_page_maps, &block->page_maps,
+                      offset, num_pages, buffer, &runs);
+        if (!locked)
+            pthread_mutex_unlock(&block->lock);
+        ret = submit_reads(info, &runs, NULL, ZNS_CLASS_USER_READ);
+        if (locked) {
+            pthread_mutex_unlock(&block->lock);
+            break;
+        }
+        if (read_runs_valid(info, &runs))
+            break;
+        __atomic_add_fetch(&info->read_retries, 1ULL, __ATOMIC_RELAXED);
+    }
+    free(runs.reqs);
+    free(runs.generations);
+    free(runs.offsets);
+    return ret;
+}
+
+// Log writes go into batch if there is one, the caller appends it. Log and
+// seq zone writes set their bits before their I/O: a merge must never take
+// pages it already sees in the log for holes. Until the write lands the
+// bits only send reads to the old place of the pages, zeros on the device.
+// Writes to the seq or data zones of consecutive blocks are gathered and go
+// out together, each block keeps its write_lock until its write is done.
+static int write_blocks(zns_info *info, uint64_t address, void *buffer,
+                        uint32_t size, log_batch *batch)
+{
+    uint32_t first = get_data_offset(address / info->page_size,
+                                     info->block_num_pages);
+    uint32_t max_writes = (first + size / info->page_size +
+                           info->block_num_pages - 1U) / info->block_num_pages;
+    zone_write *writes = (zone_write *)calloc(max_writes, sizeof(zone_write));
+    uint32_t num_writes = 0U;
+    int ret = 0;
+    while (size && !ret) {
         uint32_t index = get_block_index(address / info->page_size,
-                                         info->zone_num_pages);
+                                         info->block_num_pages);
         uint32_t offset = get_data_offset(address / info->page_size,
-                                          info->zone_num_pages);
+                                          info->block_num_pages);
         logical_block *block = &info->logical_blocks[index];
-        uint32_t curr_append_size = 0U;
+        uint32_t curr_append_size = (info->block_num_pages - offset) *
+                                    info->page_size;
+        if (curr_append_size > size)
+            curr_append_size = size;
+        zone_write *write = &writes[num_writes];
+        pthread_mutex_lock(&block->write_lock);
         pthread_mutex_lock(&block->lock);
-        // if can write to data zone directly
-        if (!block->old_page_maps &&
-            block->data_zone && block->data_zone->write_ptr <= offset) {
-            if (block->data_zone->write_ptr < offset) {
-                // append null data until arrive offset
-                uint32_t null_size = (offset - block->data_zone->write_ptr) *
-                                     info->page_size;
-                char null_buffer[null_size];
-                memset(null_buffer, 0, null_size);
-                int ret = append_to_data_zone(info, block->data_zone,
-                                              null_buffer, null_size,
-                                              user_write);
-                if (ret) {
-                    pthread_mutex_unlock(&block->lock);
-                    return ret;
-                }
-            }
-            curr_append_size = (info->zone_num_pages - offset) *
-                               info->page_size;
-            if (curr_append_size > size)
-                curr_append_size = size;
-            int ret = append_to_data_zone(info, block->data_zone,
-                                          buffer, curr_append_size, user_write);
-            if (ret) {
-                pthread_mutex_unlock(&block->lock);
-                return ret;
-            }
+        // A rewrite from the start may be sequential, give it its own zone
+        if (!offset && zns_extent_map_empty(&block->page_maps) &&
+            zns_extent_map_empty(&block->old_page_maps) && !block->seq_zone) {
+            block->seq_zone = get_seq_zone(info);
+            if (block->seq_zone)
+                log_block(info, block, META_SEQ,
+                          get_zone_index(info, block->seq_zone), 0ULL);
+        }
+        if (zns_extent_map_empty(&block->old_page_maps) && block->seq_zone &&
+            block->seq_zone->write_ptr == offset) {
             pthread_mutex_unlock(&block->lock);
+            write_bitmap(info, block, offset,
+                         curr_append_size / info->page_size);
+            write->seq = true;
+            write->zone = block->seq_zone;
+        } else if (zns_extent_map_empty(&block->old_page_maps) &&
+            !info->packed && block->data_zone &&
+            block->data_pages <= offset &&
+            block->data_zone->write_ptr ==
+            block->data_start + block->data_pages &&
+            get_log_end(block) <= offset) {
+            // write to data zone directly, not when a log page at or past
+            // offset would shadow it (written during a merge) or a failed
+            // write left the zone past the image. Readers only see the
+            // pages once they are in the bitmap. Packed images are followed
+            // by others, they are only written by merges.
+            write->zone = block->data_zone;
+            write->data_pages = block->data_pages;
+            pthread_mutex_unlock(&block->lock);
+            // Skip the hole, its bits stay clear so it reads as zeros
+            if (write->data_pages < offset)
+                write->ret = append_zeros(info, write->zone,
+                                          offset - write->data_pages,
+                                          ZNS_CLASS_USER_WRITE);
         } else {
-            curr_append_size = size;
-            if (block->data_zone) {
-                uint32_t diff_size = (block->data_zone->write_ptr - offset) *
+            if (block->data_zone && block->data_pages > offset) {
+                uint32_t diff_size = (block->data_pages - offset) *
                                      info->page_size;
                 if (curr_append_size > diff_size)
                     curr_append_size = diff_size;
             }
+            uint32_t stream = classify_write(info, block, curr_append_size /
+                                                          info->page_size);
             pthread_mutex_unlock(&block->lock);
-            int ret = append_to_log_zone(info, address / info->page_size,
-                                         buffer, curr_append_size);
-            if (ret)
-                return ret;
+            pthread_mutex_unlock(&block->write_lock);
+            write_bitmap(info, block, offset,
+                         curr_append_size / info->page_size);
+            log_seg seg = {address / info->page_size,
+                           curr_append_size / info->page_size, buffer, 0ULL};
+            if (batch) {
+                add_log_batch(batch, stream, seg.page_addr, seg.num_pages,
+                              buffer);
+            } else {
+                // The append may wait for gc, which may wait for the
+                // blocks held
+                ret = write_zones(info, writes, num_writes);
+                num_writes = 0U;
+                if (!ret)
+                    ret = append_to_log_zone(info,
+                                             &info->log_streams[stream],
+                                             &seg, buffer,
+                                             curr_append_size);
+            }
+            write = NULL;
+        }
+        if (write) {
+            write->block = block;
+            write->offset = offset;
+            write->buffer = buffer;
+            write->num_pages = curr_append_size / info->page_size;
+            if (!write->ret)
+                increase_write_ptr(write->zone, write->num_pages);
+            ret = write->ret;
+            ++num_writes;
         }
-        write_bitmap(block, offset, curr_append_size / info->page_size);
         address += curr_append_size;
         buffer = (char *)buffer + curr_append_size;
         size -= curr_append_size;
     }
-    pthread_mutex_lock(&info->size_limit_lock);
-    info->used_status &= ~user_write;
-    pthread_mutex_unlock(&info->size_limit_lock);
-    return errno;
+    int err = write_zones(info, writes, num_writes);
+    free(writes);
+    return ret ? ret : err;
 }
 
 int deinit_ss_zns_device(struct user_zns_device *my_dev)
 {
     zns_info *info = (zns_info *)my_dev->_private;
+    // Finish submitted requests, they may need gc to make progress
+    deinit_async_rings(info);
+    if (info->stripe) {
+        zns_stripe_destroy(info->stripe);
+        free(info->stripe);
+        free(info);
+        free(my_dev);
+        return 0;
+    }
+    // Buffered writes go out while gc still runs
+    deinit_wbuf(info);
+    deinit_rcache(info);
+    if (info->page_ftl) {
+        zns_page_ftl_destroy(info->page_ftl);
+        free(info->page_ftl);
+        zns_sched_destroy(&info->sched);
+        zns_io_engine_destroy(info->engine);
+        free(info);
+        free(my_dev);
+        return 0;
+    }
     // Kill gc
+    pthread_mutex_lock(&info->zones_lock);
     info->run_gc = false;
-    pthread_join(info->gc_thread, NULL);
+    pthread_cond_broadcast(&info->gc_cond);
+    pthread_mutex_unlock(&info->zones_lock);
+    for (uint32_t i = 0U; i < info->num_gc_workers; ++i)
+        pthread_join(info->gc_workers[i].thread, NULL);
+    free(info->gc_workers);
+    deinit_merge_chunks(info);
+    if (info->persist) {
+        zns_meta_stop(&info->meta);
+        pthread_join(info->checkpointer, NULL);
+        // A clean shutdown remounts without replay
+        write_checkpoint(info);
+    }
+    zns_meta_destroy(&info->meta);
+    gc_index_destroy(&info->gc_index);
+    gc_index_destroy(&info->clean_index);
     logical_block *blocks = info->logical_blocks;
-    // free hashmap
-    for (uint32_t i = 0U; i < info->num_data_zones; ++i) {
-	    // Clear all log heads for a logical block
-        while (blocks[i].page_maps) {
-            page_map *tmp = blocks[i].page_maps;
-            blocks[i].page_maps = blocks[i].page_maps->next;
-            free(tmp);
-        }
-        if (blocks[i].data_zone) {
-            pthread_mutex_destroy(&blocks[i].data_zone->num_valid_pages_lock);
-            pthread_mutex_destroy(&blocks[i].data_zone->write_ptr_lock);
-	        free(blocks[i].data_zone);
-        }
-        free(blocks[i].bitmap);
+    for (uint32_t i = 0U; i < info->num_blocks; ++i) {
         pthread_mutex_destroy(&blocks[i].lock);
+        pthread_mutex_destroy(&blocks[i].write_lock);
     }
     free(blocks);
-    while (info->used_log_zones) {
-        zone_info *tmp = info->used_log_zones;
-        info->used_log_zones = info->used_log_zones->next;
-        pthread_mutex_destroy(&tmp->num_valid_pages_lock);
-        pthread_mutex_destroy(&tmp->write_ptr_lock);
-        free(tmp);
-    }
-    while (info->free_zones) {
-        zone_info *tmp = info->free_zones;
-        info->free_zones = info->free_zones->next;
-        pthread_mutex_destroy(&tmp->num_valid_pages_lock);
-        pthread_mutex_destroy(&tmp->write_ptr_lock);
-        free(tmp);
-    }
-    pthread_mutex_destroy(&info->curr_log_zone->num_valid_pages_lock);
-    pthread_mutex_destroy(&info->curr_log_zone->write_ptr_lock);
-    free(info->curr_log_zone);
-    pthread_mutex_destroy(&info->size_limit_lock);
+    free(info->bitmaps);
+    free(info->zeros);
+    for (uint32_t i = 0U; i < info->num_log_streams; ++i)
+        pthread_mutex_destroy(&info->log_streams[i].lock);
+    // Log extents go with their slab, whatever map they are in
+    zns_slab_destroy(&info->extent_slab);
+    zns_ring_destroy(&info->free_zones);
+    for (uint32_t i = 0U; i < info->num_zones; ++i)
+        free(info->zones[i].rmap);
+    free(info->zones);
+    free(info->log_zones);
+    pthread_mutex_destroy(&info->log_zones_lock);
+    zns_sched_destroy(&info->sched);
+    pthread_cond_destroy(&info->gc_cond);
+    pthread_cond_destroy(&info->log_zone_cond);
+    pthread_mutex_destroy(&info->data_blocks_lock);
+    pthread_mutex_destroy(&info->clean_lock);
+    pthread_mutex_destroy(&info->pack_lock);
     pthread_mutex_destroy(&info->zones_lock);
+    zns_io_engine_destroy(info->engine);
     free(info);
     free(my_dev);
     return 0;
 }
 
+int zns_udevice_submit(struct user_zns_device *my_dev,
+                       struct zns_udevice_request *reqs, uint32_t num_reqs)
+{
+    async_rings *rings = ((zns_info *)my_dev->_private)->async;
+    uint32_t queued = 0U;
+    pthread_mutex_lock(&rings->lock);
+    // Nothing serves the ring any more once deinit stopped it
+    while (!rings->stop && queued < num_reqs &&
+           rings->outstanding < rings->depth) {
+        rings->sq[rings->sq_tail % rings->depth] = reqs[queued];
+        ++rings->sq_tail;
+        ++rings->outstanding;
+        ++queued;
+    }
+    if (queued)
+        pthread_cond_broadcast(&rings->sq_cond);
+    pthread_mutex_unlock(&rings->lock);
+    return queued;
+}
+
+int zns_udevice_poll(struct user_zns_device *my_dev,
+                     struct zns_udevice_completion *cqes, uint32_t max_cqes,
+                     uint32_t min_complete)
+{
+    async_rings *rings = ((zns_info *)my_dev->_private)->async;
+    if (min_complete > max_cqes)
+        min_complete = max_cqes;
+    pthread_mutex_lock(&rings->lock);
+    // Never wait for more than what is outstanding
+    if (min_complete > rings->outstanding)
+        min_complete = rings->outstanding;
+    while (rings->cq_tail - rings->cq_head < min_complete)
+        pthread_cond_wait(&rings->cq_cond, &rings->lock);
+    uint32_t num_cqes = rings->cq_tail - rings->cq_head;
+    if (num_cqes > max_cqes)
+        num_cqes = max_cqes;
+    async_completion *done = (async_completion *)
+                             malloc((num_cqes ? num_cqes : 1U) *
+                                    sizeof(async_completion));
+    for (uint32_t i = 0U; i < num_cqes; ++i) {
+        done[i] = rings->cq[rings->cq_head % rings->depth];
+        ++rings->cq_head;
+    }
+    rings->outstanding -= num_cqes;
+    pthread_mutex_unlock(&rings->lock);
+    // Callbacks run without the ring lock, they may submit again
+    for (uint32_t i = 0U; i < num_cqes; ++i) {
+        if (cqes) {
+            cqes[i].tag = done[i].tag;
+            cqes[i].status = done[i].status;
+        }
+        if (done[i].cb)
+            done[i].cb(my_dev, done[i].tag, done[i].status, done[i].cb_arg);
+    }
+    free(done);
+    return num_cqes;
+}
+
+int zns_udevice_get_stats(struct user_zns_device *my_dev,
+                          struct zns_udevice_stats *stats)
+{
+    zns_info *info = (zns_info *)my_dev->_private;
+    if (info->stripe) {
+        zns_stripe_stats(info->stripe, stats);
+        return 0;
+    }
+    memset(stats, 0, sizeof(zns_udevice_stats));
+    zns_sched_stats(&info->sched, stats);
+    if (info->wbuf) {
+        pthread_mutex_lock(&info->wbuf->lock);
+        stats->wbuf_pages = info->wbuf->pages;
+        stats->wbuf_overwrites = info->wbuf->overwrites;
+        stats->wbuf_read_hits = info->wbuf->read_hits;
+        pthread_mutex_unlock(&info->wbuf->lock);
+        stats->wbuf_flushes = __atomic_load_n(&info->wbuf_flushes,
+                                              __ATOMIC_RELAXED);
+        stats->wbuf_flushed_pages = __atomic_load_n(&info->wbuf_flushed_pages,
+                                                    __ATOMIC_RELAXED);
+    }
+    if (info->rcache)
+        zns_rcache_stats(info->rcache, &stats->rcache_hits,
+                         &stats->rcache_misses, &stats->rcache_evictions,
+                         &stats->rcache_invalidations);
+    if (info->page_ftl) {
+        zns_page_ftl_stats(info->page_ftl, stats);
+        return 0;
+    }
+    stats->gc_merges = __atomic_load_n(&info->gc_merges, __ATOMIC_RELAXED);
+    stats->gc_log_pages_merged = __atomic_load_n(&info->gc_log_pages_merged,
+                                                 __ATOMIC_RELAXED);
+    stats->gc_switch_merges = __atomic_load_n(&info->gc_switch_merges,
+                                              __ATOMIC_RELAXED);
+    stats->gc_partial_merges = __atomic_load_n(&info->gc_partial_merges,
+                                               __ATOMIC_RELAXED);
+    stats->gc_compactions = __atomic_load_n(&info->gc_compactions,
+                                            __ATOMIC_RELAXED);
+    stats->gc_compacted_pages = __atomic_load_n(&info->gc_compacted_pages,
+                                                __ATOMIC_RELAXED);
+    stats->gc_data_cleanings = __atomic_load_n(&info->gc_data_cleanings,
+                                               __ATOMIC_RELAXED);
+    stats->gc_relocations = __atomic_load_n(&info->gc_relocations,
+                                            __ATOMIC_RELAXED);
+    stats->hole_pages_zeroed = __atomic_load_n(&info->hole_pages_zeroed,
+                                               __ATOMIC_RELAXED);
+    stats->hole_pages_written = __atomic_load_n(&info->hole_pages_written,
+                                                __ATOMIC_RELAXED);
+    stats->log_streams = info->num_log_streams;
+    for (uint32_t i = 0U; i < info->num_log_streams; ++i) {
+        stats->log_stream_bytes[i] = __atomic_load_n(
+            &info->log_streams[i].bytes, __ATOMIC_RELAXED);
+        stats->log_stream_gc_bytes[i] = __atomic_load_n(
+            &info->log_streams[i].gc_bytes, __ATOMIC_RELAXED);
+    }
+    stats->gc_host_bytes = __atomic_load_n(&info->gc_host_bytes,
+                                           __ATOMIC_RELAXED);
+    stats->gc_host_cpu_us = __atomic_load_n(&info->gc_host_cpu_ns,
+                                            __ATOMIC_RELAXED) / 1000ULL;
+    stats->gc_copy_bytes = __atomic_load_n(&info->gc_copy_bytes,
+                                           __ATOMIC_RELAXED);
+    stats->gc_copy_cpu_us = __atomic_load_n(&info->gc_copy_cpu_ns,
+                                            __ATOMIC_RELAXED) / 1000ULL;
+    uint64_t hits, misses, bytes;
+    zns_slab_stats(&info->extent_slab, &hits, &misses, &bytes);
+    stats->alloc_cache_hits = hits;
+    stats->alloc_cache_misses = misses;
+    stats->alloc_slab_bytes = bytes;
+    get_memory(info, stats);
+    stats->read_retries = __atomic_load_n(&info->read_retries,
+                                          __ATOMIC_RELAXED);
+    stats->meta_remount_us = info->remount_us;
+    stats->meta_replayed_records = info->replayed_records;
+    stats->meta_checkpoints = __atomic_load_n(&info->meta.checkpoints,
+                                              __ATOMIC_RELAXED);
+    stats->meta_checkpoint_bytes = __atomic_load_n(
+        &info->meta.checkpoint_bytes, __ATOMIC_RELAXED);
+    stats->meta_journal_bytes = __atomic_load_n(&info->meta.journal_bytes,
+                                                __ATOMIC_RELAXED);
+    // Every copied byte would have been read to and written from the host
+    stats->gc_pcie_bytes_saved = stats->gc_copy_bytes * 2ULL;
+    if (stats->gc_host_bytes) {
+        double host_us = (double)stats->gc_copy_bytes *
+                         stats->gc_host_cpu_us / stats->gc_host_bytes;
+        if (host_us > stats->gc_copy_cpu_us)
+            stats->gc_cpu_saved_us = host_us - stats->gc_copy_cpu_us;
+    }
+    return 0;
+}
+
 static inline void increase_num_valid_page(zone_info *zone, uint32_t num_pages)
 {
-    pthread_mutex_lock(&zone->num_valid_pages_lock);
-    zone->num_valid_pages += num_pages;
-    pthread_mutex_unlock(&zone->num_valid_pages_lock);
+    __atomic_add_fetch(&zone->num_valid_pages, num_pages, __ATOMIC_RELEASE);
 }
 
 static inline void decrease_num_valid_page(zone_info *zone, uint32_t num_pages)
 {
-    pthread_mutex_lock(&zone->num_valid_pages_lock);
-    zone->num_valid_pages -= num_pages;
-    pthread_mutex_unlock(&zone->num_valid_pages_lock);
+    __atomic_sub_fetch(&zone->num_valid_pages, num_pages, __ATOMIC_RELEASE);
 }
 
 static inline void increase_write_ptr(zone_info *zone, uint32_t num_pages)
 {
-    pthread_mutex_lock(&zone->write_ptr_lock);
-    zone->write_ptr += num_pages;
-    pthread_mutex_unlock(&zone->write_ptr_lock);
+    __atomic_add_fetch(&zone->write_ptr, num_pages, __ATOMIC_RELEASE);
 }
 
 static inline void decrease_write_ptr(zone_info *zone, uint32_t num_pages)
 {
-    pthread_mutex_lock(&zone->write_ptr_lock);
-    zone->write_ptr -= num_pages;
-    pthread_mutex_unlock(&zone->write_ptr_lock);
+    __atomic_sub_fetch(&zone->write_ptr, num_pages, __ATOMIC_RELEASE);
 }
 
 static inline uint32_t get_block_index(unsigned long long page_addr,
-                                       uint32_t zone_num_pages)
+                                       uint32_t block_num_pages)
 {
-    return page_addr / zone_num_pages;
+    return page_addr / block_num_pages;
 }
 
 static inline uint32_t get_data_offset(unsigned long long page_addr,
-                                       uint32_t zone_num_pages)
+                                       uint32_t block_num_pages)
 {
-    return page_addr % zone_num_pages;
+    return page_addr % block_num_pages;
 }
 
-static bool read_bitmap(logical_block *block,
-                        uint32_t offset, uint32_t num_pages)
+// Called without block->lock, the bits are set atomically. Journaled only if
+// a page is written for the first time. Setting bits twice is harmless, so
+// replay applies these records whatever their lsn.
+static void write_bitmap(zns_info *info, logical_block *block,
+                         uint32_t offset, uint32_t num_pages)
 {
-    while (num_pages--) {
-        if (!(block->bitmap[offset >> 3U] & 1U << (offset & 0x7U)))
-            return false;
-        ++offset;
+    bool changed = zns_bitmap_set_range(block->bitmap, offset, num_pages);
+    if (changed && info->persist)
+        zns_meta_log(&info->meta, META_BITMAP, block - info->logical_blocks,
+                     offset, num_pages);
+}
+
+// What the mappings take at init, log extents come on top as blocks are
+// written
+static void get_memory(zns_info *info, zns_udevice_stats *stats)
+{
+    stats->mem_map_bytes = (uint64_t)info->num_blocks * sizeof(logical_block);
+    stats->mem_bitmap_bytes = (uint64_t)info->num_blocks *
+                              info->bitmap_words * sizeof(uint64_t);
+    stats->mem_zone_bytes = (uint64_t)info->num_zones * sizeof(zone_info) +
+                            (info->free_zones.mask + 1ULL) *
+                            sizeof(zns_ring_cell) +
+                            (uint64_t)info->num_zones * sizeof(uint32_t);
+}
+
+static inline uint32_t get_zone_index(zns_info *info, zone_info *zone)
+{
+    return zone - info->zones;
+}
+
+static inline void set_zone_state(zone_info *zone, uint8_t state)
+{
+    __atomic_store_n(&zone->state, state, __ATOMIC_RELEASE);
+}
+
+// Lock free, NULL if no zone is free
+static zone_info *take_free_zone(zns_info *info, uint8_t state)
+{
+    uint32_t index;
+    if (!zns_ring_pop(&info->free_zones, &index))
+        return NULL;
+    zone_info *zone = &info->zones[index];
+    set_zone_state(zone, state);
+    return zone;
+}
+
+// Call with block->lock held, so the records of a block are in lsn order
+static inline void log_block(zns_info *info, logical_block *block,
+                             uint32_t type, uint64_t arg0, uint64_t arg1)
+{
+    if (info->persist)
+        block->lsn = zns_meta_log(&info->meta, type,
+                                  block - info->logical_blocks, arg0, arg1);
+}
+
+// Zones are reset only once the records that emptied them are on the device
+static inline void sync_meta(zns_info *info)
+{
+    if (info->persist)
+        zns_meta_flush(&info->meta);
+}
+
+// Call with zones_lock held
+static inline bool gc_needed(zns_info *info, int level)
+{
+    return info->num_log_zones -
+           __atomic_load_n(&info->num_used_log_zones, __ATOMIC_ACQUIRE) <=
+           info->gc_wmark - level;
+}
+
+// Call with block->lock held. Returns the log stream for a write of
+// num_pages to block. The heats of all blocks add up to about two heat
+// epochs of log pages, a block gets one stream hotter per doubling of its
+// heat past twice the mean.
+static uint32_t classify_write(zns_info *info, logical_block *block,
+                               uint32_t num_pages)
+{
+    uint64_t log_pages = __atomic_add_fetch(&info->log_pages, num_pages,
+                                            __ATOMIC_RELAXED);
+    uint32_t epoch = log_pages / info->zone_num_pages;
+    uint32_t age = epoch - block->heat_epoch;
+    block->heat = (age < 32U ? block->heat >> age : 0U) + num_pages;
+    block->heat_epoch = epoch;
+    uint32_t stream = 0U;
+    uint64_t threshold = 4ULL * info->zone_num_pages;
+    while (stream + 1U < info->num_log_streams &&
+           (uint64_t)block->heat * info->num_blocks >= threshold) {
+        ++stream;
+        threshold <<= 1U;
     }
-    return true;
+    block->log_stream = stream;
+    return stream;
 }
 
-static void write_bitmap(logical_block *block,
-                         uint32_t offset, uint32_t num_pages)
+// Streams past the first get their zone on first use, it counts as used.
+// The first stream only lacks one after a remount and it never counts.
+// After a change, the zone was counted when the last one filled.
+static void open_log_zone(zns_info *info, log_stream *stream)
 {
-    while (num_pages--) {
-        block->bitmap[offset >> 3U] |= 1U << (offset & 0x7U);
-        ++offset;
+    int counted = stream != info->log_streams && !stream->counted;
+    stream->counted = false;
+    pthread_mutex_lock(&info->zones_lock);
+    // Sleep until the zone fits next to the first stream's
+    while (__atomic_load_n(&info->num_used_log_zones, __ATOMIC_ACQUIRE) +
+               counted >= info->num_log_zones ||
+           !(stream->zone = take_free_zone(info, ZONE_OPEN))) {
+        if (gc_needed(info, 0))
+            pthread_cond_broadcast(&info->gc_cond);
+        pthread_cond_wait(&info->log_zone_cond, &info->zones_lock);
     }
+    __atomic_add_fetch(&info->num_used_log_zones, counted, __ATOMIC_RELEASE);
+    if (gc_needed(info, 0))
+        pthread_cond_broadcast(&info->gc_cond);
+    pthread_mutex_unlock(&info->zones_lock);
+    alloc_rmap(info, stream->zone);
 }
 
-static void change_log_zone(zns_info *info)
+// Call with stream->lock held once the zone is reserved up to its end.
+// Its appends may still be in flight, the last one makes it a log zone. The
+// next writer opens the next zone, it may wait for gc to reclaim one and gc
+// may wait for these appends.
+static void change_log_zone(zns_info *info, log_stream *stream)
 {
+    // Counted before gc may see it as a log zone and reclaim it
+    __atomic_add_fetch(&info->num_used_log_zones, 1, __ATOMIC_RELEASE);
+    stream->zone = NULL;
+    stream->counted = true;
     pthread_mutex_lock(&info->zones_lock);
-    if (info->used_log_zones)
-        info->used_log_zones_tail->next = info->curr_log_zone;
-    else
-        info->used_log_zones = info->curr_log_zone;
-    info->used_log_zones_tail = info->curr_log_zone;
-    info->curr_log_zone = NULL;
-    ++info->num_used_log_zones;
+    if (gc_needed(info, 0))
+        pthread_cond_broadcast(&info->gc_cond);
     pthread_mutex_unlock(&info->zones_lock);
-    while (info->num_used_log_zones == info->num_log_zones);
-    //Dequeue from free_zone to curr_log_zone;
-    while (!info->curr_log_zone) {
-        pthread_mutex_lock(&info->zones_lock);
-        if (info->num_free_zones) {
-            info->curr_log_zone = info->free_zones;
-            info->free_zones = info->free_zones->next;
-            info->curr_log_zone->next = NULL;
-            --info->num_free_zones;
-        }
-        pthread_mutex_unlock(&info->zones_lock);
-    }
 }
 
-static void update_page_map(zns_info *info, unsigned long long page_addr,
+// Freed when the zone is reset
+static void alloc_rmap(zns_info *info, zone_info *zone)
+{
+    zone->rmap = (unsigned long long *)calloc(info->zone_num_pages,
+                                              sizeof(unsigned long long));
+}
+
+// from is 0 or where compaction moves the pages from
+static void update_page_map(zns_info *info, zone_info *zone,
+                            unsigned long long page_addr,
                             unsigned long long physical_addr,
-                            uint32_t num_pages)
+                            uint32_t num_pages, unsigned long long from)
 {
-    while (num_pages--) {
-        uint32_t index = get_block_index(page_addr, info->zone_num_pages);
+    while (num_pages) {
+        uint32_t index = get_block_index(page_addr, info->block_num_pages);
         logical_block *block = &info->logical_blocks[index];
+        uint32_t n = info->block_num_pages -
+                     get_data_offset(page_addr, info->block_num_pages);
+        if (n > num_pages)
+            n = num_pages;
         //Lock for updating page map
         pthread_mutex_lock(&block->lock);
-        if (!block->page_maps) {
-            block->page_maps = (page_map *)calloc(1, sizeof(page_map));
-            block->page_maps_tail = block->page_maps;
-            block->page_maps->page_addr = page_addr;
-            block->page_maps->physical_addr = physical_addr;
-            block->page_maps->zone = info->curr_log_zone;
-            pthread_mutex_unlock(&block->lock);
-            return;
-        }
-        if (block->page_maps->page_addr == page_addr) {
-            //Update log counter
-            decrease_num_valid_page(block->page_maps->zone, 1U);
-            block->page_maps->physical_addr = physical_addr;
-            block->page_maps->zone = info->curr_log_zone;
-            pthread_mutex_unlock(&block->lock);
-            return;
-        }
-        if (block->page_maps->page_addr > page_addr) {
-            page_map *tmp = (page_map *)calloc(1, sizeof(page_map));
-            tmp->next = block->page_maps;
-            block->page_maps = tmp;
-            tmp->page_addr = page_addr;
-            tmp->physical_addr = physical_addr;
-            tmp->zone = info->curr_log_zone;
-            pthread_mutex_unlock(&block->lock);
-            return;
-        }
-        page_map *ptr = block->page_maps;
-        while (ptr->next) {
-            if (ptr->next->page_addr == page_addr) {
-                //Update log counter
-                decrease_num_valid_page(ptr->next->zone, 1U);
-                ptr->next->physical_addr = physical_addr;
-                ptr->next->zone = info->curr_log_zone;
-                pthread_mutex_unlock(&block->lock);
-                return;
-            } else if (ptr->next->page_addr > page_addr) {
-                page_map *tmp =  (page_map *)calloc(1, sizeof(page_map));
-                tmp->next = ptr->next;
-                ptr->next = tmp;
-                tmp->page_addr = page_addr;
-                tmp->physical_addr = physical_addr;
-                tmp->zone = info->curr_log_zone;
-                pthread_mutex_unlock(&block->lock);
-                return;
-            }
-            ptr = ptr->next;
+        if (from) {
+            move_page_map(info, block, zone, page_addr, physical_addr, n,
+                          from);
+            from += n;
+        } else {
+            insert_page_map(info, block, zone, page_addr, physical_addr, n);
         }
-        ptr->next = (page_map *)calloc(1, sizeof(page_map));
-        block->page_maps_tail = ptr->next;
-        ptr->next->page_addr = page_addr;
-        ptr->next->physical_addr = physical_addr;
-        ptr->next->zone = info->curr_log_zone;
         pthread_mutex_unlock(&block->lock);
-        ++page_addr;
-        ++physical_addr;
+        page_addr += n;
+        physical_addr += n;
+        num_pages -= n;
     }
 }
 
-static unsigned request_transfer_size(zns_info *info, uint8_t type)
+// Call with block->lock held, the range is within block
+static void insert_page_map(zns_info *info, logical_block *block,
+                            zone_info *zone, unsigned long long page_addr,
+                            unsigned long long physical_addr,
+                            uint32_t num_pages)
 {
-    if (type & sb_read) {
-        uint32_t max_transfer_size = info->mdts;
-        for (;;) {
-            if (info->free_transfer_size) {
-                pthread_mutex_lock(&info->size_limit_lock);
-                break;
-            }
-        }
-        if (info->used_status & sb_write)
-            max_transfer_size -= info->zasl;
-        if (info->used_status & (sb_read & ~type))
-            max_transfer_size >>= 1;
-        if (info->free_transfer_size < max_transfer_size)
-            max_transfer_size = info->free_transfer_size;
-        info->free_transfer_size -= max_transfer_size;
-        info->used_status |= type;
-        pthread_mutex_unlock(&info->size_limit_lock);
-        return max_transfer_size;
-    } else {
-        uint32_t max_transfer_size = info->zasl;
-        for (;;) {
-            if (info->free_transfer_size && info->free_append_size) {
-                pthread_mutex_lock(&info->size_limit_lock);
-                break;
-            }
+    log_block(info, block, META_MAP,
+              (uint64_t)num_pages << 32U | (page_addr - block->s_page_addr),
+              physical_addr);
+    zns_extent_map_insert(&block->page_maps, page_addr, physical_addr,
+                          num_pages, zone, &release_log_pages, NULL);
+    // A block being merged goes back to the index once it is done
+    if (zns_extent_map_empty(&block->old_page_maps))
+        update_gc_candidate(info, block);
+}
+
+// Call with block->lock held, the range is within block. Maps the pages
+// block still has at from onwards to physical_addr onwards. The others were
+// written or merged since, their copies in zone are not valid.
+static void move_page_map(zns_info *info, logical_block *block,
+                          zone_info *zone, unsigned long long page_addr,
+                          unsigned long long physical_addr,
+                          uint32_t num_pages, unsigned long long from)
+{
+    unsigned long long end = page_addr + num_pages;
+    while (page_addr < end) {
+        zns_extent *extent = zns_extent_map_find(&block->page_maps,
+                                                 page_addr);
+        uint32_t n = end - page_addr;
+        bool moved = false;
+        if (extent && extent->page_addr > page_addr) {
+            if (extent->page_addr < end)
+                n = extent->page_addr - page_addr;
+        } else if (extent) {
+            if (extent->page_addr + extent->num_pages < end)
+                n = extent->page_addr + extent->num_pages - page_addr;
+            moved = extent->physical_addr + (page_addr - extent->page_addr) ==
+                    from;
         }
-        if (info->used_status & sb_write)
-            max_transfer_size >>= 1;
-        if (info->free_append_size < max_transfer_size)
-            max_transfer_size = info->free_append_size;
-        if (info->free_transfer_size < max_transfer_size)
-            max_transfer_size = info->free_transfer_size;
-        info->free_transfer_size -= max_transfer_size;
-        info->free_append_size -= max_transfer_size;
-        info->used_status |= type;
-        pthread_mutex_unlock(&info->size_limit_lock);
-        return max_transfer_size;
+        if (moved)
+            insert_page_map(info, block, zone, page_addr, physical_addr, n);
+        else
+            decrease_num_valid_page(zone, n);
+        page_addr += n;
+        physical_addr += n;
+        from += n;
     }
 }
 
-static void free_transfer_size(zns_info *info, uint8_t type, unsigned size)
+// Log pages that are overwritten or merged
+static void release_log_pages(void *zone, uint32_t num_pages, void *)
 {
-    pthread_mutex_lock(&info->size_limit_lock);
-    if (type & sb_write)
-        info->free_append_size += size;
-    info->free_transfer_size += size;
-    pthread_mutex_unlock(&info->size_limit_lock);
+    decrease_num_valid_page((zone_info *)zone, num_pages);
 }
 
-static int read_from_zns(zns_info *info, unsigned long long physical_addr,
-                         void *buffer, uint32_t size, uint8_t type)
+// Call with block->lock held. Offset past the last log page, 0 if none.
+static inline uint32_t get_log_end(logical_block *block)
 {
-    while (size) {
-        unsigned curr_transfer_size = request_transfer_size(info, type);
-        unsigned curr_read_size = size < curr_transfer_size ?
-                                  size : curr_transfer_size;
-        unsigned short num_pages = curr_read_size / info->page_size;
-        nvme_read(info->fd, info->nsid, physical_addr, num_pages - 1,
-                  0U, 0U, 0U, 0U, 0U, curr_read_size, buffer, 0U, NULL);
-        free_transfer_size(info, type, curr_transfer_size);
-        physical_addr += num_pages;
-        buffer = (char *)buffer + curr_read_size;
-        size -= curr_read_size;
-    }
-    return errno;
+    zns_extent *last = zns_extent_map_last(&block->page_maps);
+    if (!last)
+        return 0U;
+    return last->page_addr + last->num_pages - block->s_page_addr;
 }
 
-static int append_to_data_zone(zns_info *info, zone_info *zone,
-                               void *buffer, uint32_t size, uint8_t type)
+// Call with block->lock held. Pages a merge of block writes.
+static inline uint32_t get_merge_cost(logical_block *block)
 {
-    increase_write_ptr(zone, size / info->page_size);
-    while (size) {
-        unsigned long long physical_addr = 0ULL;
-        unsigned curr_transfer_size = request_transfer_size(info, type);
-        unsigned curr_append_size = curr_transfer_size;
-        if (curr_append_size > size)
-            curr_append_size = size;
-        unsigned short num_curr_append_pages = curr_append_size /
-                                               info->page_size;
-        nvme_zns_append(info->fd, info->nsid, zone->saddr,
-                        num_curr_append_pages - 1, 0U, 0U, 0U, 0U,
-                        curr_append_size, buffer, 0U, NULL, &physical_addr);
-        free_transfer_size(info, type, curr_transfer_size);
-        if (errno)
-            return errno;
-        buffer = (char *)buffer + curr_append_size;
-        size -= curr_append_size;
-    }
-    return errno;
+    uint32_t cost = get_log_end(block);
+    if (block->data_zone && block->data_pages > cost)
+        cost = block->data_pages;
+    return cost;
 }
 
-static int append_to_log_zone(zns_info *info, unsigned long long page_addr,
-                              void *buffer, uint32_t size)
+// Call with block->lock held
+static void update_gc_candidate(zns_info *info, logical_block *block)
 {
-    while (size) {
-        bool change = true;
-        unsigned curr_transfer_size = request_transfer_size(info, user_write);
-        unsigned curr_append_size = (info->zone_num_pages -
-                                     info->curr_log_zone->write_ptr) *
-                                    info->page_size;
-        if (curr_append_size > curr_transfer_size) {
-            curr_append_size = curr_transfer_size;
-            change = false;
-        }
-        if (curr_append_size > size) {
-            curr_append_size = size;
-            change = false;
-        }
-        unsigned long long physical_addr = 0ULL;
-        unsigned short num_curr_append_pages = curr_append_size /
-                                               info->page_size;
-        nvme_zns_append(info->fd, info->nsid, info->curr_log_zone->saddr,
-                        num_curr_append_pages - 1, 0U, 0U, 0U, 0U,
-                        curr_append_size, buffer, 0U, NULL, &physical_addr);
-        free_transfer_size(info, user_write, curr_transfer_size);
-        if (errno)
-            return errno;
-        increase_num_valid_page(info->curr_log_zone, num_curr_append_pages);
-        increase_write_ptr(info->curr_log_zone, num_curr_append_pages);
-        update_page_map(info, page_addr, physical_addr, num_curr_append_pages);
-        if (change)
-            change_log_zone(info);
-        page_addr += num_curr_append_pages;
-        physical_addr += num_curr_append_pages;
-        buffer = (char *)buffer + curr_append_size;
-        size -= curr_append_size;
+    gc_index_update(&info->gc_index, &block->candidate,
+                    block->page_maps.num_pages, get_merge_cost(block));
+}
+
+// A block rewritten from offset 0 gets a log zone of its own, which a merge
+// can turn into the data zone without copying. It counts as a used log zone
+// and is only handed out while that keeps gc asleep.
+static zone_info *get_seq_zone(zns_info *info)
+{
+    // A zone holds more than a packed block
+    if (info->packed)
+        return NULL;
+    int used = __atomic_load_n(&info->num_used_log_zones, __ATOMIC_RELAXED);
+    do {
+        if (info->num_log_zones - used - 1 <= info->gc_wmark)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&info->num_used_log_zones, &used,
+                                          used + 1, true, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+    zone_info *zone = take_free_zone(info, ZONE_SEQ);
+    if (!zone) {
+        __atomic_sub_fetch(&info->num_used_log_zones, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&info->zones_lock);
+        pthread_cond_broadcast(&info->log_zone_cond);
+        pthread_mutex_unlock(&info->zones_lock);
     }
-    return errno;
-}
-
-static int read_logical_block(zns_info *info, logical_block *block,
-                              void *buffer)
-{
-    //FIXME: Proision for contiguos block read, but not written 
-    if (block->data_zone)
-        read_from_zns(info, block->data_zone->saddr,
-                      buffer, block->data_zone->write_ptr * info->page_size,
-                      gc_read);
-    page_map *prev = block->old_page_maps;
-    page_map *start = block->old_page_maps;
-    page_map *curr = block->old_page_maps->next;
-    decrease_num_valid_page(prev->zone, 1U);
-    while (curr) {
-        if (curr->page_addr - prev->page_addr != 1ULL ||
-            curr->physical_addr - prev->physical_addr != 1ULL) {
-            unsigned long long buff_offset = (start->page_addr -
-                                              block->s_page_addr) *
-                                             info->page_size;
-            uint32_t curr_read_size = (prev->page_addr - start->page_addr +
-                                       1ULL) * info->page_size;
-            read_from_zns(info, start->physical_addr,
-                          (char *)buffer + buff_offset, curr_read_size,
-                          gc_read);
-            start = curr;
-        }
-        decrease_num_valid_page(curr->zone, 1U);
-        prev = curr;
-        curr = curr->next;
-    }
-    unsigned long long buff_offset = (start->page_addr - block->s_page_addr) *
-                                     info->page_size;
-    uint32_t curr_read_size = (prev->page_addr - start->page_addr + 1ULL) *
-                              info->page_size;
-    read_from_zns(info, start->physical_addr,
-                  (char *)buffer + buff_offset, curr_read_size, gc_read);
-    return errno;
+    return zone;
+}
+
+// Chunks land in order within a zone, so each round sends the next chunk of
+// every write at once, one zone each, as far as the grant goes. Then the
+// writes are mapped and their blocks released, full seq zones are merged.
+static int write_zones(zns_info *info, zone_write *writes,
+                       uint32_t num_writes)
+{
+    if (!num_writes)
+        return 0;
+    zns_io_req *reqs = (zns_io_req *)calloc(num_writes, sizeof(zns_io_req));
+    uint32_t *owners = (uint32_t *)calloc(num_writes, sizeof(uint32_t));
+    uint32_t max_cmd_pages = zns_sched_max_cmd(&info->sched,
+                                               ZNS_CLASS_USER_WRITE) /
+                             info->page_size;
+    for (;;) {
+        uint64_t want = 0ULL;
+        for (uint32_t i = 0U; i < num_writes; ++i) {
+            zone_write *write = &writes[i];
+            if (write->ret)
+                continue;
+            uint32_t left = write->num_pages - write->done;
+            want += left < max_cmd_pages ? left : max_cmd_pages;
+        }
+        if (!want)
+            break;
+        zns_sched_grant grant;
+        zns_sched_get(&info->sched, ZNS_CLASS_USER_WRITE,
+                      want * info->page_size, &grant);
+        uint32_t budget = grant.size / info->page_size;
+        uint32_t num_reqs = 0U;
+        for (uint32_t i = 0U; i < num_writes && budget; ++i) {
+            zone_write *write = &writes[i];
+            if (write->ret || write->done == write->num_pages)
+                continue;
+            uint32_t num_pages = write->num_pages - write->done;
+            if (num_pages > max_cmd_pages)
+                num_pages = max_cmd_pages;
+            if (num_pages > budget)
+                num_pages = budget;
+            budget -= num_pages;
+            zns_io_req *req = &reqs[num_reqs];
+            memset(req, 0, sizeof(zns_io_req));
+            req->opcode = ZNS_IO_APPEND;
+            req->slba = write->zone->saddr;
+            req->num_pages = num_pages;
+            req->buffer = (char *)write->buffer +
+                          (uint64_t)write->done * info->page_size;
+            owners[num_reqs++] = i;
+        }
+        zns_io_engine_submit(info->engine, reqs, num_reqs);
+        uint64_t landed = 0ULL;
+        for (uint32_t i = 0U; i < num_reqs; ++i) {
+            zone_write *write = &writes[owners[i]];
+            if (reqs[i].status) {
+                write->ret = reqs[i].status;
+                continue;
+            }
+            write->done += reqs[i].num_pages;
+            landed += (uint64_t)reqs[i].num_pages * info->page_size;
+        }
+        zns_sched_put(&info->sched, &grant, landed);
+    }
+    free(owners);
+    free(reqs);
+    int ret = 0;
+    for (uint32_t i = 0U; i < num_writes; ++i) {
+        zone_write *write = &writes[i];
+        logical_block *block = write->block;
+        zone_info *zone = write->zone;
+        pthread_mutex_lock(&block->lock);
+        if (write->seq) {
+            if (!write->ret) {
+                increase_num_valid_page(zone, write->num_pages);
+                insert_page_map(info, block, zone,
+                                block->s_page_addr + write->offset,
+                                zone->saddr + write->offset, write->num_pages);
+            }
+            // Once the seq zone holds the whole block in order
+            write->full = !write->ret &&
+                          zone->num_valid_pages == info->block_num_pages &&
+                          block->page_maps.num_pages == info->block_num_pages;
+        } else if (!write->ret) {
+            // The image ends where the zone does, hole and pages landed. A
+            // failed write leaves the image as it was, the zone now ends
+            // past it and takes no more writes in place.
+            block->data_pages = zone->write_ptr - block->data_start;
+            increase_num_valid_page(zone, block->data_pages -
+                                          write->data_pages);
+        }
+        pthread_mutex_unlock(&block->lock);
+        // Past the write pointer until the append lands, the bits come
+        // after it but before a merge can look at them
+        if (!write->seq && !write->ret)
+            write_bitmap(info, block, write->offset, write->num_pages);
+        pthread_mutex_unlock(&block->write_lock);
+        if (write->ret && !ret)
+            ret = write->ret;
+    }
+    // Not before all blocks are released, a merge may wait for gc
+    for (uint32_t i = 0U; i < num_writes; ++i) {
+        if (writes[i].full)
+            merge(info, writes[i].block, NULL);
+    }
+    return ret;
+}
+
+// offset is the page of the run in the range planned, its buffer if there is
+// one sits at that page too
+static void add_read_run(zns_info *info, read_runs *runs,
+                         unsigned long long physical_addr, uint32_t num_pages,
+                         uint32_t offset, void *buffer)
+{
+    uint32_t zone = physical_addr / info->zone_num_pages;
+    if (runs->num_reqs) {
+        // Extend the previous run if both device and range are contiguous,
+        // within one zone
+        zns_io_req *last = &runs->reqs[runs->num_reqs - 1U];
+        if (last->slba + last->num_pages == physical_addr &&
+            last->slba / info->zone_num_pages == zone &&
+            runs->offsets[runs->num_reqs - 1U] + last->num_pages == offset) {
+            last->num_pages += num_pages;
+            return;
+        }
+    }
+    if (runs->num_reqs == runs->max_reqs) {
+        runs->max_reqs = runs->max_reqs ? runs->max_reqs << 1U : 16U;
+        runs->reqs = (zns_io_req *)realloc(runs->reqs, runs->max_reqs *
+                                                       sizeof(zns_io_req));
+        runs->generations = (uint32_t *)realloc(runs->generations,
+                                                runs->max_reqs *
+                                                sizeof(uint32_t));
+        runs->offsets = (uint32_t *)realloc(runs->offsets, runs->max_reqs *
+                                                           sizeof(uint32_t));
+    }
+    runs->generations[runs->num_reqs] = __atomic_load_n(
+        &info->zones[zone].generation, __ATOMIC_ACQUIRE);
+    runs->offsets[runs->num_reqs] = offset;
+    zns_io_req *req = &runs->reqs[runs->num_reqs++];
+    memset(req, 0, sizeof(zns_io_req));
+    req->opcode = ZNS_IO_READ;
+    req->slba = physical_addr;
+    req->num_pages = num_pages;
+    req->buffer = buffer;
+}
+
+// Plan the device reads for [offset, offset + num_pages) of a block. Pages in
+// the log come from the newest mapping, the rest from the data zone. Pages
+// never written are zeroed in the buffer if there is one, without I/O.
+static void get_read_runs(zns_info *info, logical_block *block,
+                          zns_extent_map *old_maps, zns_extent_map *maps,
+                          uint32_t offset, uint32_t num_pages, void *buffer,
+                          read_runs *runs)
+{
+    unsigned long long start = block->s_page_addr + offset;
+    unsigned long long end = start + num_pages;
+    uint32_t data_pages = block->data_zone ? block->data_pages : 0U;
+    zns_extent *old = old_maps ? zns_extent_map_find(old_maps, start) : NULL;
+    zns_extent *next = maps ? zns_extent_map_find(maps, start) : NULL;
+    unsigned long long curr = start;
+    while (curr < end) {
+        while (old && old->page_addr + old->num_pages <= curr)
+            old = zns_extent_map_next(old_maps, old);
+        while (next && next->page_addr + next->num_pages <= curr)
+            next = zns_extent_map_next(maps, next);
+        // The newer mapping wins, the data zone has the rest
+        zns_extent *extent = NULL;
+        unsigned long long run_end = end;
+        if (next && next->page_addr <= curr) {
+            extent = next;
+        } else {
+            if (next && next->page_addr < run_end)
+                run_end = next->page_addr;
+            if (old && old->page_addr <= curr)
+                extent = old;
+            else if (old && old->page_addr < run_end)
+                run_end = old->page_addr;
+        }
+        if (extent && extent->page_addr + extent->num_pages < run_end)
+            run_end = extent->page_addr + extent->num_pages;
+        char *run_buffer = buffer ? (char *)buffer +
+                                    (curr - start) * info->page_size : NULL;
+        if (extent) {
+            add_read_run(info, runs, extent->physical_addr +
+                                     (curr - extent->page_addr),
+                         run_end - curr, curr - start, run_buffer);
+        } else {
+            // The bitmap tells written data zone pages from holes
+            uint32_t data_offset = curr - block->s_page_addr;
+            uint32_t data_end = run_end - block->s_page_addr;
+            uint32_t written_end = data_end < data_pages ? data_end :
+                                   data_pages;
+            while (data_offset < data_end) {
+                uint32_t hole = data_offset < written_end ?
+                                zns_bitmap_find(block->bitmap, data_offset,
+                                                written_end, false) :
+                                data_offset;
+                char *data_buffer = buffer ? (char *)buffer +
+                                             (uint64_t)(block->s_page_addr +
+                                                        data_offset - start) *
+                                             info->page_size : NULL;
+                if (hole > data_offset)
+                    add_read_run(info, runs, block->data_zone->saddr +
+                                             block->data_start + data_offset,
+                                 hole - data_offset,
+                                 block->s_page_addr + data_offset - start,
+                                 data_buffer);
+                uint32_t next_written = hole < written_end ?
+                                        zns_bitmap_find(block->bitmap, hole,
+                                                        written_end, true) :
+                                        data_end;
+                if (buffer && next_written > hole)
+                    memset(data_buffer + (uint64_t)(hole - data_offset) *
+                                         info->page_size,
+                           0, (uint64_t)(next_written - hole) *
+                              info->page_size);
+                data_offset = next_written;
+            }
+        }
+        curr = run_end;
+    }
+}
+
+// Whether no zone of the runs was reset since they were planned, so what
+// they read was still mapped
+static bool read_runs_valid(zns_info *info, const read_runs *runs)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for (uint32_t i = 0U; i < runs->num_reqs; ++i) {
+        zone_info *zone = &info->zones[runs->reqs[i].slba /
+                                       info->zone_num_pages];
+        if (__atomic_load_n(&zone->generation, __ATOMIC_ACQUIRE) !=
+            runs->generations[i])
+            return false;
+    }
+    return true;
+}
+
+// Pages of the runs not sent yet
+static uint64_t runs_left(const read_runs *runs, const read_cursor *cursor)
+{
+    uint64_t left = 0ULL;
+    for (uint32_t i = cursor->run; i < runs->num_reqs; ++i)
+        left += runs->reqs[i].num_pages;
+    return left - (cursor->run < runs->num_reqs ? cursor->done : 0U);
+}
+
+// Issues the runs from cursor on as far as grant goes, split into commands
+// of its max_cmd, and moves cursor past them. extra, if given, goes out in
+// the same batch. num_pages gets the pages read.
+static int submit_runs(zns_info *info, read_runs *runs, read_cursor *cursor,
+                       const zns_sched_grant *grant, zns_io_req *extra,
+                       uint64_t *num_pages)
+{
+    uint32_t max_pages = grant->max_cmd / info->page_size;
+    uint32_t budget = grant->size / info->page_size;
+    // Every run boundary and every max_pages may start a command
+    uint32_t max_cmds = runs->num_reqs - cursor->run +
+                        budget / max_pages + (extra ? 1U : 0U);
+    zns_io_req *cmds = (zns_io_req *)calloc(max_cmds, sizeof(zns_io_req));
+    uint32_t num_cmds = 0U;
+    if (extra)
+        cmds[num_cmds++] = *extra;
+    *num_pages = 0ULL;
+    while (budget && cursor->run < runs->num_reqs) {
+        zns_io_req *run = &runs->reqs[cursor->run];
+        uint32_t n = run->num_pages - cursor->done;
+        if (n > max_pages)
+            n = max_pages;
+        if (n > budget)
+            n = budget;
+        zns_io_req *cmd = &cmds[num_cmds++];
+        cmd->opcode = ZNS_IO_READ;
+        cmd->slba = run->slba + cursor->done;
+        cmd->num_pages = n;
+        cmd->buffer = (char *)run->buffer +
+                      (uint64_t)cursor->done * info->page_size;
+        budget -= n;
+        *num_pages += n;
+        cursor->done += n;
+        if (cursor->done == run->num_pages) {
+            ++cursor->run;
+            cursor->done = 0U;
+        }
+    }
+    int ret = zns_io_engine_submit(info->engine, cmds, num_cmds);
+    if (extra)
+        *extra = cmds[0];
+    free(cmds);
+    return ret;
+}
+
+// Reads the runs from cursor on, or all of them if it is NULL, a grant at
+// a time
+static int submit_reads(zns_info *info, read_runs *runs, read_cursor *cursor,
+                        uint8_t cls)
+{
+    read_cursor start = {0U, 0U};
+    if (!cursor)
+        cursor = &start;
+    int ret = 0;
+    uint64_t left = runs_left(runs, cursor);
+    while (!ret && left) {
+        zns_sched_grant grant;
+        zns_sched_get(&info->sched, cls, left * info->page_size, &grant);
+        uint64_t num_pages;
+        ret = submit_runs(info, runs, cursor, &grant, NULL, &num_pages);
+        zns_sched_put(&info->sched, &grant,
+                      ret ? 0ULL : num_pages * info->page_size);
+        left -= num_pages;
+    }
+    return ret;
+}
+
+// Reads planned before see the new generation once their I/O is done
+static int reset_zone(zns_info *info, zone_info *zone)
+{
+    __atomic_add_fetch(&zone->generation, 1U, __ATOMIC_SEQ_CST);
+    int ret = 0;
+    for (uint32_t i = 0U; i < ZNS_RESET_TRIES; ++i) {
+        zns_io_req req;
+        memset(&req, 0, sizeof(req));
+        req.opcode = ZNS_IO_RESET;
+        req.slba = zone->saddr;
+        ret = zns_io_engine_submit(info->engine, &req, 1U);
+        if (!ret)
+            break;
+        printf("Reset of zone %u failed %d\n", get_zone_index(info, zone),
+               ret);
+    }
+    return ret;
+}
+
+// Its write pointer is unknown, so it stays out of the free zones. The
+// caller keeps it counted as a used zone for good. Zones are provisioned
+// exactly, without the spare zone merges and then writers may stall.
+static void offline_zone(zns_info *info, zone_info *zone)
+{
+    printf("Zone %u is offline\n", get_zone_index(info, zone));
+    set_zone_state(zone, ZONE_OFFLINE);
+}
+
+// Chunks land in order in the data zone, so they go out one at a time
+static int append_to_data_zone(zns_info *info, zone_info *zone,
+                               void *buffer, uint32_t size, uint8_t cls)
+{
+    increase_write_ptr(zone, size / info->page_size);
+    uint32_t max_cmd = zns_sched_max_cmd(&info->sched, cls);
+    while (size) {
+        zns_sched_grant grant;
+        zns_sched_get(&info->sched, cls, size < max_cmd ? size : max_cmd,
+                      &grant);
+        unsigned curr_append_size = grant.size;
+        if (curr_append_size > size)
+            curr_append_size = size;
+        zns_io_req req;
+        memset(&req, 0, sizeof(req));
+        req.opcode = ZNS_IO_APPEND;
+        req.slba = zone->saddr;
+        req.num_pages = curr_append_size / info->page_size;
+        req.buffer = buffer;
+        int ret = zns_io_engine_submit(info->engine, &req, 1U);
+        zns_sched_put(&info->sched, &grant, ret ? 0ULL : curr_append_size);
+        if (ret)
+            return ret;
+        buffer = (char *)buffer + curr_append_size;
+        size -= curr_append_size;
+    }
+    return 0;
+}
+
+// Moves the write pointer of zone over num_pages pages nobody wrote. Write
+// Zeroes has the device do it, without it the zeros are sent. Either way
+// the pages are charged to cls like a write. The zone must not be appended
+// to meanwhile.
+static int append_zeros(zns_info *info, zone_info *zone, uint32_t num_pages,
+                        uint8_t cls)
+{
+    if (__atomic_load_n(&info->write_zeroes, __ATOMIC_RELAXED)) {
+        int ret = 0;
+        while (!ret && num_pages) {
+            uint32_t n = num_pages < ZNS_WRITE_ZEROES_MAX_PAGES ? num_pages :
+                         ZNS_WRITE_ZEROES_MAX_PAGES;
+            zns_sched_grant grant;
+            zns_sched_get(&info->sched, cls, (uint64_t)n * info->page_size,
+                          &grant);
+            n = grant.size / info->page_size;
+            zns_io_req req;
+            memset(&req, 0, sizeof(req));
+            req.opcode = ZNS_IO_WRITE_ZEROES;
+            req.slba = zone->saddr + zone->write_ptr;
+            req.num_pages = n;
+            ret = zns_io_engine_submit(info->engine, &req, 1U);
+            zns_sched_put(&info->sched, &grant,
+                          ret ? 0ULL : (uint64_t)n * info->page_size);
+            if (!ret) {
+                increase_write_ptr(zone, n);
+                __atomic_add_fetch(&info->hole_pages_zeroed, (uint64_t)n,
+                                   __ATOMIC_RELAXED);
+                num_pages -= n;
+            }
+        }
+        if (!ret)
+            return 0;
+        printf("Write zeroes failed %d, appending zeros from now\n", ret);
+        __atomic_store_n(&info->write_zeroes, false, __ATOMIC_RELAXED);
+    }
+    while (num_pages) {
+        uint32_t n = num_pages < info->zeros_pages ? num_pages :
+                     info->zeros_pages;
+        int ret = append_to_data_zone(info, zone, info->zeros,
+                                      n * info->page_size, cls);
+        if (ret)
+            return ret;
+        __atomic_add_fetch(&info->hole_pages_written, (uint64_t)n,
+                           __ATOMIC_RELAXED);
+        num_pages -= n;
+    }
+    return 0;
+}
+
+// Maps num_pages pages of an append, from page first of its data on, to
+// physical_addr onwards
+static void map_log_segs(zns_info *info, zone_info *zone,
+                         const log_seg *segs, uint64_t first,
+                         unsigned long long physical_addr,
+                         uint32_t num_pages)
+{
+    while (first >= segs->num_pages) {
+        first -= segs->num_pages;
+        ++segs;
+    }
+    while (num_pages) {
+        uint32_t n = segs->num_pages - first;
+        if (n > num_pages)
+            n = num_pages;
+        for (uint32_t i = 0U; i < n; ++i)
+            zone->rmap[physical_addr - zone->saddr + i] = segs->page_addr +
+                                                         first + i;
+        update_page_map(info, zone, segs->page_addr + first, physical_addr,
+                        n, segs->from ? segs->from + first : 0ULL);
+        physical_addr += n;
+        num_pages -= n;
+        first = 0ULL;
+        ++segs;
+    }
+}
+
+// Writers only hold stream->lock to reserve their pages, so the appends of
+// all of them are in flight together and each chunk records where the device
+// put it. segs give the logical pages of buffer in order.
+static int append_to_log_zone(zns_info *info, log_stream *stream,
+                              const log_seg *segs, void *buffer,
+                              uint32_t size)
+{
+    __atomic_add_fetch(&stream->bytes, (uint64_t)size, __ATOMIC_RELAXED);
+    uint64_t done = 0ULL;
+    while (size) {
+        zone_info *zone;
+        uint32_t num_pages = reserve_log_pages(info, stream,
+                                               size / info->page_size, &zone);
+        int ret = append_log_pages(info, zone, segs, done, buffer, num_pages,
+                                   ZNS_CLASS_USER_WRITE);
+        put_log_reservation(info, zone);
+        if (ret)
+            return ret;
+        done += num_pages;
+        buffer = (char *)buffer + num_pages * info->page_size;
+        size -= num_pages * info->page_size;
+    }
+    return 0;
+}
+
+// Reserves up to num_pages at the end of the open zone of stream, returns
+// how many with the zone in *zone. The writer reserving its last page
+// changes the zone of stream, the others go on in the next one while the
+// appends to this one complete.
+static uint32_t reserve_log_pages(zns_info *info, log_stream *stream,
+                                  uint32_t num_pages, zone_info **zone)
+{
+    pthread_mutex_lock(&stream->lock);
+    if (!stream->zone)
+        open_log_zone(info, stream);
+    zone_info *open = stream->zone;
+    uint32_t free_pages = info->zone_num_pages - open->write_ptr;
+    bool full = num_pages >= free_pages;
+    if (full)
+        num_pages = free_pages;
+    // One add, the zone is never full without this append counted
+    __atomic_add_fetch(&open->appends, full ? ZNS_ZONE_FULL + 1U : 1U,
+                       __ATOMIC_SEQ_CST);
+    increase_write_ptr(open, num_pages);
+    if (full)
+        change_log_zone(info, stream);
+    pthread_mutex_unlock(&stream->lock);
+    *zone = open;
+    return num_pages;
+}
+
+// Reserves num_pages in the coldest log stream whose zone has room for more
+// than that, so it never changes zones. A lock is only waited for briefly,
+// its holder may be waiting for gc to free a zone.
+static zone_info *try_reserve_log_pages(zns_info *info, uint32_t num_pages,
+                                        log_stream **stream)
+{
+    for (uint32_t i = 0U; i < info->num_log_streams; ++i) {
+        log_stream *s = &info->log_streams[i];
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += ZNS_COMPACT_LOCK_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_nsec -= 1000000000L;
+            ++deadline.tv_sec;
+        }
+        if (pthread_mutex_timedlock(&s->lock, &deadline))
+            continue;
+        zone_info *zone = s->zone;
+        if (zone && info->zone_num_pages - zone->write_ptr > num_pages) {
+            __atomic_add_fetch(&zone->appends, 1U, __ATOMIC_SEQ_CST);
+            increase_write_ptr(zone, num_pages);
+            pthread_mutex_unlock(&s->lock);
+            *stream = s;
+            return zone;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+// The appends of a reservation are mapped. The last one to finish in a full
+// zone makes it a log zone, gc sees all of its valid pages from then on.
+static void put_log_reservation(zns_info *info, zone_info *zone)
+{
+    if (__atomic_sub_fetch(&zone->appends, 1U, __ATOMIC_SEQ_CST) !=
+        ZNS_ZONE_FULL)
+        return;
+    zone->appends = 0U;
+    pthread_mutex_lock(&info->log_zones_lock);
+    add_log_zone(info, zone);
+    set_zone_state(zone, ZONE_LOG);
+    pthread_mutex_unlock(&info->log_zones_lock);
+}
+
+// Call with log_zones_lock held
+static void add_log_zone(zns_info *info, zone_info *zone)
+{
+    zone->log_slot = info->num_full_log_zones;
+    info->log_zones[info->num_full_log_zones++] = get_zone_index(info, zone);
+}
+
+// Call with log_zones_lock held. The last one takes its slot.
+static void remove_log_zone(zns_info *info, zone_info *zone)
+{
+    uint32_t last = info->log_zones[--info->num_full_log_zones];
+    info->log_zones[zone->log_slot] = last;
+    info->zones[last].log_slot = zone->log_slot;
+}
+
+// Appends num_pages of buffer reserved in zone, from page first of segs on.
+// Their chunks are in flight together. A failed one leaves its pages of the
+// reservation unwritten until the zone is reset.
+static int append_log_pages(zns_info *info, zone_info *zone,
+                            const log_seg *segs, uint64_t first, void *buffer,
+                            uint32_t num_pages, uint8_t cls)
+{
+    uint32_t max_pages = zns_sched_max_cmd(&info->sched, cls) /
+                         info->page_size;
+    zns_io_req *reqs = (zns_io_req *)calloc((num_pages + max_pages - 1U) /
+                                            max_pages, sizeof(zns_io_req));
+    uint32_t done = 0U;
+    int ret = 0;
+    while (!ret && done < num_pages) {
+        zns_sched_grant grant;
+        zns_sched_get(&info->sched, cls,
+                      (uint64_t)(num_pages - done) * info->page_size, &grant);
+        uint32_t budget = grant.size / info->page_size;
+        uint32_t start = done;
+        uint32_t num_reqs = 0U;
+        while (budget && done < num_pages) {
+            uint32_t n = num_pages - done;
+            if (n > max_pages)
+                n = max_pages;
+            if (n > budget)
+                n = budget;
+            zns_io_req *req = &reqs[num_reqs++];
+            memset(req, 0, sizeof(zns_io_req));
+            req->opcode = ZNS_IO_APPEND;
+            req->slba = zone->saddr;
+            req->num_pages = n;
+            req->buffer = (char *)buffer + (uint64_t)done * info->page_size;
+            budget -= n;
+            done += n;
+        }
+        ret = zns_io_engine_submit(info->engine, reqs, num_reqs);
+        uint64_t landed = 0ULL;
+        for (uint32_t i = 0U; i < num_reqs; ++i) {
+            if (!reqs[i].status) {
+                increase_num_valid_page(zone, reqs[i].num_pages);
+                map_log_segs(info, zone, segs, first + start,
+                             reqs[i].result, reqs[i].num_pages);
+                landed += (uint64_t)reqs[i].num_pages * info->page_size;
+            }
+            start += reqs[i].num_pages;
+        }
+        zns_sched_put(&info->sched, &grant, landed);
+    }
+    free(reqs);
+    return ret;
+}
+
+static void add_log_batch(log_batch *batch, uint32_t stream,
+                          unsigned long long page_addr, uint32_t num_pages,
+                          void *buffer)
+{
+    if (batch->num_segs[stream] == batch->max_segs[stream]) {
+        batch->max_segs[stream] = batch->max_segs[stream] ?
+                                  batch->max_segs[stream] << 1U : 16U;
+        batch->segs[stream] = (log_seg *)realloc(batch->segs[stream],
+                                                 batch->max_segs[stream] *
+                                                 sizeof(log_seg));
+    }
+    log_seg *seg = &batch->segs[stream][batch->num_segs[stream]++];
+    seg->page_addr = page_addr;
+    seg->num_pages = num_pages;
+    seg->buffer = buffer;
+}
+
+// The segments of a stream are gathered into appends of wbuf_gather_pages,
+// each one followed by the bitmaps of its pages
+static int append_log_batch(zns_info *info, log_batch *batch)
+{
+    uint32_t max_pages = info->wbuf_gather_pages;
+    log_seg *chunk = (log_seg *)calloc(max_pages, sizeof(log_seg));
+    int ret = 0;
+    for (uint32_t s = 0U; s < info->num_log_streams && !ret; ++s) {
+        uint32_t i = 0U;
+        uint32_t done = 0U; // pages of segs[i] in earlier appends
+        while (i < batch->num_segs[s] && !ret) {
+            uint32_t n = 0U;
+            uint32_t pages = 0U;
+            while (i < batch->num_segs[s] && pages < max_pages) {
+                log_seg *seg = &batch->segs[s][i];
+                uint32_t take = seg->num_pages - done;
+                if (take > max_pages - pages)
+                    take = max_pages - pages;
+                chunk[n].page_addr = seg->page_addr + done;
+                chunk[n].num_pages = take;
+                memcpy(info->wbuf_gather + (size_t)pages * info->page_size,
+                       (char *)seg->buffer + (size_t)done * info->page_size,
+                       (size_t)take * info->page_size);
+                ++n;
+                pages += take;
+                done += take;
+                if (done == seg->num_pages) {
+                    ++i;
+                    done = 0U;
+                }
+            }
+            ret = append_to_log_zone(info, &info->log_streams[s], chunk,
+                                     info->wbuf_gather,
+                                     pages * info->page_size);
+        }
+    }
+    free(chunk);
+    return ret;
+}
+
+// Half the budget buffers writes, the other half holds the flush in
+// progress. Writes from the zone append size limit on go around it.
+static int init_wbuf(zns_info *info, const zdev_init_params *params)
+{
+    uint32_t num_slots = params->wbuf_bytes / 2U / info->page_size;
+    if (!num_slots)
+        return 0;
+    info->wbuf = (zns_wbuf *)calloc(1UL, sizeof(zns_wbuf));
+    int ret = zns_wbuf_init(info->wbuf, info->page_size, num_slots);
+    if (ret) {
+        free(info->wbuf);
+        info->wbuf = NULL;
+        return ret;
+    }
+    info->wbuf_max_write = info->zasl;
+    if (info->wbuf_max_write > num_slots / 2U * info->page_size)
+        info->wbuf_max_write = num_slots / 2U * info->page_size;
+    info->wbuf_flush_pages = (num_slots + 1U) / 2U;
+    info->wbuf_flush_ns = (params->wbuf_flush_ms ? params->wbuf_flush_ms :
+                           ZNS_WBUF_DEFAULT_FLUSH_MS) * 1000000ULL;
+    info->wbuf_pages = (zns_wbuf_page *)calloc(num_slots,
+                                               sizeof(zns_wbuf_page));
+    info->wbuf_flush_buffer = (char *)malloc((size_t)num_slots *
+                                             info->page_size);
+    info->wbuf_gather_pages = info->zasl / info->page_size;
+    if (!info->wbuf_gather_pages)
+        info->wbuf_gather_pages = 1U;
+    info->wbuf_gather = (char *)malloc((size_t)info->wbuf_gather_pages *
+                                       info->page_size);
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&info->flush_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&info->flusher_lock, NULL);
+    pthread_cond_init(&info->flusher_cond, NULL);
+    info->run_flusher = true;
+    pthread_create(&info->flusher, NULL, &wbuf_flusher, info);
+    return 0;
+}
+
+static void deinit_wbuf(zns_info *info)
+{
+    if (!info->wbuf)
+        return;
+    pthread_mutex_lock(&info->flusher_lock);
+    info->run_flusher = false;
+    pthread_cond_signal(&info->flusher_cond);
+    pthread_mutex_unlock(&info->flusher_lock);
+    pthread_join(info->flusher, NULL);
+    int ret = flush_wbuf(info);
+    if (ret)
+        printf("Write-back buffer flush failed %d, buffered writes are lost\n",
+               ret);
+    pthread_cond_destroy(&info->flusher_cond);
+    pthread_mutex_destroy(&info->flusher_lock);
+    pthread_rwlock_destroy(&info->flush_lock);
+    free(info->wbuf_gather);
+    free(info->wbuf_flush_buffer);
+    free(info->wbuf_pages);
+    zns_wbuf_destroy(info->wbuf);
+    free(info->wbuf);
+    info->wbuf = NULL;
+}
+
+// Runs of adjacent pages are written like any write, the ones bound for
+// the log are appended together at the end. Pages leave the buffer once
+// the device has them.
+static int flush_wbuf(zns_info *info)
+{
+    pthread_rwlock_wrlock(&info->flush_lock);
+    uint32_t n = zns_wbuf_collect(info->wbuf, info->wbuf_pages,
+                                  info->wbuf_flush_buffer);
+    log_batch batch;
+    memset(&batch, 0, sizeof(batch));
+    int ret = 0;
+    for (uint32_t i = 0U, j; i < n && !ret; i = j) {
+        for (j = i + 1U; j < n && info->wbuf_pages[j].page_addr ==
+                                  info->wbuf_pages[j - 1U].page_addr + 1ULL;
+             ++j)
+            ;
+        void *buffer = info->wbuf_flush_buffer +
+                       (size_t)i * info->page_size;
+        uint64_t address = info->wbuf_pages[i].page_addr * info->page_size;
+        uint32_t size = (j - i) * info->page_size;
+        if (info->page_ftl)
+            ret = zns_page_ftl_write(info->page_ftl, address, buffer, size);
+        else
+            ret = write_blocks(info, address, buffer, size, &batch);
+    }
+    if (!ret)
+        ret = append_log_batch(info, &batch);
+    for (uint32_t s = 0U; s < ZNS_MAX_LOG_STREAMS; ++s)
+        free(batch.segs[s]);
+    if (!ret) {
+        zns_wbuf_retire(info->wbuf, info->wbuf_pages, n);
+        __atomic_add_fetch(&info->wbuf_flushes, 1ULL, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&info->wbuf_flushed_pages, (uint64_t)n,
+                           __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&info->flush_lock);
+    return ret;
+}
+
+static int init_rcache(zns_info *info, const zdev_init_params *params)
+{
+    uint64_t num_pages = params->rcache_bytes / info->page_size;
+    if (!num_pages)
+        return 0;
+    info->rcache = (zns_rcache *)calloc(1UL, sizeof(zns_rcache));
+    int ret = zns_rcache_init(info->rcache, info->page_size, num_pages);
+    if (ret) {
+        printf("Failed to allocate the read cache %d\n", ret);
+        free(info->rcache);
+        info->rcache = NULL;
+    }
+    return ret;
+}
+
+static void deinit_rcache(zns_info *info)
+{
+    if (!info->rcache)
+        return;
+    zns_rcache_destroy(info->rcache);
+    free(info->rcache);
+    info->rcache = NULL;
+}
+
+// Flushes once half the buffer is used or the oldest write is
+// wbuf_flush_ns old
+static void *wbuf_flusher(void *info_ptr)
+{
+    zns_info *info = (zns_info *)info_ptr;
+    pthread_mutex_lock(&info->flusher_lock);
+    while (info->run_flusher) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t wait_ns = deadline.tv_nsec + info->wbuf_flush_ns / 2ULL;
+        deadline.tv_sec += wait_ns / 1000000000ULL;
+        deadline.tv_nsec = wait_ns % 1000000000ULL;
+        if (zns_wbuf_used(info->wbuf) < info->wbuf_flush_pages)
+            pthread_cond_timedwait(&info->flusher_cond, &info->flusher_lock,
+                                   &deadline);
+        if (!info->run_flusher)
+            break;
+        pthread_mutex_unlock(&info->flusher_lock);
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t dirty_ns = zns_wbuf_dirty_ns(info->wbuf);
+        if (zns_wbuf_used(info->wbuf) >= info->wbuf_flush_pages ||
+            (dirty_ns && now.tv_sec * 1000000000ULL + now.tv_nsec - dirty_ns >=
+                         info->wbuf_flush_ns)) {
+            int ret = flush_wbuf(info);
+            if (ret)
+                printf("Write-back buffer flush failed %d\n", ret);
+        }
+        pthread_mutex_lock(&info->flusher_lock);
+    }
+    pthread_mutex_unlock(&info->flusher_lock);
+    return NULL;
+}
+
+// Merge on the device: Simple Copy the pages of block to the write pointer
+// of zone and fill the holes with zeros. The old image and log pages stay
+// readable throughout. On error the host path runs from where the copy
+// stopped.
+static int copy_logical_block(zns_info *info, logical_block *block,
+                              uint32_t num_pages, zone_info *zone)
+{
+    // Zero once a copy failed
+    uint32_t max_ranges = __atomic_load_n(&info->copy_max_ranges,
+                                          __ATOMIC_RELAXED);
+    if (!max_ranges)
+        return EOPNOTSUPP;
+    uint32_t start = zone->write_ptr;
+    // No buffer, the runs are placed by their offsets
+    read_runs runs = {NULL, NULL, NULL, 0U, 0U};
+    get_read_runs(info, block, &block->old_page_maps, NULL, 0U, num_pages,
+                  NULL, &runs);
+    nvme_copy_range *ranges = (nvme_copy_range *)
+                              calloc(max_ranges, sizeof(nvme_copy_range));
+    int ret = 0;
+    uint32_t done = 0U;
+    uint32_t i = 0U;
+    while (!ret && done < num_pages) {
+        uint32_t next = i < runs.num_reqs ? runs.offsets[i] : num_pages;
+        if (next > done) {
+            ret = append_zeros(info, zone, next - done, ZNS_CLASS_GC_WRITE);
+            done = next;
+            continue;
+        }
+        // Runs without holes in between go in one command, as far as the
+        // grant goes. Ask for the pages up to the next hole.
+        uint32_t max_pages = 0U;
+        for (uint32_t j = i; j < runs.num_reqs && j - i < max_ranges; ++j) {
+            if (runs.offsets[j] != done + max_pages ||
+                max_pages >= info->copy_max_pages)
+                break;
+            max_pages += runs.reqs[j].num_pages;
+        }
+        if (max_pages > info->copy_max_pages)
+            max_pages = info->copy_max_pages;
+        zns_sched_grant grant;
+        zns_sched_get(&info->sched, ZNS_CLASS_GC_WRITE,
+                      (uint64_t)max_pages * info->page_size, &grant);
+        max_pages = grant.size / info->page_size;
+        uint32_t nr = 0U;
+        uint32_t pages = 0U;
+        while (i < runs.num_reqs && nr < max_ranges && pages < max_pages &&
+               runs.offsets[i] == done + pages) {
+            zns_io_req *run = &runs.reqs[i];
+            uint32_t n = run->num_pages;
+            if (n > info->copy_max_range_pages)
+                n = info->copy_max_range_pages;
+            if (n > max_pages - pages)
+                n = max_pages - pages;
+            ranges[nr].slba = cpu_to_le64(run->slba);
+            ranges[nr].nlb = cpu_to_le16(n - 1U);
+            ++nr;
+            pages += n;
+            // Rest of a long run goes into the next range
+            run->slba += n;
+            run->num_pages -= n;
+            runs.offsets[i] += n;
+            if (!run->num_pages)
+                ++i;
+        }
+        ret = copy_pages(info, ranges, nr, pages,
+                         zone->saddr + start + done, &grant);
+        if (!ret) {
+            increase_write_ptr(zone, pages);
+            done += pages;
+        }
+    }
+    free(ranges);
+    free(runs.reqs);
+    free(runs.generations);
+    free(runs.offsets);
+    if (ret) {
+        printf("Simple copy merge failed %d, merging on the host from now\n",
+               ret);
+        __atomic_store_n(&info->copy_max_ranges, 0U, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+// Copies the num_pages pages of ranges to sdlba and returns the credits of
+// grant, which covers them
+static int copy_pages(zns_info *info, nvme_copy_range *ranges, uint32_t nr,
+                      uint32_t num_pages, unsigned long long sdlba,
+                      zns_sched_grant *grant)
+{
+    zns_io_req req;
+    memset(&req, 0, sizeof(req));
+    req.opcode = ZNS_IO_COPY;
+    req.slba = sdlba;
+    req.num_pages = num_pages;
+    req.buffer = ranges;
+    req.num_ranges = nr;
+    int ret = zns_io_engine_submit(info->engine, &req, 1U);
+    zns_sched_put(&info->sched, grant,
+                  ret ? 0ULL : (uint64_t)num_pages * info->page_size);
+    return ret;
+}
+
+static uint64_t thread_cpu_ns()
+{
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// One pair per gc worker and one for a writer that fills a seq zone, more
+// merges wait for a pair. Page aligned, the chunks go to the device as is.
+static int init_merge_chunks(zns_info *info)
+{
+    uint32_t num_pairs = info->num_gc_workers + 1U;
+    int ret = posix_memalign((void **)&info->merge_buffers, info->page_size,
+                             (size_t)num_pairs * 2U * info->mdts);
+    if (ret) {
+        printf("Failed to allocate the merge buffers %d\n", ret);
+        return ret;
+    }
+    ret = zns_ring_init(&info->merge_chunks, num_pairs);
+    if (ret)
+        return ret;
+    for (uint32_t i = 0U; i < num_pairs; ++i)
+        zns_ring_push(&info->merge_chunks, i);
+    pthread_cond_init(&info->merge_chunk_cond, NULL);
+    return 0;
+}
+
+static void deinit_merge_chunks(zns_info *info)
+{
+    pthread_cond_destroy(&info->merge_chunk_cond);
+    zns_ring_destroy(&info->merge_chunks);
+    free(info->merge_buffers);
+}
+
+// Sleeps on zones_lock like the free zones do
+static char *take_merge_chunks(zns_info *info)
+{
+    uint32_t index;
+    if (!zns_ring_pop(&info->merge_chunks, &index)) {
+        pthread_mutex_lock(&info->zones_lock);
+        while (!zns_ring_pop(&info->merge_chunks, &index))
+            pthread_cond_wait(&info->merge_chunk_cond, &info->zones_lock);
+        pthread_mutex_unlock(&info->zones_lock);
+    }
+    return info->merge_buffers + (uint64_t)index * 2U * info->mdts;
+}
+
+static void put_merge_chunks(zns_info *info, char *chunks)
+{
+    zns_ring_push(&info->merge_chunks,
+                  (chunks - info->merge_buffers) / (2U * info->mdts));
+    pthread_mutex_lock(&info->zones_lock);
+    pthread_cond_broadcast(&info->merge_chunk_cond);
+    pthread_mutex_unlock(&info->zones_lock);
+}
+
+// Appends size bytes of buffer to zone in order. reads go out in one batch
+// with its commands as far as their credits are free right away, so the
+// device works on both. Waiting for them while holding the append credits
+// could starve the scheduler, then the rest goes on its own after it.
+static int append_with_reads(zns_info *info, zone_info *zone, void *buffer,
+                             uint32_t size, read_runs *reads)
+{
+    read_cursor cursor = {0U, 0U};
+    uint64_t left = runs_left(reads, &cursor);
+    increase_write_ptr(zone, size / info->page_size);
+    uint32_t max_cmd = zns_sched_max_cmd(&info->sched, ZNS_CLASS_GC_WRITE);
+    while (size) {
+        zns_sched_grant grant;
+        zns_sched_get(&info->sched, ZNS_CLASS_GC_WRITE,
+                      size < max_cmd ? size : max_cmd, &grant);
+        unsigned curr_append_size = grant.size;
+        if (curr_append_size > size)
+            curr_append_size = size;
+        zns_io_req req;
+        memset(&req, 0, sizeof(req));
+        req.opcode = ZNS_IO_APPEND;
+        req.slba = zone->saddr;
+        req.num_pages = curr_append_size / info->page_size;
+        req.buffer = buffer;
+        zns_sched_grant read_grant;
+        int ret;
+        if (left && zns_sched_try_get(&info->sched, ZNS_CLASS_GC_READ,
+                                      left * info->page_size, &read_grant)) {
+            uint64_t num_pages;
+            ret = submit_runs(info, reads, &cursor, &read_grant, &req,
+                              &num_pages);
+            zns_sched_put(&info->sched, &read_grant,
+                          ret ? 0ULL : num_pages * info->page_size);
+            left -= num_pages;
+        } else {
+            ret = zns_io_engine_submit(info->engine, &req, 1U);
+        }
+        zns_sched_put(&info->sched, &grant, ret ? 0ULL : curr_append_size);
+        if (ret)
+            return ret;
+        buffer = (char *)buffer + curr_append_size;
+        size -= curr_append_size;
+    }
+    return submit_reads(info, reads, &cursor, ZNS_CLASS_GC_READ);
+}
+
+// Host side of a merge: appends pages [0, num_pages) of a range to zone.
+// runs has the written ones at their offsets in the range, without
+// buffers. The pages stream through a pair of chunk buffers, the reads of
+// one chunk overlap the append of the chunk before, so a merge takes two
+// chunks of memory whatever the zone size. Holes are left to Write Zeroes
+// if the device has it, else zeroed in the chunk.
+static int stream_pages(zns_info *info, read_runs *runs, uint32_t num_pages,
+                        zone_info *zone)
+{
+    char *chunks = take_merge_chunks(info);
+    uint32_t chunk_pages = info->mdts / info->page_size;
+    read_runs reads = {NULL, NULL, NULL, 0U, 0U};
+    char *pending = NULL; // read, to be appended next
+    uint32_t pending_pages = 0U;
+    uint32_t done = 0U;
+    uint32_t i = 0U;
+    int ret = 0;
+    while (!ret && (done < num_pages || pending_pages)) {
+        bool write_zeroes = __atomic_load_n(&info->write_zeroes,
+                                            __ATOMIC_RELAXED);
+        uint32_t next = i < runs->num_reqs ? runs->offsets[i] : num_pages;
+        reads.num_reqs = 0U;
+        if (next > done && write_zeroes) {
+            // The chunk before the hole lands first
+            if (pending_pages) {
+                ret = append_with_reads(info, zone, pending,
+                                        pending_pages * info->page_size,
+                                        &reads);
+                pending_pages = 0U;
+            } else {
+                ret = append_zeros(info, zone, next - done,
+                                   ZNS_CLASS_GC_WRITE);
+                done = next;
+            }
+            continue;
+        }
+        // Fill the other chunk of the pair
+        char *chunk = pending == chunks ? chunks + info->mdts : chunks;
+        uint32_t pages = 0U;
+        while (done + pages < num_pages && pages < chunk_pages) {
+            next = i < runs->num_reqs ? runs->offsets[i] : num_pages;
+            char *page = chunk + (uint64_t)pages * info->page_size;
+            uint32_t n;
+            if (next > done + pages) {
+                if (write_zeroes)
+                    break;
+                n = next - done - pages;
+                if (n > chunk_pages - pages)
+                    n = chunk_pages - pages;
+                memset(page, 0, (uint64_t)n * info->page_size);
+                __atomic_add_fetch(&info->hole_pages_written, (uint64_t)n,
+                                   __ATOMIC_RELAXED);
+            } else {
+                // Rest of a long run goes into the next chunk
+                zns_io_req *run = &runs->reqs[i];
+                n = run->num_pages;
+                if (n > chunk_pages - pages)
+                    n = chunk_pages - pages;
+                add_read_run(info, &reads, run->slba, n, pages, page);
+                run->slba += n;
+                run->num_pages -= n;
+                runs->offsets[i] += n;
+                if (!run->num_pages)
+                    ++i;
+            }
+            pages += n;
+        }
+        ret = append_with_reads(info, zone, pending,
+                                pending_pages * info->page_size, &reads);
+        pending = chunk;
+        pending_pages = pages;
+        done += pages;
+    }
+    free(reads.reqs);
+    free(reads.generations);
+    free(reads.offsets);
+    put_merge_chunks(info, chunks);
+    return ret;
 }
 
-static void merge(zns_info *info, logical_block *block)
+// Append pages [offset, offset + num_pages) of zone from to zone to, with
+// Simple Copy when the device has it
+static int move_pages(zns_info *info, zone_info *from, zone_info *to,
+                      uint32_t offset, uint32_t num_pages)
 {
+    uint64_t start = thread_cpu_ns();
+    int ret = 0;
+    uint32_t max_ranges = __atomic_load_n(&info->copy_max_ranges,
+                                          __ATOMIC_RELAXED);
+    if (max_ranges) {
+        nvme_copy_range *ranges = (nvme_copy_range *)
+                                  calloc(max_ranges, sizeof(nvme_copy_range));
+        uint32_t done = 0U;
+        while (!ret && done < num_pages) {
+            uint32_t max_pages = num_pages - done < info->copy_max_pages ?
+                                 num_pages - done : info->copy_max_pages;
+            zns_sched_grant grant;
+            zns_sched_get(&info->sched, ZNS_CLASS_GC_WRITE,
+                          (uint64_t)max_pages * info->page_size, &grant);
+            max_pages = grant.size / info->page_size;
+            uint32_t nr = 0U;
+            uint32_t pages = 0U;
+            while (done + pages < num_pages && nr < max_ranges &&
+                   pages < max_pages) {
+                uint32_t n = num_pages - done - pages;
+                if (n > info->copy_max_range_pages)
+                    n = info->copy_max_range_pages;
+                if (n > max_pages - pages)
+                    n = max_pages - pages;
+                ranges[nr].slba = cpu_to_le64(from->saddr + offset + done +
+                                              pages);
+                ranges[nr].nlb = cpu_to_le16(n - 1U);
+                ++nr;
+                pages += n;
+            }
+            ret = copy_pages(info, ranges, nr, pages,
+                             to->saddr + to->write_ptr, &grant);
+            if (!ret) {
+                increase_write_ptr(to, pages);
+                done += pages;
+            }
+        }
+        free(ranges);
+        __atomic_add_fetch(&info->gc_copy_bytes,
+                           (uint64_t)done * info->page_size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&info->gc_copy_cpu_ns, thread_cpu_ns() - start,
+                           __ATOMIC_RELAXED);
+        if (!ret)
+            return 0;
+        printf("Simple copy merge failed %d, merging on the host from now\n",
+               ret);
+        __atomic_store_n(&info->copy_max_ranges, 0U, __ATOMIC_RELAXED);
+        offset += done;
+        num_pages -= done;
+        start = thread_cpu_ns();
+    }
+    read_runs runs = {NULL, NULL, NULL, 0U, 0U};
+    add_read_run(info, &runs, from->saddr + offset, num_pages, 0U, NULL);
+    ret = stream_pages(info, &runs, num_pages, to);
+    free(runs.reqs);
+    free(runs.generations);
+    free(runs.offsets);
+    if (!ret)
+        __atomic_add_fetch(&info->gc_host_bytes,
+                           (uint64_t)num_pages * info->page_size,
+                           __ATOMIC_RELAXED);
+    __atomic_add_fetch(&info->gc_host_cpu_ns, thread_cpu_ns() - start,
+                       __ATOMIC_RELAXED);
+    return ret;
+}
+
+// Switch merge: when the log pages of the block are exactly its pages
+// [0, n) in order in seq, seq becomes the data zone as is. Partial merge: if
+// the old image holds more, only its tail [n, data_pages) moves to seq.
+// Returns false if the log pages are not such an image.
+static bool switch_merge(zns_info *info, logical_block *block,
+                         zone_info *seq)
+{
+    // Only the merge changes old_page_maps, no lock needed to look at it.
+    // In order writes join into a single extent.
+    zns_extent *extent = zns_extent_map_first(&block->old_page_maps);
+    if (block->old_page_maps.num_extents != 1U || extent->zone != seq ||
+        extent->page_addr != block->s_page_addr ||
+        extent->physical_addr != seq->saddr)
+        return false;
+    uint32_t num_pages = extent->num_pages;
+    // Pages past them may be left from before a remount
+    if (seq->write_ptr != num_pages)
+        return false;
+    // Writers keep off the data zone until the merge is done
+    zone_info *data_zone = block->data_zone;
+    uint32_t data_pages = block->data_pages;
+    bool partial = data_zone && data_pages > num_pages;
+    if (partial && move_pages(info, data_zone, seq,
+                              block->data_start + num_pages,
+                              data_pages - num_pages))
+        return false;
     pthread_mutex_lock(&block->lock);
-    block->old_page_maps = block->page_maps;
-    block->page_maps = NULL;
+    set_data_zone(info, block, seq);
+    block->data_start = 0U;
+    block->data_pages = seq->write_ptr;
+    set_zone_state(seq, ZONE_DATA);
+    log_block(info, block, META_MERGE_END, get_zone_index(info, seq),
+              block->data_pages);
+    // Its log pages are valid as the image, the moved tail comes on top
+    increase_num_valid_page(seq, block->data_pages - num_pages);
+    zns_extent_map_clear(&block->old_page_maps, NULL, NULL);
+    // Written to the log while it was merged
+    if (!zns_extent_map_empty(&block->page_maps))
+        update_gc_candidate(info, block);
     pthread_mutex_unlock(&block->lock);
-    uint32_t size = get_data_offset(block->page_maps_tail->page_addr,
-                                    info->zone_num_pages) + 1U;
-    if (block->data_zone && block->data_zone->write_ptr > size)
-        size = block->data_zone->write_ptr;
-    size *= info->page_size;
-    char buffer[size];
-    memset(buffer, 0, size);
-    read_logical_block(info, block, buffer);
-    pthread_mutex_lock(&info->size_limit_lock);
-    info->used_status &= ~gc_read;
-    pthread_mutex_unlock(&info->size_limit_lock);
+    if (data_zone)
+        release_data_pages(info, data_zone, data_pages);
+    // seq stops counting as a log zone
+    __atomic_sub_fetch(&info->num_used_log_zones, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&info->zones_lock);
+    pthread_cond_broadcast(&info->log_zone_cond);
+    pthread_mutex_unlock(&info->zones_lock);
+    if (partial)
+        __atomic_add_fetch(&info->gc_partial_merges, 1ULL, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&info->gc_switch_merges, 1ULL, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Writes a new image of block from its old one and its log pages, to a zone
+// of its own or, packed, behind other images in a pack zone. dest is the
+// pack zone of a cleaning, the block moves there even without log pages if
+// its image fits. Returns whether the block was merged.
+static bool merge(zns_info *info, logical_block *block, zone_info *dest)
+{
+    zone_info *zone = dest;
+    // Packed, the room comes first: waiting for it with the block claimed
+    // could keep cleaning from freeing the zone of its old image
+    if (!dest && info->packed) {
+        pthread_mutex_lock(&block->lock);
+        bool idle = !zns_extent_map_empty(&block->page_maps) &&
+                    zns_extent_map_empty(&block->old_page_maps);
+        pthread_mutex_unlock(&block->lock);
+        if (!idle)
+            return false;
+        zone = take_pack_zone(info, info->block_num_pages, false);
+    }
+    // Once old_page_maps is set writers keep off the data and seq zone, the
+    // write in flight is waited for
+    pthread_mutex_lock(&block->write_lock);
     pthread_mutex_lock(&block->lock);
-    // Append old data zone to free zones list
-    if (block->data_zone) {
-        decrease_write_ptr(block->data_zone, block->data_zone->write_ptr);
-        nvme_zns_mgmt_send(info->fd, info->nsid, block->data_zone->saddr,
-                           false, NVME_ZNS_ZSA_RESET, 0U, NULL);
+    uint32_t size = get_merge_cost(block);
+    // Another worker may have picked it and be merging it already
+    if ((!dest && zns_extent_map_empty(&block->page_maps)) ||
+        !zns_extent_map_empty(&block->old_page_maps) || !size ||
+        (dest && info->zone_num_pages - dest->write_ptr < size)) {
+        pthread_mutex_unlock(&block->lock);
+        pthread_mutex_unlock(&block->write_lock);
+        if (zone && !dest)
+            put_pack_zone(info, zone);
+        return false;
+    }
+    zns_extent_map_move(&block->old_page_maps, &block->page_maps);
+    zone_info *seq = block->seq_zone;
+    block->seq_zone = NULL;
+    log_stream *stream = &info->log_streams[block->log_stream];
+    gc_index_remove(&info->gc_index, &block->candidate);
+    log_block(info, block, META_MERGE_BEGIN, 0ULL, 0ULL);
+    __atomic_add_fetch(dest ? &info->gc_relocations : &info->gc_merges, 1ULL,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&info->gc_log_pages_merged,
+                       block->old_page_maps.num_pages, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&block->lock);
+    pthread_mutex_unlock(&block->write_lock);
+    if (seq) {
+        if (switch_merge(info, block, seq))
+            return true;
+        // Not written in order, keep it as an ordinary log zone. Its pages
+        // sit at their offsets in the block, compaction finds them by that.
+        alloc_rmap(info, seq);
+        for (uint32_t k = 0U; k < seq->write_ptr; ++k)
+            seq->rmap[k] = block->s_page_addr + k;
+        pthread_mutex_lock(&info->log_zones_lock);
+        add_log_zone(info, seq);
+        set_zone_state(seq, ZONE_LOG);
+        pthread_mutex_unlock(&info->log_zones_lock);
+    }
+    __atomic_add_fetch(&stream->gc_bytes, (uint64_t)size * info->page_size,
+                       __ATOMIC_RELAXED);
+    if (!zone) {
         pthread_mutex_lock(&info->zones_lock);
-        if (info->free_zones)
-            info->free_zones_tail->next = block->data_zone;
-        else
-            info->free_zones = block->data_zone;
-        info->free_zones_tail = block->data_zone;
-        ++info->num_free_zones;
+        // Other workers and writers compete for the free zones, the spare
+        // zone is always free or in a merge that frees one
+        while (!(zone = take_free_zone(info, ZONE_DATA)))
+            pthread_cond_wait(&info->log_zone_cond, &info->zones_lock);
         pthread_mutex_unlock(&info->zones_lock);
     }
+    uint32_t data_start = zone->write_ptr;
+    uint64_t start = thread_cpu_ns();
+    int ret = copy_logical_block(info, block, size, zone);
+    uint32_t copied = zone->write_ptr - data_start;
+    if (copied) {
+        __atomic_add_fetch(&info->gc_copy_bytes,
+                           (uint64_t)copied * info->page_size,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&info->gc_copy_cpu_ns, thread_cpu_ns() - start,
+                           __ATOMIC_RELAXED);
+    }
+    if (ret) {
+        // The host path goes on where the copy stopped. No buffer, the runs
+        // are streamed by their offsets.
+        start = thread_cpu_ns();
+        read_runs runs = {NULL, NULL, NULL, 0U, 0U};
+        get_read_runs(info, block, &block->old_page_maps, NULL, copied,
+                      size - copied, NULL, &runs);
+        ret = stream_pages(info, &runs, size - copied, zone);
+        free(runs.reqs);
+        free(runs.generations);
+        free(runs.offsets);
+        if (ret)
+            printf("Host merge of block %lu failed %d\n",
+                   (unsigned long)(block - info->logical_blocks), ret);
+        __atomic_add_fetch(&info->gc_host_bytes,
+                           (uint64_t)(size - copied) * info->page_size,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&info->gc_host_cpu_ns, thread_cpu_ns() - start,
+                           __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&block->lock);
+    zone_info *old_zone = block->data_zone;
+    uint32_t old_pages = block->data_pages;
+    set_data_zone(info, block, zone);
+    block->data_start = data_start;
+    block->data_pages = size;
+    increase_num_valid_page(zone, size);
+    log_block(info, block, META_MERGE_END, get_zone_index(info, zone),
+              (uint64_t)data_start << 32U | size);
+    // The data moved, only now the log zones may be reclaimed
+    zns_extent_map_clear(&block->old_page_maps, &release_log_pages, NULL);
+    // Written to the log while it was merged
+    if (!zns_extent_map_empty(&block->page_maps))
+        update_gc_candidate(info, block);
+    pthread_mutex_unlock(&block->lock);
+    if (old_zone)
+        release_data_pages(info, old_zone, old_pages);
+    if (zone != dest && info->packed)
+        put_pack_zone(info, zone);
+    return true;
+}
+
+// Call with zones_lock held, it orders the takers. A pack zone with room
+// for num_pages, else a free zone while fewer than max_used data and pack
+// zones are in use.
+static zone_info *try_take_pack_zone(zns_info *info, uint32_t num_pages,
+                                     int max_used)
+{
+    pthread_mutex_lock(&info->pack_lock);
+    zone_info **link = &info->pack_zones;
+    while (*link && info->zone_num_pages - (*link)->write_ptr < num_pages)
+        link = &(*link)->next;
+    zone_info *zone = *link;
+    if (zone)
+        *link = zone->next;
+    pthread_mutex_unlock(&info->pack_lock);
+    if (zone ||
+        __atomic_load_n(&info->num_used_data_zones, __ATOMIC_ACQUIRE) >=
+        max_used)
+        return zone;
+    zone = take_free_zone(info, ZONE_PACK);
+    if (zone)
+        __atomic_add_fetch(&info->num_used_data_zones, 1, __ATOMIC_RELEASE);
+    return zone;
+}
+
+// A zone with room for num_pages, the caller's alone until it is put back.
+// Merges use at most one zone more than there are data zones, without room
+// they clean a data zone and else wait for one to be freed. clean is set
+// by cleaning, it may use the zones kept back for it but never waits, it
+// gets NULL instead.
+static zone_info *take_pack_zone(zns_info *info, uint32_t num_pages,
+                                 bool clean)
+{
+    int max_used = info->num_data_zones + 1U +
+                   (clean ? ZNS_CLEAN_ZONES : 0U);
+    bool cleaned = false;
+    zone_info *zone;
     pthread_mutex_lock(&info->zones_lock);
-    // Get free zone and nullify the next
-    block->data_zone = info->free_zones;
-    info->free_zones = info->free_zones->next;
-    if (!info->free_zones)
-        info->free_zones_tail = NULL;
-    block->data_zone->next = NULL;
-    --info->num_free_zones;
+    while (!(zone = try_take_pack_zone(info, num_pages, max_used)) &&
+           !clean) {
+        if (!cleaned) {
+            // A zone freed meanwhile is found by the next look. Moved images
+            // take their log pages along and may fill the cleaning's zone
+            // before the victim is empty, so clean again until nothing moves.
+            pthread_mutex_unlock(&info->zones_lock);
+            cleaned = !clean_data_zone(info);
+            pthread_mutex_lock(&info->zones_lock);
+            continue;
+        }
+        pthread_cond_wait(&info->log_zone_cond, &info->zones_lock);
+        cleaned = false;
+    }
     pthread_mutex_unlock(&info->zones_lock);
-    append_to_data_zone(info, block->data_zone, buffer, size, gc_write);
-    pthread_mutex_lock(&info->size_limit_lock);
-    info->used_status &= ~gc_write;
-    pthread_mutex_unlock(&info->size_limit_lock);
-    while (block->old_page_maps) {
-        page_map *tmp = block->old_page_maps;
-        block->old_page_maps = block->old_page_maps->next;
-        free(tmp);
+    return zone;
+}
+
+// Back to the pack zones while another image fits, else closed as a data
+// zone. Either way merges waiting for room look again.
+static void put_pack_zone(zns_info *info, zone_info *zone)
+{
+    if (info->zone_num_pages - zone->write_ptr >= info->block_num_pages) {
+        pthread_mutex_lock(&info->pack_lock);
+        zone->next = info->pack_zones;
+        info->pack_zones = zone;
+        pthread_mutex_unlock(&info->pack_lock);
+        pthread_mutex_lock(&info->zones_lock);
+        pthread_cond_broadcast(&info->log_zone_cond);
+        pthread_mutex_unlock(&info->zones_lock);
+        return;
     }
-    pthread_mutex_unlock(&block->lock);
+    // Pairs with release_data_pages, one of both sees the zone empty and
+    // closed
+    __atomic_store_n(&zone->state, ZONE_DATA, __ATOMIC_SEQ_CST);
+    uint8_t state = ZONE_DATA;
+    if (!__atomic_load_n(&zone->num_valid_pages, __ATOMIC_SEQ_CST) &&
+        __atomic_compare_exchange_n(&zone->state, &state, ZONE_EMPTY, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        free_data_zone(info, zone);
+    else
+        update_clean_candidate(info, zone);
 }
 
-static void *garbage_collection(void *info_ptr)
+// The image of num_pages in zone was replaced, the journal may not have the
+// new one on the device yet. A data zone is freed with its last image, a
+// pack zone once it is closed.
+static void release_data_pages(zns_info *info, zone_info *zone,
+                               uint32_t num_pages)
 {
-    zns_info *info = (zns_info *)info_ptr;
-    uint32_t index = 0U;
-    while (info->run_gc) {
-        while (info->num_log_zones - info->num_used_log_zones >
-               info->gc_wmark) {
-            if (!info->run_gc)
-                return NULL;
+    uint8_t state = ZONE_DATA;
+    if (!__atomic_sub_fetch(&zone->num_valid_pages, num_pages,
+                            __ATOMIC_SEQ_CST) &&
+        __atomic_compare_exchange_n(&zone->state, &state, ZONE_EMPTY, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        free_data_zone(info, zone);
+    else if (info->packed)
+        update_clean_candidate(info, zone);
+}
+
+// Call with block->lock held. Moves block to the images of zone.
+static void set_data_zone(zns_info *info, logical_block *block,
+                          zone_info *zone)
+{
+    pthread_mutex_lock(&info->data_blocks_lock);
+    if (block->data_zone) {
+        if (block->data_prev)
+            block->data_prev->data_next = block->data_next;
+        else
+            block->data_zone->data_blocks = block->data_next;
+        if (block->data_next)
+            block->data_next->data_prev = block->data_prev;
+    }
+    block->data_zone = zone;
+    link_data_block(block);
+    pthread_mutex_unlock(&info->data_blocks_lock);
+}
+
+// Call with data_blocks_lock held, or alone at remount
+static void link_data_block(logical_block *block)
+{
+    zone_info *zone = block->data_zone;
+    block->data_prev = NULL;
+    block->data_next = zone->data_blocks;
+    if (zone->data_blocks)
+        zone->data_blocks->data_prev = block;
+    zone->data_blocks = block;
+}
+
+// Call with the zone claimed as ZONE_EMPTY. Reset once the journal has the
+// images that replaced the ones in it.
+static void free_data_zone(zns_info *info, zone_info *zone)
+{
+    if (info->packed)
+        gc_index_remove(&info->clean_index, &zone->clean_candidate);
+    sync_meta(info);
+    decrease_write_ptr(zone, zone->write_ptr);
+    int ret = reset_zone(info, zone);
+    if (ret) {
+        // Packed it stays a used data zone, else a block's new image took
+        // its place and it takes a log zone's
+        offline_zone(info, zone);
+        if (!info->packed)
+            __atomic_add_fetch(&info->num_used_log_zones, 1,
+                               __ATOMIC_RELEASE);
+        return;
+    }
+    if (info->packed)
+        __atomic_sub_fetch(&info->num_used_data_zones, 1, __ATOMIC_RELEASE);
+    put_free_zone(info, zone);
+}
+
+// Bucketed by valid pages. A full one frees nothing, an empty one is being
+// reset.
+static void update_clean_candidate(zns_info *info, zone_info *zone)
+{
+    uint32_t n = __atomic_load_n(&zone->num_valid_pages, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&zone->state, __ATOMIC_ACQUIRE) != ZONE_DATA || !n ||
+        n >= info->zone_num_pages) {
+        gc_index_remove(&info->clean_index, &zone->clean_candidate);
+        return;
+    }
+    gc_index_update(&info->clean_index, &zone->clean_candidate,
+                    info->zone_num_pages - n, info->zone_num_pages);
+}
+
+// Packed blocks leave dead images behind in data zones. This frees the one
+// with the fewest valid pages: the blocks with an image there are merged
+// into a pack zone of the cleaning, log pages and all. A block in a merge
+// stays, its merge releases the image. Returns whether a block moved.
+static bool clean_data_zone(zns_info *info)
+{
+    pthread_mutex_lock(&info->clean_lock);
+    zone_info *victim = NULL;
+    uint32_t valid = 0U;
+    gc_candidate *cand;
+    while (!victim && (cand = gc_index_pick(&info->clean_index))) {
+        zone_info *zone = container_of(cand, zone_info, clean_candidate);
+        uint32_t n = __atomic_load_n(&zone->num_valid_pages,
+                                     __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&zone->state, __ATOMIC_ACQUIRE) == ZONE_DATA &&
+            n && n < info->zone_num_pages) {
+            victim = zone;
+            valid = n;
         }
-        logical_block *block = &info->logical_blocks[index];
-        while(!block->page_maps) {
-	        index = (index + 1U) % info->num_data_zones;
-            block = &info->logical_blocks[index];
-            if (!info->run_gc)
-                return NULL;
+    }
+    zone_info *dest = victim ? take_pack_zone(info, valid, true) : NULL;
+    // The merges move the blocks off the list, they go from a copy
+    logical_block **blocks = NULL;
+    uint32_t num_blocks = 0U;
+    if (dest) {
+        pthread_mutex_lock(&info->data_blocks_lock);
+        for (logical_block *b = victim->data_blocks; b; b = b->data_next)
+            ++num_blocks;
+        blocks = (logical_block **)calloc(num_blocks + 1U,
+                                          sizeof(logical_block *));
+        num_blocks = 0U;
+        for (logical_block *b = victim->data_blocks; b; b = b->data_next)
+            blocks[num_blocks++] = b;
+        pthread_mutex_unlock(&info->data_blocks_lock);
+    }
+    bool moved = false;
+    for (uint32_t i = 0U; i < num_blocks &&
+                          __atomic_load_n(&victim->state, __ATOMIC_ACQUIRE) ==
+                          ZONE_DATA; ++i) {
+        logical_block *block = blocks[i];
+        pthread_mutex_lock(&block->lock);
+        bool in_victim = block->data_zone == victim;
+        pthread_mutex_unlock(&block->lock);
+        if (in_victim && merge(info, block, dest))
+            moved = true;
+    }
+    free(blocks);
+    if (dest)
+        put_pack_zone(info, dest);
+    // Back in the index with what is left in it
+    if (victim)
+        update_clean_candidate(info, victim);
+    if (moved)
+        __atomic_add_fetch(&info->gc_data_cleanings, 1ULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&info->clean_lock);
+    return moved;
+}
+
+// Moves the valid pages of the log zone with the fewest of them to an open
+// log zone, if that copies fewer pages per log page it frees than merging
+// block would. The reverse map finds the pages, a page is valid while its
+// block maps it there. The zone is reset with the other empty log zones.
+// Pages of a block in a merge stay, the merge frees them. Returns whether
+// any page moved.
+static bool compact_log_zone(zns_info *info, logical_block *block)
+{
+    zone_info *victim = NULL;
+    uint32_t valid = 0U;
+    pthread_mutex_lock(&info->log_zones_lock);
+    for (uint32_t i = 0U; i < info->num_full_log_zones; ++i) {
+        zone_info *zone = &info->zones[info->log_zones[i]];
+        // Every log zone has an rmap, the check only keeps a zone without
+        // one from being picked over and over
+        if (__atomic_load_n(&zone->state, __ATOMIC_ACQUIRE) != ZONE_LOG ||
+            !zone->rmap)
+            continue;
+        // Empty ones are reset as they are
+        uint32_t n = __atomic_load_n(&zone->num_valid_pages,
+                                     __ATOMIC_ACQUIRE);
+        if (n && (!victim || n < valid)) {
+            victim = zone;
+            valid = n;
         }
+    }
+    pthread_mutex_unlock(&info->log_zones_lock);
+    if (!victim)
+        return false;
+    uint32_t freed = __atomic_load_n(&victim->write_ptr, __ATOMIC_ACQUIRE);
+    freed = freed > valid ? freed - valid : 0U;
+    if (!freed)
+        return false;
+    if (block) {
+        pthread_mutex_lock(&block->lock);
+        uint64_t log_pages = block->page_maps.num_pages;
+        uint64_t cost = get_merge_cost(block);
+        pthread_mutex_unlock(&block->lock);
+        if ((uint64_t)valid * log_pages >= cost * freed)
+            return false;
+    }
+    uint8_t state = ZONE_LOG;
+    if (!__atomic_compare_exchange_n(&victim->state, &state, ZONE_COMPACT,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_RELAXED))
+        return false;
+    // Runs of valid pages
+    log_seg *segs = NULL;
+    uint32_t num_segs = 0U;
+    uint32_t max_segs = 0U;
+    uint32_t write_ptr = victim->write_ptr;
+    for (uint32_t k = 0U; k < write_ptr;) {
+        unsigned long long page_addr = victim->rmap[k];
+        logical_block *owner = &info->logical_blocks[
+            get_block_index(page_addr, info->block_num_pages)];
+        uint32_t n = 0U;
+        pthread_mutex_lock(&owner->lock);
+        zns_extent *extent = zns_extent_map_find(&owner->page_maps,
+                                                 page_addr);
+        if (extent && extent->page_addr <= page_addr &&
+            extent->physical_addr + (page_addr - extent->page_addr) ==
+            victim->saddr + k)
+            n = extent->page_addr + extent->num_pages - page_addr;
+        pthread_mutex_unlock(&owner->lock);
+        if (!n) {
+            ++k;
+            continue;
+        }
+        if (n > write_ptr - k)
+            n = write_ptr - k;
+        if (num_segs == max_segs) {
+            max_segs = max_segs ? max_segs << 1U : 16U;
+            segs = (log_seg *)realloc(segs, max_segs * sizeof(log_seg));
+        }
+        segs[num_segs].page_addr = page_addr;
+        segs[num_segs].num_pages = n;
+        segs[num_segs].buffer = NULL;
+        segs[num_segs].from = victim->saddr + k;
+        ++num_segs;
+        k += n;
+    }
+    // Through a merge chunk pair, appends of up to both chunks
+    char *buffer = num_segs ? take_merge_chunks(info) : NULL;
+    uint32_t max_pages = 2U * info->mdts / info->page_size;
+    log_seg *chunk = (log_seg *)calloc(max_pages, sizeof(log_seg));
+    uint64_t moved = 0ULL;
+    int ret = 0;
+    uint32_t i = 0U;
+    uint32_t done = 0U; // pages of segs[i] in earlier appends
+    while (i < num_segs && !ret) {
+        uint32_t n = 0U;
+        uint32_t pages = 0U;
+        read_runs runs = {NULL, NULL, NULL, 0U, 0U};
+        while (i < num_segs && pages < max_pages) {
+            log_seg *seg = &segs[i];
+            uint32_t take = seg->num_pages - done;
+            if (take > max_pages - pages)
+                take = max_pages - pages;
+            chunk[n].page_addr = seg->page_addr + done;
+            chunk[n].num_pages = take;
+            chunk[n].from = seg->from + done;
+            add_read_run(info, &runs, chunk[n].from, take, pages,
+                         buffer + (uint64_t)pages * info->page_size);
+            ++n;
+            pages += take;
+            done += take;
+            if (done == seg->num_pages) {
+                ++i;
+                done = 0U;
+            }
+        }
+        log_stream *stream = NULL;
+        zone_info *zone = try_reserve_log_pages(info, pages, &stream);
+        if (zone) {
+            ret = submit_reads(info, &runs, NULL, ZNS_CLASS_GC_READ);
+            if (!ret)
+                ret = append_log_pages(info, zone, chunk, 0ULL, buffer, pages,
+                                       ZNS_CLASS_GC_WRITE);
+            put_log_reservation(info, zone);
+            if (!ret) {
+                __atomic_add_fetch(&stream->gc_bytes,
+                                   (uint64_t)pages * info->page_size,
+                                   __ATOMIC_RELAXED);
+                moved += pages;
+            }
+        }
+        free(runs.reqs);
+        free(runs.generations);
+        free(runs.offsets);
+        if (!zone)
+            break;
+    }
+    if (ret)
+        printf("Log zone compaction failed %d\n", ret);
+    free(chunk);
+    free(segs);
+    if (buffer)
+        put_merge_chunks(info, buffer);
+    set_zone_state(victim, ZONE_LOG);
+    if (!moved)
+        return false;
+    __atomic_add_fetch(&info->gc_compactions, 1ULL, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&info->gc_compacted_pages, moved, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Sleepers check for free zones with zones_lock held, so taking it before
+// the broadcast loses no wake up
+static void put_free_zone(zns_info *info, zone_info *zone)
+{
+    set_zone_state(zone, ZONE_FREE);
+    zns_ring_push(&info->free_zones, get_zone_index(info, zone));
+    pthread_mutex_lock(&info->zones_lock);
+    pthread_cond_broadcast(&info->log_zone_cond);
+    pthread_mutex_unlock(&info->zones_lock);
+}
+
+// Reset used log zones without valid pages and hand them to the free zones.
+// Returns whether any zone was reclaimed.
+static bool reclaim_log_zones(zns_info *info)
+{
+    // Claim the empty zones first, other workers look too. A full log zone
+    // never gets valid pages again.
+    zone_info *empty = NULL;
+    pthread_mutex_lock(&info->log_zones_lock);
+    for (uint32_t i = 0U; i < info->num_full_log_zones;) {
+        zone_info *zone = &info->zones[info->log_zones[i]];
+        uint8_t state = ZONE_LOG;
+        if (__atomic_load_n(&zone->state, __ATOMIC_ACQUIRE) != ZONE_LOG ||
+            __atomic_load_n(&zone->num_valid_pages, __ATOMIC_ACQUIRE) ||
+            !__atomic_compare_exchange_n(&zone->state, &state, ZONE_EMPTY,
+                                         false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_RELAXED)) {
+            ++i;
+            continue;
+        }
+        // The slot gets the last zone, look at it next
+        remove_log_zone(info, zone);
+        zone->next = empty;
+        empty = zone;
+    }
+    pthread_mutex_unlock(&info->log_zones_lock);
+    if (!empty)
+        return false;
+    // They only count as free once reset
+    sync_meta(info);
+    int num_empty = 0;
+    while (empty) {
+        zone_info *zone = empty;
+        empty = zone->next;
+        free(zone->rmap);
+        zone->rmap = NULL;
+        decrease_write_ptr(zone, zone->write_ptr);
+        int ret = reset_zone(info, zone);
+        if (ret) {
+            // Stays a used log zone
+            offline_zone(info, zone);
+            continue;
+        }
+        set_zone_state(zone, ZONE_FREE);
+        zns_ring_push(&info->free_zones, get_zone_index(info, zone));
+        ++num_empty;
+    }
+    __atomic_sub_fetch(&info->num_used_log_zones, num_empty, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&info->zones_lock);
+    pthread_cond_broadcast(&info->log_zone_cond);
+    pthread_mutex_unlock(&info->zones_lock);
+    return true;
+}
+
+static void *garbage_collection(void *worker_ptr)
+{
+    gc_worker *worker = (gc_worker *)worker_ptr;
+    zns_info *info = worker->info;
+    pthread_mutex_lock(&info->zones_lock);
+    for (;;) {
+        // Sleep until a log zone change crosses the watermark
+        while (info->run_gc && !gc_needed(info, worker->level))
+            pthread_cond_wait(&info->gc_cond, &info->zones_lock);
         if (!info->run_gc)
-            return NULL;
-        // Merge logical block to data zone
-        merge(info, block);
-        if (!info->run_gc)
-            return NULL;
-        // Check used log zone valid counter
-        // if zero reset and add to free zone list
-        // Remove zone from used_log_zones
-        // if valid_page is zero and add that zone to free zones list
-        zone_info *prev = NULL;
-        zone_info *free = NULL;
-        zone_info *curr = info->used_log_zones;
-        while (info->run_gc && curr) {
-            if (!curr->num_valid_pages) {
-                // reset
-                decrease_write_ptr(curr, curr->write_ptr);
-                nvme_zns_mgmt_send(info->fd, info->nsid, curr->saddr,
-                                   false, NVME_ZNS_ZSA_RESET, 0U, NULL);
-                pthread_mutex_lock(&info->zones_lock);
-                // Remove from used_log_zones
-                free = curr;
-                curr = curr->next;
-                if (prev) {
-                    prev->next = curr;
-                    if (free == info->used_log_zones_tail)
-                        info->used_log_zones_tail = prev;
-                } else {
-                    info->used_log_zones = curr;
-                    if (!info->used_log_zones)
-                        info->used_log_zones_tail = NULL;
-                }
-                free->next = NULL;
-                --info->num_used_log_zones;
-                if (info->free_zones)
-                    info->free_zones_tail->next = free;
-                else
-                    info->free_zones = free;
-                info->free_zones_tail = free;
-                ++info->num_free_zones;
-                pthread_mutex_unlock(&info->zones_lock);
-            } else {
-                prev = curr;
-                curr = curr->next;
+            break;
+        pthread_mutex_unlock(&info->zones_lock);
+        // Victim picked by the gc policy
+        logical_block *block = NULL;
+        gc_candidate *cand = gc_index_pick(&info->gc_index);
+        if (cand)
+            block = container_of(cand, logical_block, candidate);
+        // Merge logical block to data zone, unless compacting a log zone
+        // is cheaper. Then the block keeps its place.
+        bool compacted = compact_log_zone(info, block);
+        if (compacted && block) {
+            pthread_mutex_lock(&block->lock);
+            if (!zns_extent_map_empty(&block->page_maps) &&
+                zns_extent_map_empty(&block->old_page_maps))
+                gc_index_unpick(&info->gc_index, cand);
+            pthread_mutex_unlock(&block->lock);
+        } else if (block) {
+            merge(info, block, NULL);
+        }
+        bool reclaimed = reclaim_log_zones(info);
+        pthread_mutex_lock(&info->zones_lock);
+        if (!block && !compacted && !reclaimed && info->run_gc) {
+            // Nothing to do until writers change the log, back off
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 10000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_nsec -= 1000000000L;
+                ++deadline.tv_sec;
             }
+            pthread_cond_timedwait(&info->gc_cond, &info->zones_lock,
+                                   &deadline);
         }
-        index = (index + 1U) % info->num_data_zones;
     }
+    pthread_mutex_unlock(&info->zones_lock);
+    return NULL;
+}
+
+static void init_async_rings(user_zns_device *my_dev, uint32_t depth,
+                             uint32_t num_workers)
+{
+    zns_info *info = (zns_info *)my_dev->_private;
+    async_rings *rings = (async_rings *)calloc(1UL, sizeof(async_rings));
+    rings->dev = my_dev;
+    rings->depth = depth ? depth : ZNS_ASYNC_DEFAULT_DEPTH;
+    rings->sq = (zns_udevice_request *)calloc(rings->depth,
+                                              sizeof(zns_udevice_request));
+    rings->cq = (async_completion *)calloc(rings->depth,
+                                           sizeof(async_completion));
+    pthread_mutex_init(&rings->lock, NULL);
+    pthread_cond_init(&rings->sq_cond, NULL);
+    pthread_cond_init(&rings->cq_cond, NULL);
+    rings->num_workers = num_workers ? num_workers : ZNS_ASYNC_DEFAULT_WORKERS;
+    rings->workers = (pthread_t *)calloc(rings->num_workers, sizeof(pthread_t));
+    for (uint32_t i = 0U; i < rings->num_workers; ++i)
+        pthread_create(&rings->workers[i], NULL, &async_worker, rings);
+    info->async = rings;
+}
+
+static void deinit_async_rings(zns_info *info)
+{
+    async_rings *rings = info->async;
+    pthread_mutex_lock(&rings->lock);
+    rings->stop = true;
+    pthread_cond_broadcast(&rings->sq_cond);
+    pthread_mutex_unlock(&rings->lock);
+    for (uint32_t i = 0U; i < rings->num_workers; ++i)
+        pthread_join(rings->workers[i], NULL);
+    // Callers should have polled everything, their callbacks still run
+    uint32_t unpolled = rings->cq_tail - rings->cq_head;
+    if (unpolled)
+        printf("%u completions were not polled before deinit\n", unpolled);
+    for (; rings->cq_head != rings->cq_tail; ++rings->cq_head) {
+        async_completion *cqe = &rings->cq[rings->cq_head % rings->depth];
+        if (cqe->cb)
+            cqe->cb(rings->dev, cqe->tag, cqe->status, cqe->cb_arg);
+    }
+    free(rings->workers);
+    pthread_cond_destroy(&rings->cq_cond);
+    pthread_cond_destroy(&rings->sq_cond);
+    pthread_mutex_destroy(&rings->lock);
+    free(rings->cq);
+    free(rings->sq);
+    free(rings);
+    info->async = NULL;
+}
+
+// Serves the submission ring with the synchronous path, whose device commands
+// are already batched by the io engine
+static void *async_worker(void *rings_ptr)
+{
+    async_rings *rings = (async_rings *)rings_ptr;
+    pthread_mutex_lock(&rings->lock);
+    for (;;) {
+        while (rings->sq_head == rings->sq_tail && !rings->stop)
+            pthread_cond_wait(&rings->sq_cond, &rings->lock);
+        if (rings->sq_head == rings->sq_tail)
+            break;
+        zns_udevice_request req = rings->sq[rings->sq_head % rings->depth];
+        ++rings->sq_head;
+        pthread_mutex_unlock(&rings->lock);
+        int status;
+        if (req.opcode == ZNS_UDEVICE_WRITE)
+            status = zns_udevice_write(rings->dev, req.address, req.buffer,
+                                       req.size);
+        else
+            status = zns_udevice_read(rings->dev, req.address, req.buffer,
+                                      req.size);
+        pthread_mutex_lock(&rings->lock);
+        // outstanding bounds the completions, so the slot is always free
+        async_completion *cqe = &rings->cq[rings->cq_tail % rings->depth];
+        cqe->tag = req.tag;
+        cqe->status = status;
+        cqe->cb = req.cb;
+        cqe->cb_arg = req.cb_arg;
+        ++rings->cq_tail;
+        pthread_cond_broadcast(&rings->cq_cond);
+    }
+    pthread_mutex_unlock(&rings->lock);
     return NULL;
 }
 
+// The checkpoint of full log zones has to leave room for the journal
+static bool checkpoint_fits(zns_info *info)
+{
+    uint64_t size = sizeof(meta_ckpt_header) +
+                    (uint64_t)info->num_blocks *
+                    (sizeof(meta_ckpt_block) +
+                     ((info->block_num_pages + 7U) >> 3U)) +
+                    (uint64_t)(info->num_log_zones + 1) *
+                    info->zone_num_pages * sizeof(meta_ckpt_map);
+    if (size <= zns_meta_max_checkpoint(info->page_size,
+                                        info->zone_num_pages))
+        return true;
+    printf("Checkpoints of up to %lu bytes do not fit the metadata zones, "
+           "the FTL state is not persisted\n", size);
+    return false;
+}
+
+// Fuzzy checkpoint: every block is copied under its lock together with the
+// lsn of its last record, writers go on in between
+static void write_checkpoint(zns_info *info)
+{
+    zns_meta_checkpoint_begin(&info->meta);
+    meta_ckpt_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = META_CKPT_MAGIC;
+    header.num_zones = info->num_zones;
+    header.zone_num_pages = info->zone_num_pages;
+    header.page_size = info->page_size;
+    header.num_log_zones = info->num_log_zones;
+    header.num_data_zones = info->num_data_zones;
+    header.block_num_pages = info->block_num_pages;
+    zns_meta_checkpoint_write(&info->meta, &header, sizeof(header));
+    uint32_t bitmap_size = (info->block_num_pages + 7U) >> 3U;
+    // Both the log pages and the pages being merged are at most a block
+    char *buffer = (char *)malloc(sizeof(meta_ckpt_block) +
+                                  2ULL * info->block_num_pages *
+                                  sizeof(meta_ckpt_map) + bitmap_size);
+    for (uint32_t i = 0U; i < info->num_blocks; ++i) {
+        logical_block *block = &info->logical_blocks[i];
+        meta_ckpt_block *entry = (meta_ckpt_block *)buffer;
+        meta_ckpt_map *maps = (meta_ckpt_map *)(entry + 1);
+        pthread_mutex_lock(&block->lock);
+        entry->lsn = block->lsn;
+        entry->data_zone = block->data_zone ?
+                           get_zone_index(info, block->data_zone) :
+                           META_NO_ZONE;
+        entry->seq_zone = block->seq_zone ?
+                          get_zone_index(info, block->seq_zone) :
+                          META_NO_ZONE;
+        entry->data_start = block->data_start;
+        entry->data_pages = block->data_pages;
+        entry->num_maps = 0U;
+        entry->num_old_maps = 0U;
+        for (zns_extent *extent = zns_extent_map_first(&block->page_maps);
+             extent; extent = zns_extent_map_next(&block->page_maps, extent)) {
+            maps->physical_addr = extent->physical_addr;
+            maps->offset = extent->page_addr - block->s_page_addr;
+            maps->num_pages = extent->num_pages;
+            ++maps;
+            ++entry->num_maps;
+        }
+        for (zns_extent *extent = zns_extent_map_first(&block->old_page_maps);
+             extent;
+             extent = zns_extent_map_next(&block->old_page_maps, extent)) {
+            maps->physical_addr = extent->physical_addr;
+            maps->offset = extent->page_addr - block->s_page_addr;
+            maps->num_pages = extent->num_pages;
+            ++maps;
+            ++entry->num_old_maps;
+        }
+        memcpy(maps, block->bitmap, bitmap_size);
+        pthread_mutex_unlock(&block->lock);
+        zns_meta_checkpoint_write(&info->meta, buffer,
+                                  (char *)maps + bitmap_size - buffer);
+    }
+    free(buffer);
+    zns_meta_checkpoint_end(&info->meta);
+}
+
+// Checkpoints whenever the journal fills half a metadata zone
+static void *checkpointer(void *info_ptr)
+{
+    zns_info *info = (zns_info *)info_ptr;
+    while (zns_meta_wait_checkpoint(&info->meta))
+        write_checkpoint(info);
+    return NULL;
+}
+
+// Write pointers of all zones relative to their start
+static int report_write_ptrs(zns_info *info, uint32_t *write_ptrs)
+{
+    const uint32_t max_zones = 1024U;
+    uint64_t size = sizeof(nvme_zone_report) +
+                    max_zones * sizeof(nvme_zns_desc);
+    nvme_zone_report *report = (nvme_zone_report *)malloc(size);
+    int ret = 0;
+    uint32_t zone = 0U;
+    while (!ret && zone < info->num_zones) {
+        ret = nvme_zns_mgmt_recv(info->fd, info->nsid,
+                                 (unsigned long long)zone *
+                                 info->zone_num_pages,
+                                 NVME_ZNS_ZRA_REPORT_ZONES,
+                                 NVME_ZNS_ZRAS_REPORT_ALL, true, size, report);
+        if (ret)
+            break;
+        uint64_t num_zones = le64_to_cpu(report->nr_zones);
+        if (num_zones > max_zones)
+            num_zones = max_zones;
+        if (!num_zones)
+            ret = EIO;
+        for (uint32_t i = 0U; i < num_zones && zone < info->num_zones;
+             ++i, ++zone) {
+            nvme_zns_desc *desc = &report->entries[i];
+            uint8_t state = desc->zs >> 4U;
+            if (state == NVME_ZNS_ZS_EMPTY)
+                write_ptrs[zone] = 0U;
+            else if (state == NVME_ZNS_ZS_FULL)
+                write_ptrs[zone] = info->zone_num_pages;
+            else
+                write_ptrs[zone] = le64_to_cpu(desc->wp) -
+                                   le64_to_cpu(desc->zslba);
+        }
+    }
+    free(report);
+    if (ret)
+        printf("Failed to report zones, ret %d\n", ret);
+    return ret;
+}
+
+// NULL for the metadata zones and anything out of range
+static zone_info *remount_zone(zns_info *info, uint64_t index)
+{
+    if (index < info->first_zone || index >= info->num_zones)
+        return NULL;
+    return &info->zones[index];
+}
+
+static int load_checkpoint(zns_info *info, const char *ckpt,
+                           uint64_t ckpt_len)
+{
+    meta_ckpt_header header;
+    if (ckpt_len < sizeof(header))
+        return EINVAL;
+    memcpy(&header, ckpt, sizeof(header));
+    if (header.magic != META_CKPT_MAGIC ||
+        header.num_zones != info->num_zones ||
+        header.zone_num_pages != info->zone_num_pages ||
+        header.page_size != info->page_size ||
+        header.num_log_zones != info->num_log_zones ||
+        header.num_data_zones != info->num_data_zones ||
+        header.block_num_pages != info->block_num_pages) {
+        printf("The FTL metadata is for another geometry, log zones or "
+               "block size\n");
+        return EINVAL;
+    }
+    uint32_t bitmap_size = (info->block_num_pages + 7U) >> 3U;
+    uint64_t pos = sizeof(header);
+    for (uint32_t i = 0U; i < info->num_blocks; ++i) {
+        logical_block *block = &info->logical_blocks[i];
+        meta_ckpt_block entry;
+        if (ckpt_len - pos < sizeof(entry))
+            return EINVAL;
+        memcpy(&entry, ckpt + pos, sizeof(entry));
+        pos += sizeof(entry);
+        if (entry.num_maps > info->block_num_pages ||
+            entry.num_old_maps > info->block_num_pages ||
+            ckpt_len - pos < (uint64_t)(entry.num_maps + entry.num_old_maps) *
+                             sizeof(meta_ckpt_map) + bitmap_size)
+            return EINVAL;
+        block->lsn = entry.lsn;
+        block->data_zone = remount_zone(info, entry.data_zone);
+        block->data_start = entry.data_start;
+        block->data_pages = entry.data_pages;
+        block->seq_zone = remount_zone(info, entry.seq_zone);
+        for (uint32_t j = 0U; j < entry.num_maps + entry.num_old_maps; ++j) {
+            meta_ckpt_map map;
+            memcpy(&map, ckpt + pos, sizeof(map));
+            pos += sizeof(map);
+            zone_info *zone = remount_zone(info, map.physical_addr /
+                                                 info->zone_num_pages);
+            if (!zone || !map.num_pages ||
+                map.offset + map.num_pages > info->block_num_pages)
+                continue;
+            zns_extent_map_insert(j < entry.num_maps ? &block->page_maps :
+                                                       &block->old_page_maps,
+                                  block->s_page_addr + map.offset,
+                                  map.physical_addr, map.num_pages, zone,
+                                  NULL, NULL);
+        }
+        memcpy(block->bitmap, ckpt + pos, bitmap_size);
+        pos += bitmap_size;
+    }
+    return 0;
+}
+
+// Redo a record the checkpoint of its block does not cover
+static void replay_record(zns_info *info, const zns_meta_record *record)
+{
+    if (record->block >= info->num_blocks)
+        return;
+    logical_block *block = &info->logical_blocks[record->block];
+    if (record->type == META_BITMAP) {
+        if (record->arg0 < info->block_num_pages &&
+            record->arg1 <= info->block_num_pages - record->arg0)
+            zns_bitmap_set_range(block->bitmap, record->arg0, record->arg1);
+        return;
+    }
+    if (record->lsn <= block->lsn)
+        return;
+    block->lsn = record->lsn;
+    if (record->type == META_MAP) {
+        uint64_t offset = record->arg0 & 0xffffffffULL;
+        uint32_t num_pages = record->arg0 >> 32U;
+        zone_info *zone = remount_zone(info, record->arg1 /
+                                             info->zone_num_pages);
+        if (zone && num_pages && offset + num_pages <= info->block_num_pages)
+            zns_extent_map_insert(&block->page_maps,
+                                  block->s_page_addr + offset, record->arg1,
+                                  num_pages, zone, NULL, NULL);
+    } else if (record->type == META_MERGE_BEGIN) {
+        if (!zns_extent_map_empty(&block->old_page_maps))
+            fold_old_page_maps(block);
+        zns_extent_map_move(&block->old_page_maps, &block->page_maps);
+        block->seq_zone = NULL;
+    } else if (record->type == META_MERGE_END) {
+        block->data_zone = remount_zone(info, record->arg0);
+        block->data_start = record->arg1 >> 32U;
+        block->data_pages = record->arg1 & 0xffffffffULL;
+        zns_extent_map_clear(&block->old_page_maps, NULL, NULL);
+    } else if (record->type == META_SEQ) {
+        block->seq_zone = remount_zone(info, record->arg0);
+    }
+}
+
+// Put the pages of an unfinished merge back under the newer log pages
+static void fold_old_page_maps(logical_block *block)
+{
+    zns_extent_map maps;
+    zns_extent_map_move(&maps, &block->old_page_maps);
+    for (zns_extent *extent = zns_extent_map_first(&block->page_maps); extent;
+         extent = zns_extent_map_next(&block->page_maps, extent))
+        zns_extent_map_insert(&maps, extent->page_addr, extent->physical_addr,
+                              extent->num_pages, extent->zone, NULL, NULL);
+    zns_extent_map_clear(&block->page_maps, NULL, NULL);
+    block->page_maps = maps;
+}
+
+// A zone holds images of blocks, is a seq zone of one or holds log pages of
+// one, the rest is reset. Valid page counts follow from the images and the
+// page maps.
+static void finish_remount(zns_info *info, const uint32_t *write_ptrs)
+{
+    zone_info *zones = info->zones;
+    for (uint32_t i = info->first_zone; i < info->num_zones; ++i)
+        zones[i].write_ptr = write_ptrs[i];
+    for (uint32_t i = 0U; i < info->num_blocks; ++i) {
+        logical_block *block = &info->logical_blocks[i];
+        // Its new image is dropped
+        if (!zns_extent_map_empty(&block->old_page_maps))
+            fold_old_page_maps(block);
+        if (!block->data_zone)
+            continue;
+        // Written in place since the merge, the zone is the image
+        if (!info->packed)
+            block->data_pages = block->data_zone->write_ptr;
+        block->data_zone->state = ZONE_DATA;
+        block->data_zone->num_valid_pages += block->data_pages;
+        link_data_block(block);
+    }
+    for (uint32_t i = 0U; i < info->num_blocks; ++i) {
+        logical_block *block = &info->logical_blocks[i];
+        if (!block->seq_zone)
+            continue;
+        if (block->seq_zone->state == ZONE_FREE)
+            block->seq_zone->state = ZONE_SEQ;
+        else
+            block->seq_zone = NULL;
+    }
+    for (uint32_t i = 0U; i < info->num_blocks; ++i) {
+        logical_block *block = &info->logical_blocks[i];
+        for (zns_extent *extent = zns_extent_map_first(&block->page_maps);
+             extent; extent = zns_extent_map_next(&block->page_maps, extent)) {
+            zone_info *zone = (zone_info *)extent->zone;
+            if (zone->state == ZONE_FREE)
+                zone->state = ZONE_LOG;
+            zone->num_valid_pages += extent->num_pages;
+            // Only the valid pages are found again, that is all gc needs
+            if (zone->state != ZONE_LOG)
+                continue;
+            if (!zone->rmap)
+                alloc_rmap(info, zone);
+            for (uint32_t k = 0U; k < extent->num_pages; ++k)
+                zone->rmap[extent->physical_addr - zone->saddr + k] =
+                    extent->page_addr + k;
+        }
+    }
+    // The coldest stream goes on in the log zone with the most room left,
+    // the others open a zone on first use
+    zone_info *open = NULL;
+    for (uint32_t i = info->first_zone; i < info->num_zones; ++i) {
+        if (zones[i].state == ZONE_LOG &&
+            zones[i].write_ptr < info->zone_num_pages &&
+            (!open || zones[i].write_ptr < open->write_ptr))
+            open = &zones[i];
+    }
+    info->log_streams[0].zone = open;
+    if (open)
+        open->state = ZONE_OPEN;
+    for (uint32_t i = info->first_zone; i < info->num_zones; ++i) {
+        zone_info *zone = &zones[i];
+        if (zone->state == ZONE_LOG || zone->state == ZONE_SEQ) {
+            ++info->num_used_log_zones;
+            if (zone->state == ZONE_LOG)
+                add_log_zone(info, zone);
+        } else if (zone->state == ZONE_DATA && info->packed) {
+            // Merges go on packing into the ones with room left
+            ++info->num_used_data_zones;
+            if (info->zone_num_pages - zone->write_ptr >=
+                info->block_num_pages) {
+                zone->state = ZONE_PACK;
+                zone->next = info->pack_zones;
+                info->pack_zones = zone;
+            } else {
+                update_clean_candidate(info, zone);
+            }
+        } else if (zone->state == ZONE_FREE) {
+            if (zone->write_ptr) {
+                zone->write_ptr = 0U;
+                int ret = reset_zone(info, zone);
+                if (ret) {
+                    // Takes a log zone's place
+                    offline_zone(info, zone);
+                    ++info->num_used_log_zones;
+                    continue;
+                }
+            }
+            zns_ring_push(&info->free_zones, i);
+        }
+    }
+    for (uint32_t i = 0U; i < info->num_blocks; ++i) {
+        if (!zns_extent_map_empty(&info->logical_blocks[i].page_maps))
+            update_gc_candidate(info, &info->logical_blocks[i]);
+    }
+}
+
+// Back to an empty mapping after a failed remount
+static void clear_logical_blocks(zns_info *info)
+{
+    for (uint32_t i = 0U; i < info->num_blocks; ++i) {
+        logical_block *block = &info->logical_blocks[i];
+        zns_extent_map_clear(&block->page_maps, NULL, NULL);
+        zns_extent_map_clear(&block->old_page_maps, NULL, NULL);
+        block->data_zone = NULL;
+        block->data_start = 0U;
+        block->data_pages = 0U;
+        block->seq_zone = NULL;
+        block->lsn = 0ULL;
+        memset(block->bitmap, 0, info->bitmap_words * sizeof(uint64_t));
+    }
+}
+
+// Load the newest checkpoint and replay the journal past it
+static int remount(zns_info *info)
+{
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t *write_ptrs = (uint32_t *)calloc(info->num_zones,
+                                              sizeof(uint32_t));
+    char *ckpt = NULL;
+    uint64_t ckpt_len = 0ULL;
+    zns_meta_record *records = NULL;
+    uint64_t num_records = 0ULL;
+    int ret = report_write_ptrs(info, write_ptrs);
+    if (!ret)
+        ret = zns_meta_load(&info->meta, write_ptrs, &ckpt, &ckpt_len,
+                            &records, &num_records);
+    if (!ret)
+        ret = load_checkpoint(info, ckpt, ckpt_len);
+    if (!ret) {
+        for (uint64_t i = 0ULL; i < num_records; ++i)
+            replay_record(info, &records[i]);
+        finish_remount(info, write_ptrs);
+        timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        info->remount_us = (end.tv_sec - start.tv_sec) * 1000000ULL +
+                           (end.tv_nsec - start.tv_nsec) / 1000L;
+        info->replayed_records = num_records;
+        printf("Remounted with %lu journal records replayed in %lu us\n",
+               info->replayed_records, info->remount_us);
+    } else {
+        clear_logical_blocks(info);
+    }
+    free(records);
+    free(ckpt);
+    free(write_ptrs);
+    return ret;
+}
+
 }
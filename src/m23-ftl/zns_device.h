@@ -52,17 +52,222 @@ struct user_zns_device {
     void *_private; //Points to zns_info
 };
 
+// How device commands are issued, see zns_io_engine.h
+enum zns_io_engine_type {
+    ZNS_IO_ENGINE_AUTO = 0, // io_uring passthrough if available, else sync
+    ZNS_IO_ENGINE_SYNC,     // blocking libnvme ioctls, one command in flight
+    ZNS_IO_ENGINE_URING     // IORING_OP_URING_CMD on the NVMe char device
+};
+
+#define ZNS_IO_DEFAULT_DEPTH 64U
+
+// Traffic classes of the bandwidth scheduler, see zns_sched.h
+enum zns_io_class {
+    ZNS_CLASS_USER_READ = 0,
+    ZNS_CLASS_USER_WRITE,
+    ZNS_CLASS_GC_READ,
+    ZNS_CLASS_GC_WRITE,
+    ZNS_NUM_CLASSES
+};
+
+// Default share of the device transfer budget per class, in the order above
+#define ZNS_SCHED_DEFAULT_WEIGHTS {2U, 2U, 1U, 1U}
+
+// How gc picks the logical block to merge next, see zns_gc_index.h
+enum zns_gc_policy {
+    ZNS_GC_DEFAULT = 0,    // oldest log zone
+    ZNS_GC_GREEDY,         // fewest pages copied that are not overwritten
+    ZNS_GC_COST_BENEFIT,   // age since last write x invalid ratio
+    ZNS_GC_OLDEST_LOG_ZONE // the block pinning the oldest log zone
+};
+
+// How logical pages are mapped to zones
+enum zns_ftl_mode {
+    ZNS_FTL_HYBRID = 0, // a data zone image per logical block plus log zones
+    ZNS_FTL_PAGE        // every page mapped, every zone a log zone
+};
+
 struct zdev_init_params {
     char *name;
     int log_zones;
     int gc_wmark;
+    // reset all zones, else remount from the metadata zones and only reset
+    // if they hold no checkpoint. Init fails without resetting anything if
+    // the state cannot be loaded or is not persisted on this device.
     bool force_reset;
+    int io_engine; // zns_io_engine_type
+    uint32_t io_depth; // commands in flight per thread, 0 = default
+    uint32_t async_depth; // outstanding zns_udevice_submit requests, 0 = default
+    uint32_t async_workers; // threads serving submitted requests, 0 = default
+    uint32_t class_weights[ZNS_NUM_CLASSES]; // per zns_io_class, all 0 = default
+    int gc_policy; // zns_gc_policy
+    uint32_t gc_workers; // threads merging logical blocks, 0 = default
+    bool gc_host_copy; // never offload merges to NVMe Simple Copy
+    // open log zones, coldest first, log writes go to the one matching the
+    // update frequency of their block. At most ZNS_MAX_LOG_STREAMS and
+    // log_zones - gc_wmark. 0 = one per 3 log zones above the watermark, at
+    // most ZNS_LOG_DEFAULT_STREAMS.
+    uint32_t log_streams;
+    // zns_ftl_mode. ZNS_FTL_PAGE keeps the same capacity, uses the log zones
+    // as over provisioning and always resets the device. Of the gc settings
+    // only gc_wmark applies.
+    int ftl_mode;
+    // DRAM write-back buffer: writes below the zone append size limit are
+    // buffered and flushed in batches, reads see them. 0 = off, else its
+    // memory in bytes. Buffered writes are only durable after
+    // zns_udevice_flush or deinit.
+    uint32_t wbuf_bytes;
+    uint32_t wbuf_flush_ms; // flush writes buffered this long, 0 = default
+    // Read cache of logical pages, sharded, evicting with S3-FIFO so scans
+    // do not flush the pages read again and again. 0 = off, else its
+    // memory in bytes.
+    uint64_t rcache_bytes;
+    // Logical block size in bytes, the unit a merge rewrites. 0 = the zone
+    // size. Smaller blocks must divide the zone size, their images are
+    // packed into shared data zones and merges cost the block instead of
+    // the zone. Blocks then have no seq zones and are not written in
+    // place, and one more zone is kept back to relocate them.
+    uint32_t block_bytes;
+    // Namespaces striped into one device, name is not used with two or
+    // more. Each runs its own FTL with the settings above and must be
+    // given in the same order at every init to remount. The capacity is
+    // the smallest one times num_names.
+    char **names;
+    uint32_t num_names;
+    // Bytes of one namespace before the stripe moves on to the next, a
+    // multiple of the LBA size. 0 = ZNS_STRIPE_DEFAULT_BYTES.
+    uint32_t stripe_bytes;
+};
+
+#define ZNS_GC_DEFAULT_WORKERS 2U
+
+#define ZNS_MAX_LOG_STREAMS 4U
+#define ZNS_LOG_DEFAULT_STREAMS 2U
+
+#define ZNS_WBUF_DEFAULT_FLUSH_MS 100U
+
+#define ZNS_ASYNC_DEFAULT_DEPTH 256U
+#define ZNS_ASYNC_DEFAULT_WORKERS 4U
+
+#define ZNS_STRIPE_DEFAULT_BYTES (256U * 1024U)
+
+enum zns_udevice_opcode {
+    ZNS_UDEVICE_READ = 0,
+    ZNS_UDEVICE_WRITE
+};
+
+typedef void (*zns_udevice_cb)(struct user_zns_device *my_dev, uint64_t tag,
+                               int status, void *cb_arg);
+
+/* a request for zns_udevice_submit, buffer must stay valid until it completes */
+struct zns_udevice_request {
+    uint8_t opcode; // zns_udevice_opcode
+    uint64_t address;
+    void *buffer;
+    uint32_t size;
+    uint64_t tag; // returned as is in the completion
+    zns_udevice_cb cb; // optional, called from zns_udevice_poll
+    void *cb_arg;
+};
+
+struct zns_udevice_completion {
+    uint64_t tag;
+    int status; // same as the return value of zns_udevice_read/write
+};
+
+/* counters since init, take two snapshots and diff them for a time window */
+struct zns_udevice_stats {
+    uint64_t uptime_us;
+    // bandwidth scheduler, indexed by zns_io_class
+    uint64_t class_bytes[ZNS_NUM_CLASSES]; // bytes moved
+    uint64_t class_waits[ZNS_NUM_CLASSES]; // grants that had to sleep
+    uint64_t class_borrowed[ZNS_NUM_CLASSES]; // bytes taken from idle classes
+    double class_mbps[ZNS_NUM_CLASSES]; // achieved bandwidth over uptime
+    // garbage collection, with ZNS_FTL_PAGE a merge is a collected zone and
+    // the merged log pages are the pages it moved
+    uint64_t gc_merges;
+    uint64_t gc_log_pages_merged; // log pages invalidated by merges
+    uint64_t gc_switch_merges; // in order log zone became the data zone
+    uint64_t gc_partial_merges; // same, after copying the data zone tail
+    // log zones reclaimed by moving their valid pages to an open log zone,
+    // when that copies less than merging
+    uint64_t gc_compactions;
+    uint64_t gc_compacted_pages;
+    // with blocks smaller than a zone: data zones freed by relocating the
+    // block images left in them, and the blocks relocated
+    uint64_t gc_data_cleanings;
+    uint64_t gc_relocations;
+    // pages of data zones skipped because nobody wrote them, with Write
+    // Zeroes or by appending zeros if the device does not have it. They
+    // read as zeros like every page never written.
+    uint64_t hole_pages_zeroed;
+    uint64_t hole_pages_written;
+    uint64_t gc_host_bytes; // merged through host memory
+    uint64_t gc_host_cpu_us;
+    uint64_t gc_copy_bytes; // merged on the device with Simple Copy
+    uint64_t gc_copy_cpu_us;
+    uint64_t gc_pcie_bytes_saved; // reads and writes that stayed on the device
+    // gc_copy_bytes at the host path cost per byte minus gc_copy_cpu_us, 0
+    // until the host path has been measured
+    uint64_t gc_cpu_saved_us;
+    // per log stream: user writes and merge writes of the blocks last
+    // written to it, the write amplification of the stream is their ratio
+    uint32_t log_streams;
+    uint64_t log_stream_bytes[ZNS_MAX_LOG_STREAMS];
+    uint64_t log_stream_gc_bytes[ZNS_MAX_LOG_STREAMS];
+    // metadata persistence, remount_us is 0 if init did not remount
+    uint64_t meta_remount_us; // loading the checkpoint and the journal
+    uint64_t meta_replayed_records; // journal records past the checkpoint
+    uint64_t meta_checkpoints;
+    uint64_t meta_checkpoint_bytes;
+    uint64_t meta_journal_bytes;
+    // slab allocator of FTL nodes: allocations served by the calling
+    // thread's cache, allocations that had to refill it, and slab memory
+    uint64_t alloc_cache_hits;
+    uint64_t alloc_cache_misses;
+    uint64_t alloc_slab_bytes;
+    // mapping state sized at init: logical blocks or the page map, written
+    // page bitmaps or the reverse map, and the zone table
+    uint64_t mem_map_bytes;
+    uint64_t mem_bitmap_bytes;
+    uint64_t mem_zone_bytes;
+    // reads planned again because a zone they read was reset under them
+    uint64_t read_retries;
+    // write-back buffer: pages written into it, of those the ones that were
+    // still buffered, pages read from it, and what the flushes wrote out
+    uint64_t wbuf_pages;
+    uint64_t wbuf_overwrites;
+    uint64_t wbuf_read_hits;
+    uint64_t wbuf_flushes;
+    uint64_t wbuf_flushed_pages;
+    // read cache: pages served from it and pages looked up but not cached,
+    // their ratio is the hit ratio, then pages evicted and pages dropped
+    // because they were written
+    uint64_t rcache_hits;
+    uint64_t rcache_misses;
+    uint64_t rcache_evictions;
+    uint64_t rcache_invalidations;
 };
 
 int init_ss_zns_device(struct zdev_init_params *params, struct user_zns_device **my_dev);
+/* pages never written read as zeros */
 int zns_udevice_read(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size);
 int zns_udevice_write(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size);
 int deinit_ss_zns_device(struct user_zns_device *my_dev);
+/* writes out the write-back buffer, 0 right away if there is none */
+int zns_udevice_flush(struct user_zns_device *my_dev);
+/* non-blocking interface: submit returns how many requests were queued (fewer
+ * than num_reqs when the submission ring is full), poll reaps completions in a
+ * batch, waiting until at least min_complete are available. Poll every request
+ * before deinit_ss_zns_device, which finishes the submitted ones and reports
+ * completions left unpolled, running their callbacks without queueing more */
+int zns_udevice_submit(struct user_zns_device *my_dev,
+                       struct zns_udevice_request *reqs, uint32_t num_reqs);
+int zns_udevice_poll(struct user_zns_device *my_dev,
+                     struct zns_udevice_completion *cqes, uint32_t max_cqes,
+                     uint32_t min_complete);
+int zns_udevice_get_stats(struct user_zns_device *my_dev,
+                          struct zns_udevice_stats *stats);
 
 };
 
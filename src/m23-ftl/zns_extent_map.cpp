@@ -0,0 +1,334 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include "zns_extent_map.h"
+
+extern "C" {
+
+static inline int height(const zns_extent *node);
+static void update_height(zns_extent *node);
+static zns_extent *rotate_left(zns_extent *node);
+static zns_extent *rotate_right(zns_extent *node);
+static zns_extent *balance(zns_extent *node);
+static zns_extent *insert_node(zns_extent *root, zns_extent *node);
+static zns_extent *remove_min(zns_extent *root, zns_extent **min);
+static zns_extent *remove_node(zns_extent *root, unsigned long long key);
+static zns_extent *floor_extent(zns_extent *root, unsigned long long key);
+static zns_extent *ceil_extent(zns_extent *root, unsigned long long key);
+static zns_extent *new_extent(zns_extent_map *map,
+                              unsigned long long page_addr,
+                              unsigned long long physical_addr,
+                              uint32_t num_pages, void *zone);
+static void free_extent(zns_extent_map *map, zns_extent *extent);
+static void free_extents(zns_extent_map *map, zns_extent *root,
+                         zns_extent_release_fn release, void *arg);
+
+void zns_extent_map_init(zns_extent_map *map, zns_slab *slab)
+{
+    map->slab = slab;
+    map->root = NULL;
+    map->num_pages = 0ULL;
+    map->num_extents = 0U;
+}
+
+void zns_extent_map_move(zns_extent_map *to, zns_extent_map *from)
+{
+    *to = *from;
+    zns_extent_map_init(from, from->slab);
+}
+
+void zns_extent_map_insert(zns_extent_map *map, unsigned long long page_addr,
+                           unsigned long long physical_addr,
+                           uint32_t num_pages, void *zone,
+                           zns_extent_release_fn release, void *arg)
+{
+    unsigned long long end = page_addr + num_pages;
+    // An extent from before the range keeps its head, and its tail if it
+    // reaches past the range
+    zns_extent *prev = floor_extent(map->root, page_addr);
+    if (prev && prev->page_addr < page_addr &&
+        prev->page_addr + prev->num_pages > page_addr) {
+        unsigned long long prev_end = prev->page_addr + prev->num_pages;
+        uint32_t cut = (prev_end > end ? end : prev_end) - page_addr;
+        if (prev_end > end) {
+            map->root = insert_node(map->root,
+                                    new_extent(map, end,
+                                               prev->physical_addr +
+                                                    (end - prev->page_addr),
+                                               prev_end - end, prev->zone));
+            ++map->num_extents;
+        }
+        prev->num_pages = page_addr - prev->page_addr;
+        map->num_pages -= cut;
+        if (release)
+            release(prev->zone, cut, arg);
+    }
+    // Extents starting in the range go, or lose their head
+    for (;;) {
+        zns_extent *next = ceil_extent(map->root, page_addr);
+        if (!next || next->page_addr >= end)
+            break;
+        if (next->page_addr + next->num_pages <= end) {
+            map->root = remove_node(map->root, next->page_addr);
+            --map->num_extents;
+            map->num_pages -= next->num_pages;
+            if (release)
+                release(next->zone, next->num_pages, arg);
+            free_extent(map, next);
+            continue;
+        }
+        // Its new start stays between the same neighbours
+        uint32_t cut = end - next->page_addr;
+        next->page_addr = end;
+        next->physical_addr += cut;
+        next->num_pages -= cut;
+        map->num_pages -= cut;
+        if (release)
+            release(next->zone, cut, arg);
+        break;
+    }
+    map->num_pages += num_pages;
+    prev = floor_extent(map->root, page_addr);
+    zns_extent *next = ceil_extent(map->root, page_addr);
+    bool join_prev = prev && prev->zone == zone &&
+                     prev->page_addr + prev->num_pages == page_addr &&
+                     prev->physical_addr + prev->num_pages == physical_addr;
+    bool join_next = next && next->zone == zone && next->page_addr == end &&
+                     next->physical_addr == physical_addr + num_pages;
+    if (join_prev) {
+        prev->num_pages += num_pages;
+        if (join_next) {
+            prev->num_pages += next->num_pages;
+            map->root = remove_node(map->root, next->page_addr);
+            --map->num_extents;
+            free_extent(map, next);
+        }
+    } else if (join_next) {
+        next->page_addr = page_addr;
+        next->physical_addr = physical_addr;
+        next->num_pages += num_pages;
+    } else {
+        map->root = insert_node(map->root, new_extent(map, page_addr,
+                                                      physical_addr,
+                                                      num_pages, zone));
+        ++map->num_extents;
+    }
+}
+
+zns_extent *zns_extent_map_find(const zns_extent_map *map,
+                                unsigned long long page_addr)
+{
+    zns_extent *extent = floor_extent(map->root, page_addr);
+    if (extent && extent->page_addr + extent->num_pages > page_addr)
+        return extent;
+    return ceil_extent(map->root, page_addr);
+}
+
+zns_extent *zns_extent_map_next(const zns_extent_map *map,
+                                const zns_extent *extent)
+{
+    return ceil_extent(map->root, extent->page_addr + extent->num_pages);
+}
+
+zns_extent *zns_extent_map_first(const zns_extent_map *map)
+{
+    zns_extent *node = map->root;
+    while (node && node->left)
+        node = node->left;
+    return node;
+}
+
+zns_extent *zns_extent_map_last(const zns_extent_map *map)
+{
+    zns_extent *node = map->root;
+    while (node && node->right)
+        node = node->right;
+    return node;
+}
+
+void zns_extent_map_clear(zns_extent_map *map, zns_extent_release_fn release,
+                          void *arg)
+{
+    free_extents(map, map->root, release, arg);
+    zns_extent_map_init(map, map->slab);
+}
+
+static inline int height(const zns_extent *node)
+{
+    return node ? node->height : 0;
+}
+
+static void update_height(zns_extent *node)
+{
+    int left = height(node->left);
+    int right = height(node->right);
+    node->height = (left > right ? left : right) + 1;
+}
+
+static zns_extent *rotate_left(zns_extent *node)
+{
+    zns_extent *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    update_height(node);
+    update_height(right);
+    return right;
+}
+
+static zns_extent *rotate_right(zns_extent *node)
+{
+    zns_extent *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    update_height(node);
+    update_height(left);
+    return left;
+}
+
+static zns_extent *balance(zns_extent *node)
+{
+    update_height(node);
+    int diff = height(node->left) - height(node->right);
+    if (diff > 1) {
+        if (height(node->left->left) < height(node->left->right))
+            node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+    if (diff < -1) {
+        if (height(node->right->right) < height(node->right->left))
+            node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static zns_extent *insert_node(zns_extent *root, zns_extent *node)
+{
+    if (!root)
+        return node;
+    if (node->page_addr < root->page_addr)
+        root->left = insert_node(root->left, node);
+    else
+        root->right = insert_node(root->right, node);
+    return balance(root);
+}
+
+static zns_extent *remove_min(zns_extent *root, zns_extent **min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = remove_min(root->left, min);
+    return balance(root);
+}
+
+// Unlinks the node with key, the node itself is left to the caller
+static zns_extent *remove_node(zns_extent *root, unsigned long long key)
+{
+    if (!root)
+        return NULL;
+    if (key < root->page_addr) {
+        root->left = remove_node(root->left, key);
+    } else if (key > root->page_addr) {
+        root->right = remove_node(root->right, key);
+    } else {
+        if (!root->left || !root->right)
+            return root->left ? root->left : root->right;
+        zns_extent *min;
+        zns_extent *right = remove_min(root->right, &min);
+        min->left = root->left;
+        min->right = right;
+        return balance(min);
+    }
+    return balance(root);
+}
+
+// Last extent starting at or before key
+static zns_extent *floor_extent(zns_extent *root, unsigned long long key)
+{
+    zns_extent *found = NULL;
+    while (root) {
+        if (root->page_addr <= key) {
+            found = root;
+            root = root->right;
+        } else {
+            root = root->left;
+        }
+    }
+    return found;
+}
+
+// First extent starting at or after key
+static zns_extent *ceil_extent(zns_extent *root, unsigned long long key)
+{
+    zns_extent *found = NULL;
+    while (root) {
+        if (root->page_addr >= key) {
+            found = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+    return found;
+}
+
+static zns_extent *new_extent(zns_extent_map *map,
+                              unsigned long long page_addr,
+                              unsigned long long physical_addr,
+                              uint32_t num_pages, void *zone)
+{
+    zns_extent *extent = map->slab ?
+                         (zns_extent *)zns_slab_alloc(map->slab) :
+                         (zns_extent *)calloc(1UL, sizeof(zns_extent));
+    extent->page_addr = page_addr;
+    extent->physical_addr = physical_addr;
+    extent->num_pages = num_pages;
+    extent->zone = zone;
+    extent->height = 1;
+    return extent;
+}
+
+static void free_extent(zns_extent_map *map, zns_extent *extent)
+{
+    if (map->slab)
+        zns_slab_free(map->slab, extent);
+    else
+        free(extent);
+}
+
+static void free_extents(zns_extent_map *map, zns_extent *root,
+                         zns_extent_release_fn release, void *arg)
+{
+    if (!root)
+        return;
+    free_extents(map, root->left, release, arg);
+    free_extents(map, root->right, release, arg);
+    if (release)
+        release(root->zone, root->num_pages, arg);
+    free_extent(map, root);
+}
+
+}
@@ -0,0 +1,84 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_EXTENT_MAP_H
+#define STOSYS_PROJECT_ZNS_EXTENT_MAP_H
+
+#include <cstdint>
+#include "zns_slab.h"
+
+extern "C" {
+
+// Map of logical page ranges to physical ranges, one node per extent in an
+// AVL tree keyed by the first logical page. Extents never overlap: an insert
+// trims or splits what it covers, and joins its neighbours if they continue
+// in the same zone. Lookups are O(log n), a write of any size is one insert.
+
+struct zns_extent {
+    unsigned long long page_addr; // first logical page
+    unsigned long long physical_addr;
+    uint32_t num_pages;
+    void *zone; // opaque, extents only join within one zone
+    zns_extent *left;
+    zns_extent *right;
+    int height;
+};
+
+struct zns_extent_map {
+    zns_slab *slab; // of the nodes, the heap if NULL
+    zns_extent *root;
+    uint64_t num_pages; // mapped pages
+    uint32_t num_extents;
+};
+
+// Gets the pages of zone an insert mapped elsewhere or a clear dropped
+typedef void (*zns_extent_release_fn)(void *zone, uint32_t num_pages,
+                                      void *arg);
+
+void zns_extent_map_init(zns_extent_map *map, zns_slab *slab);
+// to takes the extents of from, from is left empty with its slab
+void zns_extent_map_move(zns_extent_map *to, zns_extent_map *from);
+// Map [page_addr, page_addr + num_pages) to physical_addr onwards in zone,
+// release may be NULL
+void zns_extent_map_insert(zns_extent_map *map, unsigned long long page_addr,
+                           unsigned long long physical_addr,
+                           uint32_t num_pages, void *zone,
+                           zns_extent_release_fn release, void *arg);
+// The extent holding page_addr, else the first one after it, NULL if none
+zns_extent *zns_extent_map_find(const zns_extent_map *map,
+                                unsigned long long page_addr);
+zns_extent *zns_extent_map_next(const zns_extent_map *map,
+                                const zns_extent *extent);
+zns_extent *zns_extent_map_first(const zns_extent_map *map);
+zns_extent *zns_extent_map_last(const zns_extent_map *map);
+// Drops all extents, release may be NULL
+void zns_extent_map_clear(zns_extent_map *map, zns_extent_release_fn release,
+                          void *arg);
+
+static inline bool zns_extent_map_empty(const zns_extent_map *map)
+{
+    return !map->root;
+}
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_EXTENT_MAP_H
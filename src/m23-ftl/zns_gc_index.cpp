@@ -0,0 +1,165 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+#include "zns_device.h"
+#include "zns_gc_index.h"
+
+extern "C" {
+
+static void unlink_candidate(gc_index *index, gc_candidate *cand);
+static void link_candidate(gc_index *index, gc_candidate *cand,
+                           uint32_t bucket);
+
+void gc_index_init(gc_index *index, int policy)
+{
+    memset(index, 0, sizeof(gc_index));
+    index->policy = policy == ZNS_GC_DEFAULT ? ZNS_GC_OLDEST_LOG_ZONE : policy;
+    index->num_buckets = index->policy == ZNS_GC_OLDEST_LOG_ZONE ?
+                         1U : GC_INDEX_NUM_BUCKETS;
+    pthread_mutex_init(&index->lock, NULL);
+}
+
+void gc_index_destroy(gc_index *index)
+{
+    pthread_mutex_destroy(&index->lock);
+}
+
+void gc_index_update(gc_index *index, gc_candidate *cand, uint32_t log_pages,
+                     uint32_t cost)
+{
+    uint32_t bucket = 0U;
+    if (index->num_buckets > 1U && cost > log_pages)
+        bucket = (uint64_t)(cost - log_pages) * index->num_buckets / cost;
+    if (bucket >= index->num_buckets)
+        bucket = index->num_buckets - 1U;
+    pthread_mutex_lock(&index->lock);
+    ++index->clock;
+    if (cand->linked && index->policy == ZNS_GC_OLDEST_LOG_ZONE) {
+        // Keeps its place, it is ordered by its oldest log page
+        pthread_mutex_unlock(&index->lock);
+        return;
+    }
+    if (cand->linked)
+        unlink_candidate(index, cand);
+    cand->stamp = index->clock;
+    link_candidate(index, cand, bucket);
+    pthread_mutex_unlock(&index->lock);
+}
+
+void gc_index_remove(gc_index *index, gc_candidate *cand)
+{
+    pthread_mutex_lock(&index->lock);
+    if (cand->linked)
+        unlink_candidate(index, cand);
+    pthread_mutex_unlock(&index->lock);
+}
+
+gc_candidate *gc_index_pick(gc_index *index)
+{
+    gc_candidate *best = NULL;
+    pthread_mutex_lock(&index->lock);
+    if (!index->nonempty) {
+        pthread_mutex_unlock(&index->lock);
+        return NULL;
+    }
+    if (index->policy != ZNS_GC_COST_BENEFIT) {
+        best = index->buckets[__builtin_ctzll(index->nonempty)].head;
+    } else {
+        double best_score = -1.0;
+        for (uint64_t bits = index->nonempty; bits; bits &= bits - 1ULL) {
+            uint32_t i = __builtin_ctzll(bits);
+            gc_candidate *head = index->buckets[i].head;
+            // u at the middle of the bucket
+            double u = (i + 0.5) / index->num_buckets;
+            double score = (1.0 - u) / (1.0 + u) *
+                           (double)(index->clock - head->stamp + 1ULL);
+            if (score > best_score) {
+                best_score = score;
+                best = head;
+            }
+        }
+    }
+    unlink_candidate(index, best);
+    pthread_mutex_unlock(&index->lock);
+    return best;
+}
+
+void gc_index_unpick(gc_index *index, gc_candidate *cand)
+{
+    pthread_mutex_lock(&index->lock);
+    if (!cand->linked) {
+        // Head of its bucket, with the stamp it had
+        gc_bucket *bucket = &index->buckets[cand->bucket];
+        cand->prev = NULL;
+        cand->next = bucket->head;
+        if (bucket->head)
+            bucket->head->prev = cand;
+        else
+            bucket->tail = cand;
+        bucket->head = cand;
+        index->nonempty |= 1ULL << cand->bucket;
+        cand->linked = true;
+        ++index->num_candidates;
+    }
+    pthread_mutex_unlock(&index->lock);
+}
+
+static void unlink_candidate(gc_index *index, gc_candidate *cand)
+{
+    gc_bucket *bucket = &index->buckets[cand->bucket];
+    if (cand->prev)
+        cand->prev->next = cand->next;
+    else
+        bucket->head = cand->next;
+    if (cand->next)
+        cand->next->prev = cand->prev;
+    else
+        bucket->tail = cand->prev;
+    if (!bucket->head)
+        index->nonempty &= ~(1ULL << cand->bucket);
+    cand->prev = NULL;
+    cand->next = NULL;
+    cand->linked = false;
+    --index->num_candidates;
+}
+
+static void link_candidate(gc_index *index, gc_candidate *cand,
+                           uint32_t bucket)
+{
+    gc_bucket *b = &index->buckets[bucket];
+    cand->bucket = bucket;
+    cand->prev = b->tail;
+    cand->next = NULL;
+    if (b->tail)
+        b->tail->next = cand;
+    else
+        b->head = cand;
+    b->tail = cand;
+    index->nonempty |= 1ULL << bucket;
+    cand->linked = true;
+    ++index->num_candidates;
+}
+
+}
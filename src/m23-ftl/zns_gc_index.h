@@ -0,0 +1,82 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_GC_INDEX_H
+#define STOSYS_PROJECT_ZNS_GC_INDEX_H
+
+#include <cstdint>
+#include <pthread.h>
+
+extern "C" {
+
+// Live index of gc candidates, so picking a victim never scans all logical
+// blocks. Candidates sit in buckets by utilization u, the part of a merge
+// spent copying pages that are not overwritten in the log. Each bucket is a
+// list with the least recently written candidate at the head.
+//
+// greedy: head of the lowest non empty bucket, O(1) with the bucket bitmap
+// cost benefit: best (1 - u) / (1 + u) * age over the bucket heads, O(buckets)
+// oldest log zone: one list in order of the first log write, its head pins
+//                  the oldest used log zone
+
+#define GC_INDEX_NUM_BUCKETS 64U
+
+// Embedded in whatever is collected, see container_of
+struct gc_candidate {
+    gc_candidate *prev;
+    gc_candidate *next;
+    uint32_t bucket;
+    bool linked;
+    uint64_t stamp; // index clock of the last (or first) update
+};
+
+struct gc_bucket {
+    gc_candidate *head;
+    gc_candidate *tail;
+};
+
+struct gc_index {
+    int policy; // zns_gc_policy
+    uint32_t num_buckets;
+    uint64_t nonempty; // bit i is set if bucket i has candidates
+    gc_bucket buckets[GC_INDEX_NUM_BUCKETS];
+    uint64_t clock; // ticks once per update
+    uint32_t num_candidates;
+    pthread_mutex_t lock;
+};
+
+void gc_index_init(gc_index *index, int policy);
+void gc_index_destroy(gc_index *index);
+// A merge would copy cost pages, log_pages of them come from the log
+void gc_index_update(gc_index *index, gc_candidate *cand, uint32_t log_pages,
+                     uint32_t cost);
+void gc_index_remove(gc_index *index, gc_candidate *cand);
+// Best candidate under the policy, NULL if empty. It is taken out of the
+// index, so concurrent gc workers never pick the same one.
+gc_candidate *gc_index_pick(gc_index *index);
+// Undoes a pick, the candidate gets its place back unless it was updated
+// since
+void gc_index_unpick(gc_index *index, gc_candidate *cand);
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_GC_INDEX_H
@@ -0,0 +1,471 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <libnvme.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "zns_device.h"
+#include "zns_io_engine.h"
+
+extern "C" {
+
+// Upper bound of rings handed out to concurrent submitters
+#define ZNS_URING_MAX_QUEUES 64U
+
+// struct nvme_uring_cmd from <linux/nvme_ioctl.h>, which clashes with the
+// definitions in libnvme, so the ABI is replicated here
+struct zns_uring_cmd {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t rsvd1;
+    uint32_t nsid;
+    uint32_t cdw2;
+    uint32_t cdw3;
+    uint64_t metadata;
+    uint64_t addr;
+    uint32_t metadata_len;
+    uint32_t data_len;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+    uint32_t timeout_ms;
+    uint32_t rsvd2;
+};
+
+#define ZNS_URING_CMD_IO _IOWR('N', 0x80, struct zns_uring_cmd)
+
+// One io_uring instance, used by a single submitter at a time
+struct uring_queue {
+    int ring_fd;
+    uint32_t entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    char *sqes; // 128 byte entries (IORING_SETUP_SQE128)
+    char *cqes; // 32 byte entries (IORING_SETUP_CQE32)
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    uring_queue *next; // linked in idle_queues
+};
+
+struct uring_engine {
+    int char_fd; // NVMe generic char device (/dev/ngXnY)
+    pthread_mutex_t queues_lock;
+    pthread_cond_t queues_cond;
+    uring_queue *idle_queues;
+    uint32_t num_queues;
+};
+
+static int sync_submit(zns_io_engine *engine, zns_io_req *reqs,
+                       uint32_t num_reqs);
+static void sync_destroy(zns_io_engine *engine);
+static int uring_submit(zns_io_engine *engine, zns_io_req *reqs,
+                        uint32_t num_reqs);
+static void uring_destroy(zns_io_engine *engine);
+static uint32_t uring_reap(uring_queue *queue, zns_io_req *reqs, int *err);
+static int uring_engine_init(zns_io_engine *engine, const char *dev_name);
+static uring_queue *uring_queue_create(uint32_t entries);
+static void uring_queue_destroy(uring_queue *queue);
+
+static const zns_io_engine_ops sync_ops = {
+    "sync", &sync_submit, &sync_destroy
+};
+
+static const zns_io_engine_ops uring_ops = {
+    "io_uring", &uring_submit, &uring_destroy
+};
+
+zns_io_engine *zns_io_engine_create(const char *dev_name, int fd, unsigned nsid,
+                                    uint32_t page_size, int type,
+                                    uint32_t depth)
+{
+    zns_io_engine *engine = (zns_io_engine *)calloc(1UL, sizeof(zns_io_engine));
+    engine->fd = fd;
+    engine->nsid = nsid;
+    engine->page_size = page_size;
+    engine->depth = depth ? depth : ZNS_IO_DEFAULT_DEPTH;
+    engine->ops = &sync_ops;
+    if (type != ZNS_IO_ENGINE_SYNC) {
+        int ret = uring_engine_init(engine, dev_name);
+        if (!ret) {
+            engine->ops = &uring_ops;
+        } else if (type == ZNS_IO_ENGINE_URING) {
+            printf("Failed to set up io_uring passthrough on %s %d, "
+                   "using sync engine\n", dev_name, ret);
+        }
+    }
+    if (engine->ops == &sync_ops)
+        engine->depth = 1U;
+    return engine;
+}
+
+int zns_io_engine_submit(zns_io_engine *engine, zns_io_req *reqs,
+                         uint32_t num_reqs)
+{
+    if (!num_reqs)
+        return 0;
+    return engine->ops->submit(engine, reqs, num_reqs);
+}
+
+void zns_io_engine_destroy(zns_io_engine *engine)
+{
+    engine->ops->destroy(engine);
+    free(engine);
+}
+
+static int sync_submit(zns_io_engine *engine, zns_io_req *reqs,
+                       uint32_t num_reqs)
+{
+    int err = 0;
+    for (uint32_t i = 0U; i < num_reqs; ++i) {
+        zns_io_req *req = &reqs[i];
+        uint32_t size = req->num_pages * engine->page_size;
+        int ret = 0;
+        errno = 0;
+        switch (req->opcode) {
+        case ZNS_IO_READ:
+            ret = nvme_read(engine->fd, engine->nsid, req->slba,
+                            req->num_pages - 1, 0U, 0U, 0U, 0U, 0U,
+                            size, req->buffer, 0U, NULL);
+            break;
+        case ZNS_IO_APPEND:
+            ret = nvme_zns_append(engine->fd, engine->nsid, req->slba,
+                                  req->num_pages - 1, 0U, 0U, 0U, 0U,
+                                  size, req->buffer, 0U, NULL, &req->result);
+            break;
+        case ZNS_IO_RESET:
+            ret = nvme_zns_mgmt_send(engine->fd, engine->nsid, req->slba,
+                                     false, NVME_ZNS_ZSA_RESET, 0U, NULL);
+            break;
+        case ZNS_IO_WRITE_ZEROES:
+            ret = nvme_write_zeros(engine->fd, engine->nsid, req->slba,
+                                   req->num_pages - 1, 0U, 0U, 0U, 0U);
+            break;
+        case ZNS_IO_COPY:
+            // nvme_copy is declared by libnvme but not exported
+            ret = nvme_io_passthru(engine->fd, nvme_cmd_copy, 0U, 0U,
+                                   engine->nsid, 0U, 0U,
+                                   req->slba & 0xffffffffULL, req->slba >> 32U,
+                                   (req->num_ranges - 1U) & 0xffU, 0U, 0U, 0U,
+                                   req->num_ranges * sizeof(nvme_copy_range),
+                                   req->buffer, 0U, NULL, 0U, NULL);
+            break;
+        default:
+            ret = -1;
+            errno = EINVAL;
+        }
+        req->status = errno ? errno : (ret ? EIO : 0);
+        if (req->status && !err)
+            err = req->status;
+    }
+    return err;
+}
+
+static void sync_destroy(zns_io_engine *engine)
+{
+    (void)engine;
+}
+
+static int uring_engine_init(zns_io_engine *engine, const char *dev_name)
+{
+    // nvmeXnY -> /dev/ngXnY
+    const char *base = strrchr(dev_name, '/');
+    base = base ? base + 1 : dev_name;
+    if (strncmp(base, "nvme", 4UL))
+        return EINVAL;
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/ng%s", base + 4);
+    int char_fd = open(path, O_RDWR);
+    if (char_fd < 0)
+        return errno;
+    // Probe that the kernel supports big SQEs/CQEs for passthrough
+    uring_queue *queue = uring_queue_create(engine->depth);
+    if (!queue) {
+        int err = errno ? errno : ENOSYS;
+        close(char_fd);
+        return err;
+    }
+    uring_engine *uring = (uring_engine *)calloc(1UL, sizeof(uring_engine));
+    uring->char_fd = char_fd;
+    pthread_mutex_init(&uring->queues_lock, NULL);
+    pthread_cond_init(&uring->queues_cond, NULL);
+    uring->idle_queues = queue;
+    uring->num_queues = 1U;
+    engine->_private = uring;
+    return 0;
+}
+
+static uring_queue *uring_queue_create(uint32_t entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+    int ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0)
+        return NULL;
+    uring_queue *queue = (uring_queue *)calloc(1UL, sizeof(uring_queue));
+    queue->ring_fd = ring_fd;
+    queue->entries = params.sq_entries;
+    queue->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    queue->cq_len = params.cq_off.cqes + params.cq_entries * 32UL;
+    queue->sqes_len = params.sq_entries * 128UL;
+    queue->sq_ptr = mmap(NULL, queue->sq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    queue->cq_ptr = mmap(NULL, queue->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    queue->sqes = (char *)mmap(NULL, queue->sqes_len, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring_fd,
+                               IORING_OFF_SQES);
+    if (queue->sq_ptr == MAP_FAILED || queue->cq_ptr == MAP_FAILED ||
+        queue->sqes == MAP_FAILED) {
+        uring_queue_destroy(queue);
+        return NULL;
+    }
+    char *sq = (char *)queue->sq_ptr;
+    char *cq = (char *)queue->cq_ptr;
+    queue->sq_head = (unsigned *)(sq + params.sq_off.head);
+    queue->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    queue->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    queue->sq_array = (unsigned *)(sq + params.sq_off.array);
+    queue->cq_head = (unsigned *)(cq + params.cq_off.head);
+    queue->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    queue->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    queue->cqes = cq + params.cq_off.cqes;
+    return queue;
+}
+
+static void uring_queue_destroy(uring_queue *queue)
+{
+    if (queue->sq_ptr && queue->sq_ptr != MAP_FAILED)
+        munmap(queue->sq_ptr, queue->sq_len);
+    if (queue->cq_ptr && queue->cq_ptr != MAP_FAILED)
+        munmap(queue->cq_ptr, queue->cq_len);
+    if (queue->sqes && queue->sqes != MAP_FAILED)
+        munmap(queue->sqes, queue->sqes_len);
+    close(queue->ring_fd);
+    free(queue);
+}
+
+static uring_queue *get_queue(zns_io_engine *engine)
+{
+    uring_engine *uring = (uring_engine *)engine->_private;
+    pthread_mutex_lock(&uring->queues_lock);
+    for (;;) {
+        if (uring->idle_queues) {
+            uring_queue *queue = uring->idle_queues;
+            uring->idle_queues = queue->next;
+            pthread_mutex_unlock(&uring->queues_lock);
+            queue->next = NULL;
+            return queue;
+        }
+        if (uring->num_queues < ZNS_URING_MAX_QUEUES) {
+            ++uring->num_queues;
+            pthread_mutex_unlock(&uring->queues_lock);
+            uring_queue *queue = uring_queue_create(engine->depth);
+            if (queue)
+                return queue;
+            pthread_mutex_lock(&uring->queues_lock);
+            --uring->num_queues;
+        }
+        pthread_cond_wait(&uring->queues_cond, &uring->queues_lock);
+    }
+}
+
+static void put_queue(zns_io_engine *engine, uring_queue *queue)
+{
+    uring_engine *uring = (uring_engine *)engine->_private;
+    pthread_mutex_lock(&uring->queues_lock);
+    queue->next = uring->idle_queues;
+    uring->idle_queues = queue;
+    pthread_cond_signal(&uring->queues_cond);
+    pthread_mutex_unlock(&uring->queues_lock);
+}
+
+static void prep_cmd(zns_io_engine *engine, io_uring_sqe *sqe, int char_fd,
+                     zns_io_req *req, uint64_t tag)
+{
+    memset(sqe, 0, 128UL);
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = char_fd;
+    sqe->cmd_op = ZNS_URING_CMD_IO;
+    sqe->user_data = tag;
+    req->status = EINPROGRESS;
+    zns_uring_cmd *cmd = (zns_uring_cmd *)sqe->cmd;
+    cmd->nsid = engine->nsid;
+    cmd->cdw10 = req->slba & 0xffffffffULL;
+    cmd->cdw11 = req->slba >> 32;
+    switch (req->opcode) {
+    case ZNS_IO_READ:
+        cmd->opcode = nvme_cmd_read;
+        cmd->addr = (uint64_t)(uintptr_t)req->buffer;
+        cmd->data_len = req->num_pages * engine->page_size;
+        cmd->cdw12 = req->num_pages - 1U;
+        break;
+    case ZNS_IO_APPEND:
+        cmd->opcode = nvme_zns_cmd_append;
+        cmd->addr = (uint64_t)(uintptr_t)req->buffer;
+        cmd->data_len = req->num_pages * engine->page_size;
+        cmd->cdw12 = req->num_pages - 1U;
+        break;
+    case ZNS_IO_RESET:
+        cmd->opcode = nvme_zns_cmd_mgmt_send;
+        cmd->cdw13 = NVME_ZNS_ZSA_RESET;
+        break;
+    case ZNS_IO_WRITE_ZEROES:
+        cmd->opcode = nvme_cmd_write_zeroes;
+        cmd->cdw12 = req->num_pages - 1U;
+        break;
+    case ZNS_IO_COPY:
+        cmd->opcode = nvme_cmd_copy;
+        cmd->addr = (uint64_t)(uintptr_t)req->buffer;
+        cmd->data_len = req->num_ranges * sizeof(nvme_copy_range);
+        cmd->cdw12 = (req->num_ranges - 1U) & 0xffU;
+        break;
+    }
+}
+
+static int uring_submit(zns_io_engine *engine, zns_io_req *reqs,
+                        uint32_t num_reqs)
+{
+    uring_engine *uring = (uring_engine *)engine->_private;
+    uring_queue *queue = get_queue(engine);
+    uint32_t prepared = 0U, completed = 0U, in_flight = 0U, to_submit = 0U;
+    int err = 0;
+    while (completed < num_reqs) {
+        // Keep up to the ring size of commands in flight
+        unsigned tail = *queue->sq_tail;
+        while (prepared < num_reqs && in_flight < queue->entries) {
+            unsigned index = tail & *queue->sq_mask;
+            prep_cmd(engine, (io_uring_sqe *)(queue->sqes + index * 128UL),
+                     uring->char_fd, &reqs[prepared], prepared);
+            queue->sq_array[index] = index;
+            ++tail;
+            ++prepared;
+            ++in_flight;
+            ++to_submit;
+        }
+        __atomic_store_n(queue->sq_tail, tail, __ATOMIC_RELEASE);
+        int ret = (int)syscall(__NR_io_uring_enter, queue->ring_fd, to_submit,
+                               1U, IORING_ENTER_GETEVENTS, NULL, 0UL);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            err = errno;
+            break;
+        }
+        to_submit -= (uint32_t)ret;
+        uint32_t reaped = uring_reap(queue, reqs, &err);
+        completed += reaped;
+        in_flight -= reaped;
+    }
+    if (completed < num_reqs) {
+        // The ring is unusable. Take back the entries the kernel has not
+        // seen, then wait for the ones it has, their buffers belong to the
+        // caller.
+        __atomic_store_n(queue->sq_tail, *queue->sq_tail - to_submit,
+                         __ATOMIC_RELEASE);
+        in_flight -= to_submit;
+        bool reported = false;
+        while (in_flight) {
+            int ret = (int)syscall(__NR_io_uring_enter, queue->ring_fd, 0U,
+                                   1U, IORING_ENTER_GETEVENTS, NULL, 0UL);
+            if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+                errno != EBUSY) {
+                if (!reported)
+                    printf("io_uring: waiting for %u commands failed %d\n",
+                           in_flight, errno);
+                reported = true;
+                usleep(1000U);
+            }
+            in_flight -= uring_reap(queue, reqs, &err);
+        }
+        // Fail whatever has not completed
+        for (uint32_t i = 0U; i < num_reqs; ++i)
+            if (i >= prepared || reqs[i].status == EINPROGRESS)
+                reqs[i].status = err;
+        uring_queue_destroy(queue);
+        pthread_mutex_lock(&uring->queues_lock);
+        --uring->num_queues;
+        pthread_cond_signal(&uring->queues_cond);
+        pthread_mutex_unlock(&uring->queues_lock);
+        return err;
+    }
+    put_queue(engine, queue);
+    return err;
+}
+
+// Completes the requests of the CQEs posted so far and returns their number
+static uint32_t uring_reap(uring_queue *queue, zns_io_req *reqs, int *err)
+{
+    uint32_t reaped = 0U;
+    unsigned head = *queue->cq_head;
+    while (head != __atomic_load_n(queue->cq_tail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe *cqe = (io_uring_cqe *)(queue->cqes +
+                                             (head & *queue->cq_mask) * 32UL);
+        zns_io_req *req = &reqs[cqe->user_data];
+        // res < 0 is an errno, res > 0 an NVMe status code
+        req->status = cqe->res < 0 ? -cqe->res : (cqe->res ? EIO : 0);
+        req->result = cqe->big_cqe[0];
+        if (req->status && !*err)
+            *err = req->status;
+        ++head;
+        ++reaped;
+    }
+    __atomic_store_n(queue->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+static void uring_destroy(zns_io_engine *engine)
+{
+    uring_engine *uring = (uring_engine *)engine->_private;
+    while (uring->idle_queues) {
+        uring_queue *tmp = uring->idle_queues;
+        uring->idle_queues = tmp->next;
+        uring_queue_destroy(tmp);
+    }
+    close(uring->char_fd);
+    pthread_cond_destroy(&uring->queues_cond);
+    pthread_mutex_destroy(&uring->queues_lock);
+    free(uring);
+}
+
+}
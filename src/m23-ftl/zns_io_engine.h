@@ -0,0 +1,82 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_IO_ENGINE_H
+#define STOSYS_PROJECT_ZNS_IO_ENGINE_H
+
+#include <cstdint>
+
+extern "C" {
+
+enum zns_io_opcode {
+    ZNS_IO_READ = 0,
+    ZNS_IO_APPEND,
+    ZNS_IO_RESET,
+    ZNS_IO_WRITE_ZEROES,
+    ZNS_IO_COPY
+};
+
+// One device command. The caller fills in the command, the engine fills in
+// status (0 or an errno value) and, for appends, the lba the data landed at.
+struct zns_io_req {
+    uint8_t opcode;
+    // start lba for reads and write zeroes, destination lba for copies,
+    // zone start lba otherwise
+    unsigned long long slba;
+    uint32_t num_pages;
+    void *buffer; // the nvme_copy_range array for copies
+    uint32_t num_ranges; // copies only
+    unsigned long long result;
+    int status;
+};
+
+struct zns_io_engine;
+
+// Engines are pluggable: each one provides a batch submit that returns once
+// every request of the batch has completed.
+struct zns_io_engine_ops {
+    const char *name;
+    int (*submit)(zns_io_engine *engine, zns_io_req *reqs, uint32_t num_reqs);
+    void (*destroy)(zns_io_engine *engine);
+};
+
+struct zns_io_engine {
+    const zns_io_engine_ops *ops;
+    int fd;
+    unsigned nsid;
+    uint32_t page_size;
+    uint32_t depth; // max commands in flight per submitting thread
+    void *_private;
+};
+
+// type is one of zns_io_engine_type from zns_device.h. Returns NULL only if
+// no engine at all could be created.
+zns_io_engine *zns_io_engine_create(const char *dev_name, int fd, unsigned nsid,
+                                    uint32_t page_size, int type,
+                                    uint32_t depth);
+int zns_io_engine_submit(zns_io_engine *engine, zns_io_req *reqs,
+                         uint32_t num_reqs);
+void zns_io_engine_destroy(zns_io_engine *engine);
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_IO_ENGINE_H
@@ -0,0 +1,481 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "zns_meta.h"
+
+extern "C" {
+
+#define META_MAGIC 0x4c54465aU // "ZFTL"
+
+enum meta_page_kind {
+    META_PAGE_JOURNAL = 1,
+    META_PAGE_CKPT,
+    META_PAGE_CKPT_END
+};
+
+struct meta_page_header {
+    uint32_t magic;
+    uint32_t checksum; // of the whole page with this field 0
+    uint64_t generation; // of the checkpoint in the zone
+    uint32_t kind;
+    uint32_t count; // journal records, checkpoint bytes or checkpoint pages
+    uint64_t index; // checkpoint page, the next lsn for the end page
+};
+
+// What one metadata zone holds
+struct meta_zone_scan {
+    bool valid;
+    uint64_t generation;
+    char *ckpt;
+    uint64_t ckpt_len;
+    uint64_t ckpt_pages;
+    bool complete;
+    uint64_t end_lsn;
+    zns_meta_record *records;
+    uint64_t num_records;
+    uint64_t max_records;
+};
+
+static uint32_t page_checksum(const char *page, uint32_t size);
+static void seal_page(zns_meta *meta, char *page, uint32_t kind,
+                      uint32_t count, uint64_t index);
+static int reset_meta_zone(zns_meta *meta, uint32_t zone);
+static int append_page(zns_meta *meta, char *page);
+static int flush_journal(zns_meta *meta);
+static void add_record(zns_meta *meta, const zns_meta_record *record);
+static int scan_zone(zns_meta *meta, uint32_t zone, uint32_t write_ptr,
+                     meta_zone_scan *scan);
+static void scan_page(zns_meta *meta, const char *page, meta_zone_scan *scan);
+static int compare_records(const void *a, const void *b);
+
+void zns_meta_init(zns_meta *meta, zns_io_engine *engine, uint32_t page_size,
+                   uint32_t zone_num_pages, uint32_t max_read_pages,
+                   const unsigned long long *saddr)
+{
+    memset(meta, 0, sizeof(zns_meta));
+    meta->engine = engine;
+    meta->page_size = page_size;
+    meta->zone_num_pages = zone_num_pages;
+    meta->max_read_pages = max_read_pages ? max_read_pages : 1U;
+    for (uint32_t i = 0U; i < ZNS_META_ZONES; ++i)
+        meta->saddr[i] = saddr[i];
+    meta->next_lsn = 1ULL;
+    meta->page = (char *)calloc(1UL, page_size);
+    meta->ckpt_page = (char *)calloc(1UL, page_size);
+    pthread_mutex_init(&meta->lock, NULL);
+    pthread_cond_init(&meta->cond, NULL);
+}
+
+void zns_meta_destroy(zns_meta *meta)
+{
+    pthread_cond_destroy(&meta->cond);
+    pthread_mutex_destroy(&meta->lock);
+    free(meta->ckpt_page);
+    free(meta->page);
+}
+
+int zns_meta_format(zns_meta *meta)
+{
+    int ret = 0;
+    pthread_mutex_lock(&meta->lock);
+    for (uint32_t i = 0U; !ret && i < ZNS_META_ZONES; ++i)
+        ret = reset_meta_zone(meta, i);
+    meta->curr = 0U;
+    meta->generation = 0ULL;
+    meta->next_lsn = 1ULL;
+    meta->num_records = 0U;
+    memset(meta->page, 0, meta->page_size);
+    pthread_mutex_unlock(&meta->lock);
+    return ret;
+}
+
+int zns_meta_load(zns_meta *meta, const uint32_t *write_ptrs, char **ckpt,
+                  uint64_t *ckpt_len, zns_meta_record **records,
+                  uint64_t *num_records)
+{
+    meta_zone_scan scans[ZNS_META_ZONES];
+    memset(scans, 0, sizeof(scans));
+    int ret = 0;
+    for (uint32_t i = 0U; !ret && i < ZNS_META_ZONES; ++i)
+        ret = scan_zone(meta, i, write_ptrs[i], &scans[i]);
+    // The newest complete checkpoint wins
+    int best = -1;
+    for (uint32_t i = 0U; !ret && i < ZNS_META_ZONES; ++i) {
+        if (scans[i].complete &&
+            (best < 0 || scans[i].generation > scans[best].generation))
+            best = i;
+    }
+    if (!ret && best < 0)
+        ret = ENOENT;
+    if (!ret) {
+        meta_zone_scan *newest = &scans[best];
+        // Records of the zone holding it and of a newer, unfinished one
+        uint64_t total = 0ULL;
+        for (uint32_t i = 0U; i < ZNS_META_ZONES; ++i) {
+            if (scans[i].valid && scans[i].generation >= newest->generation)
+                total += scans[i].num_records;
+        }
+        *records = (zns_meta_record *)malloc((total ? total : 1ULL) *
+                                             sizeof(zns_meta_record));
+        *num_records = 0ULL;
+        uint64_t next_lsn = newest->end_lsn;
+        for (uint32_t i = 0U; i < ZNS_META_ZONES; ++i) {
+            if (!scans[i].num_records ||
+                scans[i].generation < newest->generation)
+                continue;
+            memcpy(*records + *num_records, scans[i].records,
+                   scans[i].num_records * sizeof(zns_meta_record));
+            *num_records += scans[i].num_records;
+        }
+        qsort(*records, *num_records, sizeof(zns_meta_record),
+              &compare_records);
+        if (*num_records && (*records)[*num_records - 1ULL].lsn >= next_lsn)
+            next_lsn = (*records)[*num_records - 1ULL].lsn + 1ULL;
+        *ckpt = newest->ckpt;
+        *ckpt_len = newest->ckpt_len;
+        newest->ckpt = NULL;
+        pthread_mutex_lock(&meta->lock);
+        meta->curr = best;
+        meta->generation = newest->generation;
+        meta->next_lsn = next_lsn;
+        for (uint32_t i = 0U; i < ZNS_META_ZONES; ++i)
+            meta->write_ptr[i] = write_ptrs[i];
+        // The other zone is reset by the next checkpoint, keep what only it
+        // has in the journal of the newest one
+        for (uint32_t i = 0U; i < ZNS_META_ZONES; ++i) {
+            if (i == (uint32_t)best || !scans[i].valid ||
+                scans[i].generation <= newest->generation)
+                continue;
+            for (uint64_t j = 0ULL; j < scans[i].num_records; ++j)
+                add_record(meta, &scans[i].records[j]);
+        }
+        ret = flush_journal(meta);
+        pthread_mutex_unlock(&meta->lock);
+    }
+    for (uint32_t i = 0U; i < ZNS_META_ZONES; ++i) {
+        free(scans[i].ckpt);
+        free(scans[i].records);
+    }
+    return ret;
+}
+
+uint64_t zns_meta_log(zns_meta *meta, uint32_t type, uint32_t block,
+                      uint64_t arg0, uint64_t arg1)
+{
+    zns_meta_record record;
+    record.type = type;
+    record.block = block;
+    record.arg0 = arg0;
+    record.arg1 = arg1;
+    pthread_mutex_lock(&meta->lock);
+    record.lsn = meta->next_lsn++;
+    add_record(meta, &record);
+    pthread_mutex_unlock(&meta->lock);
+    return record.lsn;
+}
+
+int zns_meta_flush(zns_meta *meta)
+{
+    pthread_mutex_lock(&meta->lock);
+    int ret = flush_journal(meta);
+    pthread_mutex_unlock(&meta->lock);
+    return ret;
+}
+
+uint64_t zns_meta_checkpoint_begin(zns_meta *meta)
+{
+    pthread_mutex_lock(&meta->lock);
+    // Records so far stay with the old checkpoint, the new one covers them
+    flush_journal(meta);
+    uint32_t next = (meta->curr + 1U) % ZNS_META_ZONES;
+    reset_meta_zone(meta, next);
+    meta->curr = next;
+    ++meta->generation;
+    meta->ckpt_running = true;
+    meta->ckpt_needed = false;
+    meta->ckpt_bytes = 0U;
+    meta->ckpt_pages = 0ULL;
+    memset(meta->ckpt_page, 0, meta->page_size);
+    uint64_t lsn = meta->next_lsn;
+    pthread_mutex_unlock(&meta->lock);
+    return lsn;
+}
+
+int zns_meta_checkpoint_write(zns_meta *meta, const void *data, uint32_t size)
+{
+    const uint32_t capacity = meta->page_size - sizeof(meta_page_header);
+    int ret = 0;
+    pthread_mutex_lock(&meta->lock);
+    while (!ret && size) {
+        uint32_t n = capacity - meta->ckpt_bytes;
+        if (n > size)
+            n = size;
+        memcpy(meta->ckpt_page + sizeof(meta_page_header) + meta->ckpt_bytes,
+               data, n);
+        meta->ckpt_bytes += n;
+        data = (const char *)data + n;
+        size -= n;
+        if (meta->ckpt_bytes == capacity) {
+            seal_page(meta, meta->ckpt_page, META_PAGE_CKPT, meta->ckpt_bytes,
+                      meta->ckpt_pages);
+            ret = append_page(meta, meta->ckpt_page);
+            ++meta->ckpt_pages;
+            meta->ckpt_bytes = 0U;
+            memset(meta->ckpt_page, 0, meta->page_size);
+        }
+    }
+    pthread_mutex_unlock(&meta->lock);
+    return ret;
+}
+
+int zns_meta_checkpoint_end(zns_meta *meta)
+{
+    int ret = 0;
+    pthread_mutex_lock(&meta->lock);
+    if (meta->ckpt_bytes) {
+        seal_page(meta, meta->ckpt_page, META_PAGE_CKPT, meta->ckpt_bytes,
+                  meta->ckpt_pages);
+        ret = append_page(meta, meta->ckpt_page);
+        ++meta->ckpt_pages;
+        memset(meta->ckpt_page, 0, meta->page_size);
+    }
+    // Only complete with the end page
+    if (!ret) {
+        seal_page(meta, meta->ckpt_page, META_PAGE_CKPT_END, meta->ckpt_pages,
+                  meta->next_lsn);
+        ret = append_page(meta, meta->ckpt_page);
+    }
+    memset(meta->ckpt_page, 0, meta->page_size);
+    meta->ckpt_running = false;
+    meta->ckpt_needed = meta->write_ptr[meta->curr] >= meta->zone_num_pages / 2U;
+    ++meta->checkpoints;
+    meta->checkpoint_bytes += (meta->ckpt_pages + 1ULL) * meta->page_size;
+    pthread_mutex_unlock(&meta->lock);
+    return ret;
+}
+
+uint64_t zns_meta_max_checkpoint(uint32_t page_size, uint32_t zone_num_pages)
+{
+    return (uint64_t)(zone_num_pages / 4U) *
+           (page_size - sizeof(meta_page_header));
+}
+
+bool zns_meta_wait_checkpoint(zns_meta *meta)
+{
+    pthread_mutex_lock(&meta->lock);
+    while (!meta->ckpt_needed && !meta->stop)
+        pthread_cond_wait(&meta->cond, &meta->lock);
+    bool run = !meta->stop;
+    pthread_mutex_unlock(&meta->lock);
+    return run;
+}
+
+void zns_meta_stop(zns_meta *meta)
+{
+    pthread_mutex_lock(&meta->lock);
+    meta->stop = true;
+    pthread_cond_broadcast(&meta->cond);
+    pthread_mutex_unlock(&meta->lock);
+}
+
+// FNV-1a
+static uint32_t page_checksum(const char *page, uint32_t size)
+{
+    uint32_t hash = 2166136261U;
+    for (uint32_t i = 0U; i < size; ++i) {
+        hash ^= (uint8_t)page[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void seal_page(zns_meta *meta, char *page, uint32_t kind,
+                      uint32_t count, uint64_t index)
+{
+    meta_page_header *header = (meta_page_header *)page;
+    header->magic = META_MAGIC;
+    header->checksum = 0U;
+    header->generation = meta->generation;
+    header->kind = kind;
+    header->count = count;
+    header->index = index;
+    header->checksum = page_checksum(page, meta->page_size);
+}
+
+// Call with meta->lock held
+static int reset_meta_zone(zns_meta *meta, uint32_t zone)
+{
+    zns_io_req req;
+    memset(&req, 0, sizeof(req));
+    req.opcode = ZNS_IO_RESET;
+    req.slba = meta->saddr[zone];
+    int ret = zns_io_engine_submit(meta->engine, &req, 1U);
+    if (ret) {
+        printf("Metadata zone reset failed %d, metadata is not persisted "
+               "any more\n", ret);
+        meta->failed = true;
+        return ret;
+    }
+    meta->write_ptr[zone] = 0U;
+    return 0;
+}
+
+// Call with meta->lock held
+static int append_page(zns_meta *meta, char *page)
+{
+    if (meta->failed)
+        return EIO;
+    uint32_t zone = meta->curr;
+    if (meta->write_ptr[zone] == meta->zone_num_pages) {
+        printf("Metadata zone full, metadata is not persisted any more\n");
+        meta->failed = true;
+        return ENOSPC;
+    }
+    zns_io_req req;
+    memset(&req, 0, sizeof(req));
+    req.opcode = ZNS_IO_APPEND;
+    req.slba = meta->saddr[zone];
+    req.num_pages = 1U;
+    req.buffer = page;
+    int ret = zns_io_engine_submit(meta->engine, &req, 1U);
+    if (ret) {
+        printf("Metadata append failed %d, metadata is not persisted any "
+               "more\n", ret);
+        meta->failed = true;
+        return ret;
+    }
+    ++meta->write_ptr[zone];
+    // Half full, the other half is for the journal while checkpointing
+    if (!meta->ckpt_running && !meta->ckpt_needed &&
+        meta->write_ptr[zone] >= meta->zone_num_pages / 2U) {
+        meta->ckpt_needed = true;
+        pthread_cond_broadcast(&meta->cond);
+    }
+    return 0;
+}
+
+// Call with meta->lock held
+static int flush_journal(zns_meta *meta)
+{
+    if (!meta->num_records)
+        return 0;
+    seal_page(meta, meta->page, META_PAGE_JOURNAL, meta->num_records, 0ULL);
+    int ret = append_page(meta, meta->page);
+    meta->journal_bytes += meta->page_size;
+    meta->num_records = 0U;
+    memset(meta->page, 0, meta->page_size);
+    return ret;
+}
+
+// Call with meta->lock held
+static void add_record(zns_meta *meta, const zns_meta_record *record)
+{
+    const uint32_t per_page = (meta->page_size - sizeof(meta_page_header)) /
+                              sizeof(zns_meta_record);
+    zns_meta_record *records = (zns_meta_record *)
+                               (meta->page + sizeof(meta_page_header));
+    records[meta->num_records++] = *record;
+    if (meta->num_records == per_page)
+        flush_journal(meta);
+}
+
+static int scan_zone(zns_meta *meta, uint32_t zone, uint32_t write_ptr,
+                     meta_zone_scan *scan)
+{
+    uint32_t max_pages = meta->max_read_pages;
+    char *buffer = (char *)malloc((uint64_t)max_pages * meta->page_size);
+    int ret = 0;
+    for (uint32_t done = 0U; !ret && done < write_ptr; done += max_pages) {
+        zns_io_req req;
+        memset(&req, 0, sizeof(req));
+        req.opcode = ZNS_IO_READ;
+        req.slba = meta->saddr[zone] + done;
+        req.num_pages = write_ptr - done < max_pages ? write_ptr - done :
+                        max_pages;
+        req.buffer = buffer;
+        ret = zns_io_engine_submit(meta->engine, &req, 1U);
+        for (uint32_t i = 0U; !ret && i < req.num_pages; ++i)
+            scan_page(meta, buffer + (uint64_t)i * meta->page_size, scan);
+    }
+    free(buffer);
+    if (ret)
+        printf("Failed to read metadata zone %u, %d\n", zone, ret);
+    return ret;
+}
+
+static void scan_page(zns_meta *meta, const char *page, meta_zone_scan *scan)
+{
+    meta_page_header header;
+    memcpy(&header, page, sizeof(header));
+    if (header.magic != META_MAGIC)
+        return;
+    ((meta_page_header *)page)->checksum = 0U;
+    uint32_t checksum = page_checksum(page, meta->page_size);
+    ((meta_page_header *)page)->checksum = header.checksum;
+    if (checksum != header.checksum)
+        return;
+    // All pages of a zone come after its reset, one generation
+    if (!scan->valid) {
+        scan->valid = true;
+        scan->generation = header.generation;
+    }
+    if (header.generation != scan->generation)
+        return;
+    const char *payload = page + sizeof(meta_page_header);
+    if (header.kind == META_PAGE_JOURNAL) {
+        if (scan->num_records + header.count > scan->max_records) {
+            scan->max_records = (scan->num_records + header.count) * 2ULL;
+            scan->records = (zns_meta_record *)
+                            realloc(scan->records, scan->max_records *
+                                                   sizeof(zns_meta_record));
+        }
+        memcpy(scan->records + scan->num_records, payload,
+               header.count * sizeof(zns_meta_record));
+        scan->num_records += header.count;
+    } else if (header.kind == META_PAGE_CKPT &&
+               header.index == scan->ckpt_pages && !scan->complete) {
+        scan->ckpt = (char *)realloc(scan->ckpt, scan->ckpt_len +
+                                                 header.count);
+        memcpy(scan->ckpt + scan->ckpt_len, payload, header.count);
+        scan->ckpt_len += header.count;
+        ++scan->ckpt_pages;
+    } else if (header.kind == META_PAGE_CKPT_END &&
+               header.count == scan->ckpt_pages) {
+        scan->complete = true;
+        scan->end_lsn = header.index;
+    }
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    uint64_t lsn_a = ((const zns_meta_record *)a)->lsn;
+    uint64_t lsn_b = ((const zns_meta_record *)b)->lsn;
+    return lsn_a < lsn_b ? -1 : lsn_a > lsn_b;
+}
+
+}
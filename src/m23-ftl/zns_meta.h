@@ -0,0 +1,113 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_META_H
+#define STOSYS_PROJECT_ZNS_META_H
+
+#include <cstdint>
+#include <pthread.h>
+#include "zns_io_engine.h"
+
+extern "C" {
+
+// FTL metadata on reserved zones: a checkpoint of the mapping state plus a
+// journal of the records that changed it since. Both are appended as single
+// pages that carry a header with a checksum, so torn or stale pages are
+// skipped when loading. A checkpoint goes to the zone that does not hold the
+// newest complete one and journal records follow it there, the old zone
+// stays valid until the new checkpoint is complete.
+//
+// Checkpoints are fuzzy, writers keep logging while one is taken. Every
+// record has a log sequence number (lsn) and the FTL stores with each part
+// of the checkpoint the lsn it is current to, so replay skips what the
+// checkpoint already covers.
+
+#define ZNS_META_ZONES 2U
+
+// The meaning of type, block and args is up to the FTL
+struct zns_meta_record {
+    uint64_t lsn;
+    uint32_t type;
+    uint32_t block;
+    uint64_t arg0;
+    uint64_t arg1;
+};
+
+struct zns_meta {
+    zns_io_engine *engine;
+    uint32_t page_size;
+    uint32_t zone_num_pages;
+    uint32_t max_read_pages;
+    unsigned long long saddr[ZNS_META_ZONES];
+    uint32_t write_ptr[ZNS_META_ZONES];
+    uint32_t curr; // zone journal pages go to
+    uint64_t generation; // of the checkpoint in curr
+    uint64_t next_lsn;
+    bool failed; // a metadata write failed, nothing is persisted any more
+    // journal page being filled
+    char *page;
+    uint32_t num_records;
+    // checkpoint being written
+    char *ckpt_page;
+    uint32_t ckpt_bytes;
+    uint64_t ckpt_pages;
+    bool ckpt_running;
+    bool ckpt_needed; // curr is half full
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t checkpoints;
+    uint64_t journal_bytes;
+    uint64_t checkpoint_bytes;
+};
+
+void zns_meta_init(zns_meta *meta, zns_io_engine *engine, uint32_t page_size,
+                   uint32_t zone_num_pages, uint32_t max_read_pages,
+                   const unsigned long long *saddr);
+void zns_meta_destroy(zns_meta *meta);
+// Empty metadata, a checkpoint has to follow before anything can be loaded
+int zns_meta_format(zns_meta *meta);
+// Newest complete checkpoint and the journal records past it in lsn order,
+// write_ptrs are the write pointers of the metadata zones relative to their
+// start. The caller frees ckpt and records. ENOENT if there is no checkpoint.
+int zns_meta_load(zns_meta *meta, const uint32_t *write_ptrs, char **ckpt,
+                  uint64_t *ckpt_len, zns_meta_record **records,
+                  uint64_t *num_records);
+// Returns the lsn of the record. It is on the device after the next
+// zns_meta_flush or once its journal page is full.
+uint64_t zns_meta_log(zns_meta *meta, uint32_t type, uint32_t block,
+                      uint64_t arg0, uint64_t arg1);
+int zns_meta_flush(zns_meta *meta);
+// One checkpoint at a time. begin returns the lsn the checkpoint starts at,
+// every record before it is covered.
+uint64_t zns_meta_checkpoint_begin(zns_meta *meta);
+int zns_meta_checkpoint_write(zns_meta *meta, const void *data, uint32_t size);
+int zns_meta_checkpoint_end(zns_meta *meta);
+// Largest checkpoint that leaves three quarters of a zone to the journal
+uint64_t zns_meta_max_checkpoint(uint32_t page_size, uint32_t zone_num_pages);
+// Blocks until the journal asks for a checkpoint, false once stopped
+bool zns_meta_wait_checkpoint(zns_meta *meta);
+void zns_meta_stop(zns_meta *meta);
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_META_H
@@ -0,0 +1,549 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include "zns_page_ftl.h"
+
+extern "C" {
+
+static inline uint64_t get_l2p(zns_page_ftl *ftl, uint64_t page_addr);
+static inline uint64_t exchange_l2p(zns_page_ftl *ftl, uint64_t page_addr,
+                                    uint64_t physical_addr);
+static inline bool replace_l2p(zns_page_ftl *ftl, uint64_t page_addr,
+                               uint64_t old_addr, uint64_t physical_addr);
+static inline uint64_t get_p2l(zns_page_ftl *ftl, uint64_t physical_addr);
+static inline void set_p2l(zns_page_ftl *ftl, uint64_t physical_addr,
+                           uint64_t page_addr);
+static inline zns_page_zone *get_zone(zns_page_ftl *ftl,
+                                      uint64_t physical_addr);
+static zns_page_zone *take_free_zone(zns_page_ftl *ftl, uint32_t reserve);
+static void put_free_zone(zns_page_ftl *ftl, zns_page_zone *zone);
+static int read_pages(zns_page_ftl *ftl, zns_io_req *runs, uint32_t num_runs,
+                      uint8_t cls);
+static int append_pages(zns_page_ftl *ftl, zns_page_stream *stream,
+                        uint8_t cls, uint64_t page_addr,
+                        const uint64_t *page_addrs, const uint64_t *old_addrs,
+                        void *buffer, uint32_t num_pages);
+static zns_page_zone *pick_victim(zns_page_ftl *ftl);
+static void collect_zone(zns_page_ftl *ftl, zns_page_zone *victim);
+static void *page_gc(void *ftl_ptr);
+
+int zns_page_ftl_init(zns_page_ftl *ftl, zns_io_engine *engine,
+                      zns_sched *sched, uint32_t page_size,
+                      uint32_t zone_num_pages, uint32_t first_zone,
+                      uint32_t num_zones, uint64_t num_pages, uint32_t mdts,
+                      int gc_wmark)
+{
+    memset(ftl, 0, sizeof(zns_page_ftl));
+    uint64_t num_physical_pages = (uint64_t)(num_zones - first_zone) *
+                                  zone_num_pages;
+    // The open user and gc zones and the zone only gc may take
+    if (num_physical_pages < num_pages + 3ULL * zone_num_pages) {
+        printf("Page mapped FTL needs 3 zones more than its capacity\n");
+        return EINVAL;
+    }
+    ftl->engine = engine;
+    ftl->sched = sched;
+    ftl->page_size = page_size;
+    ftl->zone_num_pages = zone_num_pages;
+    ftl->first_zone = first_zone;
+    ftl->num_zones = num_zones - first_zone;
+    ftl->num_pages = num_pages;
+    ftl->mdts = mdts;
+    ftl->gc_wmark = gc_wmark > 1 ? gc_wmark : 1U;
+    // All ones is ZNS_PAGE_UNMAPPED in either width
+    ftl->wide = num_physical_pages >= 0xffffffffULL;
+    if (ftl->wide) {
+        ftl->l2p64 = (uint64_t *)malloc(num_pages * sizeof(uint64_t));
+        ftl->p2l64 = (uint64_t *)malloc(num_physical_pages * sizeof(uint64_t));
+        memset(ftl->l2p64, 0xff, num_pages * sizeof(uint64_t));
+        memset(ftl->p2l64, 0xff, num_physical_pages * sizeof(uint64_t));
+    } else {
+        ftl->l2p32 = (uint32_t *)malloc(num_pages * sizeof(uint32_t));
+        ftl->p2l32 = (uint32_t *)malloc(num_physical_pages * sizeof(uint32_t));
+        memset(ftl->l2p32, 0xff, num_pages * sizeof(uint32_t));
+        memset(ftl->p2l32, 0xff, num_physical_pages * sizeof(uint32_t));
+    }
+    ftl->zones = (zns_page_zone *)calloc(ftl->num_zones,
+                                         sizeof(zns_page_zone));
+    for (uint32_t i = ftl->num_zones; i--;) {
+        ftl->zones[i].saddr = (unsigned long long)(first_zone + i) *
+                              zone_num_pages;
+        ftl->zones[i].next = ftl->free_zones;
+        ftl->free_zones = &ftl->zones[i];
+    }
+    ftl->num_free_zones = ftl->num_zones;
+    pthread_mutex_init(&ftl->user.lock, NULL);
+    pthread_mutex_init(&ftl->gc.lock, NULL);
+    pthread_mutex_init(&ftl->zones_lock, NULL);
+    pthread_cond_init(&ftl->free_cond, NULL);
+    pthread_cond_init(&ftl->gc_cond, NULL);
+    // Readers come all the time, a waiting reset must not starve
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ftl->reset_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    ftl->run_gc = true;
+    pthread_create(&ftl->gc_thread, NULL, &page_gc, ftl);
+    return 0;
+}
+
+void zns_page_ftl_destroy(zns_page_ftl *ftl)
+{
+    pthread_mutex_lock(&ftl->zones_lock);
+    ftl->run_gc = false;
+    pthread_cond_broadcast(&ftl->gc_cond);
+    pthread_mutex_unlock(&ftl->zones_lock);
+    pthread_join(ftl->gc_thread, NULL);
+    pthread_rwlock_destroy(&ftl->reset_lock);
+    pthread_cond_destroy(&ftl->gc_cond);
+    pthread_cond_destroy(&ftl->free_cond);
+    pthread_mutex_destroy(&ftl->zones_lock);
+    pthread_mutex_destroy(&ftl->gc.lock);
+    pthread_mutex_destroy(&ftl->user.lock);
+    free(ftl->zones);
+    free(ftl->l2p32);
+    free(ftl->p2l32);
+    free(ftl->l2p64);
+    free(ftl->p2l64);
+}
+
+int zns_page_ftl_read(zns_page_ftl *ftl, uint64_t address, void *buffer,
+                      uint32_t size)
+{
+    uint64_t page_addr = address / ftl->page_size;
+    uint32_t num_pages = size / ftl->page_size;
+    if (page_addr + num_pages > ftl->num_pages)
+        return -1;
+    // Consecutive physical pages make one run
+    zns_io_req *runs = (zns_io_req *)calloc(num_pages ? num_pages : 1U,
+                                            sizeof(zns_io_req));
+    uint32_t num_runs = 0U;
+    int ret = 0;
+    pthread_rwlock_rdlock(&ftl->reset_lock);
+    for (uint32_t i = 0U; i < num_pages; ++i) {
+        uint64_t physical_addr = get_l2p(ftl, page_addr + i);
+        // Never written, zeros without I/O
+        if (physical_addr == ZNS_PAGE_UNMAPPED) {
+            memset((char *)buffer + (uint64_t)i * ftl->page_size, 0,
+                   ftl->page_size);
+            continue;
+        }
+        zns_io_req *run = num_runs ? &runs[num_runs - 1U] : NULL;
+        // Both contiguous, an unwritten page in between splits the run
+        if (run && run->slba + run->num_pages ==
+                   physical_addr + (uint64_t)ftl->first_zone *
+                                   ftl->zone_num_pages &&
+            (char *)run->buffer + (uint64_t)run->num_pages * ftl->page_size ==
+            (char *)buffer + (uint64_t)i * ftl->page_size) {
+            ++run->num_pages;
+            continue;
+        }
+        run = &runs[num_runs++];
+        run->opcode = ZNS_IO_READ;
+        run->slba = physical_addr + (uint64_t)ftl->first_zone *
+                                    ftl->zone_num_pages;
+        run->num_pages = 1U;
+        run->buffer = (char *)buffer + (uint64_t)i * ftl->page_size;
+    }
+    if (!ret)
+        ret = read_pages(ftl, runs, num_runs, ZNS_CLASS_USER_READ);
+    pthread_rwlock_unlock(&ftl->reset_lock);
+    free(runs);
+    return ret;
+}
+
+int zns_page_ftl_write(zns_page_ftl *ftl, uint64_t address, void *buffer,
+                       uint32_t size)
+{
+    uint64_t page_addr = address / ftl->page_size;
+    uint32_t num_pages = size / ftl->page_size;
+    if (page_addr + num_pages > ftl->num_pages)
+        return -1;
+    pthread_mutex_lock(&ftl->user.lock);
+    int ret = append_pages(ftl, &ftl->user, ZNS_CLASS_USER_WRITE, page_addr,
+                           NULL, NULL, buffer, num_pages);
+    pthread_mutex_unlock(&ftl->user.lock);
+    return ret;
+}
+
+void zns_page_ftl_stats(zns_page_ftl *ftl, zns_udevice_stats *stats)
+{
+    stats->gc_merges = __atomic_load_n(&ftl->gc_zones, __ATOMIC_RELAXED);
+    stats->gc_log_pages_merged = __atomic_load_n(&ftl->gc_pages,
+                                                 __ATOMIC_RELAXED);
+    stats->gc_host_bytes = stats->gc_log_pages_merged * ftl->page_size;
+    stats->gc_host_cpu_us = __atomic_load_n(&ftl->gc_cpu_ns,
+                                            __ATOMIC_RELAXED) / 1000ULL;
+    uint64_t entry_size = ftl->wide ? sizeof(uint64_t) : sizeof(uint32_t);
+    stats->mem_map_bytes = ftl->num_pages * entry_size;
+    stats->mem_bitmap_bytes = (uint64_t)ftl->num_zones * ftl->zone_num_pages *
+                              entry_size;
+    stats->mem_zone_bytes = (uint64_t)ftl->num_zones * sizeof(zns_page_zone);
+}
+
+static inline uint64_t get_l2p(zns_page_ftl *ftl, uint64_t page_addr)
+{
+    if (ftl->wide)
+        return __atomic_load_n(&ftl->l2p64[page_addr], __ATOMIC_ACQUIRE);
+    uint32_t entry = __atomic_load_n(&ftl->l2p32[page_addr], __ATOMIC_ACQUIRE);
+    return entry == 0xffffffffU ? ZNS_PAGE_UNMAPPED : entry;
+}
+
+// Returns the previous mapping
+static inline uint64_t exchange_l2p(zns_page_ftl *ftl, uint64_t page_addr,
+                                    uint64_t physical_addr)
+{
+    if (ftl->wide)
+        return __atomic_exchange_n(&ftl->l2p64[page_addr], physical_addr,
+                                   __ATOMIC_ACQ_REL);
+    uint32_t entry = __atomic_exchange_n(&ftl->l2p32[page_addr],
+                                         (uint32_t)physical_addr,
+                                         __ATOMIC_ACQ_REL);
+    return entry == 0xffffffffU ? ZNS_PAGE_UNMAPPED : entry;
+}
+
+// Remaps a page only if it still is at old_addr
+static inline bool replace_l2p(zns_page_ftl *ftl, uint64_t page_addr,
+                               uint64_t old_addr, uint64_t physical_addr)
+{
+    if (ftl->wide)
+        return __atomic_compare_exchange_n(&ftl->l2p64[page_addr], &old_addr,
+                                           physical_addr, false,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    uint32_t expected = (uint32_t)old_addr;
+    return __atomic_compare_exchange_n(&ftl->l2p32[page_addr], &expected,
+                                       (uint32_t)physical_addr, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t get_p2l(zns_page_ftl *ftl, uint64_t physical_addr)
+{
+    if (ftl->wide)
+        return ftl->p2l64[physical_addr];
+    uint32_t entry = ftl->p2l32[physical_addr];
+    return entry == 0xffffffffU ? ZNS_PAGE_UNMAPPED : entry;
+}
+
+static inline void set_p2l(zns_page_ftl *ftl, uint64_t physical_addr,
+                           uint64_t page_addr)
+{
+    if (ftl->wide)
+        ftl->p2l64[physical_addr] = page_addr;
+    else
+        ftl->p2l32[physical_addr] = (uint32_t)page_addr;
+}
+
+static inline zns_page_zone *get_zone(zns_page_ftl *ftl,
+                                      uint64_t physical_addr)
+{
+    return &ftl->zones[physical_addr / ftl->zone_num_pages];
+}
+
+// Waits until more than reserve zones are free. Writers keep one for gc,
+// which always frees more than it takes.
+static zns_page_zone *take_free_zone(zns_page_ftl *ftl, uint32_t reserve)
+{
+    pthread_mutex_lock(&ftl->zones_lock);
+    while (ftl->num_free_zones <= reserve) {
+        pthread_cond_signal(&ftl->gc_cond);
+        pthread_cond_wait(&ftl->free_cond, &ftl->zones_lock);
+    }
+    zns_page_zone *zone = ftl->free_zones;
+    ftl->free_zones = zone->next;
+    zone->next = NULL;
+    zone->state = ZNS_PAGE_ZONE_OPEN;
+    --ftl->num_free_zones;
+    if (ftl->num_free_zones <= ftl->gc_wmark)
+        pthread_cond_signal(&ftl->gc_cond);
+    pthread_mutex_unlock(&ftl->zones_lock);
+    return zone;
+}
+
+static void put_free_zone(zns_page_ftl *ftl, zns_page_zone *zone)
+{
+    pthread_mutex_lock(&ftl->zones_lock);
+    zone->write_ptr = 0U;
+    zone->state = ZNS_PAGE_ZONE_FREE;
+    zone->next = ftl->free_zones;
+    ftl->free_zones = zone;
+    ++ftl->num_free_zones;
+    pthread_cond_broadcast(&ftl->free_cond);
+    pthread_mutex_unlock(&ftl->zones_lock);
+}
+
+// Runs are split into commands of the largest read, as many go out
+// together as the scheduler grants
+static int read_pages(zns_page_ftl *ftl, zns_io_req *runs, uint32_t num_runs,
+                      uint8_t cls)
+{
+    if (!num_runs)
+        return 0;
+    uint32_t max_pages = zns_sched_max_cmd(ftl->sched, cls) / ftl->page_size;
+    uint64_t left = 0ULL;
+    uint32_t max_cmds = 0U;
+    for (uint32_t i = 0U; i < num_runs; ++i) {
+        max_cmds += (runs[i].num_pages + max_pages - 1U) / max_pages;
+        left += runs[i].num_pages;
+    }
+    zns_io_req *cmds = (zns_io_req *)calloc(max_cmds, sizeof(zns_io_req));
+    uint32_t i = 0U;
+    uint32_t done = 0U; // pages of runs[i] already read
+    int ret = 0;
+    while (!ret && left) {
+        zns_sched_grant grant;
+        zns_sched_get(ftl->sched, cls, left * ftl->page_size, &grant);
+        uint32_t budget = grant.size / ftl->page_size;
+        uint32_t num_cmds = 0U;
+        uint64_t num_pages = 0ULL;
+        while (budget && i < num_runs) {
+            uint32_t n = runs[i].num_pages - done;
+            if (n > max_pages)
+                n = max_pages;
+            if (n > budget)
+                n = budget;
+            zns_io_req *cmd = &cmds[num_cmds++];
+            memset(cmd, 0, sizeof(zns_io_req));
+            cmd->opcode = ZNS_IO_READ;
+            cmd->slba = runs[i].slba + done;
+            cmd->num_pages = n;
+            cmd->buffer = (char *)runs[i].buffer +
+                          (uint64_t)done * ftl->page_size;
+            budget -= n;
+            num_pages += n;
+            done += n;
+            if (done == runs[i].num_pages) {
+                ++i;
+                done = 0U;
+            }
+        }
+        ret = zns_io_engine_submit(ftl->engine, cmds, num_cmds);
+        zns_sched_put(ftl->sched, &grant,
+                      ret ? 0ULL : num_pages * ftl->page_size);
+        left -= num_pages;
+    }
+    free(cmds);
+    return ret;
+}
+
+// Call with stream->lock held. Writes num_pages pages to the stream and maps
+// them to page_addr onwards, or to page_addrs if set. With old_addrs gc
+// moves pages: a page overwritten since old_addrs were read keeps its newer
+// mapping.
+static int append_pages(zns_page_ftl *ftl, zns_page_stream *stream,
+                        uint8_t cls, uint64_t page_addr,
+                        const uint64_t *page_addrs, const uint64_t *old_addrs,
+                        void *buffer, uint32_t num_pages)
+{
+    uint64_t base = (uint64_t)ftl->first_zone * ftl->zone_num_pages;
+    uint32_t done = 0U;
+    while (done < num_pages) {
+        if (!stream->zone)
+            stream->zone = take_free_zone(ftl, stream == &ftl->gc ? 0U : 1U);
+        zns_page_zone *zone = stream->zone;
+        uint32_t n = num_pages - done;
+        if (n > ftl->zone_num_pages - zone->write_ptr)
+            n = ftl->zone_num_pages - zone->write_ptr;
+        // As much as the grant covers, split into appends of the largest
+        zns_sched_grant grant;
+        zns_sched_get(ftl->sched, cls, (uint64_t)n * ftl->page_size, &grant);
+        if (n > grant.size / ftl->page_size)
+            n = grant.size / ftl->page_size;
+        uint32_t max_pages = grant.max_cmd / ftl->page_size;
+        zone->write_ptr += n;
+        uint32_t num_reqs = (n + max_pages - 1U) / max_pages;
+        zns_io_req *reqs = (zns_io_req *)calloc(num_reqs, sizeof(zns_io_req));
+        for (uint32_t i = 0U; i < num_reqs; ++i) {
+            reqs[i].opcode = ZNS_IO_APPEND;
+            reqs[i].slba = zone->saddr;
+            reqs[i].num_pages = n - i * max_pages < max_pages ?
+                                n - i * max_pages : max_pages;
+            reqs[i].buffer = (char *)buffer +
+                             (uint64_t)(done + i * max_pages) * ftl->page_size;
+        }
+        int ret = zns_io_engine_submit(ftl->engine, reqs, num_reqs);
+        zns_sched_put(ftl->sched, &grant,
+                      ret ? 0ULL : (uint64_t)n * ftl->page_size);
+        for (uint32_t i = 0U; i < num_reqs; ++i) {
+            if (reqs[i].status)
+                continue;
+            __atomic_add_fetch(&zone->num_valid_pages, reqs[i].num_pages,
+                               __ATOMIC_RELAXED);
+            for (uint32_t j = 0U; j < reqs[i].num_pages; ++j) {
+                uint32_t k = done + i * max_pages + j;
+                uint64_t physical_addr = reqs[i].result - base + j;
+                uint64_t addr = page_addrs ? page_addrs[k] : page_addr + k;
+                set_p2l(ftl, physical_addr, addr);
+                zns_page_zone *stale = zone;
+                if (!old_addrs) {
+                    uint64_t old_addr = exchange_l2p(ftl, addr, physical_addr);
+                    stale = old_addr == ZNS_PAGE_UNMAPPED ?
+                            NULL : get_zone(ftl, old_addr);
+                } else if (replace_l2p(ftl, addr, old_addrs[k],
+                                       physical_addr)) {
+                    stale = get_zone(ftl, old_addrs[k]);
+                }
+                if (stale)
+                    __atomic_sub_fetch(&stale->num_valid_pages, 1U,
+                                       __ATOMIC_RELAXED);
+            }
+        }
+        free(reqs);
+        if (ret)
+            return ret;
+        if (zone->write_ptr == ftl->zone_num_pages) {
+            pthread_mutex_lock(&ftl->zones_lock);
+            zone->state = ZNS_PAGE_ZONE_FULL;
+            pthread_mutex_unlock(&ftl->zones_lock);
+            stream->zone = NULL;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// Call with zones_lock held. The full zone with the fewest valid pages, NULL
+// if no zone has anything to gain.
+static zns_page_zone *pick_victim(zns_page_ftl *ftl)
+{
+    zns_page_zone *victim = NULL;
+    uint32_t min_valid = ftl->zone_num_pages;
+    for (uint32_t i = 0U; i < ftl->num_zones; ++i) {
+        zns_page_zone *zone = &ftl->zones[i];
+        uint32_t num_valid = __atomic_load_n(&zone->num_valid_pages,
+                                             __ATOMIC_RELAXED);
+        if (zone->state == ZNS_PAGE_ZONE_FULL && num_valid < min_valid) {
+            victim = zone;
+            min_valid = num_valid;
+        }
+    }
+    return victim;
+}
+
+// Moves the pages of victim the map still points at to the gc stream, one
+// MDTS worth at a time, and frees it
+static void collect_zone(zns_page_ftl *ftl, zns_page_zone *victim)
+{
+    timespec start;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    uint64_t base = (uint64_t)ftl->first_zone * ftl->zone_num_pages;
+    uint64_t victim_addr = victim->saddr - base;
+    uint32_t chunk = ftl->mdts / ftl->page_size;
+    char *buffer = (char *)malloc((uint64_t)chunk * ftl->page_size);
+    uint64_t *page_addrs = (uint64_t *)calloc(chunk, sizeof(uint64_t));
+    uint64_t *old_addrs = (uint64_t *)calloc(chunk, sizeof(uint64_t));
+    zns_io_req *runs = (zns_io_req *)calloc(chunk, sizeof(zns_io_req));
+    uint64_t moved = 0ULL;
+    pthread_mutex_lock(&ftl->gc.lock);
+    for (uint32_t offset = 0U; offset < ftl->zone_num_pages; offset += chunk) {
+        uint32_t n = 0U;
+        uint32_t num_runs = 0U;
+        for (uint32_t i = offset; i < offset + chunk &&
+                                  i < ftl->zone_num_pages; ++i) {
+            uint64_t physical_addr = victim_addr + i;
+            uint64_t addr = get_p2l(ftl, physical_addr);
+            if (addr == ZNS_PAGE_UNMAPPED ||
+                get_l2p(ftl, addr) != physical_addr)
+                continue;
+            page_addrs[n] = addr;
+            old_addrs[n] = physical_addr;
+            if (n && old_addrs[n - 1U] + 1U == physical_addr) {
+                ++runs[num_runs - 1U].num_pages;
+            } else {
+                runs[num_runs].opcode = ZNS_IO_READ;
+                runs[num_runs].slba = physical_addr + base;
+                runs[num_runs].num_pages = 1U;
+                runs[num_runs].buffer = buffer + (uint64_t)n * ftl->page_size;
+                ++num_runs;
+            }
+            ++n;
+        }
+        // A page that fails to move stays where it is until the reset, its
+        // mapping is lost with it
+        if (read_pages(ftl, runs, num_runs, ZNS_CLASS_GC_READ) ||
+            append_pages(ftl, &ftl->gc, ZNS_CLASS_GC_WRITE, 0ULL, page_addrs,
+                         old_addrs, buffer, n))
+            printf("Failed to move pages of zone %llu\n",
+                   victim->saddr / ftl->zone_num_pages);
+        moved += n;
+    }
+    pthread_mutex_unlock(&ftl->gc.lock);
+    free(runs);
+    free(old_addrs);
+    free(page_addrs);
+    free(buffer);
+    // No reader is left on the old pages once the reset lock is ours
+    zns_io_req req;
+    memset(&req, 0, sizeof(req));
+    req.opcode = ZNS_IO_RESET;
+    req.slba = victim->saddr;
+    pthread_rwlock_wrlock(&ftl->reset_lock);
+    int ret = zns_io_engine_submit(ftl->engine, &req, 1U);
+    pthread_rwlock_unlock(&ftl->reset_lock);
+    if (ret) {
+        printf("Zone reset failed %d\n", ret);
+        return;
+    }
+    for (uint32_t i = 0U; i < ftl->zone_num_pages; ++i)
+        set_p2l(ftl, victim_addr + i, ZNS_PAGE_UNMAPPED);
+    __atomic_store_n(&victim->num_valid_pages, 0U, __ATOMIC_RELAXED);
+    put_free_zone(ftl, victim);
+    timespec end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    __atomic_add_fetch(&ftl->gc_zones, 1ULL, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ftl->gc_pages, moved, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ftl->gc_cpu_ns,
+                       (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                       end.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+}
+
+// Collects zones while no more than gc_wmark are free
+static void *page_gc(void *ftl_ptr)
+{
+    zns_page_ftl *ftl = (zns_page_ftl *)ftl_ptr;
+    pthread_mutex_lock(&ftl->zones_lock);
+    while (ftl->run_gc) {
+        zns_page_zone *victim = NULL;
+        if (ftl->num_free_zones <= ftl->gc_wmark)
+            victim = pick_victim(ftl);
+        if (!victim) {
+            pthread_cond_wait(&ftl->gc_cond, &ftl->zones_lock);
+            continue;
+        }
+        victim->state = ZNS_PAGE_ZONE_VICTIM;
+        pthread_mutex_unlock(&ftl->zones_lock);
+        collect_zone(ftl, victim);
+        pthread_mutex_lock(&ftl->zones_lock);
+    }
+    pthread_mutex_unlock(&ftl->zones_lock);
+    return NULL;
+}
+
+}
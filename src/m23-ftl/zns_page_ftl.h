@@ -0,0 +1,118 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_PAGE_FTL_H
+#define STOSYS_PROJECT_ZNS_PAGE_FTL_H
+
+#include <cstdint>
+#include <pthread.h>
+#include "zns_device.h"
+#include "zns_io_engine.h"
+#include "zns_sched.h"
+
+extern "C" {
+
+// Fully page mapped, log structured FTL (ZNS_FTL_PAGE). Every zone is a log
+// zone: writes go to the open user zone, a flat array maps each logical page
+// to where it was last written, and gc moves the valid pages of the zone
+// with the fewest of them to the open gc zone before resetting it. No block
+// is ever merged, so random overwrites only cost what gc relocates.
+//
+// Entries are 32 bit, 64 bit if the device has 2^32 pages or more. The map
+// is not persisted, the device is formatted at every init.
+
+#define ZNS_PAGE_UNMAPPED 0xffffffffffffffffULL
+
+enum zns_page_zone_state {
+    ZNS_PAGE_ZONE_FREE = 0,
+    ZNS_PAGE_ZONE_OPEN, // written by the user or the gc stream
+    ZNS_PAGE_ZONE_FULL, // gc candidate
+    ZNS_PAGE_ZONE_VICTIM // being collected
+};
+
+struct zns_page_zone {
+    unsigned long long saddr;
+    uint32_t write_ptr;
+    uint32_t num_valid_pages; // atomic, pages the map points at
+    uint8_t state; // zns_page_zone_state, changed under zones_lock
+    zns_page_zone *next; // free list
+};
+
+// An open zone and the lock serializing its writers
+struct zns_page_stream {
+    zns_page_zone *zone;
+    pthread_mutex_t lock;
+};
+
+struct zns_page_ftl {
+    zns_io_engine *engine;
+    zns_sched *sched;
+    uint32_t page_size;
+    uint32_t zone_num_pages;
+    uint32_t first_zone; // zones before it are not used
+    uint32_t num_zones;
+    uint64_t num_pages; // logical pages
+    uint32_t mdts;
+    uint32_t gc_wmark; // free zones gc keeps, writers stall at one
+    // Logical to physical and physical to logical page, physical pages count
+    // from first_zone. One of the pairs is allocated, see wide.
+    bool wide;
+    uint32_t *l2p32;
+    uint32_t *p2l32;
+    uint64_t *l2p64;
+    uint64_t *p2l64;
+    zns_page_zone *zones;
+    zns_page_stream user;
+    zns_page_stream gc;
+    uint32_t num_free_zones;
+    zns_page_zone *free_zones;
+    pthread_mutex_t zones_lock;
+    pthread_cond_t free_cond; // a zone was freed
+    pthread_cond_t gc_cond; // free zones dropped to the watermark
+    // Readers hold it across their reads, a zone is only reset with it held
+    // for writing
+    pthread_rwlock_t reset_lock;
+    bool run_gc;
+    pthread_t gc_thread;
+    uint64_t gc_zones;
+    uint64_t gc_pages;
+    uint64_t gc_cpu_ns;
+};
+
+// Zones [first_zone, num_zones) are reset and become the log, the device
+// exports num_pages logical pages
+int zns_page_ftl_init(zns_page_ftl *ftl, zns_io_engine *engine,
+                      zns_sched *sched, uint32_t page_size,
+                      uint32_t zone_num_pages, uint32_t first_zone,
+                      uint32_t num_zones, uint64_t num_pages, uint32_t mdts,
+                      int gc_wmark);
+void zns_page_ftl_destroy(zns_page_ftl *ftl);
+// Same contract as zns_udevice_read/write, reading an unwritten page fails
+int zns_page_ftl_read(zns_page_ftl *ftl, uint64_t address, void *buffer,
+                      uint32_t size);
+int zns_page_ftl_write(zns_page_ftl *ftl, uint64_t address, void *buffer,
+                       uint32_t size);
+void zns_page_ftl_stats(zns_page_ftl *ftl, zns_udevice_stats *stats);
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_PAGE_FTL_H
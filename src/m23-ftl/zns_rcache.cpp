@@ -0,0 +1,404 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "zns_rcache.h"
+
+extern "C" {
+
+// Smaller shards would be left with too few pages for their hot set
+#define ZNS_RCACHE_MIN_SHARD_PAGES 64U
+#define ZNS_RCACHE_MAX_FREQ 3U
+
+static int init_shard(zns_rcache_shard *shard, uint64_t num_slots);
+static void destroy_shard(zns_rcache_shard *shard);
+static inline uint64_t hash_page(unsigned long long page_addr);
+static inline zns_rcache_shard *get_shard(zns_rcache *cache,
+                                          unsigned long long page_addr);
+static zns_rcache_shard *lock_shard(zns_rcache *cache, zns_rcache_shard *held,
+                                    unsigned long long page_addr);
+static uint32_t find_slot(zns_rcache_shard *shard,
+                          unsigned long long page_addr, uint32_t **link);
+static void insert_page(zns_rcache_shard *shard, uint32_t page_size,
+                        unsigned long long page_addr, const void *page);
+static inline void push_fifo(zns_rcache_shard *shard, uint8_t queue,
+                             uint32_t slot);
+static inline uint32_t pop_fifo(zns_rcache_shard *shard, uint8_t queue);
+static void evict(zns_rcache_shard *shard);
+static void evict_small(zns_rcache_shard *shard);
+static void evict_main(zns_rcache_shard *shard);
+static void remove_slot(zns_rcache_shard *shard, uint32_t slot);
+static inline void free_slot(zns_rcache_shard *shard, uint32_t slot);
+
+int zns_rcache_init(zns_rcache *cache, uint32_t page_size, uint64_t num_pages)
+{
+    memset(cache, 0, sizeof(zns_rcache));
+    cache->page_size = page_size;
+    cache->num_shards = ZNS_RCACHE_MAX_SHARDS;
+    while (cache->num_shards > 1U &&
+           num_pages / cache->num_shards < ZNS_RCACHE_MIN_SHARD_PAGES)
+        cache->num_shards >>= 1U;
+    size_t size = cache->num_shards * sizeof(zns_rcache_shard);
+    int ret = posix_memalign((void **)&cache->shards,
+                             alignof(zns_rcache_shard), size);
+    if (ret) {
+        cache->shards = NULL;
+        return ret;
+    }
+    memset(cache->shards, 0, size);
+    uint64_t num_slots = num_pages / cache->num_shards;
+    for (uint32_t i = 0U; i < cache->num_shards; ++i) {
+        ret = init_shard(&cache->shards[i], num_slots ? num_slots : 1ULL);
+        if (ret) {
+            zns_rcache_destroy(cache);
+            return ret;
+        }
+        cache->shards[i].data = (char *)malloc(cache->shards[i].num_slots *
+                                               (size_t)page_size);
+        if (!cache->shards[i].data) {
+            zns_rcache_destroy(cache);
+            return ENOMEM;
+        }
+    }
+    return 0;
+}
+
+void zns_rcache_destroy(zns_rcache *cache)
+{
+    if (!cache->shards)
+        return;
+    for (uint32_t i = 0U; i < cache->num_shards; ++i)
+        destroy_shard(&cache->shards[i]);
+    free(cache->shards);
+    cache->shards = NULL;
+}
+
+void zns_rcache_snapshot(zns_rcache *cache, uint64_t *seqs)
+{
+    for (uint32_t i = 0U; i < cache->num_shards; ++i)
+        seqs[i] = __atomic_load_n(&cache->shards[i].seq, __ATOMIC_SEQ_CST);
+}
+
+uint32_t zns_rcache_get(zns_rcache *cache, unsigned long long page_addr,
+                        uint32_t num_pages, void *buffer, uint64_t *present)
+{
+    uint32_t found = 0U;
+    zns_rcache_shard *shard = NULL;
+    for (uint32_t i = 0U; i < num_pages; ++i) {
+        if (present[i >> 6U] >> (i & 63U) & 1ULL)
+            continue;
+        shard = lock_shard(cache, shard, page_addr + i);
+        uint32_t *link;
+        uint32_t slot = find_slot(shard, page_addr + i, &link);
+        if (slot == ZNS_RCACHE_NO_SLOT) {
+            ++shard->misses;
+            continue;
+        }
+        memcpy((char *)buffer + (size_t)i * cache->page_size,
+               shard->data + (size_t)slot * cache->page_size,
+               cache->page_size);
+        if (shard->slots[slot].freq < ZNS_RCACHE_MAX_FREQ)
+            ++shard->slots[slot].freq;
+        present[i >> 6U] |= 1ULL << (i & 63U);
+        ++shard->hits;
+        ++found;
+    }
+    if (shard)
+        pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+void zns_rcache_fill(zns_rcache *cache, unsigned long long page_addr,
+                     uint32_t num_pages, const void *buffer,
+                     const uint64_t *seqs)
+{
+    zns_rcache_shard *shard = NULL;
+    for (uint32_t i = 0U; i < num_pages; ++i) {
+        shard = lock_shard(cache, shard, page_addr + i);
+        // A write may have come after the device read, its data is stale
+        if (shard->seq != seqs[shard - cache->shards])
+            continue;
+        insert_page(shard, cache->page_size, page_addr + i,
+                    (const char *)buffer + (size_t)i * cache->page_size);
+    }
+    if (shard)
+        pthread_mutex_unlock(&shard->lock);
+}
+
+void zns_rcache_invalidate(zns_rcache *cache, unsigned long long page_addr,
+                           uint32_t num_pages)
+{
+    zns_rcache_shard *shard = NULL;
+    for (uint32_t i = 0U; i < num_pages; ++i) {
+        zns_rcache_shard *next = lock_shard(cache, shard, page_addr + i);
+        // Fills that read before this write are dropped from now on
+        if (next != shard)
+            __atomic_add_fetch(&next->seq, 1ULL, __ATOMIC_SEQ_CST);
+        shard = next;
+        uint32_t *link;
+        uint32_t slot = find_slot(shard, page_addr + i, &link);
+        if (slot == ZNS_RCACHE_NO_SLOT)
+            continue;
+        // Its FIFO still refers to it, the slot is freed from there
+        *link = shard->slots[slot].next;
+        shard->slots[slot].queue = ZNS_RCACHE_DEAD;
+        ++shard->invalidations;
+    }
+    if (shard)
+        pthread_mutex_unlock(&shard->lock);
+}
+
+void zns_rcache_stats(zns_rcache *cache, uint64_t *hits, uint64_t *misses,
+                      uint64_t *evictions, uint64_t *invalidations)
+{
+    *hits = 0ULL;
+    *misses = 0ULL;
+    *evictions = 0ULL;
+    *invalidations = 0ULL;
+    for (uint32_t i = 0U; i < cache->num_shards; ++i) {
+        zns_rcache_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        *hits += shard->hits;
+        *misses += shard->misses;
+        *evictions += shard->evictions;
+        *invalidations += shard->invalidations;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static int init_shard(zns_rcache_shard *shard, uint64_t num_slots)
+{
+    pthread_mutex_init(&shard->lock, NULL);
+    if (num_slots >= ZNS_RCACHE_NO_SLOT)
+        num_slots = ZNS_RCACHE_NO_SLOT - 1U;
+    shard->num_slots = num_slots;
+    shard->num_buckets = 1U;
+    while (shard->num_buckets < num_slots)
+        shard->num_buckets <<= 1U;
+    shard->buckets = (uint32_t *)malloc(shard->num_buckets *
+                                        sizeof(uint32_t));
+    shard->slots = (zns_rcache_slot *)calloc(num_slots,
+                                             sizeof(zns_rcache_slot));
+    shard->small = (uint32_t *)malloc(num_slots * sizeof(uint32_t));
+    shard->main = (uint32_t *)malloc(num_slots * sizeof(uint32_t));
+    // As many ghosts as the main FIFO holds pages
+    shard->ghosts = (zns_rcache_ghost *)calloc(shard->num_buckets,
+                                               sizeof(zns_rcache_ghost));
+    if (!shard->buckets || !shard->slots || !shard->small || !shard->main ||
+        !shard->ghosts)
+        return ENOMEM;
+    shard->ghost_mask = shard->num_buckets - 1U;
+    memset(shard->buckets, 0xff, shard->num_buckets * sizeof(uint32_t));
+    for (uint32_t i = 0U; i < num_slots; ++i)
+        shard->slots[i].next = i + 1U < num_slots ? i + 1U :
+                               ZNS_RCACHE_NO_SLOT;
+    shard->free_slots = 0U;
+    shard->small_max = num_slots / 10U ? num_slots / 10U : 1U;
+    return 0;
+}
+
+static void destroy_shard(zns_rcache_shard *shard)
+{
+    free(shard->buckets);
+    free(shard->slots);
+    free(shard->data);
+    free(shard->small);
+    free(shard->main);
+    free(shard->ghosts);
+    pthread_mutex_destroy(&shard->lock);
+}
+
+static inline uint64_t hash_page(unsigned long long page_addr)
+{
+    return page_addr * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline zns_rcache_shard *get_shard(zns_rcache *cache,
+                                          unsigned long long page_addr)
+{
+    uint64_t hash = hash_page(page_addr / ZNS_RCACHE_SHARD_PAGES);
+    return &cache->shards[(hash >> 32U) & (cache->num_shards - 1U)];
+}
+
+// Keeps held locked if page_addr is in it, else swaps it for the shard of
+// page_addr
+static zns_rcache_shard *lock_shard(zns_rcache *cache, zns_rcache_shard *held,
+                                    unsigned long long page_addr)
+{
+    zns_rcache_shard *shard = get_shard(cache, page_addr);
+    if (shard == held)
+        return held;
+    if (held)
+        pthread_mutex_unlock(&held->lock);
+    pthread_mutex_lock(&shard->lock);
+    return shard;
+}
+
+// Call with lock held. link is left at the index that points to the slot,
+// or at the end of the chain if the page is not cached.
+static uint32_t find_slot(zns_rcache_shard *shard,
+                          unsigned long long page_addr, uint32_t **link)
+{
+    *link = &shard->buckets[(hash_page(page_addr) >> 32U) &
+                            (shard->num_buckets - 1U)];
+    while (**link != ZNS_RCACHE_NO_SLOT) {
+        zns_rcache_slot *slot = &shard->slots[**link];
+        if (slot->page_addr == page_addr)
+            return **link;
+        *link = &slot->next;
+    }
+    return ZNS_RCACHE_NO_SLOT;
+}
+
+// Call with lock held
+static void insert_page(zns_rcache_shard *shard, uint32_t page_size,
+                        unsigned long long page_addr, const void *page)
+{
+    uint32_t *link;
+    // Another read filled it first
+    if (find_slot(shard, page_addr, &link) != ZNS_RCACHE_NO_SLOT)
+        return;
+    if (shard->free_slots == ZNS_RCACHE_NO_SLOT) {
+        evict(shard);
+        find_slot(shard, page_addr, &link);
+    }
+    uint32_t slot = shard->free_slots;
+    zns_rcache_slot *entry = &shard->slots[slot];
+    shard->free_slots = entry->next;
+    *link = slot;
+    entry->next = ZNS_RCACHE_NO_SLOT;
+    entry->page_addr = page_addr;
+    entry->freq = 0U;
+    memcpy(shard->data + (size_t)slot * page_size, page, page_size);
+    // Evicted from the small FIFO not long ago, it is read more than once
+    zns_rcache_ghost *ghost = &shard->ghosts[hash_page(page_addr) &
+                                             shard->ghost_mask];
+    if (ghost->page_addr == page_addr + 1ULL &&
+        shard->ghost_clock - ghost->clock <= shard->ghost_mask) {
+        ghost->page_addr = 0ULL;
+        push_fifo(shard, ZNS_RCACHE_MAIN, slot);
+    } else {
+        push_fifo(shard, ZNS_RCACHE_SMALL, slot);
+    }
+}
+
+static inline void push_fifo(zns_rcache_shard *shard, uint8_t queue,
+                             uint32_t slot)
+{
+    shard->slots[slot].queue = queue;
+    if (queue == ZNS_RCACHE_SMALL) {
+        shard->small[(shard->small_head + shard->small_count) %
+                     shard->num_slots] = slot;
+        ++shard->small_count;
+    } else {
+        shard->main[(shard->main_head + shard->main_count) %
+                    shard->num_slots] = slot;
+        ++shard->main_count;
+    }
+}
+
+static inline uint32_t pop_fifo(zns_rcache_shard *shard, uint8_t queue)
+{
+    uint32_t slot;
+    if (queue == ZNS_RCACHE_SMALL) {
+        slot = shard->small[shard->small_head];
+        shard->small_head = (shard->small_head + 1U) % shard->num_slots;
+        --shard->small_count;
+    } else {
+        slot = shard->main[shard->main_head];
+        shard->main_head = (shard->main_head + 1U) % shard->num_slots;
+        --shard->main_count;
+    }
+    return slot;
+}
+
+// Frees at least one slot. Every slot in use is in one of the FIFOs.
+static void evict(zns_rcache_shard *shard)
+{
+    while (shard->free_slots == ZNS_RCACHE_NO_SLOT) {
+        if (shard->small_count && (shard->small_count > shard->small_max ||
+                                   !shard->main_count))
+            evict_small(shard);
+        else
+            evict_main(shard);
+    }
+}
+
+// Pages hit while in the small FIFO move on to the main FIFO, the others
+// leave a ghost
+static void evict_small(zns_rcache_shard *shard)
+{
+    uint32_t slot = pop_fifo(shard, ZNS_RCACHE_SMALL);
+    zns_rcache_slot *entry = &shard->slots[slot];
+    if (entry->queue == ZNS_RCACHE_DEAD) {
+        free_slot(shard, slot);
+        return;
+    }
+    if (entry->freq) {
+        entry->freq = 0U;
+        push_fifo(shard, ZNS_RCACHE_MAIN, slot);
+        return;
+    }
+    zns_rcache_ghost *ghost = &shard->ghosts[hash_page(entry->page_addr) &
+                                             shard->ghost_mask];
+    ghost->page_addr = entry->page_addr + 1ULL;
+    ghost->clock = ++shard->ghost_clock;
+    remove_slot(shard, slot);
+}
+
+// Pages hit since their last round get another one
+static void evict_main(zns_rcache_shard *shard)
+{
+    uint32_t slot = pop_fifo(shard, ZNS_RCACHE_MAIN);
+    zns_rcache_slot *entry = &shard->slots[slot];
+    if (entry->queue == ZNS_RCACHE_DEAD) {
+        free_slot(shard, slot);
+        return;
+    }
+    if (entry->freq) {
+        --entry->freq;
+        push_fifo(shard, ZNS_RCACHE_MAIN, slot);
+        return;
+    }
+    remove_slot(shard, slot);
+}
+
+static void remove_slot(zns_rcache_shard *shard, uint32_t slot)
+{
+    uint32_t *link;
+    find_slot(shard, shard->slots[slot].page_addr, &link);
+    *link = shard->slots[slot].next;
+    free_slot(shard, slot);
+    ++shard->evictions;
+}
+
+static inline void free_slot(zns_rcache_shard *shard, uint32_t slot)
+{
+    shard->slots[slot].queue = ZNS_RCACHE_FREE;
+    shard->slots[slot].next = shard->free_slots;
+    shard->free_slots = slot;
+}
+
+}
@@ -0,0 +1,123 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_RCACHE_H
+#define STOSYS_PROJECT_ZNS_RCACHE_H
+
+#include <cstdint>
+#include <pthread.h>
+
+extern "C" {
+
+// Read cache of logical pages, split in shards by runs of
+// ZNS_RCACHE_SHARD_PAGES pages so a read mostly takes one shard lock.
+// Each shard evicts with S3-FIFO: new pages enter a small FIFO, and only
+// the ones hit again while there move to the main FIFO, which gives pages
+// with hits another round. Pages evicted from the small FIFO are
+// remembered in a ghost table, and go straight to the main FIFO when read
+// again soon. A scan so only ever churns the small FIFO.
+//
+// The cache holds logical pages, so moving pages between zones leaves it
+// valid and only writes invalidate it. A fill carries the invalidation
+// counters of before its device read, and is dropped if a write to its
+// shard came in between.
+
+#define ZNS_RCACHE_MAX_SHARDS 16U
+#define ZNS_RCACHE_SHARD_PAGES 16U
+#define ZNS_RCACHE_NO_SLOT 0xffffffffU
+
+enum zns_rcache_queue {
+    ZNS_RCACHE_FREE = 0,
+    ZNS_RCACHE_SMALL,
+    ZNS_RCACHE_MAIN,
+    ZNS_RCACHE_DEAD // invalidated, freed once its FIFO gets to it
+};
+
+struct zns_rcache_slot {
+    unsigned long long page_addr;
+    uint32_t next; // in its hash chain or the free list
+    uint8_t freq; // hits since it entered its FIFO, at most 3
+    uint8_t queue; // zns_rcache_queue
+};
+
+// Page evicted from the small FIFO, one per ghost table entry
+struct zns_rcache_ghost {
+    unsigned long long page_addr; // plus one, 0 if empty
+    uint64_t clock; // of the shard when it was evicted
+};
+
+struct alignas(64) zns_rcache_shard {
+    pthread_mutex_t lock;
+    uint32_t num_slots;
+    uint32_t free_slots;
+    uint32_t num_buckets; // power of two
+    uint32_t *buckets;
+    zns_rcache_slot *slots;
+    char *data; // num_slots pages, slot i at page i
+    // FIFOs of slot indexes, num_slots entries each
+    uint32_t *small;
+    uint32_t small_head;
+    uint32_t small_count;
+    uint32_t small_max; // a tenth of the slots
+    uint32_t *main;
+    uint32_t main_head;
+    uint32_t main_count;
+    zns_rcache_ghost *ghosts; // direct mapped, a power of two
+    uint32_t ghost_mask;
+    uint64_t ghost_clock; // evictions into the ghost table
+    uint64_t seq; // bumped by every invalidation, atomic
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+struct zns_rcache {
+    uint32_t page_size;
+    uint32_t num_shards; // power of two
+    zns_rcache_shard *shards;
+};
+
+// num_pages of memory for the pages, split over the shards
+int zns_rcache_init(zns_rcache *cache, uint32_t page_size, uint64_t num_pages);
+void zns_rcache_destroy(zns_rcache *cache);
+// Takes the invalidation counters before a device read, seqs has
+// ZNS_RCACHE_MAX_SHARDS entries
+void zns_rcache_snapshot(zns_rcache *cache, uint64_t *seqs);
+// Copies the cached pages of the range whose bit in present is clear to
+// their place in buffer and sets their bits. Returns how many.
+uint32_t zns_rcache_get(zns_rcache *cache, unsigned long long page_addr,
+                        uint32_t num_pages, void *buffer, uint64_t *present);
+// Caches the pages of buffer read from the device, unless their shard was
+// invalidated since seqs were taken
+void zns_rcache_fill(zns_rcache *cache, unsigned long long page_addr,
+                     uint32_t num_pages, const void *buffer,
+                     const uint64_t *seqs);
+// Drops the pages of the range, call once a write of them is done
+void zns_rcache_invalidate(zns_rcache *cache, unsigned long long page_addr,
+                           uint32_t num_pages);
+void zns_rcache_stats(zns_rcache *cache, uint64_t *hits, uint64_t *misses,
+                      uint64_t *evictions, uint64_t *invalidations);
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_RCACHE_H
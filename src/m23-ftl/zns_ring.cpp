@@ -0,0 +1,114 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <sched.h>
+#include "zns_ring.h"
+
+extern "C" {
+
+int zns_ring_init(zns_ring *ring, uint32_t capacity)
+{
+    uint64_t size = 1ULL;
+    while (size < capacity)
+        size <<= 1U;
+    ring->cells = (zns_ring_cell *)calloc(size, sizeof(zns_ring_cell));
+    if (!ring->cells)
+        return ENOMEM;
+    // Cell i takes the push of position i first
+    for (uint64_t i = 0ULL; i < size; ++i)
+        ring->cells[i].seq = i;
+    ring->mask = size - 1ULL;
+    ring->head = 0ULL;
+    ring->tail = 0ULL;
+    ring->count = 0U;
+    return 0;
+}
+
+void zns_ring_destroy(zns_ring *ring)
+{
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+bool zns_ring_push(zns_ring *ring, uint32_t value)
+{
+    zns_ring_cell *cell;
+    uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (!diff) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1ULL,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // Still holds the value of the last lap
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->value = value;
+    __atomic_store_n(&cell->seq, pos + 1ULL, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ring->count, 1U, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool zns_ring_pop(zns_ring *ring, uint32_t *value)
+{
+    uint32_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+    do {
+        if (!count)
+            return false;
+    } while (!__atomic_compare_exchange_n(&ring->count, &count, count - 1U,
+                                          true, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+    zns_ring_cell *cell;
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - (pos + 1ULL));
+        if (!diff) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1ULL,
+                                            true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else {
+            // A push claimed the cell and has not filled it yet
+            if (diff < 0)
+                sched_yield();
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    *value = cell->value;
+    // Ready for the push of the next lap
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1ULL, __ATOMIC_RELEASE);
+    return true;
+}
+
+}
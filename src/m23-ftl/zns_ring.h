@@ -0,0 +1,69 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_RING_H
+#define STOSYS_PROJECT_ZNS_RING_H
+
+#include <cstdint>
+
+extern "C" {
+
+// Bounded lock-free ring of 32 bit values for any number of producers and
+// consumers. Every cell carries a sequence number that says whether it is
+// ready for the next push or the next pop of its turn, so a push or pop is
+// one CAS on the tail or head plus a release store on the cell.
+//
+// count is raised after a value is in its cell and lowered before a value
+// is taken, so a pop that got past count always finds a value, at worst
+// after waiting for a push that claimed an earlier cell to fill it.
+
+#define ZNS_RING_CACHE_LINE 64U
+
+struct zns_ring_cell {
+    uint64_t seq;
+    uint32_t value;
+};
+
+struct zns_ring {
+    zns_ring_cell *cells;
+    uint64_t mask; // capacity - 1
+    alignas(ZNS_RING_CACHE_LINE) uint64_t head; // next pop
+    alignas(ZNS_RING_CACHE_LINE) uint64_t tail; // next push
+    alignas(ZNS_RING_CACHE_LINE) uint32_t count; // values not taken yet
+};
+
+// Holds at least capacity values
+int zns_ring_init(zns_ring *ring, uint32_t capacity);
+void zns_ring_destroy(zns_ring *ring);
+// false if the ring is full
+bool zns_ring_push(zns_ring *ring, uint32_t value);
+// false if the ring is empty
+bool zns_ring_pop(zns_ring *ring, uint32_t *value);
+
+static inline uint32_t zns_ring_count(const zns_ring *ring)
+{
+    return __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+}
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_RING_H
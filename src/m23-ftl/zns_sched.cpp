@@ -0,0 +1,218 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include "zns_device.h"
+#include "zns_sched.h"
+
+extern "C" {
+
+static uint64_t sched_now_us();
+static bool take_credits(zns_sched *sched, zns_sched_class *c, uint32_t want,
+                         uint32_t *taken);
+static bool try_get(zns_sched *sched, uint8_t cls, uint32_t want,
+                    zns_sched_grant *grant);
+static uint32_t clamp_want(zns_sched *sched, uint64_t want);
+
+void zns_sched_init(zns_sched *sched, uint32_t page_size, uint32_t mdts,
+                    uint32_t zasl, uint32_t depth, const uint32_t *weights)
+{
+    static const uint32_t default_weights[ZNS_NUM_CLASSES] =
+            ZNS_SCHED_DEFAULT_WEIGHTS;
+    memset(sched, 0, sizeof(zns_sched));
+    uint32_t sum = 0U;
+    for (uint32_t i = 0U; weights && i < ZNS_NUM_CLASSES; ++i)
+        sum += weights[i];
+    if (!sum)
+        weights = default_weights;
+    sum = 0U;
+    for (uint32_t i = 0U; i < ZNS_NUM_CLASSES; ++i)
+        sum += weights[i];
+    sched->page_size = page_size;
+    uint64_t budget = (uint64_t)mdts * (depth ? depth : 1U);
+    if (budget > 0x80000000ULL)
+        budget = 0x80000000ULL;
+    for (uint32_t i = 0U; i < ZNS_NUM_CLASSES; ++i) {
+        zns_sched_class *c = &sched->classes[i];
+        // Round to pages, every class can always move at least one page
+        c->pool = (uint32_t)(budget * weights[i] / sum);
+        c->pool -= c->pool % page_size;
+        if (c->pool < page_size)
+            c->pool = page_size;
+        c->credits = c->pool;
+        c->max_cmd = i == ZNS_CLASS_USER_WRITE || i == ZNS_CLASS_GC_WRITE ?
+                     zasl : mdts;
+    }
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->cond, NULL);
+    sched->start_us = sched_now_us();
+}
+
+void zns_sched_destroy(zns_sched *sched)
+{
+    pthread_cond_destroy(&sched->cond);
+    pthread_mutex_destroy(&sched->lock);
+}
+
+uint32_t zns_sched_max_cmd(zns_sched *sched, uint8_t cls)
+{
+    return sched->classes[cls].max_cmd;
+}
+
+void zns_sched_get(zns_sched *sched, uint8_t cls, uint64_t want,
+                   zns_sched_grant *grant)
+{
+    memset(grant, 0, sizeof(zns_sched_grant));
+    grant->cls = cls;
+    grant->max_cmd = sched->classes[cls].max_cmd;
+    uint32_t size = clamp_want(sched, want);
+    __atomic_add_fetch(&sched->classes[cls].active, 1U, __ATOMIC_SEQ_CST);
+    if (try_get(sched, cls, size, grant))
+        return;
+    __atomic_add_fetch(&sched->classes[cls].waits, 1ULL, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&sched->lock);
+    // Count as waiter before retrying, so a put in between sees us
+    __atomic_add_fetch(&sched->waiters, 1U, __ATOMIC_SEQ_CST);
+    while (!try_get(sched, cls, size, grant))
+        pthread_cond_wait(&sched->cond, &sched->lock);
+    __atomic_sub_fetch(&sched->waiters, 1U, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+bool zns_sched_try_get(zns_sched *sched, uint8_t cls, uint64_t want,
+                       zns_sched_grant *grant)
+{
+    memset(grant, 0, sizeof(zns_sched_grant));
+    grant->cls = cls;
+    grant->max_cmd = sched->classes[cls].max_cmd;
+    __atomic_add_fetch(&sched->classes[cls].active, 1U, __ATOMIC_SEQ_CST);
+    if (try_get(sched, cls, clamp_want(sched, want), grant))
+        return true;
+    // Idle again, waiters may borrow from the pool
+    __atomic_sub_fetch(&sched->classes[cls].active, 1U, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched->waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_broadcast(&sched->cond);
+        pthread_mutex_unlock(&sched->lock);
+    }
+    return false;
+}
+
+void zns_sched_put(zns_sched *sched, zns_sched_grant *grant, uint64_t done)
+{
+    zns_sched_class *c = &sched->classes[grant->cls];
+    __atomic_add_fetch(&c->bytes, done, __ATOMIC_RELAXED);
+    for (uint32_t i = 0U; i < ZNS_NUM_CLASSES; ++i) {
+        if (grant->taken[i])
+            __atomic_add_fetch(&sched->classes[i].credits, grant->taken[i],
+                               __ATOMIC_SEQ_CST);
+    }
+    __atomic_sub_fetch(&c->active, 1U, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched->waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_broadcast(&sched->cond);
+        pthread_mutex_unlock(&sched->lock);
+    }
+    grant->size = 0U;
+}
+
+void zns_sched_stats(zns_sched *sched, zns_udevice_stats *stats)
+{
+    stats->uptime_us = sched_now_us() - sched->start_us;
+    for (uint32_t i = 0U; i < ZNS_NUM_CLASSES; ++i) {
+        zns_sched_class *c = &sched->classes[i];
+        stats->class_bytes[i] = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+        stats->class_waits[i] = __atomic_load_n(&c->waits, __ATOMIC_RELAXED);
+        stats->class_borrowed[i] = __atomic_load_n(&c->borrowed,
+                                                   __ATOMIC_RELAXED);
+        // bytes per microsecond is MB/s
+        stats->class_mbps[i] = stats->uptime_us ?
+                               (double)stats->class_bytes[i] /
+                               stats->uptime_us : 0.0;
+    }
+}
+
+static uint64_t sched_now_us()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000ULL;
+}
+
+// Take up to want bytes, in whole pages, from a pool
+static bool take_credits(zns_sched *sched, zns_sched_class *c, uint32_t want,
+                         uint32_t *taken)
+{
+    uint32_t credits = __atomic_load_n(&c->credits, __ATOMIC_SEQ_CST);
+    for (;;) {
+        uint32_t size = credits < want ? credits : want;
+        size -= size % sched->page_size;
+        if (!size)
+            return false;
+        if (__atomic_compare_exchange_n(&c->credits, &credits, credits - size,
+                                        true, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST)) {
+            *taken += size;
+            return true;
+        }
+    }
+}
+
+// At least a page, at most what all pools hold
+static uint32_t clamp_want(zns_sched *sched, uint64_t want)
+{
+    uint64_t total = 0ULL;
+    for (uint32_t i = 0U; i < ZNS_NUM_CLASSES; ++i)
+        total += sched->classes[i].pool;
+    if (want > total)
+        want = total;
+    if (want < sched->page_size)
+        want = sched->page_size;
+    return (uint32_t)want;
+}
+
+// Own pool first, then top up from classes with nothing going on
+static bool try_get(zns_sched *sched, uint8_t cls, uint32_t want,
+                    zns_sched_grant *grant)
+{
+    zns_sched_class *c = &sched->classes[cls];
+    take_credits(sched, c, want, &grant->taken[cls]);
+    grant->size = grant->taken[cls];
+    for (uint32_t i = 0U; i < ZNS_NUM_CLASSES && grant->size < want; ++i) {
+        zns_sched_class *other = &sched->classes[i];
+        if (i == cls || __atomic_load_n(&other->active, __ATOMIC_SEQ_CST))
+            continue;
+        uint32_t before = grant->taken[i];
+        if (take_credits(sched, other, want - grant->size,
+                         &grant->taken[i])) {
+            grant->size += grant->taken[i] - before;
+            __atomic_add_fetch(&c->borrowed, grant->taken[i] - before,
+                               __ATOMIC_RELAXED);
+        }
+    }
+    return grant->size;
+}
+
+}
@@ -0,0 +1,90 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_SCHED_H
+#define STOSYS_PROJECT_ZNS_SCHED_H
+
+#include <cstdint>
+#include <pthread.h>
+#include "zns_device.h"
+
+extern "C" {
+
+// Credit based scheduler for the device transfer budget (io depth commands
+// of MDTS bytes in flight). Every zns_io_class owns a pool of credits sized
+// by its weight and takes from it with atomics. A class that runs dry
+// borrows from classes that have nothing in flight, so an idle class never
+// wastes device time, and only sleeps when neither works. Borrowed credits
+// go back to their owner.
+//
+// A grant is the bytes a caller may have in flight. It sends at most that
+// much per batch, split into commands of max_cmd, and gets a new grant for
+// the rest.
+
+struct zns_sched_class {
+    uint32_t credits; // free bytes of this pool
+    uint32_t pool; // size of the pool
+    uint32_t max_cmd; // largest single command, MDTS or ZASL
+    uint32_t active; // callers holding or waiting for a grant
+    uint64_t bytes;
+    uint64_t waits;
+    uint64_t borrowed;
+};
+
+struct zns_sched {
+    uint32_t page_size;
+    zns_sched_class classes[ZNS_NUM_CLASSES];
+    uint32_t waiters;
+    pthread_mutex_t lock; // slow path only
+    pthread_cond_t cond;
+    uint64_t start_us;
+};
+
+// Credits held by one caller, taken[i] came from class i
+struct zns_sched_grant {
+    uint32_t size;
+    uint32_t max_cmd; // of cls
+    uint8_t cls;
+    uint32_t taken[ZNS_NUM_CLASSES];
+};
+
+// The budget is depth commands of mdts bytes. weights may be NULL or all 0
+// for ZNS_SCHED_DEFAULT_WEIGHTS.
+void zns_sched_init(zns_sched *sched, uint32_t page_size, uint32_t mdts,
+                    uint32_t zasl, uint32_t depth, const uint32_t *weights);
+void zns_sched_destroy(zns_sched *sched);
+uint32_t zns_sched_max_cmd(zns_sched *sched, uint8_t cls);
+// Grants up to want bytes, blocks until at least one page worth of credits
+// is available
+void zns_sched_get(zns_sched *sched, uint8_t cls, uint64_t want,
+                   zns_sched_grant *grant);
+// Like zns_sched_get, but false instead of blocking if no credits are free
+bool zns_sched_try_get(zns_sched *sched, uint8_t cls, uint64_t want,
+                       zns_sched_grant *grant);
+// Returns the credits, done is the number of bytes actually moved, at most
+// the size of the grant
+void zns_sched_put(zns_sched *sched, zns_sched_grant *grant, uint64_t done);
+void zns_sched_stats(zns_sched *sched, zns_udevice_stats *stats);
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_SCHED_H
@@ -0,0 +1,189 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "zns_slab.h"
+
+extern "C" {
+
+static zns_slab_cache *get_cache(zns_slab *slab);
+static void refill_cache(zns_slab *slab, zns_slab_cache *cache);
+static void drain_cache(zns_slab *slab, zns_slab_cache *cache,
+                        uint32_t num_objs);
+static void put_cache(void *cache_ptr);
+
+void zns_slab_init(zns_slab *slab, uint32_t obj_size)
+{
+    memset(slab, 0, sizeof(zns_slab));
+    slab->obj_size = (obj_size + ZNS_SLAB_CACHE_LINE - 1U) &
+                     ~(ZNS_SLAB_CACHE_LINE - 1U);
+    // The first line of a slab links it to the next one
+    slab->objs_per_slab = (ZNS_SLAB_BYTES - ZNS_SLAB_CACHE_LINE) /
+                          slab->obj_size;
+    if (!slab->objs_per_slab)
+        slab->objs_per_slab = 1U;
+    pthread_key_create(&slab->key, &put_cache);
+    pthread_mutex_init(&slab->lock, NULL);
+}
+
+void zns_slab_destroy(zns_slab *slab)
+{
+    // Exiting threads must not hand their caches back any more
+    pthread_key_delete(slab->key);
+    while (slab->caches) {
+        zns_slab_cache *cache = slab->caches;
+        slab->caches = cache->next;
+        free(cache);
+    }
+    while (slab->slabs) {
+        void *next = *(void **)slab->slabs;
+        free(slab->slabs);
+        slab->slabs = next;
+    }
+    pthread_mutex_destroy(&slab->lock);
+}
+
+void *zns_slab_alloc(zns_slab *slab)
+{
+    zns_slab_cache *cache = get_cache(slab);
+    if (cache->objs) {
+        __atomic_store_n(&cache->hits, cache->hits + 1U, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&cache->misses, cache->misses + 1U,
+                         __ATOMIC_RELAXED);
+        refill_cache(slab, cache);
+    }
+    void *obj = cache->objs;
+    cache->objs = *(void **)obj;
+    --cache->num_objs;
+    memset(obj, 0, slab->obj_size);
+    return obj;
+}
+
+void zns_slab_free(zns_slab *slab, void *obj)
+{
+    zns_slab_cache *cache = get_cache(slab);
+    *(void **)obj = cache->objs;
+    cache->objs = obj;
+    // A thread that only frees, like a gc worker, passes objects on
+    if (++cache->num_objs > 2U * ZNS_SLAB_BATCH)
+        drain_cache(slab, cache, ZNS_SLAB_BATCH);
+}
+
+void zns_slab_stats(zns_slab *slab, uint64_t *hits, uint64_t *misses,
+                    uint64_t *bytes)
+{
+    pthread_mutex_lock(&slab->lock);
+    *hits = slab->retired_hits;
+    *misses = slab->retired_misses;
+    for (zns_slab_cache *cache = slab->caches; cache; cache = cache->next) {
+        *hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+    }
+    *bytes = (uint64_t)slab->num_slabs * ZNS_SLAB_BYTES;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+static zns_slab_cache *get_cache(zns_slab *slab)
+{
+    zns_slab_cache *cache = (zns_slab_cache *)pthread_getspecific(slab->key);
+    if (cache)
+        return cache;
+    cache = (zns_slab_cache *)calloc(1UL, sizeof(zns_slab_cache));
+    cache->slab = slab;
+    pthread_mutex_lock(&slab->lock);
+    cache->next = slab->caches;
+    if (slab->caches)
+        slab->caches->prev = cache;
+    slab->caches = cache;
+    pthread_mutex_unlock(&slab->lock);
+    pthread_setspecific(slab->key, cache);
+    return cache;
+}
+
+// Takes a batch of free objects, or a new slab if there are none
+static void refill_cache(zns_slab *slab, zns_slab_cache *cache)
+{
+    pthread_mutex_lock(&slab->lock);
+    if (!slab->objs) {
+        char *chunk = NULL;
+        if (posix_memalign((void **)&chunk, ZNS_SLAB_CACHE_LINE,
+                           ZNS_SLAB_BYTES))
+            abort();
+        *(void **)chunk = slab->slabs;
+        slab->slabs = chunk;
+        ++slab->num_slabs;
+        for (uint32_t i = slab->objs_per_slab; i--;) {
+            void *obj = chunk + ZNS_SLAB_CACHE_LINE +
+                        (uint64_t)i * slab->obj_size;
+            *(void **)obj = slab->objs;
+            slab->objs = obj;
+        }
+    }
+    for (uint32_t i = 0U; i < ZNS_SLAB_BATCH && slab->objs; ++i) {
+        void *obj = slab->objs;
+        slab->objs = *(void **)obj;
+        *(void **)obj = cache->objs;
+        cache->objs = obj;
+        ++cache->num_objs;
+    }
+    pthread_mutex_unlock(&slab->lock);
+}
+
+// Hands up to num_objs objects of the cache back to the slab
+static void drain_cache(zns_slab *slab, zns_slab_cache *cache,
+                        uint32_t num_objs)
+{
+    pthread_mutex_lock(&slab->lock);
+    while (num_objs-- && cache->objs) {
+        void *obj = cache->objs;
+        cache->objs = *(void **)obj;
+        --cache->num_objs;
+        *(void **)obj = slab->objs;
+        slab->objs = obj;
+    }
+    pthread_mutex_unlock(&slab->lock);
+}
+
+// Destructor of the thread key, the objects stay with the slab
+static void put_cache(void *cache_ptr)
+{
+    zns_slab_cache *cache = (zns_slab_cache *)cache_ptr;
+    zns_slab *slab = cache->slab;
+    drain_cache(slab, cache, cache->num_objs);
+    pthread_mutex_lock(&slab->lock);
+    slab->retired_hits += cache->hits;
+    slab->retired_misses += cache->misses;
+    if (cache->prev)
+        cache->prev->next = cache->next;
+    else
+        slab->caches = cache->next;
+    if (cache->next)
+        cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&slab->lock);
+    free(cache);
+}
+
+}
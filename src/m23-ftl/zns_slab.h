@@ -0,0 +1,78 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_SLAB_H
+#define STOSYS_PROJECT_ZNS_SLAB_H
+
+#include <cstdint>
+#include <pthread.h>
+
+extern "C" {
+
+// Fixed size object allocator for FTL nodes. Objects are carved from
+// cache line aligned slabs and rounded up to whole cache lines, so two nodes
+// never share a line. Every thread keeps a cache of free objects and only
+// takes the slab lock to move a batch between its cache and the shared free
+// list, or to add a slab. Destroying the allocator frees all objects at
+// once, one free per slab.
+
+#define ZNS_SLAB_CACHE_LINE 64U
+#define ZNS_SLAB_BYTES (64U << 10U)
+#define ZNS_SLAB_BATCH 32U // objects moved between a cache and the slab
+
+struct zns_slab;
+
+struct zns_slab_cache {
+    zns_slab *slab;
+    void *objs; // free objects, linked through their first word
+    uint32_t num_objs;
+    uint64_t hits; // allocations served by the cache
+    uint64_t misses; // allocations that refilled it
+    zns_slab_cache *prev;
+    zns_slab_cache *next;
+};
+
+struct zns_slab {
+    uint32_t obj_size;
+    uint32_t objs_per_slab;
+    pthread_key_t key; // the zns_slab_cache of the calling thread
+    pthread_mutex_t lock;
+    void *objs; // free objects of no cache
+    void *slabs; // linked through their first cache line
+    uint32_t num_slabs;
+    zns_slab_cache *caches;
+    uint64_t retired_hits; // of caches of exited threads
+    uint64_t retired_misses;
+};
+
+void zns_slab_init(zns_slab *slab, uint32_t obj_size);
+// Frees every object, allocated or not. No other thread may still use it.
+void zns_slab_destroy(zns_slab *slab);
+// Zeroed
+void *zns_slab_alloc(zns_slab *slab);
+void zns_slab_free(zns_slab *slab, void *obj);
+void zns_slab_stats(zns_slab *slab, uint64_t *hits, uint64_t *misses,
+                    uint64_t *bytes);
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_SLAB_H
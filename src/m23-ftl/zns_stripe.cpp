@@ -0,0 +1,379 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "zns_stripe.h"
+
+extern "C" {
+
+// What a thread of a member queue serves
+struct stripe_worker_arg {
+    zns_stripe *stripe;
+    uint32_t member;
+};
+
+static uint32_t split_request(zns_stripe *stripe, uint8_t opcode,
+                              uint64_t address, void *buffer, uint32_t size,
+                              zns_stripe_piece *pieces);
+static void gather_units(zns_stripe *stripe, uint64_t address, void *buffer,
+                         uint32_t size, zns_stripe_piece *pieces,
+                         bool to_bounce);
+static int run_request(zns_stripe *stripe, uint8_t opcode, uint64_t address,
+                       void *buffer, uint32_t size);
+static int serve_piece(zns_stripe *stripe, zns_stripe_piece *piece);
+static void *stripe_worker(void *arg_ptr);
+
+int zns_stripe_init(zns_stripe *stripe, const zdev_init_params *params)
+{
+    stripe->num_members = params->num_names;
+    stripe->members = (user_zns_device **)calloc(stripe->num_members,
+                                                 sizeof(user_zns_device *));
+    zdev_init_params member_params = *params;
+    member_params.names = NULL;
+    member_params.num_names = 0U;
+    // Members are only called synchronously, from the stripe queues
+    member_params.async_depth = 1U;
+    member_params.async_workers = 1U;
+    int ret = 0;
+    uint32_t num_inited = 0U;
+    for (; num_inited < stripe->num_members; ++num_inited) {
+        member_params.name = params->names[num_inited];
+        ret = init_ss_zns_device(&member_params,
+                                 &stripe->members[num_inited]);
+        if (ret) {
+            printf("Failed to init stripe member %s %d\n",
+                   params->names[num_inited], ret);
+            break;
+        }
+        if (stripe->members[num_inited]->lba_size_bytes !=
+            stripe->members[0]->lba_size_bytes) {
+            printf("Stripe member %s has %u byte pages, not %u\n",
+                   params->names[num_inited],
+                   stripe->members[num_inited]->lba_size_bytes,
+                   stripe->members[0]->lba_size_bytes);
+            deinit_ss_zns_device(stripe->members[num_inited]);
+            ret = EINVAL;
+            break;
+        }
+    }
+    if (ret) {
+        for (uint32_t i = 0U; i < num_inited; ++i)
+            deinit_ss_zns_device(stripe->members[i]);
+        free(stripe->members);
+        return ret;
+    }
+    stripe->page_size = stripe->members[0]->lba_size_bytes;
+    stripe->unit = params->stripe_bytes ? params->stripe_bytes :
+                   ZNS_STRIPE_DEFAULT_BYTES;
+    stripe->unit -= stripe->unit % stripe->page_size;
+    if (!stripe->unit)
+        stripe->unit = stripe->page_size;
+    // Every member holds the same number of whole units
+    uint64_t member_capacity = stripe->members[0]->capacity_bytes;
+    for (uint32_t i = 1U; i < stripe->num_members; ++i)
+        if (stripe->members[i]->capacity_bytes < member_capacity)
+            member_capacity = stripe->members[i]->capacity_bytes;
+    stripe->capacity = member_capacity / stripe->unit * stripe->unit *
+                       stripe->num_members;
+    stripe->queues = (zns_stripe_queue *)calloc(stripe->num_members,
+                                                sizeof(zns_stripe_queue));
+    for (uint32_t i = 0U; i < stripe->num_members; ++i) {
+        zns_stripe_queue *queue = &stripe->queues[i];
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->cond, NULL);
+        for (uint32_t j = 0U; j < ZNS_STRIPE_WORKERS; ++j) {
+            stripe_worker_arg *arg = (stripe_worker_arg *)
+                                     malloc(sizeof(stripe_worker_arg));
+            arg->stripe = stripe;
+            arg->member = i;
+            pthread_create(&queue->threads[j], NULL, &stripe_worker, arg);
+        }
+    }
+    return 0;
+}
+
+void zns_stripe_destroy(zns_stripe *stripe)
+{
+    for (uint32_t i = 0U; i < stripe->num_members; ++i) {
+        zns_stripe_queue *queue = &stripe->queues[i];
+        pthread_mutex_lock(&queue->lock);
+        queue->stop = true;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+        for (uint32_t j = 0U; j < ZNS_STRIPE_WORKERS; ++j)
+            pthread_join(queue->threads[j], NULL);
+        pthread_cond_destroy(&queue->cond);
+        pthread_mutex_destroy(&queue->lock);
+    }
+    free(stripe->queues);
+    for (uint32_t i = 0U; i < stripe->num_members; ++i)
+        deinit_ss_zns_device(stripe->members[i]);
+    free(stripe->members);
+}
+
+int zns_stripe_read(zns_stripe *stripe, uint64_t address, void *buffer,
+                    uint32_t size)
+{
+    return run_request(stripe, ZNS_UDEVICE_READ, address, buffer, size);
+}
+
+int zns_stripe_write(zns_stripe *stripe, uint64_t address, void *buffer,
+                     uint32_t size)
+{
+    return run_request(stripe, ZNS_UDEVICE_WRITE, address, buffer, size);
+}
+
+int zns_stripe_flush(zns_stripe *stripe)
+{
+    int ret = 0;
+    for (uint32_t i = 0U; i < stripe->num_members; ++i) {
+        int err = zns_udevice_flush(stripe->members[i]);
+        if (!ret)
+            ret = err;
+    }
+    return ret;
+}
+
+void zns_stripe_stats(zns_stripe *stripe, zns_udevice_stats *stats)
+{
+    memset(stats, 0, sizeof(zns_udevice_stats));
+    for (uint32_t i = 0U; i < stripe->num_members; ++i) {
+        zns_udevice_stats s;
+        zns_udevice_get_stats(stripe->members[i], &s);
+        if (s.uptime_us > stats->uptime_us)
+            stats->uptime_us = s.uptime_us;
+        for (uint32_t c = 0U; c < ZNS_NUM_CLASSES; ++c) {
+            stats->class_bytes[c] += s.class_bytes[c];
+            stats->class_waits[c] += s.class_waits[c];
+            stats->class_borrowed[c] += s.class_borrowed[c];
+            stats->class_mbps[c] += s.class_mbps[c];
+        }
+        stats->gc_merges += s.gc_merges;
+        stats->gc_log_pages_merged += s.gc_log_pages_merged;
+        stats->gc_switch_merges += s.gc_switch_merges;
+        stats->gc_partial_merges += s.gc_partial_merges;
+        stats->gc_compactions += s.gc_compactions;
+        stats->gc_compacted_pages += s.gc_compacted_pages;
+        stats->gc_data_cleanings += s.gc_data_cleanings;
+        stats->gc_relocations += s.gc_relocations;
+        stats->hole_pages_zeroed += s.hole_pages_zeroed;
+        stats->hole_pages_written += s.hole_pages_written;
+        stats->gc_host_bytes += s.gc_host_bytes;
+        stats->gc_host_cpu_us += s.gc_host_cpu_us;
+        stats->gc_copy_bytes += s.gc_copy_bytes;
+        stats->gc_copy_cpu_us += s.gc_copy_cpu_us;
+        stats->gc_pcie_bytes_saved += s.gc_pcie_bytes_saved;
+        stats->gc_cpu_saved_us += s.gc_cpu_saved_us;
+        if (s.log_streams > stats->log_streams)
+            stats->log_streams = s.log_streams;
+        for (uint32_t l = 0U; l < s.log_streams; ++l) {
+            stats->log_stream_bytes[l] += s.log_stream_bytes[l];
+            stats->log_stream_gc_bytes[l] += s.log_stream_gc_bytes[l];
+        }
+        // Members are remounted one after the other
+        stats->meta_remount_us += s.meta_remount_us;
+        stats->meta_replayed_records += s.meta_replayed_records;
+        stats->meta_checkpoints += s.meta_checkpoints;
+        stats->meta_checkpoint_bytes += s.meta_checkpoint_bytes;
+        stats->meta_journal_bytes += s.meta_journal_bytes;
+        stats->alloc_cache_hits += s.alloc_cache_hits;
+        stats->alloc_cache_misses += s.alloc_cache_misses;
+        stats->alloc_slab_bytes += s.alloc_slab_bytes;
+        stats->mem_map_bytes += s.mem_map_bytes;
+        stats->mem_bitmap_bytes += s.mem_bitmap_bytes;
+        stats->mem_zone_bytes += s.mem_zone_bytes;
+        stats->read_retries += s.read_retries;
+        stats->wbuf_pages += s.wbuf_pages;
+        stats->wbuf_overwrites += s.wbuf_overwrites;
+        stats->wbuf_read_hits += s.wbuf_read_hits;
+        stats->wbuf_flushes += s.wbuf_flushes;
+        stats->wbuf_flushed_pages += s.wbuf_flushed_pages;
+        stats->rcache_hits += s.rcache_hits;
+        stats->rcache_misses += s.rcache_misses;
+        stats->rcache_evictions += s.rcache_evictions;
+        stats->rcache_invalidations += s.rcache_invalidations;
+    }
+}
+
+// The units of a request on one member are adjacent there, only the first
+// and the last unit of the request can be partial. pieces has a slot per
+// member, returns how many got a part of the request.
+static uint32_t split_request(zns_stripe *stripe, uint8_t opcode,
+                              uint64_t address, void *buffer, uint32_t size,
+                              zns_stripe_piece *pieces)
+{
+    uint32_t num_pieces = 0U;
+    uint32_t *num_units = (uint32_t *)calloc(stripe->num_members,
+                                             sizeof(uint32_t));
+    for (uint32_t done = 0U; done < size;) {
+        uint64_t unit = (address + done) / stripe->unit;
+        uint64_t offset = (address + done) % stripe->unit;
+        uint32_t n = stripe->unit - offset < size - done ?
+                     (uint32_t)(stripe->unit - offset) : size - done;
+        zns_stripe_piece *piece = &pieces[unit % stripe->num_members];
+        if (!piece->size) {
+            piece->member = unit % stripe->num_members;
+            piece->address = unit / stripe->num_members * stripe->unit +
+                             offset;
+            piece->buffer = (char *)buffer + done;
+            piece->opcode = opcode;
+            ++num_pieces;
+        }
+        piece->size += n;
+        ++num_units[piece->member];
+        done += n;
+    }
+    for (uint32_t i = 0U; i < stripe->num_members; ++i)
+        if (num_units[i] > 1U)
+            pieces[i].bounce = (char *)malloc(pieces[i].size);
+    free(num_units);
+    return num_pieces;
+}
+
+// Copies every unit of the request between buffer and the bounce buffer of
+// its member, in the order split_request laid them out
+static void gather_units(zns_stripe *stripe, uint64_t address, void *buffer,
+                         uint32_t size, zns_stripe_piece *pieces,
+                         bool to_bounce)
+{
+    uint32_t *filled = (uint32_t *)calloc(stripe->num_members,
+                                          sizeof(uint32_t));
+    for (uint32_t done = 0U; done < size;) {
+        uint64_t unit = (address + done) / stripe->unit;
+        uint64_t offset = (address + done) % stripe->unit;
+        uint32_t n = stripe->unit - offset < size - done ?
+                     (uint32_t)(stripe->unit - offset) : size - done;
+        uint32_t member = unit % stripe->num_members;
+        if (pieces[member].bounce) {
+            char *bounce = pieces[member].bounce + filled[member];
+            if (to_bounce)
+                memcpy(bounce, (char *)buffer + done, n);
+            else
+                memcpy((char *)buffer + done, bounce, n);
+            filled[member] += n;
+        }
+        done += n;
+    }
+    free(filled);
+}
+
+// A request on one member is served by the caller. Else the caller serves
+// its first piece while the member threads serve the others.
+static int run_request(zns_stripe *stripe, uint8_t opcode, uint64_t address,
+                       void *buffer, uint32_t size)
+{
+    if (!size)
+        return 0;
+    zns_stripe_piece *pieces = (zns_stripe_piece *)
+                               calloc(stripe->num_members,
+                                      sizeof(zns_stripe_piece));
+    uint32_t num_pieces = split_request(stripe, opcode, address, buffer,
+                                        size, pieces);
+    if (opcode == ZNS_UDEVICE_WRITE)
+        gather_units(stripe, address, buffer, size, pieces, true);
+    zns_stripe_request req;
+    req.pending = num_pieces - 1U;
+    pthread_mutex_init(&req.lock, NULL);
+    pthread_cond_init(&req.cond, NULL);
+    zns_stripe_piece *first = NULL;
+    for (uint32_t i = 0U; i < stripe->num_members; ++i) {
+        zns_stripe_piece *piece = &pieces[i];
+        if (!piece->size)
+            continue;
+        if (!first) {
+            first = piece;
+            continue;
+        }
+        piece->req = &req;
+        zns_stripe_queue *queue = &stripe->queues[i];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->tail)
+            queue->tail->next = piece;
+        else
+            queue->head = piece;
+        queue->tail = piece;
+        pthread_cond_signal(&queue->cond);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    first->ret = serve_piece(stripe, first);
+    pthread_mutex_lock(&req.lock);
+    while (req.pending)
+        pthread_cond_wait(&req.cond, &req.lock);
+    pthread_mutex_unlock(&req.lock);
+    pthread_cond_destroy(&req.cond);
+    pthread_mutex_destroy(&req.lock);
+    int ret = 0;
+    for (uint32_t i = 0U; i < stripe->num_members && !ret; ++i)
+        ret = pieces[i].ret;
+    if (!ret && opcode == ZNS_UDEVICE_READ)
+        gather_units(stripe, address, buffer, size, pieces, false);
+    for (uint32_t i = 0U; i < stripe->num_members; ++i)
+        free(pieces[i].bounce);
+    free(pieces);
+    return ret;
+}
+
+static int serve_piece(zns_stripe *stripe, zns_stripe_piece *piece)
+{
+    user_zns_device *member = stripe->members[piece->member];
+    void *buffer = piece->bounce ? piece->bounce : piece->buffer;
+    if (piece->opcode == ZNS_UDEVICE_READ)
+        return zns_udevice_read(member, piece->address, buffer, piece->size);
+    return zns_udevice_write(member, piece->address, buffer, piece->size);
+}
+
+// Serves the pieces queued for one member, in order of their requests
+static void *stripe_worker(void *arg_ptr)
+{
+    stripe_worker_arg *arg = (stripe_worker_arg *)arg_ptr;
+    zns_stripe *stripe = arg->stripe;
+    zns_stripe_queue *queue = &stripe->queues[arg->member];
+    free(arg);
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (!queue->head && !queue->stop)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        if (!queue->head)
+            break;
+        zns_stripe_piece *piece = queue->head;
+        queue->head = piece->next;
+        if (!queue->head)
+            queue->tail = NULL;
+        pthread_mutex_unlock(&queue->lock);
+        piece->ret = serve_piece(stripe, piece);
+        zns_stripe_request *req = piece->req;
+        pthread_mutex_lock(&req->lock);
+        if (!--req->pending)
+            pthread_cond_signal(&req->cond);
+        pthread_mutex_unlock(&req->lock);
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+}
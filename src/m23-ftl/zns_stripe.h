@@ -0,0 +1,97 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_STRIPE_H
+#define STOSYS_PROJECT_ZNS_STRIPE_H
+
+#include <cstdint>
+#include <pthread.h>
+#include "zns_device.h"
+
+extern "C" {
+
+// RAID-0 over several ZNS namespaces. Every namespace is a member device
+// with its own FTL, so its log zones, gc workers and metadata only ever
+// see its own zones. Stripe unit u of the address space is unit u / N of
+// member u % N, a sequential stream thus stays sequential on every member.
+// The parts of a request on other members go to their queues and are
+// served in parallel, each member by its own threads.
+
+// Threads per member queue, members take concurrent writers in parallel
+#define ZNS_STRIPE_WORKERS 4U
+
+// Part of a request on one member. Its units are adjacent on the member,
+// gathered in bounce if they are not adjacent in the request.
+struct zns_stripe_piece {
+    uint32_t member;
+    uint64_t address; // on the member
+    uint32_t size;
+    char *buffer;
+    char *bounce;
+    uint8_t opcode; // zns_udevice_opcode
+    int ret;
+    struct zns_stripe_request *req;
+    zns_stripe_piece *next;
+};
+
+// Pieces of a request that are still queued or being served
+struct zns_stripe_request {
+    uint32_t pending;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct zns_stripe_queue {
+    zns_stripe_piece *head;
+    zns_stripe_piece *tail;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[ZNS_STRIPE_WORKERS];
+};
+
+struct zns_stripe {
+    uint32_t num_members;
+    user_zns_device **members;
+    zns_stripe_queue *queues; // one per member
+    uint32_t page_size;
+    uint64_t unit; // stripe unit in bytes
+    uint64_t capacity; // of the stripe, the smallest member times N
+};
+
+// Inits a member per params->names with the rest of params. Each member
+// must have the same page size.
+int zns_stripe_init(zns_stripe *stripe, const zdev_init_params *params);
+void zns_stripe_destroy(zns_stripe *stripe);
+// Same contract as zns_udevice_read/write/flush
+int zns_stripe_read(zns_stripe *stripe, uint64_t address, void *buffer,
+                    uint32_t size);
+int zns_stripe_write(zns_stripe *stripe, uint64_t address, void *buffer,
+                     uint32_t size);
+int zns_stripe_flush(zns_stripe *stripe);
+// Counters of all members added up, rates and times are the members' sum
+// or maximum
+void zns_stripe_stats(zns_stripe *stripe, zns_udevice_stats *stats);
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_STRIPE_H
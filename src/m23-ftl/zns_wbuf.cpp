@@ -0,0 +1,236 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include "zns_wbuf.h"
+
+extern "C" {
+
+static inline uint32_t get_bucket(const zns_wbuf *wbuf,
+                                  unsigned long long page_addr);
+static uint32_t find_slot(zns_wbuf *wbuf, unsigned long long page_addr,
+                          uint32_t **link);
+static void free_slot(zns_wbuf *wbuf, uint32_t slot, uint32_t *link);
+static int compare_pages(const void *a, const void *b);
+static uint64_t now_ns();
+
+int zns_wbuf_init(zns_wbuf *wbuf, uint32_t page_size, uint32_t num_slots)
+{
+    memset(wbuf, 0, sizeof(zns_wbuf));
+    wbuf->page_size = page_size;
+    wbuf->num_slots = num_slots;
+    wbuf->num_buckets = 1U;
+    while (wbuf->num_buckets < num_slots)
+        wbuf->num_buckets <<= 1U;
+    wbuf->buckets = (uint32_t *)malloc(wbuf->num_buckets * sizeof(uint32_t));
+    wbuf->slots = (zns_wbuf_slot *)calloc(num_slots, sizeof(zns_wbuf_slot));
+    wbuf->data = (char *)malloc((size_t)num_slots * page_size);
+    if (!wbuf->buckets || !wbuf->slots || !wbuf->data) {
+        zns_wbuf_destroy(wbuf);
+        return ENOMEM;
+    }
+    memset(wbuf->buckets, 0xff, wbuf->num_buckets * sizeof(uint32_t));
+    for (uint32_t i = 0U; i < num_slots; ++i)
+        wbuf->slots[i].next = i + 1U < num_slots ? i + 1U : ZNS_WBUF_NO_SLOT;
+    wbuf->free_slots = num_slots ? 0U : ZNS_WBUF_NO_SLOT;
+    pthread_mutex_init(&wbuf->lock, NULL);
+    return 0;
+}
+
+void zns_wbuf_destroy(zns_wbuf *wbuf)
+{
+    free(wbuf->buckets);
+    free(wbuf->slots);
+    free(wbuf->data);
+    wbuf->buckets = NULL;
+    wbuf->slots = NULL;
+    wbuf->data = NULL;
+    pthread_mutex_destroy(&wbuf->lock);
+}
+
+bool zns_wbuf_put(zns_wbuf *wbuf, unsigned long long page_addr,
+                  uint32_t num_pages, const void *buffer)
+{
+    pthread_mutex_lock(&wbuf->lock);
+    uint32_t *link;
+    uint32_t needed = 0U;
+    for (uint32_t i = 0U; i < num_pages; ++i) {
+        if (find_slot(wbuf, page_addr + i, &link) == ZNS_WBUF_NO_SLOT)
+            ++needed;
+    }
+    if (needed > wbuf->num_slots - wbuf->num_used) {
+        pthread_mutex_unlock(&wbuf->lock);
+        return false;
+    }
+    for (uint32_t i = 0U; i < num_pages; ++i) {
+        uint32_t slot = find_slot(wbuf, page_addr + i, &link);
+        if (slot == ZNS_WBUF_NO_SLOT) {
+            slot = wbuf->free_slots;
+            wbuf->free_slots = wbuf->slots[slot].next;
+            // link points at the end of the chain
+            *link = slot;
+            wbuf->slots[slot].next = ZNS_WBUF_NO_SLOT;
+            wbuf->slots[slot].page_addr = page_addr + i;
+            wbuf->slots[slot].used = true;
+            __atomic_store_n(&wbuf->num_used, wbuf->num_used + 1U,
+                             __ATOMIC_RELAXED);
+        } else {
+            ++wbuf->overwrites;
+        }
+        wbuf->slots[slot].version = ++wbuf->next_version;
+        memcpy(wbuf->data + (size_t)slot * wbuf->page_size,
+               (const char *)buffer + (size_t)i * wbuf->page_size,
+               wbuf->page_size);
+    }
+    wbuf->pages += num_pages;
+    if (!wbuf->dirty_ns)
+        __atomic_store_n(&wbuf->dirty_ns, now_ns(), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&wbuf->lock);
+    return true;
+}
+
+uint32_t zns_wbuf_get(zns_wbuf *wbuf, unsigned long long page_addr,
+                      uint32_t num_pages, void *buffer, uint64_t *present)
+{
+    uint32_t found = 0U;
+    pthread_mutex_lock(&wbuf->lock);
+    if (!wbuf->num_used) {
+        pthread_mutex_unlock(&wbuf->lock);
+        return 0U;
+    }
+    for (uint32_t i = 0U; i < num_pages; ++i) {
+        uint32_t *link;
+        uint32_t slot = find_slot(wbuf, page_addr + i, &link);
+        if (slot == ZNS_WBUF_NO_SLOT)
+            continue;
+        memcpy((char *)buffer + (size_t)i * wbuf->page_size,
+               wbuf->data + (size_t)slot * wbuf->page_size, wbuf->page_size);
+        present[i >> 6U] |= 1ULL << (i & 63U);
+        ++found;
+    }
+    wbuf->read_hits += found;
+    pthread_mutex_unlock(&wbuf->lock);
+    return found;
+}
+
+void zns_wbuf_drop(zns_wbuf *wbuf, unsigned long long page_addr,
+                   uint32_t num_pages)
+{
+    pthread_mutex_lock(&wbuf->lock);
+    for (uint32_t i = 0U; i < num_pages && wbuf->num_used; ++i) {
+        uint32_t *link;
+        uint32_t slot = find_slot(wbuf, page_addr + i, &link);
+        if (slot != ZNS_WBUF_NO_SLOT)
+            free_slot(wbuf, slot, link);
+    }
+    pthread_mutex_unlock(&wbuf->lock);
+}
+
+uint32_t zns_wbuf_collect(zns_wbuf *wbuf, zns_wbuf_page *pages,
+                          void *buffer)
+{
+    pthread_mutex_lock(&wbuf->lock);
+    uint32_t n = 0U;
+    for (uint32_t i = 0U; i < wbuf->num_slots; ++i) {
+        if (!wbuf->slots[i].used)
+            continue;
+        pages[n].page_addr = wbuf->slots[i].page_addr;
+        pages[n].version = wbuf->slots[i].version;
+        ++n;
+    }
+    qsort(pages, n, sizeof(zns_wbuf_page), &compare_pages);
+    for (uint32_t i = 0U; i < n; ++i) {
+        uint32_t *link;
+        uint32_t slot = find_slot(wbuf, pages[i].page_addr, &link);
+        memcpy((char *)buffer + (size_t)i * wbuf->page_size,
+               wbuf->data + (size_t)slot * wbuf->page_size, wbuf->page_size);
+    }
+    __atomic_store_n(&wbuf->dirty_ns, 0ULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&wbuf->lock);
+    return n;
+}
+
+void zns_wbuf_retire(zns_wbuf *wbuf, const zns_wbuf_page *pages,
+                     uint32_t num_pages)
+{
+    pthread_mutex_lock(&wbuf->lock);
+    for (uint32_t i = 0U; i < num_pages; ++i) {
+        uint32_t *link;
+        uint32_t slot = find_slot(wbuf, pages[i].page_addr, &link);
+        if (slot != ZNS_WBUF_NO_SLOT &&
+            wbuf->slots[slot].version == pages[i].version)
+            free_slot(wbuf, slot, link);
+    }
+    pthread_mutex_unlock(&wbuf->lock);
+}
+
+static inline uint32_t get_bucket(const zns_wbuf *wbuf,
+                                  unsigned long long page_addr)
+{
+    return (page_addr * 0x9e3779b97f4a7c15ULL >> 32U) &
+           (wbuf->num_buckets - 1U);
+}
+
+// Call with lock held. link is left at the index that points to the slot,
+// or at the end of the chain if the page is not buffered.
+static uint32_t find_slot(zns_wbuf *wbuf, unsigned long long page_addr,
+                          uint32_t **link)
+{
+    *link = &wbuf->buckets[get_bucket(wbuf, page_addr)];
+    while (**link != ZNS_WBUF_NO_SLOT) {
+        zns_wbuf_slot *slot = &wbuf->slots[**link];
+        if (slot->page_addr == page_addr)
+            return **link;
+        *link = &slot->next;
+    }
+    return ZNS_WBUF_NO_SLOT;
+}
+
+// Call with lock held
+static void free_slot(zns_wbuf *wbuf, uint32_t slot, uint32_t *link)
+{
+    *link = wbuf->slots[slot].next;
+    wbuf->slots[slot].used = false;
+    wbuf->slots[slot].next = wbuf->free_slots;
+    wbuf->free_slots = slot;
+    __atomic_store_n(&wbuf->num_used, wbuf->num_used - 1U, __ATOMIC_RELAXED);
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+    unsigned long long x = ((const zns_wbuf_page *)a)->page_addr;
+    unsigned long long y = ((const zns_wbuf_page *)b)->page_addr;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+}
@@ -0,0 +1,103 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_WBUF_H
+#define STOSYS_PROJECT_ZNS_WBUF_H
+
+#include <cstdint>
+#include <pthread.h>
+
+extern "C" {
+
+// Write-back buffer of logical pages. Every buffered page is dirty and owns
+// one slot of a fixed arena, found through a hash of its address. The
+// buffer only holds the data, writing it out is up to the owner:
+// zns_wbuf_collect copies the pages out sorted by address, and once they
+// are on the device zns_wbuf_retire frees the ones not written again since.
+
+#define ZNS_WBUF_NO_SLOT 0xffffffffU
+
+struct zns_wbuf_slot {
+    unsigned long long page_addr;
+    uint64_t version; // changes with every write of the page
+    uint32_t next; // in its hash chain or the free list
+    bool used;
+};
+
+// A page copied out by zns_wbuf_collect
+struct zns_wbuf_page {
+    unsigned long long page_addr;
+    uint64_t version;
+};
+
+struct zns_wbuf {
+    uint32_t page_size;
+    uint32_t num_slots;
+    uint32_t num_used;
+    uint32_t free_slots;
+    uint32_t num_buckets; // power of two
+    uint32_t *buckets;
+    zns_wbuf_slot *slots;
+    char *data; // num_slots pages, slot i at page i
+    uint64_t next_version;
+    uint64_t dirty_ns; // CLOCK_MONOTONIC of the first write since the last
+                       // collect, 0 if none
+    pthread_mutex_t lock;
+    uint64_t pages; // written into the buffer
+    uint64_t overwrites; // of those, pages that were still buffered
+    uint64_t read_hits; // pages served from the buffer
+};
+
+int zns_wbuf_init(zns_wbuf *wbuf, uint32_t page_size, uint32_t num_slots);
+void zns_wbuf_destroy(zns_wbuf *wbuf);
+// Buffers num_pages pages of buffer. false if the free slots do not fit the
+// pages, nothing is buffered then.
+bool zns_wbuf_put(zns_wbuf *wbuf, unsigned long long page_addr,
+                  uint32_t num_pages, const void *buffer);
+// Copies the buffered pages of the range to their place in buffer and sets
+// their bits in present, one bit per page of the range. Returns how many.
+uint32_t zns_wbuf_get(zns_wbuf *wbuf, unsigned long long page_addr,
+                      uint32_t num_pages, void *buffer, uint64_t *present);
+// Frees the buffered pages of the range, for writes around the buffer
+void zns_wbuf_drop(zns_wbuf *wbuf, unsigned long long page_addr,
+                   uint32_t num_pages);
+// Copies all pages out sorted by address, pages has num_slots entries and
+// buffer room for num_slots pages. Returns how many.
+uint32_t zns_wbuf_collect(zns_wbuf *wbuf, zns_wbuf_page *pages,
+                          void *buffer);
+// Frees the collected pages that were not written again since
+void zns_wbuf_retire(zns_wbuf *wbuf, const zns_wbuf_page *pages,
+                     uint32_t num_pages);
+
+static inline uint32_t zns_wbuf_used(zns_wbuf *wbuf)
+{
+    return __atomic_load_n(&wbuf->num_used, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t zns_wbuf_dirty_ns(zns_wbuf *wbuf)
+{
+    return __atomic_load_n(&wbuf->dirty_ns, __ATOMIC_RELAXED);
+}
+
+}
+
+#endif //STOSYS_PROJECT_ZNS_WBUF_H
@@ -423,7 +423,7 @@ namespace ROCKSDB_NAMESPACE
         std::string sdelimiter = ":";
         std::string edelimiter = "://";
         this->_uri = uri_db_path;
-        struct zdev_init_params params;
+        struct zdev_init_params params = {};
         std::string device = uri_db_path.substr(uri_db_path.find(sdelimiter) + sdelimiter.size(),
                                                 uri_db_path.find(edelimiter) -
                                                     (uri_db_path.find(sdelimiter) + sdelimiter.size()));